@@ -0,0 +1,383 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access_log.h"
+
+#define CACHE_LINE 64
+#define BATCH_LINES 256           // Lines gathered into one writev, below IOV_MAX
+#define LINE_SIZE 768             // Longest line, with every resource byte escaped
+
+// Struct representing the ring of one thread. Only that thread advances head
+// and only the writer thread advances tail, so a single producer and a single
+// consumer share it without locks. Each index sits on a cache line of its
+// own, next to what only its writer touches.
+typedef struct log_ring {
+    _Alignas(CACHE_LINE) atomic_ulong head;  // Records pushed so far
+    unsigned long tail_seen;  // Last value of tail read by the owning thread
+    atomic_ulong dropped;     // Records that found the ring full
+    _Alignas(CACHE_LINE) atomic_ulong tail;  // Records taken by the writer
+    int released;             // Set once the owner exited, until another takes over
+    struct log_ring *next;
+    _Alignas(CACHE_LINE) access_log_record_t records[ACCESS_LOG_RING_SIZE];
+} log_ring_t;
+
+static int enabled = 0;
+static int log_fd = -1;
+static uint64_t realtime_offset;  // CLOCK_REALTIME minus CLOCK_MONOTONIC
+
+// Ring of the calling thread, allocated the first time it logs a request
+static _Thread_local log_ring_t *local_ring = NULL;
+
+// Every thread's ring, newest first. Rings are only ever added to the front,
+// so the list can be walked from a head read under the lock without holding it.
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond;
+static log_ring_t *all_rings = NULL;
+static int stopping = 0;
+static pthread_t writer;
+
+// Only used by the writer thread
+static char lines[BATCH_LINES][LINE_SIZE];
+static struct iovec iov[BATCH_LINES];
+static time_t date_second = -1;
+static char date[32];
+static atomic_ulong written;
+static int write_failed = 0;
+
+
+static unsigned long load(atomic_ulong *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+
+static log_ring_t *get_local_ring(void) {
+    if (local_ring != NULL) {
+        return local_ring;
+    }
+    // A ring released by a thread that exited keeps its indices, so the next
+    // producer simply carries on where the last one stopped
+    pthread_mutex_lock(&log_lock);
+    for (log_ring_t *ring = all_rings; ring != NULL; ring = ring->next) {
+        if (ring->released) {
+            ring->released = 0;
+            pthread_mutex_unlock(&log_lock);
+            local_ring = ring;
+            return ring;
+        }
+    }
+    pthread_mutex_unlock(&log_lock);
+
+    log_ring_t *ring = aligned_alloc(CACHE_LINE, sizeof(log_ring_t));
+    if (ring == NULL) {
+        perror("aligned_alloc");
+        return NULL;
+    }
+    atomic_init(&ring->head, 0);
+    ring->tail_seen = 0;
+    atomic_init(&ring->dropped, 0);
+    atomic_init(&ring->tail, 0);
+    ring->released = 0;
+    pthread_mutex_lock(&log_lock);
+    ring->next = all_rings;
+    all_rings = ring;
+    pthread_mutex_unlock(&log_lock);
+    local_ring = ring;
+    return ring;
+}
+
+
+void access_log_thread_exit(void) {
+    if (local_ring != NULL) {
+        pthread_mutex_lock(&log_lock);
+        local_ring->released = 1;
+        pthread_mutex_unlock(&log_lock);
+        local_ring = NULL;
+    }
+}
+
+
+void access_log_client(access_log_addr_t *client, const struct sockaddr *addr) {
+    if (addr->sa_family == AF_INET) {
+        client->family = AF_INET;
+        memcpy(client->addr, &((const struct sockaddr_in *) addr)->sin_addr, 4);
+    } else if (addr->sa_family == AF_INET6) {
+        // IPv4 clients of a dual-stack socket are logged as IPv4 addresses
+        const struct in6_addr *in6 = &((const struct sockaddr_in6 *) addr)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(in6)) {
+            client->family = AF_INET;
+            memcpy(client->addr, &in6->s6_addr[12], 4);
+        } else {
+            client->family = AF_INET6;
+            memcpy(client->addr, in6, 16);
+        }
+    } else {
+        client->family = 0;
+    }
+}
+
+
+void access_log_request(const access_log_addr_t *client, const http_request_t *req,
+        const request_timing_t *timing, int status, size_t bytes) {
+    if (!enabled) {
+        return;
+    }
+    log_ring_t *ring = get_local_ring();
+    if (ring == NULL) {
+        return;
+    }
+
+    // The writer's progress is only read again once the ring looks full
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - ring->tail_seen == ACCESS_LOG_RING_SIZE) {
+        ring->tail_seen = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head - ring->tail_seen == ACCESS_LOG_RING_SIZE) {
+            atomic_store_explicit(&ring->dropped, load(&ring->dropped) + 1,
+                    memory_order_relaxed);
+            return;
+        }
+    }
+
+    access_log_record_t *r = &ring->records[head % ACCESS_LOG_RING_SIZE];
+    r->done = stats_now();
+    r->duration = timing->start != 0 && r->done >= timing->start ? r->done - timing->start : 0;
+    if (client != NULL) {
+        r->client = *client;
+    } else {
+        r->client.family = 0;
+    }
+    r->status = status;
+    r->minor_version = req->minor_version;
+    r->bytes = bytes;
+    size_t len = req->method.len < ACCESS_LOG_METHOD_MAX ? req->method.len : ACCESS_LOG_METHOD_MAX - 1;
+    memcpy(r->method, req->method.data, len);
+    r->method[len] = '\0';
+    len = strnlen(req->resource_name, ACCESS_LOG_RESOURCE_MAX - 1);
+    memcpy(r->resource, req->resource_name, len);
+    r->resource[len] = '\0';
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+
+// Copy a string into a line, escaping quotes, backslashes and bytes that are
+// not printable ASCII so that every record stays on one line.
+// Returns the end of the copy in 'out'
+static char *append_escaped(char *out, const char *s) {
+    for (; *s != '\0'; s++) {
+        unsigned char c = *s;
+        if (c < 0x20 || c >= 0x7f || c == '"' || c == '\\') {
+            out += sprintf(out, "\\x%02x", c);
+        } else {
+            *out++ = c;
+        }
+    }
+    return out;
+}
+
+
+// Format a record as a line of the Common Log Format, followed by the duration
+// in microseconds.
+// Returns the length of the line
+static size_t format_record(char *line, const access_log_record_t *r) {
+    char client[INET6_ADDRSTRLEN] = "-";
+    if (r->client.family != 0) {
+        inet_ntop(r->client.family, r->client.addr, client, sizeof(client));
+    }
+
+    // Requests come in bursts, so the date of the previous line is reused
+    time_t second = (r->done + realtime_offset) / 1000000000;
+    if (second != date_second) {
+        struct tm tm;
+        gmtime_r(&second, &tm);
+        strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+        date_second = second;
+    }
+
+    char *out = line;
+    out += sprintf(out, "%s - - [%s] \"", client, date);
+    out = append_escaped(out, r->method);
+    *out++ = ' ';
+    out = append_escaped(out, r->resource);
+    out += sprintf(out, " HTTP/1.%d\" %d %zu %lu\n", r->minor_version, r->status,
+            r->bytes, (unsigned long) (r->duration / 1000));
+    return out - line;
+}
+
+
+// Write a batch of lines, resuming after short writes
+static void write_lines(int n) {
+    struct iovec *next = iov;
+    int left = n;
+    while (left > 0) {
+        ssize_t sent = writev(log_fd, next, left);
+        if (sent == -1) {
+            if (errno == EINTR) { continue; }
+            if (!write_failed) { perror("writev"); }
+            write_failed = 1;
+            return;
+        }
+        while (left > 0 && (size_t) sent >= next->iov_len) {
+            sent -= next->iov_len;
+            next++;
+            left--;
+        }
+        if (left > 0) {
+            next->iov_base = (char *) next->iov_base + sent;
+            next->iov_len -= sent;
+        }
+    }
+    atomic_store_explicit(&written, load(&written) + n, memory_order_relaxed);
+}
+
+
+// Format and write every record pushed to the rings so far. A slot is handed
+// back to its thread as soon as its record has been formatted.
+// Returns the number of records written
+static unsigned long flush_rings(void) {
+    pthread_mutex_lock(&log_lock);
+    log_ring_t *rings = all_rings;
+    pthread_mutex_unlock(&log_lock);
+
+    unsigned long total = 0;
+    int n = 0;
+    for (log_ring_t *ring = rings; ring != NULL; ring = ring->next) {
+        unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        while (tail != head) {
+            iov[n].iov_base = lines[n];
+            iov[n].iov_len = format_record(lines[n], &ring->records[tail % ACCESS_LOG_RING_SIZE]);
+            tail++;
+            if (++n == BATCH_LINES) {
+                atomic_store_explicit(&ring->tail, tail, memory_order_release);
+                write_lines(n);
+                total += n;
+                n = 0;
+            }
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+    if (n > 0) {
+        write_lines(n);
+        total += n;
+    }
+    return total;
+}
+
+
+// Flush the rings until access_log_free is called, waiting a little whenever
+// they are all empty
+static void *writer_func(void *arg) {
+    pthread_mutex_lock(&log_lock);
+    while (!stopping) {
+        pthread_mutex_unlock(&log_lock);
+        unsigned long flushed = flush_rings();
+        pthread_mutex_lock(&log_lock);
+        if (flushed == 0 && !stopping) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_nsec += ACCESS_LOG_FLUSH_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&log_cond, &log_lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&log_lock);
+
+    // Whatever was logged before the loop was asked to stop
+    flush_rings();
+    return NULL;
+}
+
+
+static void report_access_log(FILE *out, void *arg) {
+    unsigned long dropped = 0;
+    pthread_mutex_lock(&log_lock);
+    for (log_ring_t *ring = all_rings; ring != NULL; ring = ring->next) {
+        dropped += load(&ring->dropped);
+    }
+    pthread_mutex_unlock(&log_lock);
+    fprintf(out, "access log: %lu lines written, %lu records dropped\n",
+            load(&written), dropped);
+}
+
+
+int access_log_init(const char *path) {
+    if (strcmp(path, "-") == 0) {
+        log_fd = STDOUT_FILENO;
+    } else if ((log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) == -1) {
+        perror("open");
+        return -1;
+    }
+
+    struct timespec realtime;
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    realtime_offset = (uint64_t) realtime.tv_sec * 1000000000 + realtime.tv_nsec - stats_now();
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&log_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    // The writer leaves signals to the main thread
+    sigset_t all_signals, old_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+    int create_result = pthread_create(&writer, NULL, writer_func, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    if (create_result != 0) {
+        fprintf(stderr, "pthread_create failed: %s\n", strerror(create_result));
+        pthread_cond_destroy(&log_cond);
+        if (log_fd != STDOUT_FILENO) { close(log_fd); }
+        return -1;
+    }
+    enabled = 1;
+    stats_add_reporter(report_access_log, NULL);
+    return 0;
+}
+
+
+int access_log_free(void) {
+    if (!enabled) {
+        return 0;
+    }
+    int ret_val = 0;
+    pthread_mutex_lock(&log_lock);
+    stopping = 1;
+    pthread_cond_signal(&log_cond);
+    pthread_mutex_unlock(&log_lock);
+    int join_result = pthread_join(writer, NULL);
+    if (join_result != 0) { fprintf(stderr, "pthread_join failed: %s\n", strerror(join_result)); ret_val = -1; }
+
+    unsigned long dropped = 0;
+    pthread_mutex_lock(&log_lock);
+    while (all_rings != NULL) {
+        log_ring_t *ring = all_rings;
+        all_rings = ring->next;
+        dropped += load(&ring->dropped);
+        free(ring);
+    }
+    pthread_mutex_unlock(&log_lock);
+    if (dropped > 0) {
+        fprintf(stderr, "Access log dropped %lu records\n", dropped);
+    }
+
+    enabled = 0;
+    pthread_cond_destroy(&log_cond);
+    if (write_failed) { ret_val = -1; }
+    if (log_fd != STDOUT_FILENO && close(log_fd) == -1) { perror("close"); ret_val = -1; }
+    log_fd = -1;
+    return ret_val;
+}
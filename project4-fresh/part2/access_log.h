@@ -0,0 +1,79 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "http_parser.h"
+#include "stats.h"
+
+#define ACCESS_LOG_RING_SIZE 4096     // Records buffered per thread, a power of two
+#define ACCESS_LOG_RESOURCE_MAX 128
+#define ACCESS_LOG_METHOD_MAX 8
+#define ACCESS_LOG_FLUSH_MS 100       // How often the writer looks for records
+
+// Struct representing the address of a client, without the port
+typedef struct {
+    unsigned short family;    // AF_INET or AF_INET6, 0 if unknown
+    unsigned char addr[16];
+} access_log_addr_t;
+
+// Struct representing one line of the access log. Records are fixed-size, so
+// logging a request copies it into a ring without allocating; the writer
+// thread formats it.
+typedef struct {
+    uint64_t done;            // CLOCK_MONOTONIC time the response was sent
+    uint64_t duration;        // Nanoseconds since the request started arriving
+    access_log_addr_t client;
+    int status;
+    int minor_version;
+    size_t bytes;
+    char method[ACCESS_LOG_METHOD_MAX];      // Truncated, NUL-terminated
+    char resource[ACCESS_LOG_RESOURCE_MAX];  // Truncated, NUL-terminated
+} access_log_record_t;
+
+/*
+ * Open the access log and start the thread that writes it. Until this is
+ * called, requests are not logged.
+ * path: File that lines are appended to, or "-" for stdout
+ * Returns 0 on success or -1 on error
+ */
+int access_log_init(const char *path);
+
+/*
+ * Capture the address of a client when its connection is accepted. The
+ * address travels with the connection to every request logged on it.
+ * client: Set to the address, without the port
+ * addr: The address accept returned for the connection
+ */
+void access_log_client(access_log_addr_t *client, const struct sockaddr *addr);
+
+/*
+ * Log a request that was answered. The record goes into a ring owned by the
+ * calling thread without taking locks or blocking; if the writer has fallen
+ * so far behind that the ring is full, the record is dropped and counted.
+ * client: The address of the connection's client, or NULL if it is not known
+ * req: The request
+ * timing: The phase boundaries of the request
+ * status: The HTTP status code of the response
+ * bytes: Number of bytes sent, including the header
+ */
+void access_log_request(const access_log_addr_t *client, const http_request_t *req,
+        const request_timing_t *timing, int status, size_t bytes);
+
+/*
+ * Hand the calling thread's ring over to the next thread that logs a request.
+ * Records still in it are written as usual. Called by threads before they
+ * exit.
+ */
+void access_log_thread_exit(void);
+
+/*
+ * Write out every record still buffered, stop the writer thread and close
+ * the log. Must only be called once no thread logs requests any more.
+ * Returns 0 on success or -1 on error
+ */
+int access_log_free(void);
+
+#endif // ACCESS_LOG_H
@@ -0,0 +1,311 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "blob_store.h"
+#include "http.h"
+
+// Struct representing a response rendered during the walk, kept until the
+// arena it is copied into can be sized
+typedef struct pending_blob {
+    char *path;
+    char *data;
+    size_t len;
+    size_t header_len;
+    size_t prefix_len;
+    struct pending_blob *next;
+} pending_blob_t;
+
+// Struct representing the state of the walk over the served directory
+typedef struct {
+    size_t max_file_size;
+    int (*format_header)(char *header, const char *path, const struct stat *statbuf,
+            size_t *prefix_len);
+    pending_blob_t *head;
+    int n_blobs;
+    size_t arena_size;        // Bytes the blobs take once aligned
+} walk_t;
+
+
+static size_t align_up(size_t n, size_t align) {
+    return (n + align - 1) & ~(align - 1);
+}
+
+
+// Render the response to one file. Files that change size while they are read
+// or cannot be read at all are left out.
+// Returns 0 on success or -1 on error
+static int render_file(walk_t *walk, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd == -1) {
+        fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    struct stat statbuf;
+    char header[HTTP_HEADER_MAX];
+    size_t prefix_len;
+    int header_len = -1;
+    if (fstat(fd, &statbuf) == 0 && S_ISREG(statbuf.st_mode) &&
+            (size_t) statbuf.st_size <= walk->max_file_size) {
+        header_len = walk->format_header(header, path, &statbuf, &prefix_len);
+    }
+    if (header_len == -1) {
+        if (close(fd) == -1) { perror("close"); }
+        return 0;
+    }
+
+    size_t size = statbuf.st_size;
+    pending_blob_t *blob = malloc(sizeof(pending_blob_t));
+    char *data = malloc(header_len + size);
+    char *path_copy = strdup(path);
+    if (blob == NULL || data == NULL || path_copy == NULL) {
+        perror("malloc");
+        free(blob);
+        free(data);
+        free(path_copy);
+        if (close(fd) == -1) { perror("close"); }
+        return -1;
+    }
+    memcpy(data, header, header_len);
+    size_t offset = 0;
+    while (offset < size) {
+        ssize_t bytes_read = pread(fd, data + header_len + offset, size - offset, offset);
+        if (bytes_read <= 0) {
+            if (bytes_read == -1 && errno == EINTR) { continue; }
+            break;
+        }
+        offset += bytes_read;
+    }
+    if (close(fd) == -1) { perror("close"); }
+    if (offset < size) {
+        fprintf(stderr, "Failed to read %s, not rendering it\n", path);
+        free(blob);
+        free(data);
+        free(path_copy);
+        return 0;
+    }
+
+    blob->path = path_copy;
+    blob->data = data;
+    blob->len = header_len + size;
+    blob->header_len = header_len;
+    blob->prefix_len = prefix_len;
+    blob->next = walk->head;
+    walk->head = blob;
+    walk->n_blobs++;
+    walk->arena_size += align_up(blob->len, BLOB_ALIGN);
+    return 0;
+}
+
+
+// Render every file below a directory, without following symlinks, which
+// requests would not reach by the same path.
+// Returns 0 on success or -1 on error
+static int walk_dir(walk_t *walk, const char *dir_path) {
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        fprintf(stderr, "opendir %s: %s\n", dir_path, strerror(errno));
+        return 0;
+    }
+    int ret = 0;
+    struct dirent *dirent;
+    while (ret == 0 && (dirent = readdir(dir)) != NULL) {
+        if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+            continue;
+        }
+        char child[strlen(dir_path) + strlen(dirent->d_name) + 2];
+        sprintf(child, "%s/%s", dir_path, dirent->d_name);
+        int type = dirent->d_type;
+        struct stat statbuf;
+        if (type == DT_UNKNOWN && lstat(child, &statbuf) == 0) {
+            type = S_ISDIR(statbuf.st_mode) ? DT_DIR : S_ISREG(statbuf.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type == DT_DIR) {
+            ret = walk_dir(walk, child);
+        } else if (type == DT_REG) {
+            ret = render_file(walk, child);
+        }
+    }
+    closedir(dir);
+    return ret;
+}
+
+
+// Map an arena of at least size bytes, from the huge pages reserved for
+// applications if there are enough, otherwise from regular pages the kernel
+// is asked to back with transparent huge pages.
+// Returns the arena, or NULL on error
+static char *map_arena(blob_store_t *store, size_t size) {
+    size_t huge_size = align_up(size, BLOB_HUGE_PAGE);
+    char *arena = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (arena != MAP_FAILED) {
+        store->arena_size = huge_size;
+        store->huge_pages = 1;
+        return arena;
+    }
+    arena = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    if (size >= BLOB_HUGE_PAGE) {
+        madvise(arena, size, MADV_HUGEPAGE); // Not every kernel has them
+    }
+    store->arena_size = size;
+    store->huge_pages = 0;
+    return arena;
+}
+
+
+static void free_pending(walk_t *walk) {
+    while (walk->head != NULL) {
+        pending_blob_t *next = walk->head->next;
+        free(walk->head->path);
+        free(walk->head->data);
+        free(walk->head);
+        walk->head = next;
+    }
+}
+
+
+int blob_store_init(blob_store_t *store, const char *root, size_t max_file_size,
+        int (*format_header)(char *header, const char *path,
+            const struct stat *statbuf, size_t *prefix_len)) {
+    memset(store, 0, sizeof(blob_store_t));
+    if ((store->root = strdup(root)) == NULL) {
+        perror("strdup");
+        return -1;
+    }
+    walk_t walk;
+    memset(&walk, 0, sizeof(walk_t));
+    walk.max_file_size = max_file_size;
+    walk.format_header = format_header;
+    if (walk_dir(&walk, root) == -1) {
+        free_pending(&walk);
+        free(store->root);
+        return -1;
+    }
+
+    // Sized up front so that the table never grows
+    size_t n_buckets = 16;
+    while (n_buckets < (size_t) walk.n_blobs) { n_buckets *= 2; }
+    if (path_table_init(&store->table, n_buckets) == -1) {
+        free_pending(&walk);
+        free(store->root);
+        return -1;
+    }
+    store->blobs = malloc((walk.n_blobs + 1) * sizeof(response_blob_t));
+    if (store->blobs == NULL) {
+        perror("malloc");
+        path_table_free(&store->table);
+        free_pending(&walk);
+        free(store->root);
+        return -1;
+    }
+    if (walk.n_blobs > 0 && (store->arena = map_arena(store, walk.arena_size)) == NULL) {
+        path_table_free(&store->table);
+        free(store->blobs);
+        free_pending(&walk);
+        free(store->root);
+        return -1;
+    }
+
+    // Copy every response into the arena, which is read-only from then on
+    size_t offset = 0;
+    while (walk.head != NULL) {
+        pending_blob_t *pending = walk.head;
+        response_blob_t *blob = &store->blobs[store->n_blobs++];
+        memcpy(store->arena + offset, pending->data, pending->len);
+        blob->node.hash = path_hash(pending->path);
+        blob->node.path = pending->path;
+        blob->data = store->arena + offset;
+        blob->len = pending->len;
+        blob->header_len = pending->header_len;
+        blob->prefix_len = pending->prefix_len;
+        atomic_init(&blob->stale, 0);
+        path_table_insert(&store->table, &blob->node);
+        offset += align_up(pending->len, BLOB_ALIGN);
+
+        walk.head = pending->next;
+        free(pending->data);
+        free(pending);
+    }
+    if (store->arena != NULL && mprotect(store->arena, store->arena_size, PROT_READ) == -1) {
+        perror("mprotect");
+    }
+    return 0;
+}
+
+
+static response_blob_t *lookup(blob_store_t *store, const char *path) {
+    path_node_t *node = path_table_find(&store->table, path_hash(path), path);
+    return node != NULL ? PATH_ENTRY(node, response_blob_t, node) : NULL;
+}
+
+
+const response_blob_t *blob_store_find(blob_store_t *store, const char *path) {
+    response_blob_t *blob = lookup(store, path);
+    if (blob == NULL || atomic_load_explicit(&blob->stale, memory_order_relaxed)) {
+        return NULL;
+    }
+    atomic_fetch_add_explicit(&store->hits, 1, memory_order_relaxed);
+    return blob;
+}
+
+
+// Mark a blob stale, counting it the first time
+static void retire(blob_store_t *store, response_blob_t *blob) {
+    if (atomic_exchange_explicit(&blob->stale, 1, memory_order_relaxed) == 0) {
+        atomic_fetch_add_explicit(&store->n_stale, 1, memory_order_relaxed);
+    }
+}
+
+
+void blob_store_invalidate(void *arg, const char *path) {
+    blob_store_t *store = arg;
+    if (path == NULL) {
+        for (int i = 0; i < store->n_blobs; i++) {
+            retire(store, &store->blobs[i]);
+        }
+        return;
+    }
+    // Blobs are named the way requests name them, under the root as given
+    char full_path[strlen(store->root) + strlen(path) + 1];
+    sprintf(full_path, "%s%s", store->root, path);
+    response_blob_t *blob = lookup(store, full_path);
+    if (blob != NULL) {
+        retire(store, blob);
+    }
+}
+
+
+void blob_store_report(FILE *out, void *arg) {
+    blob_store_t *store = arg;
+    fprintf(out, "blob store: %d responses, %zu bytes%s, %ld hits, %d retired\n",
+            store->n_blobs, store->arena_size,
+            store->huge_pages ? " in huge pages" : "", atomic_load(&store->hits),
+            atomic_load(&store->n_stale));
+}
+
+
+int blob_store_free(blob_store_t *store) {
+    int ret = 0;
+    if (store->arena != NULL && munmap(store->arena, store->arena_size) == -1) {
+        perror("munmap");
+        ret = -1;
+    }
+    for (int i = 0; i < store->n_blobs; i++) {
+        free((char *) store->blobs[i].node.path);
+    }
+    free(store->blobs);
+    path_table_free(&store->table);
+    free(store->root);
+    return ret;
+}
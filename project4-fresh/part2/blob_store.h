@@ -0,0 +1,91 @@
+#ifndef BLOB_STORE_H
+#define BLOB_STORE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "path_table.h"
+
+#define BLOB_ALIGN 64             // Blobs start on a cache line of their own
+#define BLOB_HUGE_PAGE (2 * 1024 * 1024)
+
+// Struct representing the complete response to a request for a small file,
+// status line, header and body, laid out contiguously so that it goes out
+// with one send on a persistent connection
+typedef struct response_blob {
+    path_node_t node;         // Keyed by the path of the file
+    const char *data;         // The response, in the arena
+    size_t len;               // Bytes of the whole response
+    size_t header_len;        // Bytes of the header, ending with keep-alive
+    size_t prefix_len;        // Bytes of the header before its Connection line
+    atomic_int stale;         // Set once the file changed, no longer served
+} response_blob_t;
+
+// Struct representing the responses rendered by walking the served directory
+// at startup. The store is read-only once built, so lookups take no locks.
+// It is a snapshot: files changed later are served as they were, unless the
+// change is reported to blob_store_invalidate, which retires their blobs.
+typedef struct {
+    char *root;
+    response_blob_t *blobs;
+    int n_blobs;
+    path_table_t table;
+    char *arena;              // Every blob, in one mapping
+    size_t arena_size;
+    int huge_pages;           // Whether the arena is backed by huge pages
+    atomic_long hits;
+    atomic_int n_stale;
+} blob_store_t;
+
+/*
+ * Render the response to every regular file of at most max_file_size bytes
+ * below root, without following symlinks, into an arena backed by huge
+ * pages if the system has them reserved.
+ * store: Pointer to blob_store_t to be initialized
+ * root: The served directory, which requested paths start with
+ * max_file_size: Largest file rendered, in bytes
+ * format_header: Formats the header of a file into a buffer of
+ *                HTTP_HEADER_MAX bytes, setting prefix_len to the length
+ *                before its Connection line, and returns its length or -1
+ * Returns 0 on success or -1 on error
+ */
+int blob_store_init(blob_store_t *store, const char *root, size_t max_file_size,
+        int (*format_header)(char *header, const char *path,
+            const struct stat *statbuf, size_t *prefix_len));
+
+/*
+ * Look up the response rendered for a path.
+ * store: A pointer to the blob_store_t to search
+ * path: The path of the requested resource below the served directory
+ * Returns the response, valid until the store is freed, or NULL if there is
+ * none or its file changed
+ */
+const response_blob_t *blob_store_find(blob_store_t *store, const char *path);
+
+/*
+ * Stop serving the response rendered for a path, for good. Meant to be
+ * passed to open_cache_init as its on_invalidate callback.
+ * arg: A pointer to the blob_store_t
+ * path: The path that changed, relative to the served directory and starting
+ *       with '/', or NULL to stop serving every response
+ */
+void blob_store_invalidate(void *arg, const char *path);
+
+/*
+ * Write the number of responses, bytes rendered, hits and responses retired
+ * to 'out'.
+ * Meant to be registered with stats_add_reporter.
+ * arg: A pointer to the blob_store_t
+ */
+void blob_store_report(FILE *out, void *arg);
+
+/*
+ * Deallocates and cleans up any resources associated with a store.
+ * Returns 0 on success or -1 on error
+ */
+int blob_store_free(blob_store_t *store);
+
+#endif // BLOB_STORE_H
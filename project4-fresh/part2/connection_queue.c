@@ -1,212 +1,229 @@
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "connection_queue.h"
-
-int connection_queue_init(connection_queue_t *queue) {
-    int err = 0;
-
-    // Zero out the struct
-    memset(queue, 0, sizeof(connection_queue_t));
-
-    // Initialize the mutex
-    if ((err = pthread_mutex_init(&queue->lock, NULL)) != 0) {
-        fprintf(stderr, "pthread_mutex_init failed: %s\n", strerror(err));
-        return -1;
-    }
-
-    // Initialize first condition variable
-    if ((err = pthread_cond_init(&queue->full, NULL)) != 0) {
-        fprintf(stderr, "pthread_cond_init failed: %s\n", strerror(err));
-
-        // Attempt to free mutex on error
-        if ((err = pthread_mutex_destroy(&queue->lock)) != 0) {
-            fprintf(stderr,
-                    "pthread_mutex_destroy failed: %s\n", strerror(err));
+#include "futex.h"
+
+
+// Returns 0 if the element was added or -1 if the queue is full
+static int try_enqueue(connection_queue_t *queue, const queued_connection_t *conn) {
+    size_t pos = atomic_load_explicit(&queue->write_idx, memory_order_relaxed);
+    connection_slot_t *slot;
+
+    while (1) {
+        slot = &queue->slots[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            // The slot is free for this lap -- claim it
+            if (atomic_compare_exchange_weak_explicit(&queue->write_idx, &pos,
+                        pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return -1; // the slot still holds an element from the last lap
+        } else {
+            pos = atomic_load_explicit(&queue->write_idx, memory_order_relaxed);
         }
-
-        return -1;
     }
 
-    // Initialize second condition variable, or abort on error
-    if ((err = pthread_cond_init(&queue->empty, NULL)) != 0) {
-        fprintf(stderr, "pthread_cond_init failed: %s\n", strerror(err));
+    slot->conn = *conn;
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    return 0;
+}
 
-        // Attempt to free mutex on error
-        if ((err = pthread_mutex_destroy(&queue->lock)) != 0) {
-            fprintf(stderr,
-                    "pthread_mutex_destroy failed: %s\n", strerror(err));
-        }
 
-        // Attempt to free previous condition variable on error
-        if ((err = pthread_cond_destroy(&queue->full)) != 0) {
-            fprintf(stderr, "pthread_cond_destroy failed: %s\n", strerror(err));
+// Sets 'conn' to the removed element.
+// Returns 0 on success or -1 if the queue is empty
+static int try_dequeue(connection_queue_t *queue, queued_connection_t *conn) {
+    size_t pos = atomic_load_explicit(&queue->read_idx, memory_order_relaxed);
+    connection_slot_t *slot;
+
+    while (1) {
+        slot = &queue->slots[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (diff == 0) {
+            // The slot holds an element for this lap -- claim it
+            if (atomic_compare_exchange_weak_explicit(&queue->read_idx, &pos,
+                        pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return -1; // no element has been published in this slot yet
+        } else {
+            pos = atomic_load_explicit(&queue->read_idx, memory_order_relaxed);
         }
-
-        return -1;
     }
 
+    *conn = slot->conn;
+    // Free the slot for the producer of the next lap
+    atomic_store_explicit(&slot->sequence, pos + queue->mask + 1, memory_order_release);
     return 0;
 }
 
-int connection_enqueue(connection_queue_t *queue, int connection_fd) {
-    int err;
-
-    // Obtain lock on the queue
-    if ((err = pthread_mutex_lock(&queue->lock)) != 0) {
-        fprintf(stderr, "pthread_mutex_lock failed: %s\n", strerror(err));
-        return -1;
-    }
-
-    // If the queue is already full, release the lock and wait for
-    // an available space
-    while (queue->length == CAPACITY) {
-        if ((err = pthread_cond_wait(&queue->full, &queue->lock)) != 0) {
-            fprintf(stderr, "pthread_cond_wait failed: %s\n", strerror(err));
 
-            // Release the lock on failure
-            if ((err = pthread_mutex_unlock(&queue->lock)) != 0) {
-                fprintf(stderr,
-                        "pthread_mutex_unlock failed: %s\n", strerror(err));
-            }
+int connection_queue_init(connection_queue_t *queue, size_t capacity) {
+    // Zero out the struct
+    memset(queue, 0, sizeof(connection_queue_t));
 
-            return -1;
-        }
+    // Slots are picked by masking the index, so capacity is a power of two.
+    // With a single slot the sequence numbers of consecutive laps collide.
+    size_t rounded = 2;
+    while (rounded < capacity) {
+        rounded <<= 1;
     }
+    queue->capacity = rounded;
+    queue->mask = rounded - 1;
 
-    // If the queue is empty and shutdown is indicated, exit
-    if (queue->shutdown == 1) {
-        // Release the lock
-        if ((err = pthread_mutex_unlock(&queue->lock)) != 0) {
-            fprintf(stderr,
-                    "pthread_mutex_unlock failed: %s\n", strerror(err));
-        }
+    queue->slots = malloc(rounded * sizeof(connection_slot_t));
+    if (queue->slots == NULL) {
+        perror("malloc");
         return -1;
     }
+    // Slot i is first written by the producer that claims index i
+    for (size_t i = 0; i < rounded; i++) {
+        atomic_init(&queue->slots[i].sequence, i);
+    }
+
+    return 0;
+}
 
-    // Add item to queue
-    queue->client_fds[queue->write_idx] = connection_fd;
-    queue->write_idx = (queue->write_idx + 1) % CAPACITY;
-    queue->length += 1;
 
-    // Signal that the queue is no longer empty
-    if ((err = pthread_cond_signal(&queue->empty)) != 0) {
-        fprintf(stderr, "pthread_cond_signal failed: %s\n", strerror(err));
+int connection_enqueue(connection_queue_t *queue, const queued_connection_t *conn) {
+    int spins = 0;
 
-        // Release the lock on failure
-        if ((err = pthread_mutex_unlock(&queue->lock)) != 0) {
-            fprintf(stderr, "pthread_mutex_unlock failed: %s\n", strerror(err));
+    while (1) {
+        // If shutdown is indicated, exit
+        if (atomic_load(&queue->shutdown)) {
+            return -1;
         }
 
-        return -1;
-    }
+        if (try_enqueue(queue, conn) == 0) {
+            futex_notify(&queue->added, &queue->n_waiting_consumers);
+            return 0;
+        }
 
-    // Release the lock
-    if ((err = pthread_mutex_unlock(&queue->lock)) != 0) {
-        fprintf(stderr, "pthread_mutex_unlock failed: %s\n", strerror(err));
-        return -1;
+        // The queue is full -- spin for a while, then wait for a consumer
+        if (spins < SPIN_COUNT) {
+            spins++;
+            cpu_relax();
+            continue;
+        }
+        unsigned int removed = atomic_load(&queue->removed);
+        atomic_fetch_add(&queue->n_waiting_producers, 1);
+        // Re-check after announcing ourselves, or a consumer that removed an
+        // element in between might not know to wake us
+        if (try_enqueue(queue, conn) == 0) {
+            atomic_fetch_sub(&queue->n_waiting_producers, 1);
+            futex_notify(&queue->added, &queue->n_waiting_consumers);
+            return 0;
+        }
+        if (!atomic_load(&queue->shutdown) &&
+                futex_wait(&queue->removed, removed) == -1 &&
+                errno != EAGAIN && errno != EINTR) {
+            perror("futex");
+            atomic_fetch_sub(&queue->n_waiting_producers, 1);
+            return -1;
+        }
+        atomic_fetch_sub(&queue->n_waiting_producers, 1);
     }
-
-    return 0;
 }
 
-int connection_dequeue(connection_queue_t *queue) {
-    int err;
-    int fd;
 
-    // Obtain lock on the queue
-    if ((err = pthread_mutex_lock(&queue->lock)) != 0) {
-        fprintf(stderr, "pthread_mutex_lock failed: %s\n", strerror(err));
-        return -1;
-    }
+int connection_dequeue(connection_queue_t *queue, queued_connection_t *conn) {
+    int spins = 0;
+
+    while (1) {
+        if (try_dequeue(queue, conn) == 0) {
+            futex_notify(&queue->removed, &queue->n_waiting_producers);
+            return 0;
+        }
 
-    // If the queue is already full, release the lock and wait for
-    // an available space
-    while (queue->length == 0) {
         // If the queue is empty and shutdown is indicated, exit
-        if (queue->shutdown == 1) {
-            // Release the lock
-            if ((err = pthread_mutex_unlock(&queue->lock)) != 0) {
-                fprintf(stderr,
-                        "pthread_mutex_unlock failed: %s\n", strerror(err));
-            }
+        if (atomic_load(&queue->shutdown)) {
             return -1;
         }
 
-        // Attempt to wait for a signal
-        if ((err = pthread_cond_wait(&queue->empty, &queue->lock)) != 0) {
-            fprintf(stderr, "pthread_cond_wait failed: %s\n", strerror(err));
-
-            // Release the lock on failure
-            if ((err = pthread_mutex_unlock(&queue->lock)) != 0) {
-                fprintf(stderr,
-                        "pthread_mutex_unlock failed: %s\n", strerror(err));
-            }
-
+        // The queue is empty -- spin for a while, then wait for a producer
+        if (spins < SPIN_COUNT) {
+            spins++;
+            cpu_relax();
+            continue;
+        }
+        unsigned int added = atomic_load(&queue->added);
+        atomic_fetch_add(&queue->n_waiting_consumers, 1);
+        // Re-check after announcing ourselves, or a producer that added an
+        // element in between might not know to wake us
+        if (try_dequeue(queue, conn) == 0) {
+            atomic_fetch_sub(&queue->n_waiting_consumers, 1);
+            futex_notify(&queue->removed, &queue->n_waiting_producers);
+            return 0;
+        }
+        if (!atomic_load(&queue->shutdown) &&
+                futex_wait(&queue->added, added) == -1 &&
+                errno != EAGAIN && errno != EINTR) {
+            perror("futex");
+            atomic_fetch_sub(&queue->n_waiting_consumers, 1);
             return -1;
         }
+        atomic_fetch_sub(&queue->n_waiting_consumers, 1);
     }
+}
 
-    // Remove an item from the queue
-    fd = queue->client_fds[queue->read_idx];
-    queue->read_idx = (queue->read_idx + 1) % CAPACITY;
-    queue->length -= 1;
-
-    // Signal that the queue is no longer empty
-    if ((err = pthread_cond_signal(&queue->full)) != 0) {
-        fprintf(stderr, "pthread_cond_signal failed: %s\n", strerror(err));
-
-        // Release the lock on failure
-        if ((err = pthread_mutex_unlock(&queue->lock)) != 0) {
-            fprintf(stderr, "pthread_mutex_unlock failed: %s\n", strerror(err));
-        }
 
+int connection_try_enqueue(connection_queue_t *queue, const queued_connection_t *conn) {
+    if (atomic_load(&queue->shutdown) || try_enqueue(queue, conn) == -1) {
         return -1;
     }
+    futex_notify(&queue->added, &queue->n_waiting_consumers);
+    return 0;
+}
+
 
-    // Release the lock
-    if ((err = pthread_mutex_unlock(&queue->lock)) != 0) {
-        fprintf(stderr, "pthread_mutex_unlock failed: %s\n", strerror(err));
+int connection_try_dequeue(connection_queue_t *queue, queued_connection_t *conn) {
+    if (try_dequeue(queue, conn) == -1) {
         return -1;
     }
+    futex_notify(&queue->removed, &queue->n_waiting_producers);
+    return 0;
+}
+
 
-    return fd;
+size_t connection_queue_length(connection_queue_t *queue) {
+    // Read the consumer side first, so a concurrent dequeue cannot make the
+    // result negative
+    size_t read_idx = atomic_load(&queue->read_idx);
+    size_t write_idx = atomic_load(&queue->write_idx);
+    return write_idx - read_idx;
 }
 
+
 int connection_queue_shutdown(connection_queue_t *queue) {
     int ret = 0;
-    int err = 0;
-    queue->shutdown = 1;
-
-    if ((err = pthread_cond_broadcast(&queue->full)) != 0) {
-        fprintf(stderr, "pthread_cond_broadcast failed: %s\n", strerror(err));
+    atomic_store(&queue->shutdown, 1);
+
+    // Bump both futex words so that no thread goes to sleep on a stale value,
+    // then wake everyone up to notice the shutdown
+    atomic_fetch_add(&queue->added, 1);
+    atomic_fetch_add(&queue->removed, 1);
+    if (futex_wake(&queue->added, INT_MAX) == -1) {
+        perror("futex");
         ret = -1;
     }
-
-    if ((err = pthread_cond_broadcast(&queue->empty)) != 0) {
-        fprintf(stderr, "pthread_cond_broadcast failed: %s\n", strerror(err));
+    if (futex_wake(&queue->removed, INT_MAX) == -1) {
+        perror("futex");
         ret = -1;
     }
 
     return ret;
 }
 
-int connection_queue_free(connection_queue_t *queue) {
-    int ret = 0;
-    int err = 0;
-    if ((err = pthread_mutex_destroy(&queue->lock)) != 0) {
-        fprintf(stderr, "pthread_mutex_destroy failed: %s\n", strerror(err));
-        ret = -1;
-    }
 
-    if ((err = pthread_cond_destroy(&queue->full)) != 0) {
-        fprintf(stderr, "pthread_cond_destroy failed: %s\n", strerror(err));
-        ret = -1;
-    }
-
-    if ((err = pthread_cond_destroy(&queue->empty)) != 0) {
-        fprintf(stderr, "pthread_cond_destroy failed: %s\n", strerror(err));
-        ret = -1;
-    }
-
-    return ret;
+int connection_queue_free(connection_queue_t *queue) {
+    free(queue->slots);
+    queue->slots = NULL;
+    return 0;
 }
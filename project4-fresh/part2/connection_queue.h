@@ -1,51 +1,97 @@
 #ifndef CONNECTION_QUEUE_H
 #define CONNECTION_QUEUE_H
 
-#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
 
-#define CAPACITY 5
+#include "access_log.h"
+
+#define CAPACITY 64
+#define CACHE_LINE 64
+
+// Struct representing a connection waiting for a worker: its socket, along
+// with the address of its client, captured when it was accepted
+typedef struct {
+    int fd;
+    access_log_addr_t client;
+} queued_connection_t;
+
+// A slot of the ring. Its sequence number tells producers and consumers
+// whether the slot is free or holds an element for the current lap.
+typedef struct {
+    atomic_size_t sequence;
+    queued_connection_t conn;
+} connection_slot_t;
 
 // Struct representing a thread-safe queue data structure
-// The queue stores file descriptors of active client TCP sockets
+// The queue stores connections of active client TCP sockets in a bounded
+// lock-free ring (Vyukov's sequence-numbered MPMC queue). Threads that find
+// the queue empty or full spin briefly and then sleep on a futex.
 typedef struct {
-    int client_fds[CAPACITY];
-    int length;
-    int read_idx;
-    int write_idx;
-    int shutdown;
-    // Thread synchronization
-    pthread_mutex_t lock;
-    pthread_cond_t full;
-    pthread_cond_t empty;
+    connection_slot_t *slots;
+    size_t capacity;
+    size_t mask;
+    _Alignas(CACHE_LINE) atomic_size_t write_idx;
+    _Alignas(CACHE_LINE) atomic_size_t read_idx;
+    // Futex words bumped whenever an element is added or removed, together
+    // with the number of threads sleeping on them
+    _Alignas(CACHE_LINE) atomic_uint added;
+    atomic_int n_waiting_consumers;
+    atomic_uint removed;
+    atomic_int n_waiting_producers;
+    atomic_int shutdown;
 } connection_queue_t;
 
 /*
  * Initialize a new connection queue.
- * The queue can store at most 'CAPACITY' elements.
  * queue: Pointer to connection_queue_t to be initialized
+ * capacity: Maximum number of elements, rounded up to a power of two
  * Returns 0 on success or -1 on error
  */
-int connection_queue_init(connection_queue_t *queue);
+int connection_queue_init(connection_queue_t *queue, size_t capacity);
 
 /*
- * Add a new file descriptor to a connection queue. If the queue is full, then
+ * Add a new connection to a connection queue. If the queue is full, then
  * this function blocks until space becomes available. If the queue is shut
  * down, then no addition to the queue takes place and an error is returned.
  * queue: A pointer to the connection_queue_t to add to
- * connection_fd: The socket file descriptor to add to the queue
+ * conn: The connection to add to the queue, which is copied
  * Returns 0 on success or -1 on error
  */
-int connection_enqueue(connection_queue_t *queue, int connection_fd);
+int connection_enqueue(connection_queue_t *queue, const queued_connection_t *conn);
 
 /*
- * Remove a file descriptor from the connection queue. If the queue is empty,
+ * Remove a connection from the connection queue. If the queue is empty,
  * then this function blocks until an item becomes available. If the queue is
  * shut down, then no removal from the queue takes place and an error is
  * returned.
  * queue: A pointer to the connection_queue_t to remove from
- * Returns the removed socket file descriptor on success or -1 on error
+ * conn: Set to the removed connection on success
+ * Returns 0 on success or -1 on error
+ */
+int connection_dequeue(connection_queue_t *queue, queued_connection_t *conn);
+
+/*
+ * Add a new connection to a connection queue without blocking.
+ * queue: A pointer to the connection_queue_t to add to
+ * conn: The connection to add to the queue, which is copied
+ * Returns 0 on success or -1 if the queue is full or shut down
+ */
+int connection_try_enqueue(connection_queue_t *queue, const queued_connection_t *conn);
+
+/*
+ * Remove a connection from the connection queue without blocking.
+ * queue: A pointer to the connection_queue_t to remove from
+ * conn: Set to the removed connection on success
+ * Returns 0 on success or -1 if the queue is empty
+ */
+int connection_try_dequeue(connection_queue_t *queue, queued_connection_t *conn);
+
+/*
+ * Returns the number of connections currently in the queue. The value is
+ * only a snapshot while other threads are using the queue.
  */
-int connection_dequeue(connection_queue_t *queue);
+size_t connection_queue_length(connection_queue_t *queue);
 
 /*
  * Cleanly shuts down the connection queue. All threads currently blocked on an
@@ -0,0 +1,173 @@
+#include <brotli/encode.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+#include "content_encoding.h"
+
+// Compression happens once per file version, so favour ratio over speed
+#define GZIP_LEVEL 9
+#define BROTLI_QUALITY 9
+
+
+// Parse the q parameter of an Accept-Encoding element, which defaults to 1.
+// Only whether it is zero matters, so it is returned in thousandths.
+static int parse_qvalue(const char *params, size_t len) {
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && (params[i] == ';' || params[i] == ' ' || params[i] == '\t')) { i++; }
+        if (i + 2 <= len && (params[i] == 'q' || params[i] == 'Q') && params[i + 1] == '=') {
+            i += 2;
+            int q = 0;
+            int digits = 0;
+            int seen_point = 0;
+            for (; i < len && digits < 4; i++) {
+                if (params[i] == '.' && !seen_point) {
+                    seen_point = 1;
+                    digits = 1;
+                } else if (params[i] >= '0' && params[i] <= '9') {
+                    q = q * 10 + (params[i] - '0');
+                    if (seen_point) { digits++; }
+                    else if (q > 1) { q = 1; }  // Out of range, not zero
+                } else {
+                    break;
+                }
+            }
+            for (; seen_point && digits < 4; digits++) { q *= 10; }
+            return seen_point ? q : q * 1000;
+        }
+        while (i < len && params[i] != ';') { i++; }
+    }
+    return 1000;
+}
+
+
+int negotiate_content_encoding(const http_slice_t *accept_encoding) {
+    if (accept_encoding == NULL) {
+        return ENCODING_IDENTITY;
+    }
+
+    int gzip = 0, brotli = 0, any = -1;
+    const char *s = accept_encoding->data;
+    size_t len = accept_encoding->len;
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && (s[i] == ' ' || s[i] == '\t' || s[i] == ',')) { i++; }
+        size_t start = i;
+        while (i < len && s[i] != ',' && s[i] != ';' && s[i] != ' ' && s[i] != '\t') { i++; }
+        size_t name_len = i - start;
+        size_t params = i;
+        while (i < len && s[i] != ',') { i++; }
+        int q = parse_qvalue(s + params, i - params);
+
+        if (name_len == 2 && strncasecmp(s + start, "br", 2) == 0) {
+            brotli = q > 0 ? 1 : -1;
+        } else if ((name_len == 4 && strncasecmp(s + start, "gzip", 4) == 0) ||
+                (name_len == 6 && strncasecmp(s + start, "x-gzip", 6) == 0)) {
+            gzip = q > 0 ? 1 : -1;
+        } else if (name_len == 1 && s[start] == '*') {
+            any = q > 0;
+        }
+    }
+
+    // Codings that are not listed are acceptable if '*' is
+    if (brotli == 1 || (brotli == 0 && any == 1)) {
+        return ENCODING_BROTLI;
+    }
+    if (gzip == 1 || (gzip == 0 && any == 1)) {
+        return ENCODING_GZIP;
+    }
+    return ENCODING_IDENTITY;
+}
+
+
+const char *content_encoding_name(int encoding) {
+    switch (encoding) {
+    case ENCODING_GZIP: return "gzip";
+    case ENCODING_BROTLI: return "br";
+    default: return "identity";
+    }
+}
+
+
+const char *content_encoding_extension(int encoding) {
+    switch (encoding) {
+    case ENCODING_GZIP: return ".gz";
+    case ENCODING_BROTLI: return ".br";
+    default: return "";
+    }
+}
+
+
+static int compress_gzip(const char *data, size_t size, char **out, size_t *out_len) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // 16 added to the window bits asks for a gzip header and trailer
+    int err = deflateInit2(&stream, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 9,
+            Z_DEFAULT_STRATEGY);
+    if (err != Z_OK) {
+        fprintf(stderr, "deflateInit2 failed: %d\n", err);
+        return -1;
+    }
+
+    size_t bound = deflateBound(&stream, size);
+    char *buf = malloc(bound);
+    if (buf == NULL) {
+        perror("malloc");
+        deflateEnd(&stream);
+        return -1;
+    }
+    stream.next_in = (Bytef *) data;
+    stream.avail_in = size;
+    stream.next_out = (Bytef *) buf;
+    stream.avail_out = bound;
+    err = deflate(&stream, Z_FINISH);
+    if (err != Z_STREAM_END) {
+        fprintf(stderr, "deflate failed: %d\n", err);
+        deflateEnd(&stream);
+        free(buf);
+        return -1;
+    }
+    *out = buf;
+    *out_len = stream.total_out;
+    deflateEnd(&stream);
+    return 0;
+}
+
+
+static int compress_brotli(const char *data, size_t size, char **out, size_t *out_len) {
+    // The bound is 0 for sizes too large to have one
+    size_t len = BrotliEncoderMaxCompressedSize(size);
+    if (len == 0) {
+        fprintf(stderr, "File is too large to compress\n");
+        return -1;
+    }
+    char *buf = malloc(len);
+    if (buf == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    if (!BrotliEncoderCompress(BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW,
+                BROTLI_MODE_TEXT, size, (const uint8_t *) data, &len, (uint8_t *) buf)) {
+        fprintf(stderr, "BrotliEncoderCompress failed\n");
+        free(buf);
+        return -1;
+    }
+    *out = buf;
+    *out_len = len;
+    return 0;
+}
+
+
+int compress_content(int encoding, const char *data, size_t size,
+        char **out, size_t *out_len) {
+    switch (encoding) {
+    case ENCODING_GZIP: return compress_gzip(data, size, out, out_len);
+    case ENCODING_BROTLI: return compress_brotli(data, size, out, out_len);
+    default:
+        fprintf(stderr, "Unsupported content encoding %d\n", encoding);
+        return -1;
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef CONTENT_ENCODING_H
+#define CONTENT_ENCODING_H
+
+#include <stddef.h>
+
+#include "http_parser.h"
+
+// Content codings the server can send, from least to most preferred
+enum { ENCODING_IDENTITY, ENCODING_GZIP, ENCODING_BROTLI };
+
+/*
+ * Choose the content coding to answer a request with.
+ * accept_encoding: Value of the request's Accept-Encoding header, or NULL
+ * Returns the most preferred ENCODING_* that the client accepts
+ */
+int negotiate_content_encoding(const http_slice_t *accept_encoding);
+
+/*
+ * Returns the name of a content coding as used in Content-Encoding, e.g. "br"
+ */
+const char *content_encoding_name(int encoding);
+
+/*
+ * Returns the extension of precompressed files in a content coding, e.g. ".br"
+ */
+const char *content_encoding_extension(int encoding);
+
+/*
+ * Compress data in memory.
+ * encoding: ENCODING_GZIP or ENCODING_BROTLI
+ * data: The bytes to compress
+ * size: Number of bytes in data
+ * out: Set to a buffer allocated with malloc holding the compressed bytes
+ * out_len: Set to the number of compressed bytes
+ * Returns 0 on success or -1 on error
+ */
+int compress_content(int encoding, const char *data, size_t size,
+        char **out, size_t *out_len);
+
+#endif // CONTENT_ENCODING_H
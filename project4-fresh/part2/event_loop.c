@@ -0,0 +1,491 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access_log.h"
+#include "event_loop.h"
+#include "trace.h"
+
+#define ACCEPT_BATCH 64
+#define PREFETCH_BYTES (256 * 1024)  // Start of a body read in by the I/O threads
+
+// A connection is preparing while its response is with the I/O threads, which
+// own the response until they hand it back, and lingering once it was sent a
+// final response, until the client closes its end
+enum { CONN_READING, CONN_PREPARING, CONN_WRITING, CONN_LINGERING };
+
+// Tags stored in epoll_event.data.ptr for the loop's own file descriptors.
+// Connections are identified by their connection_t pointer instead.
+static char listen_tag;
+static char wakeup_tag;
+static char prepared_tag;
+
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+// Restart the timeout of a connection for the state it is in: waiting for
+// its next request, receiving a request, which includes a new connection's
+// first one, or writing a response
+static void arm_timeout(event_loop_t *loop, connection_t *conn) {
+    int timeout_ms = loop->header_timeout_ms;
+    if (conn->state != CONN_READING) {
+        timeout_ms = loop->send_timeout_ms;
+    } else if (conn->requests_served > 0 && conn->request_len == 0) {
+        timeout_ms = loop->idle_timeout_ms;
+    }
+    conn->sent_seen = conn->response.bytes_sent;
+    timer_wheel_arm(&loop->timers, &conn->timer, loop->now_ms + timeout_ms);
+}
+
+
+static void close_connection(event_loop_t *loop, connection_t *conn) {
+    timer_wheel_cancel(&loop->timers, &conn->timer);
+    if (conn->state == CONN_PREPARING) {
+        // An I/O thread is still writing the response, so the connection is
+        // closed once it comes back
+        conn->abandoned = 1;
+        return;
+    }
+    release_http_response(&conn->response);
+    if (close(conn->fd) == -1) { perror("close"); }
+
+    if (conn->prev != NULL) { conn->prev->next = conn->next; }
+    else { loop->connections = conn->next; }
+    if (conn->next != NULL) { conn->next->prev = conn->prev; }
+    loop->n_connections--;
+
+    free(conn);
+}
+
+
+static void accept_connections(event_loop_t *loop) {
+    // Several loops may wake up for the same connection, so running out of
+    // pending connections is expected and not an error
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        struct sockaddr_storage client_addr;
+        socklen_t addr_len = sizeof(client_addr);
+        int client_fd = accept4(loop->listen_fd, (struct sockaddr *) &client_addr,
+                &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                fprintf(stderr, "accept failed: %s\n", strerror(errno));
+            }
+            return;
+        }
+
+        connection_t *conn = malloc(sizeof(connection_t));
+        if (conn == NULL) {
+            perror("malloc");
+            close(client_fd);
+            continue;
+        }
+        conn->fd = client_fd;
+        conn->state = CONN_READING;
+        access_log_client(&conn->client, (struct sockaddr *) &client_addr);
+        conn->request_len = 0;
+        init_http_parser(&conn->parser);
+        memset(&conn->timing, 0, sizeof(request_timing_t));
+        conn->timing.accepted = stats_now();
+        conn->requests_served = 0;
+        conn->abandoned = 0;
+        init_http_response(&conn->response);
+
+        // Edge-triggered for both directions, so the interest set never has
+        // to be modified as the connection switches between reading and writing
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = conn;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_fd, &event) == -1) {
+            perror("epoll_ctl");
+            close(client_fd);
+            free(conn);
+            continue;
+        }
+        stats_accepted(1);
+
+        conn->prev = NULL;
+        conn->next = loop->connections;
+        if (loop->connections != NULL) { loop->connections->prev = conn; }
+        loop->connections = conn;
+        loop->n_connections++;
+        wheel_timer_init(&conn->timer);
+        arm_timeout(loop, conn);
+    }
+}
+
+
+// Prepare a response on an I/O thread, which may block on opening the file,
+// loading it into the cache or compressing it without stalling the loop. The
+// start of the body is read in too, so that sending it finds it in memory.
+static void prepare_in_background(io_task_t *task) {
+    connection_t *conn = (connection_t *) ((char *) task - offsetof(connection_t, prepare));
+    http_response_t *resp = &conn->response;
+    conn->prepare_result = prepare_http_response(resp, conn->resource_path,
+            &conn->req, conn->keep_alive);
+    if (conn->prepare_result == 0 && resp->file_fd != -1 && resp->body_remaining > 0) {
+        size_t length = resp->body_remaining < PREFETCH_BYTES ?
+            resp->body_remaining : PREFETCH_BYTES;
+        posix_fadvise(resp->file_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        readahead(resp->file_fd, resp->body_offset, length);
+    }
+}
+
+
+// Read as much of the next request as is available and start the response
+// once it has fully arrived. Bytes pipelined behind the previous request are
+// parsed before reading from the socket, and parsing picks up where it left
+// off whenever more of the request arrives.
+// Returns 1 if the connection started writing a response, 0 if it is waiting
+// for more data, or -1 if it should be closed
+static int read_request(event_loop_t *loop, connection_t *conn) {
+    http_request_t *req = &conn->req;
+    while (1) {
+        // The request is timed from its first byte, which may have been
+        // pipelined behind the previous one. From then on, a kept-alive
+        // connection gets the time for a request instead of for idling.
+        if (conn->timing.start == 0 && conn->request_len > 0) {
+            conn->timing.start = stats_now();
+            if (conn->requests_served > 0) { arm_timeout(loop, conn); }
+        }
+        int res = parse_http_request(&conn->parser, conn->request,
+                conn->request_len, req);
+        if (res == 0) { break; }
+        if (res == -1) {
+            stats_bad_request();
+            if (send_http_error(conn->fd, conn->parser.error) == -1) { return -1; }
+            conn->state = CONN_LINGERING;
+            timer_wheel_arm(&loop->timers, &conn->timer, loop->now_ms + HTTP_LINGER_MS);
+            return drain_http_connection(conn->fd) == 1 ? -1 : 0;
+        }
+
+        ssize_t bytes_read = read(conn->fd, conn->request + conn->request_len,
+                HTTP_REQUEST_MAX - conn->request_len);
+        if (bytes_read == -1) {
+            if (errno == EINTR) { continue; }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { return 0; }
+            perror("read");
+            return -1;
+        }
+        if (bytes_read == 0) {
+            return -1; // client closed the connection
+        }
+        conn->request_len += bytes_read;
+    }
+
+    conn->timing.parsed = stats_now();
+    conn->state = CONN_WRITING;
+    conn->request_consumed = req->length;
+    conn->requests_served++;
+    conn->keep_alive = req->keep_alive && loop->idle_timeout_ms > 0 &&
+        conn->requests_served < loop->max_requests;
+
+    // get resource path from resource name
+    char resource_path[strlen(loop->serve_dir) + HTTP_RESOURCE_MAX];
+    strcpy(resource_path, loop->serve_dir);
+    strcat(resource_path, req->resource_name);
+
+    // Only responses served from memory are prepared right away when the I/O
+    // threads can take the rest
+    if (loop->io_pool != NULL) {
+        if (!prepare_cached_http_response(&conn->response, resource_path, req,
+                    conn->keep_alive)) {
+            strcpy(conn->resource_path, resource_path);
+            conn->state = CONN_PREPARING;
+            arm_timeout(loop, conn);
+            conn->prepare.work = prepare_in_background;
+            conn->prepare.done = &loop->prepared;
+            if (io_pool_submit(loop->io_pool, &conn->prepare) == -1) {
+                conn->state = CONN_WRITING;
+                return -1;
+            }
+            loop->n_preparing++;
+            return 0;
+        }
+    } else if (prepare_http_response(&conn->response, resource_path, req,
+                conn->keep_alive) == -1) {
+        fprintf(stderr, "Error writing http response\n");
+        return -1;
+    }
+    conn->timing.prepared = stats_now();
+    arm_timeout(loop, conn);
+    return 1;
+}
+
+
+// Advance the response of a connection in the writing state.
+// Returns 1 if the response is complete and the connection is waiting for the
+// next request, 0 if the socket would block, or -1 if it should be closed
+static int write_response(event_loop_t *loop, connection_t *conn) {
+    int res = send_http_response(conn->fd, &conn->response);
+    if (res == 1) {
+        return 0; // resumed on the next EPOLLOUT
+    }
+    if (res == 0) {
+        conn->timing.first_byte = conn->response.first_sent;
+        stats_request_done(&conn->timing, conn->response.status,
+                conn->response.bytes_sent);
+        trace_request(&conn->timing, conn->req.resource_name, conn->response.status,
+                conn->response.bytes_sent);
+        access_log_request(&conn->client, &conn->req, &conn->timing, conn->response.status,
+                conn->response.bytes_sent);
+        stats_request_reset(&conn->timing);
+    }
+    release_http_response(&conn->response);
+    if (res == -1) {
+        fprintf(stderr, "Error writing http response\n");
+        return -1;
+    }
+    if (!conn->keep_alive) {
+        return -1;
+    }
+
+    // Drop the answered request, keeping anything pipelined behind it
+    conn->request_len -= conn->request_consumed;
+    memmove(conn->request, conn->request + conn->request_consumed,
+            conn->request_len);
+    init_http_parser(&conn->parser);
+    conn->state = CONN_READING;
+    arm_timeout(loop, conn);
+    return 1;
+}
+
+
+// Advance a connection as far as possible without blocking. Data that
+// arrived while a response was being written produced no new edge-triggered
+// event, so reading always resumes right after a response completes.
+// Returns 0 if the connection should stay open or -1 if it should be closed
+static int drive_connection(event_loop_t *loop, connection_t *conn) {
+    int res;
+    do {
+        if (conn->state == CONN_PREPARING) {
+            res = 0; // driven again once the response is prepared
+        } else if (conn->state == CONN_LINGERING) {
+            res = drain_http_connection(conn->fd) == 1 ? -1 : 0;
+        } else if (conn->state == CONN_READING) {
+            res = read_request(loop, conn);
+        } else {
+            res = write_response(loop, conn);
+        }
+    } while (res == 1);
+    return res;
+}
+
+
+// Hand the responses the I/O threads prepared back to their connections and
+// start sending them
+static void finish_prepared(event_loop_t *loop) {
+    io_task_t *task = io_completions_take(&loop->prepared);
+    while (task != NULL) {
+        io_task_t *next = task->next;
+        connection_t *conn = (connection_t *) ((char *) task - offsetof(connection_t, prepare));
+        loop->n_preparing--;
+        conn->state = CONN_WRITING;
+        if (conn->abandoned) {
+            close_connection(loop, conn);
+        } else if (conn->prepare_result == -1) {
+            fprintf(stderr, "Error writing http response\n");
+            close_connection(loop, conn);
+        } else {
+            conn->timing.prepared = stats_now();
+            arm_timeout(loop, conn);
+            if (drive_connection(loop, conn) == -1) {
+                close_connection(loop, conn);
+            }
+        }
+        task = next;
+    }
+}
+
+
+int event_loop_init(event_loop_t *loop, int listen_fd, const char *serve_dir,
+        int idle_timeout_ms, int header_timeout_ms, int send_timeout_ms,
+        int max_requests, io_pool_t *io_pool) {
+    memset(loop, 0, sizeof(event_loop_t));
+    loop->listen_fd = listen_fd;
+    loop->serve_dir = serve_dir;
+    loop->idle_timeout_ms = idle_timeout_ms;
+    loop->header_timeout_ms = header_timeout_ms;
+    loop->send_timeout_ms = send_timeout_ms;
+    loop->max_requests = max_requests;
+    loop->io_pool = io_pool;
+    loop->now_ms = now_ms();
+    timer_wheel_init(&loop->timers, loop->now_ms);
+
+    if (io_pool != NULL && strlen(serve_dir) + HTTP_RESOURCE_MAX > PATH_MAX) {
+        fprintf(stderr, "Served directory path is too long\n");
+        return -1;
+    }
+
+    if ((loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    if ((loop->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        perror("eventfd");
+        close(loop->epoll_fd);
+        return -1;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &wakeup_tag;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wakeup_fd, &event) == -1) {
+        perror("epoll_ctl");
+        close(loop->wakeup_fd);
+        close(loop->epoll_fd);
+        return -1;
+    }
+
+    // EPOLLEXCLUSIVE avoids waking every loop for each new connection when
+    // the listening socket is shared between loops
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.ptr = &listen_tag;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) == -1) {
+        perror("epoll_ctl");
+        close(loop->wakeup_fd);
+        close(loop->epoll_fd);
+        return -1;
+    }
+
+    if (io_pool != NULL) {
+        if (io_completions_init(&loop->prepared) == -1) {
+            close(loop->wakeup_fd);
+            close(loop->epoll_fd);
+            return -1;
+        }
+        event.events = EPOLLIN;
+        event.data.ptr = &prepared_tag;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->prepared.event_fd, &event) == -1) {
+            perror("epoll_ctl");
+            io_completions_free(&loop->prepared);
+            close(loop->wakeup_fd);
+            close(loop->epoll_fd);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+void *event_loop_run(void *arg) {
+    event_loop_t *loop = arg;
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    void *ret = NULL;
+    int running = 1;
+    int prepared;
+    stats_set_thread_name("epoll loop");
+
+    while (running) {
+        // Wake up in time for the next timeout
+        int timeout = timer_wheel_timeout(&loop->timers, now_ms());
+        int n_events = epoll_wait(loop->epoll_fd, events,
+                EVENT_LOOP_MAX_EVENTS, timeout);
+        if (n_events == -1) {
+            if (errno == EINTR) { continue; }
+            perror("epoll_wait");
+            ret = (void *) -1;
+            break;
+        }
+        uint64_t busy_start = stats_now();
+        loop->now_ms = now_ms();
+        prepared = 0;
+
+        for (int i = 0; i < n_events; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &wakeup_tag) {
+                running = 0;
+                continue;
+            }
+            if (ptr == &listen_tag) {
+                accept_connections(loop);
+                continue;
+            }
+            if (ptr == &prepared_tag) {
+                prepared = 1;
+                continue;
+            }
+
+            connection_t *conn = ptr;
+            if ((events[i].events & EPOLLERR) || drive_connection(loop, conn) == -1) {
+                close_connection(loop, conn);
+            }
+        }
+
+        // Prepared responses and timeouts are handled after the events, which
+        // may still refer to the connections they close. A response that made
+        // progress since its timeout was armed only gets a new one, which
+        // saves touching the wheel on every send.
+        if (prepared) {
+            finish_prepared(loop);
+        }
+        wheel_timer_t *timer;
+        while ((timer = timer_wheel_expire(&loop->timers, now_ms())) != NULL) {
+            connection_t *conn = (connection_t *) ((char *) timer - offsetof(connection_t, timer));
+            if (conn->state == CONN_WRITING && conn->response.bytes_sent != conn->sent_seen) {
+                arm_timeout(loop, conn);
+            } else if (conn->state == CONN_LINGERING) {
+                close_connection(loop, conn);
+            } else {
+                stats_timed_out();
+                close_connection(loop, conn);
+            }
+        }
+        stats_busy(stats_now() - busy_start);
+    }
+
+    // Wait for the responses the I/O threads are still preparing, whose
+    // connections close as they come back
+    for (connection_t *conn = loop->connections; conn != NULL; conn = conn->next) {
+        if (conn->state == CONN_PREPARING) { conn->abandoned = 1; }
+    }
+    while (loop->n_preparing > 0) {
+        struct pollfd pfd = { .fd = loop->prepared.event_fd, .events = POLLIN };
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR) { perror("poll"); }
+        finish_prepared(loop);
+    }
+
+    // Close all connections that are still in progress
+    while (loop->connections != NULL) {
+        close_connection(loop, loop->connections);
+    }
+
+    return ret;
+}
+
+
+int event_loop_stop(event_loop_t *loop) {
+    uint64_t one = 1;
+    if (write(loop->wakeup_fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("write");
+        return -1;
+    }
+    return 0;
+}
+
+
+int event_loop_free(event_loop_t *loop) {
+    int ret = 0;
+    if (loop->io_pool != NULL && io_completions_free(&loop->prepared) == -1) { ret = -1; }
+    if (close(loop->wakeup_fd) == -1) { perror("close"); ret = -1; }
+    if (close(loop->epoll_fd) == -1) { perror("close"); ret = -1; }
+    return ret;
+}
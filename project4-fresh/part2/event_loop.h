@@ -0,0 +1,104 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <limits.h>
+
+#include "access_log.h"
+#include "http.h"
+#include "io_pool.h"
+#include "stats.h"
+#include "timer_wheel.h"
+
+#define EVENT_LOOP_MAX_EVENTS 256
+
+// Struct representing a single client connection multiplexed by an event loop.
+// Reading requests and writing responses are both resumable, so the
+// connection can be parked whenever its socket would block.
+typedef struct connection {
+    int fd;
+    int state;
+    access_log_addr_t client; // Address the connection was accepted from
+    char request[HTTP_REQUEST_MAX];
+    size_t request_len;
+    size_t request_consumed;  // Bytes of the request currently being answered
+    http_parser_t parser;     // Progress parsing the request at the buffer start
+    http_request_t req;
+    request_timing_t timing;  // Phases of the request being answered
+    int keep_alive;
+    int requests_served;
+    http_response_t response;
+    wheel_timer_t timer;      // Timeout of the current state
+    size_t sent_seen;         // Bytes of the response sent when it was armed
+    io_task_t prepare;        // Preparing the response on an I/O thread
+    int prepare_result;       // What preparing it returned
+    int abandoned;            // Closed while the response was being prepared
+    char resource_path[PATH_MAX];
+    struct connection *prev;  // Neighbours in the list of all connections
+    struct connection *next;
+} connection_t;
+
+// Struct representing an epoll-based event loop. Each loop is driven by one
+// thread and serves every connection it accepts from the listening socket
+// until that connection is closed.
+typedef struct {
+    int epoll_fd;
+    int listen_fd;
+    int wakeup_fd;            // eventfd used to ask the loop to stop
+    const char *serve_dir;
+    int idle_timeout_ms;      // 0 disables persistent connections
+    int header_timeout_ms;    // Longest a request may take to arrive
+    int send_timeout_ms;      // Longest a response may go without progress
+    int max_requests;         // Requests served before a connection is closed
+    connection_t *connections;
+    int n_connections;
+    timer_wheel_t timers;     // Timeouts of all connections
+    long now_ms;              // CLOCK_MONOTONIC milliseconds after the last wait
+    io_pool_t *io_pool;       // Threads that prepare responses, or NULL
+    io_completions_t prepared;  // Responses the I/O threads finished preparing
+    int n_preparing;          // Responses still with the I/O threads
+} event_loop_t;
+
+/*
+ * Initialize a new event loop.
+ * loop: Pointer to event_loop_t to be initialized
+ * listen_fd: Non-blocking listening socket. Several loops may share it.
+ * serve_dir: Directory that requested resources are served from
+ * idle_timeout_ms: How long a connection may wait for its next request, or 0
+ *                  to close every connection after one response
+ * header_timeout_ms: How long a client may take to send a whole request, from
+ *                    when it connects or the request starts arriving
+ * send_timeout_ms: How long a response may go without any of it being sent
+ * max_requests: Number of requests served on a connection before closing it
+ * io_pool: Threads that prepare the responses to requests that may have to
+ *          wait for the disk, so the loop never blocks on it, or NULL to
+ *          prepare every response on the loop's own thread. May be shared by
+ *          several loops.
+ * Returns 0 on success or -1 on error
+ */
+int event_loop_init(event_loop_t *loop, int listen_fd, const char *serve_dir,
+        int idle_timeout_ms, int header_timeout_ms, int send_timeout_ms,
+        int max_requests, io_pool_t *io_pool);
+
+/*
+ * Run an event loop until event_loop_stop is called. Meant to be used as the
+ * start routine of the thread that drives the loop.
+ * arg: A pointer to the event_loop_t to run
+ * Returns NULL on a clean stop, or a non-NULL value on error
+ */
+void *event_loop_run(void *arg);
+
+/*
+ * Ask an event loop to stop. The loop closes all of its open connections and
+ * event_loop_run returns. Safe to call from any thread.
+ * Returns 0 on success or -1 on error
+ */
+int event_loop_stop(event_loop_t *loop);
+
+/*
+ * Deallocates and cleans up any resources associated with an event loop.
+ * Must only be called once the loop is no longer running.
+ * Returns 0 on success or -1 on error
+ */
+int event_loop_free(event_loop_t *loop);
+
+#endif // EVENT_LOOP_H
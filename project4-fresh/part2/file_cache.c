@@ -0,0 +1,434 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "file_cache.h"
+
+#define INITIAL_BUCKETS 64
+
+
+static file_cache_shard_t *shard_for(file_cache_t *cache, uint64_t hash) {
+    // The low bits pick the bucket inside a shard, so use the high bits here
+    return &cache->shards[(hash >> 56) % FILE_CACHE_SHARDS];
+}
+
+
+// Returns CLOCK_MONOTONIC_COARSE milliseconds, which are read without a system
+// call and only as precise as the scheduler tick
+static long coarse_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+// Find an entry in a shard. Must be called with shard->lock held.
+static file_cache_entry_t *shard_find(file_cache_shard_t *shard, uint64_t hash,
+        const char *path) {
+    path_node_t *node = path_table_find(&shard->table, hash, path);
+    return node != NULL ? PATH_ENTRY(node, file_cache_entry_t, node) : NULL;
+}
+
+
+// Remove an entry from a shard and drop the shard's reference to it.
+// Must be called with shard->lock held.
+static void shard_remove(file_cache_shard_t *shard, file_cache_entry_t *entry) {
+    path_table_remove(&shard->table, &entry->node);
+    lru_unlink(&shard->lru, &entry->lru);
+    shard->bytes_used -= entry->charge;
+    file_cache_release(entry);
+}
+
+
+int file_cache_init(file_cache_t *cache, size_t budget, size_t max_file_size) {
+    int err;
+    memset(cache, 0, sizeof(file_cache_t));
+    cache->shard_budget = budget / FILE_CACHE_SHARDS;
+    cache->max_file_size = max_file_size;
+
+    for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+        file_cache_shard_t *shard = &cache->shards[i];
+        if (path_table_init(&shard->table, INITIAL_BUCKETS) == -1) {
+            file_cache_free(cache);
+            return -1;
+        }
+        if ((err = pthread_mutex_init(&shard->lock, NULL)) != 0) {
+            fprintf(stderr, "pthread_mutex_init failed: %s\n", strerror(err));
+            path_table_free(&shard->table);
+            file_cache_free(cache);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+// Whether an entry holds the version of a file that statbuf describes
+static int is_current(const file_cache_entry_t *entry, const struct stat *statbuf) {
+    return entry->ino == statbuf->st_ino && entry->file_size == statbuf->st_size &&
+        entry->mtime.tv_sec == statbuf->st_mtim.tv_sec &&
+        entry->mtime.tv_nsec == statbuf->st_mtim.tv_nsec;
+}
+
+
+// Find an entry in a shard, dropping it if it holds another version of the
+// file. Must be called with shard->lock held.
+static file_cache_entry_t *shard_find_current(file_cache_t *cache,
+        file_cache_shard_t *shard, uint64_t hash, const char *path,
+        const struct stat *statbuf) {
+    file_cache_entry_t *entry = shard_find(shard, hash, path);
+    if (entry != NULL && !is_current(entry, statbuf)) {
+        shard_remove(shard, entry);
+        atomic_fetch_add_explicit(&cache->stale, 1, memory_order_relaxed);
+        return NULL;
+    }
+    return entry;
+}
+
+
+file_cache_entry_t *file_cache_get(file_cache_t *cache, const char *path,
+        const struct stat *statbuf) {
+    uint64_t hash = path_hash(path);
+    file_cache_shard_t *shard = shard_for(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    file_cache_entry_t *entry = shard_find_current(cache, shard, hash, path, statbuf);
+    if (entry != NULL) {
+        atomic_fetch_add(&entry->refs, 1);
+        lru_unlink(&shard->lru, &entry->lru);
+        lru_push_front(&shard->lru, &entry->lru);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    return entry;
+}
+
+
+file_cache_entry_t *file_cache_get_fresh(file_cache_t *cache, const char *path,
+        long max_age_ms, int (*get_status)(const char *, struct stat *)) {
+    uint64_t hash = path_hash(path);
+    file_cache_shard_t *shard = shard_for(cache, hash);
+    long now = coarse_now_ms();
+
+    pthread_mutex_lock(&shard->lock);
+    file_cache_entry_t *entry = shard_find(shard, hash, path);
+    int cached = entry != NULL;
+    if (cached && now - atomic_load_explicit(&entry->verified_ms, memory_order_relaxed) <
+            max_age_ms) {
+        atomic_fetch_add(&entry->refs, 1);
+        lru_unlink(&shard->lru, &entry->lru);
+        lru_push_front(&shard->lru, &entry->lru);
+    } else {
+        entry = NULL;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    if (entry != NULL || !cached) {
+        return entry;
+    }
+
+    // Check the cached version against the file without holding the lock
+    struct stat statbuf;
+    if (get_status(path, &statbuf) == -1) {
+        return NULL;
+    }
+    entry = file_cache_get(cache, path, &statbuf);
+    if (entry != NULL) {
+        atomic_store_explicit(&entry->verified_ms, now, memory_order_relaxed);
+    }
+    return entry;
+}
+
+
+// Whether a flight loads the version of a file that statbuf describes
+static int same_version(const file_cache_flight_t *flight, const struct stat *statbuf) {
+    return flight->ino == statbuf->st_ino && flight->size == statbuf->st_size &&
+        flight->mtime.tv_sec == statbuf->st_mtim.tv_sec &&
+        flight->mtime.tv_nsec == statbuf->st_mtim.tv_nsec;
+}
+
+
+// Drop a thread's interest in a flight, freeing it after the last one.
+// Must be called with the lock of the flight's shard held.
+static void drop_flight(file_cache_flight_t *flight) {
+    if (--flight->users > 0) {
+        return;
+    }
+    if (flight->entry != NULL) {
+        file_cache_release(flight->entry);
+    }
+    pthread_cond_destroy(&flight->cond);
+    free(flight);
+}
+
+
+file_cache_entry_t *file_cache_join(file_cache_t *cache, const char *key,
+        const struct stat *statbuf, file_cache_flight_t **flight) {
+    uint64_t hash = path_hash(key);
+    file_cache_shard_t *shard = shard_for(cache, hash);
+    *flight = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+    file_cache_entry_t *entry = shard_find_current(cache, shard, hash, key, statbuf);
+    if (entry != NULL) {
+        atomic_fetch_add(&entry->refs, 1);
+        lru_unlink(&shard->lru, &entry->lru);
+        lru_push_front(&shard->lru, &entry->lru);
+        pthread_mutex_unlock(&shard->lock);
+        return entry;
+    }
+
+    file_cache_flight_t *other = shard->flights;
+    while (other != NULL && (other->hash != hash || strcmp(other->path, key) != 0)) {
+        other = other->next;
+    }
+    if (other != NULL) {
+        // A different version is left uncached rather than loaded twice
+        if (same_version(other, statbuf)) {
+            other->users++;
+            atomic_fetch_add_explicit(&cache->coalesced, 1, memory_order_relaxed);
+            while (!other->landed) {
+                pthread_cond_wait(&other->cond, &shard->lock);
+            }
+            if ((entry = other->entry) != NULL) {
+                atomic_fetch_add(&entry->refs, 1);
+            }
+            drop_flight(other);
+        }
+        pthread_mutex_unlock(&shard->lock);
+        return entry;
+    }
+
+    // Nobody is loading it yet, so the caller does
+    size_t key_len = strlen(key);
+    file_cache_flight_t *claimed = malloc(sizeof(file_cache_flight_t) + key_len + 1);
+    if (claimed == NULL) {
+        perror("malloc");
+        pthread_mutex_unlock(&shard->lock);
+        return NULL;
+    }
+    int err = pthread_cond_init(&claimed->cond, NULL);
+    if (err != 0) {
+        fprintf(stderr, "pthread_cond_init failed: %s\n", strerror(err));
+        free(claimed);
+        pthread_mutex_unlock(&shard->lock);
+        return NULL;
+    }
+    claimed->hash = hash;
+    claimed->path = (char *) (claimed + 1);
+    memcpy(claimed->path, key, key_len + 1);
+    claimed->ino = statbuf->st_ino;
+    claimed->mtime = statbuf->st_mtim;
+    claimed->size = statbuf->st_size;
+    claimed->landed = 0;
+    claimed->users = 1;
+    claimed->entry = NULL;
+    claimed->next = shard->flights;
+    shard->flights = claimed;
+    pthread_mutex_unlock(&shard->lock);
+
+    *flight = claimed;
+    return NULL;
+}
+
+
+void file_cache_land(file_cache_t *cache, file_cache_flight_t *flight,
+        file_cache_entry_t *entry) {
+    file_cache_shard_t *shard = shard_for(cache, flight->hash);
+    atomic_fetch_add_explicit(&cache->loads, 1, memory_order_relaxed);
+
+    pthread_mutex_lock(&shard->lock);
+    file_cache_flight_t **link = &shard->flights;
+    while (*link != flight) {
+        link = &(*link)->next;
+    }
+    *link = flight->next;
+
+    // The flight keeps a reference for the threads that have yet to wake up
+    if (entry != NULL) {
+        atomic_fetch_add(&entry->refs, 1);
+    }
+    flight->entry = entry;
+    flight->landed = 1;
+    pthread_cond_broadcast(&flight->cond);
+    drop_flight(flight);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+
+// Allocate an entry big enough for a file of the given size. The entry, its
+// path, header and data share a single allocation.
+// Returns the entry with its data still to be filled in, or NULL if the file
+// is too large to cache or the allocation fails
+static file_cache_entry_t *new_entry(file_cache_t *cache, const char *path,
+        size_t size, const struct stat *statbuf, const char *header, size_t header_len) {
+    size_t path_len = strlen(path);
+    size_t charge = sizeof(file_cache_entry_t) + path_len + 1 + header_len + size;
+    if (size > cache->max_file_size || charge > cache->shard_budget) {
+        return NULL;
+    }
+
+    file_cache_entry_t *entry = malloc(charge);
+    if (entry == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    char *path_copy = (char *) (entry + 1);
+    char *header_copy = path_copy + path_len + 1;
+    memcpy(path_copy, path, path_len + 1);
+    memcpy(header_copy, header, header_len);
+
+    entry->node.hash = path_hash(path);
+    entry->node.path = path_copy;
+    entry->header = header_copy;
+    entry->header_len = header_len;
+    entry->data = header_copy + header_len;
+    entry->size = size;
+    entry->ino = statbuf->st_ino;
+    entry->mtime = statbuf->st_mtim;
+    entry->file_size = statbuf->st_size;
+    atomic_init(&entry->verified_ms, coarse_now_ms());
+    entry->charge = charge;
+    atomic_init(&entry->refs, 2); // one for the shard, one for the caller
+    return entry;
+}
+
+
+// Add a filled-in entry to its shard, evicting least recently used entries
+// to make room, along with an entry of another version of the same file.
+// Returns the entry, or the existing one if the same version was cached
+// concurrently
+static file_cache_entry_t *insert_entry(file_cache_t *cache, file_cache_entry_t *entry,
+        const struct stat *statbuf) {
+    file_cache_shard_t *shard = shard_for(cache, entry->node.hash);
+    pthread_mutex_lock(&shard->lock);
+
+    file_cache_entry_t *existing = shard_find_current(cache, shard, entry->node.hash,
+            entry->node.path, statbuf);
+    if (existing != NULL) {
+        atomic_fetch_add(&existing->refs, 1);
+        pthread_mutex_unlock(&shard->lock);
+        free(entry);
+        return existing;
+    }
+
+    while (shard->bytes_used + entry->charge > cache->shard_budget) {
+        shard_remove(shard, PATH_ENTRY(shard->lru.tail, file_cache_entry_t, lru));
+    }
+
+    path_table_insert(&shard->table, &entry->node);
+    lru_push_front(&shard->lru, &entry->lru);
+    shard->bytes_used += entry->charge;
+
+    pthread_mutex_unlock(&shard->lock);
+    return entry;
+}
+
+
+// Read a file into a new entry and add it to the cache.
+// Returns a referenced entry, or NULL if the file is too large or could not
+// be read
+static file_cache_entry_t *read_entry(file_cache_t *cache, const char *path,
+        int fd, const struct stat *statbuf, const char *header, size_t header_len) {
+    size_t size = statbuf->st_size;
+    file_cache_entry_t *entry = new_entry(cache, path, size, statbuf, header, header_len);
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    // Read the file before taking the shard lock
+    char *data = (char *) entry->data;
+    size_t offset = 0;
+    while (offset < size) {
+        ssize_t bytes_read = pread(fd, data + offset, size - offset, offset);
+        if (bytes_read == -1) {
+            if (errno == EINTR) { continue; }
+            perror("pread");
+            free(entry);
+            return NULL;
+        }
+        if (bytes_read == 0) {
+            fprintf(stderr, "File was truncated while being cached\n");
+            free(entry);
+            return NULL;
+        }
+        offset += bytes_read;
+    }
+
+    return insert_entry(cache, entry, statbuf);
+}
+
+
+file_cache_entry_t *file_cache_load(file_cache_t *cache, const char *path,
+        int fd, const struct stat *statbuf, const char *header, size_t header_len) {
+    if ((size_t) statbuf->st_size > cache->max_file_size) {
+        return NULL;
+    }
+    file_cache_flight_t *flight;
+    file_cache_entry_t *entry = file_cache_join(cache, path, statbuf, &flight);
+    if (flight == NULL) {
+        return entry;
+    }
+    entry = read_entry(cache, path, fd, statbuf, header, header_len);
+    file_cache_land(cache, flight, entry);
+    return entry;
+}
+
+
+file_cache_entry_t *file_cache_insert(file_cache_t *cache, const char *key,
+        const char *data, size_t size, const struct stat *statbuf,
+        const char *header, size_t header_len) {
+    file_cache_entry_t *entry = new_entry(cache, key, size, statbuf, header, header_len);
+    if (entry == NULL) {
+        return NULL;
+    }
+    memcpy((char *) entry->data, data, size);
+    return insert_entry(cache, entry, statbuf);
+}
+
+
+void file_cache_release(file_cache_entry_t *entry) {
+    if (atomic_fetch_sub(&entry->refs, 1) == 1) {
+        free(entry);
+    }
+}
+
+
+void file_cache_report(FILE *out, void *arg) {
+    file_cache_t *cache = arg;
+    size_t n_entries = 0;
+    size_t bytes_used = 0;
+    for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+        file_cache_shard_t *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        n_entries += shard->table.n_nodes;
+        bytes_used += shard->bytes_used;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    fprintf(out, "file cache: %zu entries, %zu bytes, %ld loads, %ld misses coalesced, "
+            "%ld stale\n", n_entries, bytes_used, atomic_load(&cache->loads),
+            atomic_load(&cache->coalesced), atomic_load(&cache->stale));
+}
+
+
+int file_cache_free(file_cache_t *cache) {
+    int ret = 0;
+    int err;
+    for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+        file_cache_shard_t *shard = &cache->shards[i];
+        if (shard->table.buckets == NULL) {
+            continue;
+        }
+        while (shard->lru.head != NULL) {
+            shard_remove(shard, PATH_ENTRY(shard->lru.head, file_cache_entry_t, lru));
+        }
+        path_table_free(&shard->table);
+        if ((err = pthread_mutex_destroy(&shard->lock)) != 0) {
+            fprintf(stderr, "pthread_mutex_destroy failed: %s\n", strerror(err));
+            ret = -1;
+        }
+    }
+    return ret;
+}
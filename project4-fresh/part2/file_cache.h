@@ -0,0 +1,183 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "path_table.h"
+
+#define FILE_CACHE_SHARDS 16
+
+// Struct representing a file held in memory together with the ready-to-send
+// start of its response header. Entries are reference counted so that a
+// response can keep sending one after it has been evicted, and remember the
+// version of the file they hold so that a changed file is read again.
+typedef struct file_cache_entry {
+    path_node_t node;         // Keyed by the path the entry was loaded from
+    const char *header;       // Status line and headers, minus Connection
+    size_t header_len;
+    const char *data;         // The file's contents
+    size_t size;
+    ino_t ino;                // Identity of the file when it was read, which
+    struct timespec mtime;    // clients revalidate their copies against
+    off_t file_size;          // Size of the file, which data may be derived from
+    atomic_long verified_ms;  // When the file was last found to be this version
+    size_t charge;            // Bytes counted against the cache budget
+    atomic_int refs;
+    lru_node_t lru;
+} file_cache_entry_t;
+
+// Struct representing a file, or data derived from one, that a thread is
+// reading into the cache. Threads missing the same version of it wait for
+// that thread's entry instead of reading it once more.
+typedef struct file_cache_flight {
+    uint64_t hash;
+    char *path;
+    ino_t ino;                // Version being loaded
+    struct timespec mtime;
+    off_t size;
+    int landed;               // Set once entry is final
+    int users;                // Threads still referring to the flight
+    file_cache_entry_t *entry;  // The result, NULL if it could not be cached
+    pthread_cond_t cond;      // Signalled when the flight lands
+    struct file_cache_flight *next;
+} file_cache_flight_t;
+
+// Struct representing one independently locked part of the cache. Paths are
+// spread over the shards by hash so that workers rarely contend on a lock.
+typedef struct {
+    path_table_t table;
+    size_t bytes_used;
+    lru_list_t lru;
+    file_cache_flight_t *flights;  // Loads in progress
+    pthread_mutex_t lock;
+} file_cache_shard_t;
+
+// Struct representing a bounded in-memory cache of small files keyed by
+// their resolved path. Least recently used files are evicted to stay within
+// the byte budget.
+typedef struct {
+    size_t shard_budget;      // Byte budget of each shard
+    size_t max_file_size;     // Larger files are never cached
+    atomic_long loads;        // Files and variants read or built
+    atomic_long coalesced;    // Misses that waited for another thread's load
+    atomic_long stale;        // Entries dropped because their file changed
+    file_cache_shard_t shards[FILE_CACHE_SHARDS];
+} file_cache_t;
+
+/*
+ * Initialize a new file cache.
+ * cache: Pointer to file_cache_t to be initialized
+ * budget: Total number of bytes the cache may hold
+ * max_file_size: Size above which files are streamed instead of cached
+ * Returns 0 on success or -1 on error
+ */
+int file_cache_init(file_cache_t *cache, size_t budget, size_t max_file_size);
+
+/*
+ * Look up a file by path. On a hit the entry is marked most recently used.
+ * An entry holding another version of the file is dropped instead.
+ * cache: A pointer to the file_cache_t to search
+ * path: The resolved path of the file, or the key of data derived from it
+ * statbuf: Current status of the file
+ * Returns a referenced entry that must be passed to file_cache_release, or
+ * NULL if this version of the file is not cached
+ */
+file_cache_entry_t *file_cache_get(file_cache_t *cache, const char *path,
+        const struct stat *statbuf);
+
+/*
+ * Look up a file by path like file_cache_get, but take the file's status only
+ * if the entry was last found current at least max_age_ms ago. A miss takes
+ * no status at all.
+ * cache: A pointer to the file_cache_t to search
+ * path: The resolved path of the file
+ * max_age_ms: How long a version found current is trusted, 0 to always check
+ * get_status: Looks up the current status of the file at a path, returning 0
+ *             if there is a regular file there or -1 otherwise
+ * Returns a referenced entry that must be passed to file_cache_release, or
+ * NULL if the file is not cached or changed
+ */
+file_cache_entry_t *file_cache_get_fresh(file_cache_t *cache, const char *path,
+        long max_age_ms, int (*get_status)(const char *, struct stat *));
+
+/*
+ * Look up data derived from a file, or wait for the thread producing the same
+ * version of it. If there is no such thread, the caller becomes it. An entry
+ * derived from another version of the file is dropped.
+ * cache: A pointer to the file_cache_t to search
+ * key: Key of the data
+ * statbuf: Status of the file the data is derived from
+ * flight: Set to the flight the caller must complete with file_cache_land if
+ *         the data is to be produced by the caller, or to NULL otherwise
+ * Returns a referenced entry that must be passed to file_cache_release, or
+ * NULL if the caller is to produce the data or another thread failed to
+ */
+file_cache_entry_t *file_cache_join(file_cache_t *cache, const char *key,
+        const struct stat *statbuf, file_cache_flight_t **flight);
+
+/*
+ * Hand the result of a flight to the threads waiting for it.
+ * flight: The flight set by file_cache_join
+ * entry: The entry the caller produced, or NULL if it failed to
+ */
+void file_cache_land(file_cache_t *cache, file_cache_flight_t *flight,
+        file_cache_entry_t *entry);
+
+/*
+ * Read a file into the cache, evicting least recently used files as needed.
+ * If the same version was cached concurrently, the existing entry is
+ * returned, and concurrent loads of the same version read it only once.
+ * cache: A pointer to the file_cache_t to add to
+ * path: The resolved path of the file
+ * fd: Open file descriptor of the file, which is read with pread
+ * statbuf: Status of the file, giving its size, inode and modification time
+ * header: Start of the response header to store with the file
+ * header_len: Length of header in bytes
+ * Returns a referenced entry that must be passed to file_cache_release, or
+ * NULL if the file is too large or could not be read
+ */
+file_cache_entry_t *file_cache_load(file_cache_t *cache, const char *path,
+        int fd, const struct stat *statbuf, const char *header, size_t header_len);
+
+/*
+ * Add data that is already in memory, such as a compressed variant of a file,
+ * to the cache under a key of the caller's choosing.
+ * cache: A pointer to the file_cache_t to add to
+ * key: Key to look the data up by, which must not collide with file paths
+ * data: The bytes to cache, which are copied
+ * size: Number of bytes in data
+ * statbuf: Status of the file the data was derived from
+ * header: Start of the response header to store with the data
+ * header_len: Length of header in bytes
+ * Returns a referenced entry that must be passed to file_cache_release, or
+ * NULL if the data is too large to cache
+ */
+file_cache_entry_t *file_cache_insert(file_cache_t *cache, const char *key,
+        const char *data, size_t size, const struct stat *statbuf,
+        const char *header, size_t header_len);
+
+/*
+ * Drop a reference obtained from file_cache_get or file_cache_load.
+ */
+void file_cache_release(file_cache_entry_t *entry);
+
+/*
+ * Write the number of cached entries and bytes, and of loads, coalesced
+ * misses and stale entries, to 'out'. Meant to be registered with stats_add_reporter.
+ * arg: A pointer to the file_cache_t
+ */
+void file_cache_report(FILE *out, void *arg);
+
+/*
+ * Deallocates and cleans up any resources associated with a file cache.
+ * Returns 0 on success or -1 on error
+ */
+int file_cache_free(file_cache_t *cache);
+
+#endif // FILE_CACHE_H
@@ -0,0 +1,162 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "file_map.h"
+
+
+static int same_version(const file_mapping_t *mapping, const struct stat *statbuf) {
+    return mapping->ino == statbuf->st_ino && mapping->size == (size_t) statbuf->st_size &&
+        mapping->mtime.tv_sec == statbuf->st_mtim.tv_sec &&
+        mapping->mtime.tv_nsec == statbuf->st_mtim.tv_nsec;
+}
+
+
+// Find the mapping of a path. Must be called with map->lock held.
+static file_mapping_t *find(file_map_t *map, uint64_t hash, const char *path) {
+    path_node_t *node = path_table_find(&map->table, hash, path);
+    return node != NULL ? PATH_ENTRY(node, file_mapping_t, node) : NULL;
+}
+
+
+// Take a mapping out of the table and drop the table's reference to it.
+// Must be called with map->lock held.
+static void remove_mapping(file_map_t *map, file_mapping_t *mapping) {
+    path_table_remove(&map->table, &mapping->node);
+    lru_unlink(&map->lru, &mapping->lru);
+    map->bytes_mapped -= mapping->size;
+    file_map_release(mapping);
+}
+
+
+int file_map_init(file_map_t *map, int max_mappings) {
+    int err;
+    memset(map, 0, sizeof(file_map_t));
+    map->max_mappings = max_mappings;
+    if (path_table_init(&map->table, FILE_MAP_BUCKETS) == -1) {
+        return -1;
+    }
+    if ((err = pthread_mutex_init(&map->lock, NULL)) != 0) {
+        fprintf(stderr, "pthread_mutex_init failed: %s\n", strerror(err));
+        path_table_free(&map->table);
+        return -1;
+    }
+    return 0;
+}
+
+
+file_mapping_t *file_map_get(file_map_t *map, const char *path, int fd,
+        const struct stat *statbuf) {
+    if (statbuf->st_size == 0) {
+        return NULL;
+    }
+    uint64_t hash = path_hash(path);
+
+    pthread_mutex_lock(&map->lock);
+    file_mapping_t *mapping = find(map, hash, path);
+    if (mapping != NULL && same_version(mapping, statbuf)) {
+        atomic_fetch_add(&mapping->refs, 1);
+        lru_unlink(&map->lru, &mapping->lru);
+        lru_push_front(&map->lru, &mapping->lru);
+        pthread_mutex_unlock(&map->lock);
+        atomic_fetch_add_explicit(&map->hits, 1, memory_order_relaxed);
+        return mapping;
+    }
+    pthread_mutex_unlock(&map->lock);
+
+    // Map the file outside the lock. Pages are only read in as they are sent.
+    size_t path_len = strlen(path);
+    if ((mapping = malloc(sizeof(file_mapping_t) + path_len + 1)) == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    void *data = mmap(NULL, statbuf->st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        free(mapping);
+        return NULL;
+    }
+    if (madvise(data, statbuf->st_size, MADV_SEQUENTIAL) == -1) {
+        perror("madvise");
+    }
+    char *path_copy = (char *) (mapping + 1);
+    memcpy(path_copy, path, path_len + 1);
+    mapping->node.hash = hash;
+    mapping->node.path = path_copy;
+    mapping->data = data;
+    mapping->size = statbuf->st_size;
+    mapping->ino = statbuf->st_ino;
+    mapping->mtime = statbuf->st_mtim;
+    atomic_init(&mapping->refs, 2); // one for the table, one for the caller
+    atomic_fetch_add_explicit(&map->maps, 1, memory_order_relaxed);
+
+    // Replace an outdated mapping, or use the one mapped concurrently
+    pthread_mutex_lock(&map->lock);
+    file_mapping_t *existing = find(map, hash, path);
+    if (existing != NULL && same_version(existing, statbuf)) {
+        atomic_fetch_add(&existing->refs, 1);
+        pthread_mutex_unlock(&map->lock);
+        atomic_init(&mapping->refs, 1);
+        file_map_release(mapping);
+        return existing;
+    }
+    if (existing != NULL) {
+        remove_mapping(map, existing);
+    }
+    while (map->table.n_nodes >= (size_t) map->max_mappings && map->lru.tail != NULL) {
+        remove_mapping(map, PATH_ENTRY(map->lru.tail, file_mapping_t, lru));
+    }
+    path_table_insert(&map->table, &mapping->node);
+    lru_push_front(&map->lru, &mapping->lru);
+    map->bytes_mapped += mapping->size;
+    pthread_mutex_unlock(&map->lock);
+    return mapping;
+}
+
+
+void file_map_advise(const file_mapping_t *mapping, size_t offset, size_t length) {
+    if (length > FILE_MAP_WINDOW) {
+        length = FILE_MAP_WINDOW;
+    }
+    // madvise wants a page-aligned start
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = offset & ~(page - 1);
+    if (length > 0 && madvise((char *) mapping->data + start, offset - start + length,
+                MADV_WILLNEED) == -1) {
+        perror("madvise");
+    }
+}
+
+
+void file_map_release(file_mapping_t *mapping) {
+    if (atomic_fetch_sub(&mapping->refs, 1) == 1) {
+        if (munmap((void *) mapping->data, mapping->size) == -1) { perror("munmap"); }
+        free(mapping);
+    }
+}
+
+
+void file_map_report(FILE *out, void *arg) {
+    file_map_t *map = arg;
+    pthread_mutex_lock(&map->lock);
+    size_t n_mappings = map->table.n_nodes;
+    size_t bytes_mapped = map->bytes_mapped;
+    pthread_mutex_unlock(&map->lock);
+    fprintf(out, "file map: %zu mappings, %zu bytes mapped, %ld maps, %ld hits\n",
+            n_mappings, bytes_mapped, atomic_load(&map->maps), atomic_load(&map->hits));
+}
+
+
+int file_map_free(file_map_t *map) {
+    int err;
+    while (map->lru.head != NULL) {
+        remove_mapping(map, PATH_ENTRY(map->lru.head, file_mapping_t, lru));
+    }
+    path_table_free(&map->table);
+    if ((err = pthread_mutex_destroy(&map->lock)) != 0) {
+        fprintf(stderr, "pthread_mutex_destroy failed: %s\n", strerror(err));
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,92 @@
+#ifndef FILE_MAP_H
+#define FILE_MAP_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "path_table.h"
+
+#define FILE_MAP_BUCKETS 256      // Initial buckets of the table, which grows
+#define FILE_MAP_WINDOW (256 * 1024)  // Bytes ahead of a response read in early
+
+// Struct representing a file mapped read-only into memory, which every
+// response sending that version of the file shares. Mappings are reference
+// counted, so one that is replaced or evicted stays mapped until the last
+// response using it is released. Responses only hand the mapping to the
+// kernel, which fails the send with EFAULT should the file be truncated.
+typedef struct file_mapping {
+    path_node_t node;         // Keyed by the path of the file
+    const char *data;         // The mapped file
+    size_t size;
+    ino_t ino;                // Version of the file that is mapped
+    struct timespec mtime;
+    atomic_int refs;
+    lru_node_t lru;
+} file_mapping_t;
+
+// Struct representing the mappings of large files, keyed by path. The least
+// recently used mapping is dropped once there are more than allowed, which
+// bounds address space and open mappings rather than memory: the pages
+// belong to the page cache either way.
+typedef struct {
+    path_table_t table;
+    int max_mappings;
+    size_t bytes_mapped;
+    lru_list_t lru;
+    pthread_mutex_t lock;
+    atomic_long maps;         // Files mapped, including remapped ones
+    atomic_long hits;         // Responses served from an existing mapping
+} file_map_t;
+
+/*
+ * Initialize an empty set of mappings.
+ * map: Pointer to file_map_t to be initialized
+ * max_mappings: Number of files kept mapped at once
+ * Returns 0 on success or -1 on error
+ */
+int file_map_init(file_map_t *map, int max_mappings);
+
+/*
+ * Find the mapping of a file, mapping it if it is not mapped yet or was
+ * modified since. New mappings are advised to be read sequentially.
+ * map: A pointer to the file_map_t to search
+ * path: The resolved path of the file
+ * fd: Open file descriptor of the file, which the caller keeps
+ * statbuf: Status of the file, giving its size, inode and modification time
+ * Returns a referenced mapping that must be passed to file_map_release, or
+ * NULL if the file is empty or could not be mapped
+ */
+file_mapping_t *file_map_get(file_map_t *map, const char *path, int fd,
+        const struct stat *statbuf);
+
+/*
+ * Ask the kernel to start reading in the part of a mapping a response is
+ * about to send, up to FILE_MAP_WINDOW bytes of it.
+ */
+void file_map_advise(const file_mapping_t *mapping, size_t offset, size_t length);
+
+/*
+ * Drop a reference obtained from file_map_get.
+ */
+void file_map_release(file_mapping_t *mapping);
+
+/*
+ * Write the number of mappings and bytes mapped, and of maps and hits, to
+ * 'out'. Meant to be registered with stats_add_reporter.
+ * arg: A pointer to the file_map_t
+ */
+void file_map_report(FILE *out, void *arg);
+
+/*
+ * Deallocates and cleans up any resources associated with a set of mappings.
+ * Mappings still referenced by responses are unmapped once they are released.
+ * Returns 0 on success or -1 on error
+ */
+int file_map_free(file_map_t *map);
+
+#endif // FILE_MAP_H
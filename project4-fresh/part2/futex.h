@@ -0,0 +1,50 @@
+#ifndef FUTEX_H
+#define FUTEX_H
+
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Number of times a thread re-checks for work before sleeping on a futex
+#define SPIN_COUNT 100
+
+// Hint to the CPU that this is a spin-wait loop
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/*
+ * Sleep until 'word' is woken, unless it no longer holds 'expected'.
+ * Returns 0 when woken, or -1 with errno set (EAGAIN if the value changed)
+ */
+static inline int futex_wait(atomic_uint *word, unsigned int expected) {
+    return syscall(SYS_futex, (uint32_t *) word, FUTEX_WAIT_PRIVATE, expected,
+            NULL, NULL, 0);
+}
+
+/*
+ * Wake up to 'n_threads' threads sleeping on 'word'.
+ * Returns the number of threads woken, or -1 on error
+ */
+static inline int futex_wake(atomic_uint *word, int n_threads) {
+    return syscall(SYS_futex, (uint32_t *) word, FUTEX_WAKE_PRIVATE, n_threads,
+            NULL, NULL, 0);
+}
+
+/*
+ * Signal a state change to threads sleeping on 'word'. The increment makes a
+ * thread that is about to sleep return from futex_wait right away, so the
+ * wake-up system call is only needed when someone is already waiting.
+ */
+static inline void futex_notify(atomic_uint *word, atomic_int *n_waiting) {
+    atomic_fetch_add(word, 1);
+    if (atomic_load(n_waiting) > 0) {
+        futex_wake(word, 1);
+    }
+}
+
+#endif // FUTEX_H
@@ -1,192 +1,1343 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 #include <poll.h>
+#include "content_encoding.h"
 #include "http.h"
+#include "stats.h"
+#include "trace.h"
+
+// Cache of small files, or NULL if caching is disabled
+static file_cache_t *file_cache = NULL;
+// Mappings large files are sent from, or NULL to send them from their files
+static file_map_t *file_map = NULL;
+// Files kept open along with their status, or NULL to open them per request
+static open_cache_t *open_cache = NULL;
+// Complete responses rendered at startup, or NULL if there are none
+static blob_store_t *blob_store = NULL;
 
 #define BUFSIZE 512
 #define CHUNKSIZE (8*BUFSIZE)
+#define CONNECTION_LINE_MAX 32
+#define HTTP_BOUNDARY "3d6b6a416f9b5c2e"  // Separates the parts of multipart bodies
+#define HTTP_ETAG_MAX 64
+#define HTTP_DATE_MAX 32
+#define HTTP_DATE_FORMAT "%a, %d %b %Y %H:%M:%S GMT"
+#define HTTP_RETRY_AFTER "1"      // Seconds clients that are turned away should wait
+#define CACHE_REVALIDATE_MS 1000  // How long a cached file is served without a stat
 
 
 typedef struct content_info {
-    char mime_type[BUFSIZE];
+    const mime_type_t *mime_type;
     size_t length;
 } content_info_t;
 
 
-const char *get_mime_type(const char *file_extension) {
-    if (strcmp(".txt", file_extension) == 0) {
-        return "text/plain";
-    } else if (strcmp(".html", file_extension) == 0) {
-        return "text/html";
-    } else if (strcmp(".jpg", file_extension) == 0) {
-        return "image/jpeg";
-    } else if (strcmp(".png", file_extension) == 0) {
-        return "image/png";
-    } else if (strcmp(".pdf", file_extension) == 0) {
-        return "application/pdf";
+// What clients revalidate their cached copy of a file against
+typedef struct validators {
+    char etag[HTTP_ETAG_MAX];             // Strong entity tag, quoted
+    char last_modified[HTTP_DATE_MAX];
+    time_t mtime;
+    int vary;                 // Whether the response depends on Accept-Encoding
+} validators_t;
+
+
+int extract_content_info(const char *resource_path,
+        const struct stat *file_stat, content_info_t *content_info) {
+    // Files of unknown types are still served, as application/octet-stream
+    content_info->length = file_stat->st_size;
+    content_info->mime_type = mime_type_of(resource_path);
+    return 0;
+}
+
+
+int read_http_request(int fd, char *buf, size_t *buf_len, http_request_t *req) {
+    http_parser_t parser;
+    init_http_parser(&parser);
+    while (1) {
+        // the buffer may already hold a request pipelined behind the last one
+        int res = parse_http_request(&parser, buf, *buf_len, req);
+        if (res == 0) { return 0; }
+        if (res == -1) {
+            // Counted rather than logged, so clients cannot flood the log
+            stats_bad_request();
+            send_http_error(fd, parser.error);
+            return 2;
+        }
+
+        ssize_t bytes_read = read(fd, buf + *buf_len, HTTP_REQUEST_MAX - *buf_len);
+        if (bytes_read == -1) {
+            if (errno == EINTR) { continue; }
+            perror("read");
+            return -1;
+        }
+        if (bytes_read == 0) {
+            if (*buf_len > 0) { stats_bad_request(); } // closed mid-request
+            return 1;
+        }
+        *buf_len += bytes_read;
     }
+}
+
 
-    return NULL;
+void set_http_file_cache(file_cache_t *cache) {
+    file_cache = cache;
 }
 
 
-int extract_content_info(const char *resource_path,
-        content_info_t *content_info) {
-    memset(content_info, 0, sizeof(content_info_t));
+void set_http_file_map(file_map_t *map) {
+    file_map = map;
+}
+
+
+void set_http_open_cache(open_cache_t *cache) {
+    open_cache = cache;
+}
+
+
+void set_http_blob_store(blob_store_t *store) {
+    blob_store = store;
+}
+
+
+void init_http_response(http_response_t *resp) {
+    resp->header_len = 0;
+    resp->header_sent = 0;
+    resp->file_fd = -1;
+    resp->body_data = NULL;
+    resp->cache_entry = NULL;
+    resp->mapping = NULL;
+    resp->open_entry = NULL;
+    resp->body_offset = 0;
+    resp->body_remaining = 0;
+    resp->body_method = BODY_SENDFILE;
+    resp->pipe_fds[0] = -1;
+    resp->pipe_fds[1] = -1;
+    resp->pipe_pending = 0;
+    resp->n_ranges = 0;
+    resp->next_range = 0;
+    resp->content_type = NULL;
+    resp->file_size = 0;
+    resp->body_buffer = NULL;
+    resp->status = 0;
+    resp->bytes_sent = 0;
+    resp->first_sent = 0;
+}
+
+
+// Finish a response header that ends just before the Connection line. Every
+// header starts with "HTTP/1.1 <status>", so the status is read back here.
+static void finish_header(http_response_t *resp, int keep_alive) {
+    const char *connection = keep_alive
+        ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    size_t len = strlen(connection);
+    memcpy(resp->header + resp->header_len, connection, len);
+    resp->header_len += len;
+    resp->status = atoi(resp->header + strlen("HTTP/1.1 "));
+}
+
+
+// Text is worth compressing, other types served here already are compressed
+static int is_compressible(const char *content_type) {
+    return content_type != NULL && strncmp(content_type, "text/", 5) == 0;
+}
+
+
+// Pick the content coding of the response. Ranges always refer to the file
+// itself, so range requests are answered uncompressed.
+static int choose_encoding(const http_request_t *req, const char *content_type) {
+    if (req == NULL || !is_compressible(content_type) ||
+            find_http_header(req, "Range") != NULL) {
+        return ENCODING_IDENTITY;
+    }
+    return negotiate_content_encoding(find_http_header(req, "Accept-Encoding"));
+}
+
+
+// The entity tag changes whenever the file is replaced (inode), or written
+// to (size and modification time to the nanosecond), and differs between the
+// content codings of the same file
+static void get_validators(const struct stat *statbuf, int encoding,
+        const char *content_type, validators_t *validators) {
+    const struct timespec *mtime = &statbuf->st_mtim;
+    unsigned long long mtime_ns =
+        (unsigned long long) mtime->tv_sec * 1000000000ULL + mtime->tv_nsec;
+    snprintf(validators->etag, HTTP_ETAG_MAX, "\"%llx-%llx-%llx%s%s\"",
+            (unsigned long long) statbuf->st_ino, (unsigned long long) statbuf->st_size,
+            mtime_ns, encoding == ENCODING_IDENTITY ? "" : "-",
+            encoding == ENCODING_IDENTITY ? "" : content_encoding_name(encoding));
+    validators->vary = is_compressible(content_type);
+
+    struct tm tm;
+    validators->mtime = mtime->tv_sec;
+    if (gmtime_r(&validators->mtime, &tm) == NULL ||
+            strftime(validators->last_modified, HTTP_DATE_MAX, HTTP_DATE_FORMAT, &tm) == 0) {
+        validators->last_modified[0] = '\0';
+    }
+}
 
-    // get file extension
-    const char *file_extension;
-    if ((file_extension = strrchr(resource_path, '.')) == NULL) {
-        fprintf(stderr, "Failed to retreive file extension\n");
+
+// Returns 1 if a comma-separated list of entity tags contains 'etag', or 0
+// otherwise. Weak tags match too, as If-None-Match compares weakly.
+static int etag_list_matches(const http_slice_t *value, const char *etag) {
+    size_t etag_len = strlen(etag);
+    const char *s = value->data;
+    size_t len = value->len;
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && (s[i] == ' ' || s[i] == '\t' || s[i] == ',')) { i++; }
+        if (i + 2 <= len && s[i] == 'W' && s[i + 1] == '/') { i += 2; }
+        size_t start = i;
+        while (i < len && s[i] != ',') { i++; }
+        size_t end = i;
+        while (end > start && (s[end - 1] == ' ' || s[end - 1] == '\t')) { end--; }
+        if ((end - start == 1 && s[start] == '*') ||
+                (end - start == etag_len && memcmp(s + start, etag, etag_len) == 0)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// Parse an HTTP-date in the preferred IMF-fixdate format.
+// Returns 0 on success or -1 if the date can't be parsed
+static int parse_http_date(const http_slice_t *value, time_t *t) {
+    char date[HTTP_DATE_MAX];
+    if (value->len >= HTTP_DATE_MAX) {
         return -1;
     }
+    memcpy(date, value->data, value->len);
+    date[value->len] = '\0';
 
-    // get mime type
-    const char *mime_type = get_mime_type(file_extension);
-    if (mime_type == NULL) {
-        fprintf(stderr, "Failed to get mime type\n");
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(date, HTTP_DATE_FORMAT, &tm);
+    if (end == NULL || *end != '\0') {
         return -1;
     }
+    *t = timegm(&tm);
+    return 0;
+}
 
-    // get content length
-    struct stat file_stat;
-    if (stat(resource_path, &file_stat) != 0) { perror("stat"); return -1; }
 
-    // populate content_info fields
-    content_info->length = file_stat.st_size;
-    strncpy(content_info->mime_type, mime_type, strlen(mime_type));
+// Returns 1 if the client's copy described by the request's conditional
+// headers is still current, or 0 if the full response must be sent
+static int is_not_modified(const http_request_t *req, const validators_t *validators) {
+    // If-Modified-Since only counts when there is no If-None-Match
+    const http_slice_t *value;
+    if ((value = find_http_header(req, "If-None-Match")) != NULL) {
+        return etag_list_matches(value, validators->etag);
+    }
+    time_t since;
+    if ((value = find_http_header(req, "If-Modified-Since")) != NULL &&
+            parse_http_date(value, &since) == 0) {
+        return validators->mtime <= since;
+    }
+    return 0;
+}
+
+
+// Returns 1 if an If-Range header, if any, still matches the file, so that the
+// Range header applies, or 0 if the whole file has to be sent instead
+static int if_range_matches(const http_request_t *req, const validators_t *validators) {
+    const http_slice_t *value = find_http_header(req, "If-Range");
+    if (value == NULL) {
+        return 1;
+    }
+    // Entity tags are compared strongly, dates have to match exactly
+    const char *expected = value->len > 0 && value->data[0] == '"'
+        ? validators->etag : validators->last_modified;
+    return value->len == strlen(expected) && memcmp(value->data, expected, value->len) == 0;
+}
+
 
+// Replace the response with a body-less 304 carrying the file's validators
+static int prepare_not_modified(http_response_t *resp, const validators_t *validators,
+        int keep_alive) {
+    int res = snprintf(resp->header, HTTP_HEADER_MAX,
+            "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nLast-Modified: %s\r\n%s",
+            validators->etag, validators->last_modified,
+            validators->vary ? "Vary: Accept-Encoding\r\n" : "");
+    if (res < 0 || res >= HTTP_HEADER_MAX - CONNECTION_LINE_MAX) {
+        fprintf(stderr, "Failed to format HTTP response header\n");
+        return -1;
+    }
+    resp->header_len = res;
+    finish_header(resp, keep_alive);
+    resp->body_remaining = 0;
     return 0;
 }
 
 
-int read_http_request(int fd, char *resource_name) {
-    char buf[BUFSIZE];
-    memset(buf, 0, BUFSIZE);
+int is_conditional_http_request(const http_request_t *req) {
+    return find_http_header(req, "If-None-Match") != NULL ||
+        find_http_header(req, "If-Modified-Since") != NULL;
+}
+
+
+int prepare_not_modified_http_response(http_response_t *resp, const char *resource_path,
+        const struct stat *statbuf, const http_request_t *req, int keep_alive) {
+    init_http_response(resp);
+    const char *content_type = mime_type_of(resource_path)->type;
+    validators_t validators;
+    get_validators(statbuf, choose_encoding(req, content_type), content_type, &validators);
+    if (!is_not_modified(req, &validators)) {
+        return 0;
+    }
+    return prepare_not_modified(resp, &validators, keep_alive) == 0 ? 1 : 0;
+}
+
+
+// Parse a decimal number of at most 18 digits, so it can't overflow.
+// Returns the number of characters consumed, or 0 if there is no number
+static size_t parse_offset(const char *s, size_t len, unsigned long long *value) {
+    size_t i = 0;
+    *value = 0;
+    while (i < len && i < 18 && s[i] >= '0' && s[i] <= '9') {
+        *value = *value * 10 + (s[i] - '0');
+        i++;
+    }
+    return i < len && s[i] >= '0' && s[i] <= '9' ? 0 : i;
+}
+
+
+// Work out which bytes of a file of the given size a Range header asks for.
+// Ranges that start past the end of the file are dropped and the others are
+// clipped to it.
+// Returns the number of ranges stored in 'ranges', 0 if the header should be
+// ignored and the whole file sent, or -1 if no range can be satisfied
+static int parse_ranges(const http_slice_t *value, size_t size, http_range_t *ranges) {
+    const char *s = value->data;
+    size_t len = value->len;
+    if (len < 6 || strncasecmp(s, "bytes=", 6) != 0) {
+        return 0;
+    }
+
+    int n_ranges = 0;
+    int n_specs = 0;
+    size_t i = 6;
+    while (i < len) {
+        while (i < len && (s[i] == ' ' || s[i] == '\t' || s[i] == ',')) { i++; }
+        if (i == len) { break; }
+        if (++n_specs > HTTP_RANGES_MAX) {
+            return 0;
+        }
+
+        // first-last, first- or -suffix_length
+        unsigned long long first = 0, last = 0;
+        size_t n = parse_offset(s + i, len - i, &first);
+        int has_first = n > 0;
+        i += n;
+        if (i == len || s[i] != '-') { return 0; }
+        i++;
+        n = parse_offset(s + i, len - i, &last);
+        int has_last = n > 0;
+        i += n;
+        while (i < len && (s[i] == ' ' || s[i] == '\t')) { i++; }
+        if (i < len && s[i] != ',') { return 0; }
+        if (!has_first && !has_last) { return 0; }
+        if (has_first && has_last && last < first) { return 0; }
+
+        if (!has_first) {
+            // The last 'last' bytes of the file
+            if (last == 0 || size == 0) { continue; }
+            first = last < size ? size - last : 0;
+            last = size - 1;
+        } else {
+            if (first >= size) { continue; }
+            if (!has_last || last >= size) { last = size - 1; }
+        }
+        ranges[n_ranges].offset = first;
+        ranges[n_ranges].length = last - first + 1;
+        n_ranges++;
+    }
+
+    if (n_specs == 0) {
+        return 0;
+    }
+    return n_ranges == 0 ? -1 : n_ranges;
+}
+
+
+// Format the delimiter and header that precede part 'index' of a multipart
+// body, or the closing delimiter if index is n_ranges.
+// Returns the length of the formatted text, or -1 if it does not fit
+static int format_part_header(const http_response_t *resp, int index,
+        char *buf, size_t size) {
+    int res;
+    if (index == resp->n_ranges) {
+        res = snprintf(buf, size, "\r\n--" HTTP_BOUNDARY "--\r\n");
+    } else {
+        const http_range_t *range = &resp->ranges[index];
+        res = snprintf(buf, size, "\r\n--" HTTP_BOUNDARY "\r\n"
+                "Content-Type: %s\r\nContent-Range: bytes %lld-%lld/%zu\r\n\r\n",
+                resp->content_type, (long long) range->offset,
+                (long long) (range->offset + range->length - 1), resp->file_size);
+    }
+    return res < 0 || (size_t) res >= size ? -1 : res;
+}
+
+
+// Answer a Range header, replacing the 200 header of a response whose body
+// (a file or a cache entry) has already been set up. A single range is sent
+// as is, several ranges as a multipart/byteranges body.
+// Returns 1 if the response now answers the range, 0 if the request has no
+// usable Range header and the whole file should be sent, or -1 on error
+static int prepare_range_response(http_response_t *resp, const http_request_t *req,
+        const char *content_type, size_t size, const validators_t *validators,
+        int keep_alive) {
+    const http_slice_t *value;
+    if ((value = find_http_header(req, "Range")) == NULL ||
+            !if_range_matches(req, validators)) {
+        return 0;
+    }
+    int n_ranges = parse_ranges(value, size, resp->ranges);
+    if (n_ranges == 0) {
+        return 0;
+    }
+
+    int res;
+    if (n_ranges == -1) {
+        res = snprintf(resp->header, HTTP_HEADER_MAX,
+                "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%zu\r\n"
+                "Content-Length: 0\r\n", size);
+        resp->body_remaining = 0;
+    } else if (n_ranges == 1) {
+        const http_range_t *range = &resp->ranges[0];
+        res = snprintf(resp->header, HTTP_HEADER_MAX,
+                "HTTP/1.1 206 Partial Content\r\nContent-Type: %s\r\n"
+                "Content-Range: bytes %lld-%lld/%zu\r\nContent-Length: %zu\r\n"
+                "ETag: %s\r\n%s",
+                content_type, (long long) range->offset,
+                (long long) (range->offset + range->length - 1), size, range->length,
+                validators->etag, validators->vary ? "Vary: Accept-Encoding\r\n" : "");
+        resp->body_offset = range->offset;
+        resp->body_remaining = range->length;
+    } else {
+        resp->n_ranges = n_ranges;
+        resp->content_type = content_type;
+        resp->file_size = size;
+
+        // The length of the body includes every part's header
+        char part[HTTP_HEADER_MAX];
+        size_t length = 0;
+        for (int i = 0; i <= n_ranges; i++) {
+            int part_len = format_part_header(resp, i, part, sizeof(part));
+            if (part_len == -1) {
+                fprintf(stderr, "Failed to format multipart header\n");
+                return -1;
+            }
+            length += part_len + (i < n_ranges ? resp->ranges[i].length : 0);
+        }
+        res = snprintf(resp->header, HTTP_HEADER_MAX,
+                "HTTP/1.1 206 Partial Content\r\n"
+                "Content-Type: multipart/byteranges; boundary=" HTTP_BOUNDARY "\r\n"
+                "Content-Length: %zu\r\nETag: %s\r\n%s", length, validators->etag,
+                validators->vary ? "Vary: Accept-Encoding\r\n" : "");
+    }
+    if (res < 0 || res >= HTTP_HEADER_MAX - CONNECTION_LINE_MAX) {
+        fprintf(stderr, "Failed to format HTTP response header\n");
+        return -1;
+    }
+    resp->header_len = res;
+    finish_header(resp, keep_alive);
+
+    // The first part's header follows the response header directly
+    if (resp->n_ranges > 0) {
+        int part_len = format_part_header(resp, 0, resp->header + resp->header_len,
+                HTTP_HEADER_MAX - resp->header_len);
+        if (part_len == -1) {
+            fprintf(stderr, "Failed to format multipart header\n");
+            return -1;
+        }
+        resp->header_len += part_len;
+        resp->next_range = 1;
+        resp->body_offset = resp->ranges[0].offset;
+        resp->body_remaining = resp->ranges[0].length;
+    }
+    return 1;
+}
+
+
+int next_http_response_part(http_response_t *resp) {
+    if (resp->n_ranges == 0 || resp->next_range > resp->n_ranges) {
+        return 0;
+    }
 
-    int bytes_read;
+    // Part headers are much shorter than a response header, so this fits
+    int index = resp->next_range++;
+    resp->header_len = format_part_header(resp, index, resp->header, HTTP_HEADER_MAX);
+    resp->header_sent = 0;
+    if (index < resp->n_ranges) {
+        resp->body_offset = resp->ranges[index].offset;
+        resp->body_remaining = resp->ranges[index].length;
+    } else {
+        resp->body_remaining = 0;
+    }
+    return 1;
+}
 
-    // discard first four characters ("GET ")
-    bytes_read = read(fd, buf, 4*sizeof(char));
-    if (bytes_read == 4*sizeof(char)) {}
-    else if (bytes_read == -1) 
-        { perror("read"); return -1; } 
-    else {
-        // http request is less than four characters long
-        fprintf(stderr, "Bad HTTP request\n"); return -1;
+
+// Send the whole of a cached file or variant, which the response keeps a
+// reference to until it is released
+static void send_cache_entry(http_response_t *resp, file_cache_entry_t *entry,
+        int keep_alive) {
+    resp->cache_entry = entry;
+    resp->body_data = entry->data;
+    memcpy(resp->header, entry->header, entry->header_len);
+    resp->header_len = entry->header_len;
+    finish_header(resp, keep_alive);
+    resp->body_remaining = entry->size;
+}
+
+
+// Send a response rendered at startup. On a persistent connection the header
+// and body go out together, straight from the arena.
+static void send_blob(http_response_t *resp, const response_blob_t *blob, int keep_alive,
+        int head) {
+    if (keep_alive && !head) {
+        resp->body_data = blob->data;
+        resp->body_remaining = blob->len;
+        resp->status = 200;
+        return;
     }
+    memcpy(resp->header, blob->data, blob->prefix_len);
+    resp->header_len = blob->prefix_len;
+    finish_header(resp, keep_alive);
+    resp->body_data = blob->data + blob->header_len;
+    resp->body_remaining = blob->len - blob->header_len;
+}
 
-    // retrieve resource name -- assuming it's under BUFSIZE characters (throw error otherwise)
-    bytes_read = read(fd, buf, BUFSIZE);
-    if (bytes_read == -1) 
-        { perror("read"); return -1; } 
-    char *saveptr = NULL;  // for strtok_r
-    char *name = strtok_r(buf, " ", &saveptr);
-    if (name == NULL) {
-        fprintf(stderr, "Resource name is too long or HTTP request is badly formatted\n");
+
+// The status of the file a cache entry was loaded from
+static void get_entry_stat(const file_cache_entry_t *entry, struct stat *statbuf) {
+    memset(statbuf, 0, sizeof(struct stat));
+    statbuf->st_mode = S_IFREG;
+    statbuf->st_ino = entry->ino;
+    statbuf->st_size = entry->size;
+    statbuf->st_mtim = entry->mtime;
+}
+
+
+// Format the start of the header of a compressed variant.
+// Returns the length of the header, or -1 if it does not fit
+static int format_encoded_header(char *header, const char *content_type, int encoding,
+        size_t length, const validators_t *validators) {
+    int res = snprintf(header, HTTP_HEADER_MAX,
+            "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Encoding: %s\r\n"
+            "Content-Length: %zu\r\nVary: Accept-Encoding\r\nETag: %s\r\n"
+            "Last-Modified: %s\r\n",
+            content_type, content_encoding_name(encoding), length,
+            validators->etag, validators->last_modified);
+    if (res < 0 || res >= HTTP_HEADER_MAX - CONNECTION_LINE_MAX) {
+        fprintf(stderr, "Failed to format HTTP response header\n");
         return -1;
     }
+    return res;
+}
+
+
+// Answer with a compressed variant of a file: one cached earlier, a
+// precompressed sibling file (the path plus ".gz" or ".br"), or one compressed
+// now from the file's contents and cached for the following requests.
+// resp: Response that sends the file as is, which is replaced on success
+// statbuf: Status of the file
+// data: The file's contents if they are in memory, or NULL
+// Returns 1 if resp now holds the response, 0 if no variant is available and
+// the file should be sent as is, or -1 on error
+static int prepare_encoded_response(http_response_t *resp, const char *resource_path,
+        const char *content_type, int encoding, const struct stat *statbuf,
+        const char *data, const http_request_t *req, int keep_alive) {
+    validators_t validators;
+    get_validators(statbuf, encoding, content_type, &validators);
+    if (is_not_modified(req, &validators)) {
+        release_http_response(resp);
+        init_http_response(resp);
+        return prepare_not_modified(resp, &validators, keep_alive) == 0 ? 1 : -1;
+    }
+
+    // Variants are cached under their entity tag, which changes along with
+    // the file, followed by the path. No file path starts with a quote.
+    char key[strlen(validators.etag) + strlen(resource_path) + 1];
+    strcpy(key, validators.etag);
+    strcat(key, resource_path);
+    file_cache_entry_t *entry;
+    if (file_cache != NULL && (entry = file_cache_get(file_cache, key, statbuf)) != NULL) {
+        release_http_response(resp);
+        init_http_response(resp);
+        send_cache_entry(resp, entry, keep_alive);
+        return 1;
+    }
+
+    char header[HTTP_HEADER_MAX];
+    int header_len;
+    const char *extension = content_encoding_extension(encoding);
+    char sibling_path[strlen(resource_path) + strlen(extension) + 1];
+    strcpy(sibling_path, resource_path);
+    strcat(sibling_path, extension);
+    int sibling_fd = open(sibling_path, O_RDONLY | O_CLOEXEC);
+    if (sibling_fd != -1) {
+        // A sibling older than the file itself is stale
+        struct stat sibling;
+        if (fstat(sibling_fd, &sibling) == 0 && S_ISREG(sibling.st_mode) &&
+                (sibling.st_mtim.tv_sec > statbuf->st_mtim.tv_sec ||
+                 (sibling.st_mtim.tv_sec == statbuf->st_mtim.tv_sec &&
+                  sibling.st_mtim.tv_nsec >= statbuf->st_mtim.tv_nsec))) {
+            header_len = format_encoded_header(header, content_type, encoding,
+                    sibling.st_size, &validators);
+            if (header_len == -1) {
+                if (close(sibling_fd) == -1) { perror("close"); }
+                return -1;
+            }
+            release_http_response(resp);
+            init_http_response(resp);
+            if (file_cache != NULL && (entry = file_cache_load(file_cache, key,
+                            sibling_fd, &sibling, header, header_len)) != NULL) {
+                if (close(sibling_fd) == -1) { perror("close"); }
+                send_cache_entry(resp, entry, keep_alive);
+                return 1;
+            }
+            resp->file_fd = sibling_fd;
+            memcpy(resp->header, header, header_len);
+            resp->header_len = header_len;
+            finish_header(resp, keep_alive);
+            resp->body_remaining = sibling.st_size;
+            return 1;
+        }
+        if (close(sibling_fd) == -1) { perror("close"); }
+    }
+
+    // Compress files small enough to be cached, once per version of the file.
+    // Requests arriving meanwhile wait for that instead of compressing too.
+    if (data == NULL || file_cache == NULL) {
+        return 0;
+    }
+    file_cache_flight_t *flight;
+    if ((entry = file_cache_join(file_cache, key, statbuf, &flight)) == NULL) {
+        if (flight == NULL) {
+            return 0;
+        }
+        char *compressed;
+        size_t compressed_len;
+        if (compress_content(encoding, data, statbuf->st_size, &compressed,
+                    &compressed_len) == 0) {
+            header_len = format_encoded_header(header, content_type, encoding,
+                    compressed_len, &validators);
+            entry = header_len == -1 ? NULL : file_cache_insert(file_cache, key,
+                    compressed, compressed_len, statbuf, header, header_len);
+            free(compressed);
+        }
+        file_cache_land(file_cache, flight, entry);
+        if (entry == NULL) {
+            return 0;
+        }
+    }
+    release_http_response(resp);
+    init_http_response(resp);
+    send_cache_entry(resp, entry, keep_alive);
+    return 1;
+}
+
+
+// Serve a response from a cached file, or a variant or part of it
+static int use_cache_entry(http_response_t *resp, file_cache_entry_t *entry,
+        const char *resource_path, const char *content_type,
+        const http_request_t *req, int keep_alive) {
+    resp->cache_entry = entry;
+    resp->body_data = entry->data;
+
+    // The validators are already part of the cached header, so they are only
+    // formatted again for requests that have to be checked against them
+    if (req != NULL) {
+        struct stat statbuf;
+        get_entry_stat(entry, &statbuf);
+        int encoding = choose_encoding(req, content_type);
+        if (encoding != ENCODING_IDENTITY) {
+            int res = prepare_encoded_response(resp, resource_path, content_type,
+                    encoding, &statbuf, entry->data, req, keep_alive);
+            if (res != 0) {
+                return res == 1 ? 0 : -1;
+            }
+        }
+
+        if (is_conditional_http_request(req) || find_http_header(req, "Range") != NULL) {
+            validators_t validators;
+            get_validators(&statbuf, ENCODING_IDENTITY, content_type, &validators);
+            if (is_not_modified(req, &validators)) {
+                return prepare_not_modified(resp, &validators, keep_alive);
+            }
+            int res = prepare_range_response(resp, req, content_type, entry->size,
+                    &validators, keep_alive);
+            if (res != 0) {
+                return res;
+            }
+        }
+    }
+
+    send_cache_entry(resp, entry, keep_alive);
+    return 0;
+}
+
 
-    strcpy(resource_name, name);
+// Answer a request for STATS_PATH or TRACE_PATH with a report rendered into
+// memory by 'render'
+// Returns 0 on success or -1 on error
+static int prepare_report_response(http_response_t *resp, int (*render)(FILE *),
+        int keep_alive) {
+    char *report;
+    size_t report_len;
+    FILE *out = open_memstream(&report, &report_len);
+    if (out == NULL) {
+        perror("open_memstream");
+        return -1;
+    }
+    int res = render(out);
+    if (fclose(out) != 0) {
+        perror("fclose");
+        res = -1;
+    }
+    if (res == -1) {
+        free(report);
+        return -1;
+    }
 
+    resp->body_buffer = report;
+    resp->body_data = report;
+    resp->body_remaining = report_len;
+    resp->header_len = snprintf(resp->header, HTTP_HEADER_MAX,
+            "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n"
+            "Cache-Control: no-store\r\n", report_len);
+    finish_header(resp, keep_alive);
     return 0;
 }
 
 
-int write_http_response(int fd, const char *resource_path) {
-    int status_val = 200;
-    int bytes_read = 0;
-    int bytes_written = 0;
-    FILE *file;
+// Answer a HEAD request with the header the same GET request gets, which
+// describes the body that is left out
+static void omit_body(http_response_t *resp) {
+    const char *end = memmem(resp->header, resp->header_len, "\r\n\r\n", 4);
+    if (end != NULL) {
+        resp->header_len = end + 4 - resp->header; // Before a multipart body
+    }
+    resp->body_remaining = 0;
+    resp->n_ranges = 0;
+}
 
-    // make sure file can be opened -- different headers depending on
-    // success/failure failure to open need not yield a -1 return error value
-    // -- we indicate error in the HTTP response
-    if (strcmp("", resource_path) == 0) {
-        status_val = 404;
-    } else {
-        file = fopen(resource_path, "r");
-        if (file == NULL) { status_val = 404; }
+
+// Look up the current status of the file at a path, from the open file cache
+// when it has the path, which keeps it up to date without system calls
+// Returns 0 if there is a regular file at the path, or -1 otherwise
+static int get_file_status(const char *resource_path, struct stat *statbuf) {
+    open_entry_t *open_entry;
+    if (open_cache != NULL &&
+            (open_entry = open_cache_get(open_cache, resource_path)) != NULL) {
+        int found = open_entry->fd != -1;
+        if (found) {
+            *statbuf = open_entry->statbuf;
+        }
+        open_cache_release(open_entry);
+        return found ? 0 : -1;
     }
+    return stat(resource_path, statbuf) == 0 && S_ISREG(statbuf->st_mode) ? 0 : -1;
+}
+
+
+// Prepare a response that needs neither the file nor an I/O thread, as
+// prepare_cached_http_response does, but with the body of a GET
+static int prepare_cached_response(http_response_t *resp, const char *resource_path,
+        const http_request_t *req, int keep_alive) {
+    init_http_response(resp);
+
+    int (*render)(FILE *) = NULL;
+    if (req != NULL && strcmp(req->resource_name, STATS_PATH) == 0) {
+        render = stats_render;
+    } else if (req != NULL && strcmp(req->resource_name, TRACE_PATH) == 0) {
+        render = trace_render;
+    }
+    if (render != NULL) {
+        if (prepare_report_response(resp, render, keep_alive) == 0) {
+            return 1;
+        }
+        release_http_response(resp);
+        init_http_response(resp);
+        return 0;
+    }
+
+    // Plain requests for a rendered file get that response as it is
+    const response_blob_t *blob;
+    if (blob_store != NULL && (blob = blob_store_find(blob_store, resource_path)) != NULL &&
+            (req == NULL || (!is_conditional_http_request(req) &&
+                             find_http_header(req, "Range") == NULL &&
+                             choose_encoding(req, mime_type_of(resource_path)->type) ==
+                             ENCODING_IDENTITY))) {
+        send_blob(resp, blob, keep_alive, req != NULL && req->head);
+        return 1;
+    }
+
+    // Cached files need no freshly built header, and no more than the file's
+    // status to make sure they did not change. That takes a stat unless the
+    // open file cache keeps it current, so it is then only taken once every
+    // CACHE_REVALIDATE_MS.
+    file_cache_entry_t *entry;
+    long max_age_ms = open_cache != NULL ? 0 : CACHE_REVALIDATE_MS;
+    if (file_cache != NULL && (entry = file_cache_get_fresh(file_cache, resource_path,
+                    max_age_ms, get_file_status)) != NULL) {
+        // The type was known when the file was cached
+        if (use_cache_entry(resp, entry, resource_path, mime_type_of(resource_path)->type,
+                    req, keep_alive) == -1) {
+            // Let the caller build the response from the file instead
+            release_http_response(resp);
+            init_http_response(resp);
+            return 0;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+
+int prepare_cached_http_response(http_response_t *resp, const char *resource_path,
+        const http_request_t *req, int keep_alive) {
+    int res = prepare_cached_response(resp, resource_path, req, keep_alive);
+    if (res == 1 && req != NULL && req->head) {
+        omit_body(resp);
+    }
+    return res;
+}
+
+
+// Format the start of the header of a response with a whole file as its body.
+// Returns the length of the header, or -1 if it does not fit
+static int format_file_header(char *header, const content_info_t *content_info,
+        const validators_t *validators) {
+    // The Content-Type line was rendered when the type was registered
+    const char status_line[] = "HTTP/1.1 200 OK\r\n";
+    size_t len = sizeof(status_line) - 1;
+    memcpy(header, status_line, len);
+    memcpy(header + len, content_info->mime_type->header, content_info->mime_type->header_len);
+    len += content_info->mime_type->header_len;
+    int res = snprintf(header + len, HTTP_HEADER_MAX - len,
+            "Content-Length: %zu\r\n"
+            "Accept-Ranges: bytes\r\nETag: %s\r\nLast-Modified: %s\r\n%s",
+            content_info->length,
+            validators->etag,
+            validators->last_modified,
+            validators->vary ? "Vary: Accept-Encoding\r\n" : "");
+    if (res < 0 || len + res >= HTTP_HEADER_MAX - CONNECTION_LINE_MAX) {
+        return -1;
+    }
+    return len + res;
+}
+
+
+int format_http_file_header(char *header, const char *resource_path,
+        const struct stat *statbuf, size_t *prefix_len) {
+    content_info_t content_info;
+    extract_content_info(resource_path, statbuf, &content_info);
+    validators_t validators;
+    get_validators(statbuf, ENCODING_IDENTITY, content_info.mime_type->type, &validators);
+
+    http_response_t resp;
+    int res = format_file_header(resp.header, &content_info, &validators);
+    if (res == -1) {
+        return -1;
+    }
+    resp.header_len = res;
+    finish_header(&resp, 1);
+    *prefix_len = res;
+    memcpy(header, resp.header, resp.header_len);
+    return resp.header_len;
+}
+
+
+// Stop sending from the response's file, which belongs to the open file cache
+// if it came from there
+static void close_body_file(http_response_t *resp) {
+    if (resp->open_entry != NULL) {
+        open_cache_release(resp->open_entry);
+        resp->open_entry = NULL;
+    } else if (close(resp->file_fd) == -1) {
+        perror("close");
+    }
+    resp->file_fd = -1;
+}
+
+
+// Prepare a response from a file opened by the caller, or taken from the open
+// file cache along with its type if open_entry is not NULL
+static int prepare_opened_response(http_response_t *resp, const char *resource_path,
+        int file_fd, open_entry_t *open_entry, const struct stat *statbuf,
+        const http_request_t *req, int keep_alive) {
+    init_http_response(resp);
+    resp->file_fd = file_fd;
+    resp->open_entry = open_entry;
 
     // Pretend as if directory files do not exist, since we do not provide
     // a facility for listing their contents like real HTTP servers do
-    struct stat statbuf;
     // Note that if stat errors, we just assume the file is not usable
     // and send a 404 rather than crashing
-    if (file && (stat(resource_path, &statbuf) != 0 || S_ISDIR(statbuf.st_mode))) {
-        status_val = 404;
-        if (fclose(file) == -1) { perror("close"); return -1; }
-    }
-
-    // write HTTP response header -- return on 404 status
-    if (status_val == 404) {
-        // construct header
-        char notfound[] = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
-        size_t nfsize = strlen(notfound);
-        // Write 404 header
-        if ((bytes_written = write(fd, notfound, nfsize)) != nfsize) {
-            if (bytes_written < 0) { perror("write"); }
-            else { fprintf(stderr, "Failed to write HTTP response header\n"); }
-            return -1;
-        }
-        // clean up and return
+    if (resp->file_fd != -1 && (statbuf == NULL || S_ISDIR(statbuf->st_mode))) {
+        close_body_file(resp);
+    }
+
+    if (resp->file_fd == -1) {
+        const char notfound[] = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n";
+        resp->header_len = strlen(notfound);
+        memcpy(resp->header, notfound, resp->header_len);
+        finish_header(resp, keep_alive);
         return 0;
     }
 
     // extract content type and length
     content_info_t content_info;
-    if (extract_content_info(resource_path, &content_info) == -1) {
+    if (resp->open_entry != NULL) {
+        content_info.length = statbuf->st_size;
+        content_info.mime_type = resp->open_entry->content_type;
+    } else if (extract_content_info(resource_path, statbuf, &content_info) == -1) {
         fprintf(stderr, "Failed to extract content info\n");
-        fclose(file);
+        release_http_response(resp);
         return -1;
     }
-    // FIXED
-    // Declare chunk to write
-    char chunk[CHUNKSIZE];
-    unsigned int offset = 0;
-
-    // Add header to chunk
-    int res = sprintf(chunk,
-            "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %ld\r\n\r\n",
-            content_info.mime_type,
-            content_info.length);
-    if (res < 0) {
-        perror("sprintf");
-        if (fclose(file) == EOF) {
-            perror("sprintf");
+
+    const char *content_type = content_info.mime_type->type;
+    validators_t validators;
+    get_validators(statbuf, ENCODING_IDENTITY, content_type, &validators);
+
+    int res = format_file_header(resp->header, &content_info, &validators);
+    if (res == -1) {
+        fprintf(stderr, "Failed to format HTTP response header\n");
+        release_http_response(resp);
+        return -1;
+    }
+    resp->header_len = res;
+
+    // Small files are kept in memory along with their header, so the next
+    // request for them needs no system calls besides a stat and the send
+    file_cache_entry_t *entry;
+    int encoding;
+    if (file_cache != NULL &&
+            (entry = file_cache_load(file_cache, resource_path, resp->file_fd,
+                    statbuf, resp->header, resp->header_len)) != NULL) {
+        close_body_file(resp);
+        res = use_cache_entry(resp, entry, resource_path, content_type,
+                req, keep_alive);
+    } else if ((encoding = choose_encoding(req, content_type)) !=
+            ENCODING_IDENTITY && (res = prepare_encoded_response(resp, resource_path,
+                    content_type, encoding, statbuf, NULL, req,
+                    keep_alive)) != 0) {
+        // Only a precompressed sibling can stand in for a file this large
+        res = res == 1 ? 0 : -1;
+    } else if (req != NULL && is_not_modified(req, &validators)) {
+        res = prepare_not_modified(resp, &validators, keep_alive);
+    } else {
+        // A mapping shared by every response for the file stands in for the
+        // descriptor, so the body goes out with the header from memory
+        file_mapping_t *mapping;
+        if (file_map != NULL && (mapping = file_map_get(file_map, resource_path,
+                        resp->file_fd, statbuf)) != NULL) {
+            close_body_file(resp);
+            resp->mapping = mapping;
+            resp->body_data = mapping->data;
+        }
+
+        // Only the requested bytes of the file are ever sent
+        res = req == NULL ? 0 : prepare_range_response(resp, req,
+                content_type, content_info.length, &validators, keep_alive);
+        if (res == 0) {
+            finish_header(resp, keep_alive);
+            resp->body_remaining = content_info.length;
+        }
+        if (res != -1 && resp->mapping != NULL) {
+            file_map_advise(resp->mapping, resp->body_offset, resp->body_remaining);
         }
+    }
+    if (res == -1) {
+        release_http_response(resp);
         return -1;
     }
-    offset = strlen(chunk);
+    if (req != NULL && req->head) {
+        omit_body(resp);
+    }
+    return 0;
+}
 
-    // Write file chunk by chunk
-    do {
-        // Read into the chunk
-        bytes_read = fread(chunk + offset, 1, CHUNKSIZE - offset, file);
-        if (ferror(file)) {
-            perror("fread");
-            if (fclose(file) == EOF) { perror("fclose"); }
+
+int prepare_http_file_response(http_response_t *resp, const char *resource_path,
+        int file_fd, const struct stat *statbuf, const http_request_t *req,
+        int keep_alive) {
+    return prepare_opened_response(resp, resource_path, file_fd, NULL, statbuf,
+            req, keep_alive);
+}
+
+
+int prepare_http_response(http_response_t *resp, const char *resource_path,
+        const http_request_t *req, int keep_alive) {
+    if (prepare_cached_http_response(resp, resource_path, req, keep_alive) == 1) {
+        return 0;
+    }
+
+    // A file opened for an earlier request is reused, along with its status,
+    // and so is finding that there is no file
+    struct stat statbuf;
+    open_entry_t *open_entry;
+    if (open_cache != NULL &&
+            (open_entry = open_cache_get(open_cache, resource_path)) != NULL) {
+        statbuf = open_entry->statbuf;
+        if (open_entry->fd == -1) {
+            open_cache_release(open_entry);
+            return prepare_opened_response(resp, resource_path, -1, NULL, NULL,
+                    req, keep_alive);
+        }
+        if (req != NULL && is_conditional_http_request(req) &&
+                prepare_not_modified_http_response(resp, resource_path, &statbuf, req,
+                    keep_alive) == 1) {
+            open_cache_release(open_entry);
+            return 0;
+        }
+        return prepare_opened_response(resp, resource_path, open_entry->fd, open_entry,
+                &statbuf, req, keep_alive);
+    }
+
+    // A client revalidating its copy may need nothing but the file's status
+    if (req != NULL && is_conditional_http_request(req) &&
+            stat(resource_path, &statbuf) == 0 && S_ISREG(statbuf.st_mode) &&
+            prepare_not_modified_http_response(resp, resource_path, &statbuf, req,
+                keep_alive) == 1) {
+        return 0;
+    }
+
+    // make sure file can be opened -- failure to open need not yield a -1
+    // return error value -- we indicate error in the HTTP response
+    int file_fd = -1;
+    if (strcmp("", resource_path) != 0) {
+        file_fd = open(resource_path, O_RDONLY);
+    }
+
+    int stat_ok = file_fd != -1 && fstat(file_fd, &statbuf) == 0;
+    return prepare_http_file_response(resp, resource_path, file_fd,
+            stat_ok ? &statbuf : NULL, req, keep_alive);
+}
+
+
+// Account for bytes the socket accepted
+static void count_sent(http_response_t *resp, size_t n) {
+    if (resp->bytes_sent == 0 && n > 0) {
+        resp->first_sent = stats_now();
+    }
+    resp->bytes_sent += n;
+}
+
+
+// Returns 1 if a failed socket operation just means the socket would block
+static int would_block(void) {
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+
+// Move body bytes from the file into the socket without copying them through
+// user space. Falls back to splice if sendfile is not supported here.
+// Returns 0 once the body is sent, 1 if the socket would block or -1 on error
+static int send_body_sendfile(int fd, http_response_t *resp) {
+    while (resp->body_remaining > 0) {
+        ssize_t bytes_sent = sendfile(fd, resp->file_fd, &resp->body_offset,
+                resp->body_remaining);
+        if (bytes_sent == -1) {
+            if (errno == EINTR) { continue; }
+            if (would_block()) { return 1; }
+            if (errno == EINVAL || errno == ENOSYS) {
+                resp->body_method = BODY_SPLICE;
+                return 0;
+            }
+            perror("sendfile");
             return -1;
         }
+        if (bytes_sent == 0) {
+            fprintf(stderr, "File was truncated while being sent\n");
+            return -1;
+        }
+        resp->body_remaining -= bytes_sent;
+        count_sent(resp, bytes_sent);
+    }
+    return 0;
+}
 
-        // Write the chunk
-        bytes_written = write(fd, chunk, bytes_read + offset) == -1;
+
+// Move body bytes from the file into the socket through a pipe. The pipe may
+// hold bytes the socket has not accepted yet, which are sent first.
+// Returns 0 once the body is sent, 1 if the socket would block or -1 on error
+static int send_body_splice(int fd, http_response_t *resp) {
+    if (resp->pipe_fds[0] == -1 && pipe2(resp->pipe_fds, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        return -1;
+    }
+
+    while (resp->pipe_pending > 0 || resp->body_remaining > 0) {
+        if (resp->pipe_pending == 0) {
+            ssize_t bytes_in = splice(resp->file_fd, &resp->body_offset,
+                    resp->pipe_fds[1], NULL, resp->body_remaining, SPLICE_F_MOVE);
+            if (bytes_in == -1) {
+                if (errno == EINTR) { continue; }
+                if (errno == EINVAL) {
+                    resp->body_method = BODY_COPY;
+                    return 0;
+                }
+                perror("splice");
+                return -1;
+            }
+            if (bytes_in == 0) {
+                fprintf(stderr, "File was truncated while being sent\n");
+                return -1;
+            }
+            resp->pipe_pending = bytes_in;
+        }
+
+        ssize_t bytes_out = splice(resp->pipe_fds[0], NULL, fd, NULL,
+                resp->pipe_pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK |
+                (resp->body_remaining > resp->pipe_pending ? SPLICE_F_MORE : 0));
+        if (bytes_out == -1) {
+            if (errno == EINTR) { continue; }
+            if (would_block()) { return 1; }
+            perror("splice");
+            return -1;
+        }
+        resp->pipe_pending -= bytes_out;
+        resp->body_remaining -= bytes_out;
+        count_sent(resp, bytes_out);
+    }
+    return 0;
+}
+
+
+// Copy body bytes through a stack buffer. Only bytes the socket accepted are
+// consumed, so a short write simply re-reads the rest on the next attempt.
+// Returns 0 once the body is sent, 1 if the socket would block or -1 on error
+static int send_body_copy(int fd, http_response_t *resp) {
+    char chunk[CHUNKSIZE];
+    while (resp->body_remaining > 0) {
+        size_t want = resp->body_remaining < CHUNKSIZE
+            ? resp->body_remaining : CHUNKSIZE;
+        ssize_t bytes_read = pread(resp->file_fd, chunk, want, resp->body_offset);
+        if (bytes_read == -1) {
+            if (errno == EINTR) { continue; }
+            perror("pread");
+            return -1;
+        }
+        if (bytes_read == 0) {
+            fprintf(stderr, "File was truncated while being sent\n");
+            return -1;
+        }
+
+        ssize_t bytes_written = send(fd, chunk, bytes_read, MSG_NOSIGNAL);
         if (bytes_written == -1) {
-            perror("fread");
-            if (fclose(file) == EOF) { perror("fclose"); }
+            if (errno == EINTR) { continue; }
+            if (would_block()) { return 1; }
+            perror("send");
             return -1;
         }
+        resp->body_offset += bytes_written;
+        resp->body_remaining -= bytes_written;
+        count_sent(resp, bytes_written);
+    }
+    return 0;
+}
+
+
+// Send a response whose body is in memory. The header and body go out
+// together, so a small response takes a single system call.
+// Returns 0 once the response is sent, 1 if the socket would block or -1 on error
+static int send_memory_response(int fd, http_response_t *resp) {
+    while (resp->header_sent < resp->header_len || resp->body_remaining > 0) {
+        struct iovec iov[2];
+        iov[0].iov_base = resp->header + resp->header_sent;
+        iov[0].iov_len = resp->header_len - resp->header_sent;
+        iov[1].iov_base = (char *) resp->body_data + resp->body_offset;
+        iov[1].iov_len = resp->body_remaining;
 
-        // Reset the offset after the first write - we only need to write the
-        // header once.
-        offset = 0;
-    } while (bytes_read > 0);
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
 
+        ssize_t bytes_written = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (bytes_written == -1) {
+            if (errno == EINTR) { continue; }
+            if (would_block()) { return 1; }
+            perror("sendmsg");
+            return -1;
+        }
+
+        size_t header_part = iov[0].iov_len < (size_t) bytes_written
+            ? iov[0].iov_len : (size_t) bytes_written;
+        resp->header_sent += header_part;
+        resp->body_offset += bytes_written - header_part;
+        resp->body_remaining -= bytes_written - header_part;
+        count_sent(resp, bytes_written);
+    }
     return 0;
 }
+
+
+// Send the header and body of the current part of a response.
+// Returns 0 once the part is sent, 1 if the socket would block or -1 on error
+static int send_response_part(int fd, http_response_t *resp) {
+    if (resp->body_data != NULL) {
+        return send_memory_response(fd, resp);
+    }
+
+    // Write whatever is left of the header. MSG_MORE lets the kernel put the
+    // header and the start of the body into the same segment.
+    int more = resp->body_remaining > 0 ||
+        (resp->n_ranges > 0 && resp->next_range <= resp->n_ranges);
+    int flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+    while (resp->header_sent < resp->header_len) {
+        ssize_t bytes_written = send(fd, resp->header + resp->header_sent,
+                resp->header_len - resp->header_sent, flags);
+        if (bytes_written == -1) {
+            if (errno == EINTR) { continue; }
+            if (would_block()) { return 1; }
+            perror("send");
+            return -1;
+        }
+        resp->header_sent += bytes_written;
+        count_sent(resp, bytes_written);
+    }
+
+    // A method that is not supported switches body_method and returns 0
+    // without finishing, in which case the next method takes over
+    int res = 0;
+    while (res == 0 && (resp->body_remaining > 0 || resp->pipe_pending > 0)) {
+        switch (resp->body_method) {
+        case BODY_SENDFILE: res = send_body_sendfile(fd, resp); break;
+        case BODY_SPLICE: res = send_body_splice(fd, resp); break;
+        default: res = send_body_copy(fd, resp); break;
+        }
+    }
+
+    return res;
+}
+
+
+int send_http_response(int fd, http_response_t *resp) {
+    int res;
+    do {
+        res = send_response_part(fd, resp);
+    } while (res == 0 && next_http_response_part(resp));
+    return res;
+}
+
+
+void release_http_response(http_response_t *resp) {
+    if (resp->cache_entry != NULL) {
+        file_cache_release(resp->cache_entry);
+        resp->cache_entry = NULL;
+        resp->body_data = NULL;
+    }
+    if (resp->mapping != NULL) {
+        file_map_release(resp->mapping);
+        resp->mapping = NULL;
+        resp->body_data = NULL;
+    }
+    if (resp->body_buffer != NULL) {
+        free(resp->body_buffer);
+        resp->body_buffer = NULL;
+        resp->body_data = NULL;
+    }
+    if (resp->file_fd != -1) {
+        close_body_file(resp);
+    }
+    for (int i = 0; i < 2; i++) {
+        if (resp->pipe_fds[i] != -1) {
+            if (close(resp->pipe_fds[i]) == -1) { perror("close"); }
+            resp->pipe_fds[i] = -1;
+        }
+    }
+}
+
+
+// Send a short response that ends the connection without blocking, then
+// discard what already arrived of the request, at most one buffer so that a
+// client that keeps sending cannot hold the caller, and signal the end of
+// the response.
+// Returns 0 on success or -1 on error
+static int send_final_response(int fd, const char *response, size_t len) {
+    // The response fits any socket's empty send buffer
+    if (send(fd, response, len, MSG_DONTWAIT | MSG_NOSIGNAL) == -1) {
+        return -1;
+    }
+    char discard[HTTP_REQUEST_MAX];
+    recv(fd, discard, sizeof(discard), MSG_DONTWAIT);
+    if (shutdown(fd, SHUT_WR) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+
+int drain_http_connection(int fd) {
+    char discard[HTTP_REQUEST_MAX];
+    for (int i = 0; i < HTTP_LINGER_READS; i++) {
+        ssize_t bytes_read = recv(fd, discard, sizeof(discard), MSG_DONTWAIT);
+        if (bytes_read == 0) {
+            return 1;
+        }
+        if (bytes_read == -1) {
+            if (errno == EINTR) { continue; }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : 1;
+        }
+    }
+    return 0;
+}
+
+
+int send_http_overload(int fd) {
+    static const char response[] = "HTTP/1.1 503 Service Unavailable\r\n"
+        "Content-Length: 0\r\nConnection: close\r\n"
+        "Retry-After: " HTTP_RETRY_AFTER "\r\n\r\n";
+    return send_final_response(fd, response, sizeof(response) - 1);
+}
+
+
+// Format the header of an error response, up to its Connection line.
+// Returns the length of the header
+static int format_error_header(char *header, int status) {
+    const char *reason;
+    switch (status) {
+    case 413: reason = "Content Too Large"; break;
+    case 414: reason = "URI Too Long"; break;
+    case 431: reason = "Request Header Fields Too Large"; break;
+    case 501: reason = "Not Implemented"; break;
+    case 505: reason = "HTTP Version Not Supported"; break;
+    default: status = 400; reason = "Bad Request"; break;
+    }
+    return snprintf(header, HTTP_HEADER_MAX, "HTTP/1.1 %d %s\r\nContent-Length: 0\r\n",
+            status, reason);
+}
+
+
+int send_http_error(int fd, int status) {
+    char response[HTTP_HEADER_MAX];
+    int len = format_error_header(response, status);
+    const char connection[] = "Connection: close\r\n\r\n";
+    memcpy(response + len, connection, sizeof(connection) - 1);
+    return send_final_response(fd, response, len + sizeof(connection) - 1);
+}
+
+
+void prepare_http_error_response(http_response_t *resp, int status) {
+    init_http_response(resp);
+    resp->header_len = format_error_header(resp->header, status);
+    finish_header(resp, 0);
+}
@@ -1,20 +1,247 @@
 #ifndef HTTP_H
 #define HTTP_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "blob_store.h"
+#include "file_cache.h"
+#include "file_map.h"
+#include "http_parser.h"
+#include "mime.h"
+#include "open_cache.h"
+
+#define HTTP_HEADER_MAX 1024
+#define HTTP_RANGES_MAX 8         // More ranges than this get the whole file
+#define HTTP_LINGER_MS 500        // How long a final response is lingered over
+#define HTTP_LINGER_READS 16      // Buffers discarded per wakeup while lingering
+
+// A byte range of the resource that is sent as (part of) a response body
+typedef struct {
+    off_t offset;
+    size_t length;
+} http_range_t;
+
+// Ways of moving the body from the file to the socket, from fastest to the
+// most widely supported. A response falls back to the next one if the kernel
+// rejects the current one for this particular file/socket pair.
+enum { BODY_SENDFILE, BODY_SPLICE, BODY_COPY };
+
+// Struct representing an HTTP response that is in the middle of being written
+// to a client socket. It records how far the header and body have been sent so
+// that writing can be resumed once a non-blocking socket is writable again.
+typedef struct {
+    char header[HTTP_HEADER_MAX];
+    size_t header_len;
+    size_t header_sent;
+    int file_fd;              // File the body is sent from, or -1 if no body
+    const char *body_data;    // Body held in memory instead of a file, or NULL
+    file_cache_entry_t *cache_entry;  // Cache entry that body_data belongs to
+    file_mapping_t *mapping;  // Mapped file that body_data belongs to
+    open_entry_t *open_entry; // Cached open file that file_fd belongs to, or NULL
+    off_t body_offset;        // Offset in file_fd of the next byte to send
+    size_t body_remaining;    // Body bytes not yet sent to the socket
+    int body_method;
+    int pipe_fds[2];          // Pipe used by the splice fallback, or -1
+    size_t pipe_pending;      // Bytes spliced into the pipe but not yet sent
+    http_range_t ranges[HTTP_RANGES_MAX];  // Parts of a multipart/byteranges body
+    int n_ranges;             // Number of parts, or 0 if the body is not multipart
+    int next_range;           // Part whose header is sent next
+    const char *content_type; // Content-Type of each part
+    size_t file_size;
+    char *body_buffer;        // Body allocated for this response alone, or NULL
+    int status;               // Status code, known once the response is prepared
+    size_t bytes_sent;        // Header and body bytes sent so far
+    uint64_t first_sent;      // When the first byte was sent, or 0
+} http_response_t;
+
 /*
  * Read an HTTP request from an active TCP connection socket
  * fd: The socket's file descriptor
- * resource_name: Set to the name of the requested resource on success
+ * buf: Bytes received on the connection but not consumed yet. Must have room
+ *      for HTTP_REQUEST_MAX bytes. Read data is appended here.
+ * buf_len: Number of valid bytes in buf, updated as data is read
+ * req: Set to the parsed request on success. The request occupies the first
+ *      req->length bytes of buf.
+ * Returns 0 on success, 1 if the client closed the connection, 2 if the request
+ * was malformed and answered with its error status, after which the connection
+ * must be closed, or -1 on I/O error. Only I/O errors are worth logging.
+ */
+int read_http_request(int fd, char *buf, size_t *buf_len, http_request_t *req);
+
+/*
+ * Turn a connection away because the server is overloaded: send a 503 with a
+ * Retry-After header without blocking, discard at most one buffer of the
+ * request that already arrived and shut down the sending side. Data the
+ * client sends later would still make closing the socket reset the
+ * connection before the client reads the response, so the caller should
+ * close it lingering: waiting up to HTTP_LINGER_MS for the client to close
+ * its end, and discarding what it sends with drain_http_connection meanwhile.
+ * fd: The socket's file descriptor, which the caller still has to close
+ * Returns 0 on success or -1 on error
+ */
+int send_http_overload(int fd);
+
+/*
+ * Answer a request that cannot be served, such as a malformed one, with its
+ * error status and Connection: close, in the same way as send_http_overload.
+ * fd: The socket's file descriptor, which the caller still has to close
+ * status: The status code, one the parser reports or 413, 400 if unknown
  * Returns 0 on success or -1 on error
  */
-int read_http_request(int fd, char *resource_name);
+int send_http_error(int fd, int status);
 
 /*
- * Write an HTTP response to an active TCP connection socket
+ * Discard what a client sent after a final response, without blocking, at
+ * most HTTP_LINGER_READS buffers at a time.
  * fd: The socket's file descriptor
+ * Returns 1 once the client closed its end or the connection failed, so that
+ * the socket can be closed, or 0 if the client may still send more
+ */
+int drain_http_connection(int fd);
+
+/*
+ * Prepare the response send_http_error sends, for callers that send it
+ * themselves. It holds no resources.
+ * resp: Pointer to the http_response_t to be initialized
+ * status: As for send_http_error
+ */
+void prepare_http_error_response(http_response_t *resp, int status);
+
+/*
+ * Serve small files from an in-memory cache, or pass NULL to disable caching.
+ * Must be called before any responses are prepared.
+ */
+void set_http_file_cache(file_cache_t *cache);
+
+/*
+ * Send files too large for the file cache from shared memory mappings instead
+ * of their file descriptors, or pass NULL to send them with sendfile. Must be
+ * called before any responses are prepared.
+ */
+void set_http_file_map(file_map_t *map);
+
+/*
+ * Reuse open files, their status and type across requests, or pass NULL to
+ * open every requested file. Must be called before any responses are prepared.
+ */
+void set_http_open_cache(open_cache_t *cache);
+
+/*
+ * Answer plain requests for the files rendered into a blob store with those
+ * responses, or pass NULL to disable them. Must be called before any
+ * responses are prepared.
+ */
+void set_http_blob_store(blob_store_t *store);
+
+/*
+ * Format the header of a 200 response whose body is the whole of a file, on a
+ * persistent connection.
+ * header: Buffer of HTTP_HEADER_MAX bytes receiving the header
+ * resource_path: The path to the file
+ * statbuf: Status of the file
+ * prefix_len: Set to the length of the header before its Connection line
+ * Returns the length of the header, or -1 if it does not fit
+ */
+int format_http_file_header(char *header, const char *resource_path,
+        const struct stat *statbuf, size_t *prefix_len);
+
+/*
+ * Initialize a response that holds no resources, so that it can safely be
+ * released before it is prepared.
+ */
+void init_http_response(http_response_t *resp);
+
+/*
+ * Prepare an HTTP response for the given resource without sending anything.
+ * A missing resource results in a 404 response rather than an error, a
+ * Range header in the request results in a 206 or 416 response and a
+ * conditional request for an unchanged resource in a 304 response. Text is
+ * compressed if the client accepts gzip or brotli. Requests for STATS_PATH
+ * and TRACE_PATH are answered with the server's statistics and slow requests.
+ * resp: Pointer to the http_response_t to be initialized
  * resource_path: The path to the requested resource in the server's file system
+ * req: The request being answered, or NULL to ignore its headers
+ * keep_alive: Whether the connection stays open after this response
  * Returns 0 on success or -1 on error
  */
-int write_http_response(int fd, const char *resource_path);
+int prepare_http_response(http_response_t *resp, const char *resource_path,
+        const http_request_t *req, int keep_alive);
+
+/*
+ * Prepare an HTTP response from memory alone. Cached files are checked against
+ * the file's status, which the open file cache keeps current if it is enabled.
+ * Otherwise that takes a stat, which each file is only checked with once per
+ * CACHE_REVALIDATE_MS (one second), and a file that changed may be served for
+ * that long. Statistics and slow requests are served from memory too.
+ * resp: Pointer to the http_response_t to be initialized
+ * resource_path: The path to the requested resource in the server's file system
+ * req: The request being answered, or NULL to ignore its headers
+ * keep_alive: Whether the connection stays open after this response
+ * Returns 1 if the resource was cached and resp is ready, or 0 otherwise
+ */
+int prepare_cached_http_response(http_response_t *resp, const char *resource_path,
+        const http_request_t *req, int keep_alive);
+
+/*
+ * Returns 1 if the request carries If-None-Match or If-Modified-Since
+ * validators, which a 304 response may answer, or 0 otherwise
+ */
+int is_conditional_http_request(const http_request_t *req);
+
+/*
+ * Answer a conditional request from the status of the resource alone, so that
+ * a client whose copy is still current gets a 304 without the file being
+ * opened.
+ * resp: Pointer to the http_response_t to be initialized
+ * resource_path: The path to the requested resource in the server's file system
+ * statbuf: The status of the resource, which must be a regular file
+ * req: The conditional request being answered
+ * keep_alive: Whether the connection stays open after this response
+ * Returns 1 if resp now holds a 304 response, or 0 if the resource has to be
+ * sent in full
+ */
+int prepare_not_modified_http_response(http_response_t *resp, const char *resource_path,
+        const struct stat *statbuf, const http_request_t *req, int keep_alive);
+
+/*
+ * Prepare an HTTP response for a resource the caller has already opened and
+ * examined, for instance through asynchronous system calls. A resource that
+ * could not be opened or is a directory results in a 404 response.
+ * resp: Pointer to the http_response_t to be initialized
+ * resource_path: The path to the requested resource in the server's file system
+ * file_fd: The opened resource, or -1. The response takes ownership of it.
+ * statbuf: The status of the opened resource, or NULL if it is unknown
+ * req: The request being answered, or NULL to ignore its headers
+ * keep_alive: Whether the connection stays open after this response
+ * Returns 0 on success or -1 on error
+ */
+int prepare_http_file_response(http_response_t *resp, const char *resource_path,
+        int file_fd, const struct stat *statbuf, const http_request_t *req,
+        int keep_alive);
+
+/*
+ * Send as much of a prepared HTTP response as the socket accepts.
+ * fd: The socket's file descriptor, which may be non-blocking
+ * resp: The response prepared by prepare_http_response
+ * Returns 0 once the whole response is sent, 1 if the socket would block, or
+ * -1 on error
+ */
+int send_http_response(int fd, http_response_t *resp);
+
+/*
+ * Move on to the next part of a multipart response once the current part has
+ * been sent, placing the part's header in resp->header and its range in
+ * body_offset and body_remaining. send_http_response does this by itself.
+ * Returns 1 if another part was started, or 0 if the response is complete
+ */
+int next_http_response_part(http_response_t *resp);
+
+/*
+ * Release any resources (such as open files) held by a prepared response.
+ */
+void release_http_response(http_response_t *resp);
 
 #endif // HTTP_H
@@ -0,0 +1,347 @@
+#include <string.h>
+#include <strings.h>
+
+#include "http_parser.h"
+
+enum {
+    S_METHOD,
+    S_TARGET,
+    S_VERSION,
+    S_REQUEST_LINE_LF,
+    S_HEADER_START,
+    S_HEADER_NAME,
+    S_VALUE_START,
+    S_VALUE,
+    S_HEADER_LF,
+    S_END_LF
+};
+
+// Characters allowed in methods and header names (RFC 9110 tchar)
+static const unsigned char token_chars[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 0, 1, 1, 1, 1, 1, 0, 0, 1, 1, 0, 1, 1, 0,   //  !"#$%&'()*+,-./
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,   // 0-9 :;<=>?
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,   // @A-O
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 1,   // P-Z [\]^_
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,   // `a-o
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0,   // p-z {|}~
+};
+
+
+void init_http_parser(http_parser_t *parser) {
+    parser->state = S_METHOD;
+    parser->offset = 0;
+    parser->token_start = 0;
+    parser->error = 0;
+}
+
+
+static int fail(http_parser_t *parser, int status) {
+    parser->error = status;
+    return -1;
+}
+
+
+static http_slice_t slice(const char *buf, size_t start, size_t end) {
+    http_slice_t s = { buf + start, end - start };
+    return s;
+}
+
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') { return c - '0'; }
+    if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
+    if (c >= 'A' && c <= 'F') { return c - 'A' + 10; }
+    return -1;
+}
+
+
+// Decode the target into the path of the resource, which is appended to the
+// served directory. It has to start with '/', and neither a ".." segment nor
+// a NUL byte may appear once it is decoded, so it never leads outside.
+// Returns 0 on success or -1 if the target is refused
+static int decode_target(http_parser_t *parser, http_request_t *req) {
+    const char *target = req->target.data;
+    size_t len = req->target.len;
+    if (target[0] != '/') {
+        return fail(parser, 400);
+    }
+    char *out = req->resource_name;
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = target[i];
+        if (c == '?' || c == '#') {
+            break; // The query and fragment do not name the file
+        }
+        if (c == '%') {
+            int high = i + 2 < len ? hex_value(target[i + 1]) : -1;
+            int low = i + 2 < len ? hex_value(target[i + 2]) : -1;
+            if (high == -1 || low == -1 || (high == 0 && low == 0)) {
+                return fail(parser, 400);
+            }
+            c = (char) (high << 4 | low);
+            i += 2;
+        }
+        out[n++] = c;
+    }
+    out[n] = '\0';
+
+    for (const char *segment = out; segment != NULL; segment = strchr(segment + 1, '/')) {
+        if (segment[1] == '.' && segment[2] == '.' && (segment[3] == '/' || segment[3] == '\0')) {
+            return fail(parser, 400);
+        }
+    }
+    return 0;
+}
+
+
+// The request line's version must be HTTP/1.x
+static int parse_version(http_parser_t *parser, const char *version, size_t len,
+        http_request_t *req) {
+    if (len != 8 || memcmp(version, "HTTP/", 5) != 0) {
+        return fail(parser, 400);
+    }
+    if (version[5] != '1' || version[6] != '.' || version[7] < '0' || version[7] > '9') {
+        return fail(parser, 505);
+    }
+    req->minor_version = version[7] - '0';
+    return 0;
+}
+
+
+// Returns 1 if a slice holds exactly the given string, or 0 otherwise
+static int slice_is(const http_slice_t *s, const char *str) {
+    size_t len = strlen(str);
+    return s->len == len && memcmp(s->data, str, len) == 0;
+}
+
+
+// Returns 1 if a Content-Length value is a valid length of zero, 0 if it is
+// a valid non-zero length, or -1 if it is not a number
+static int is_zero_length(const http_slice_t *value) {
+    if (value->len == 0) {
+        return -1;
+    }
+    int zero = 1;
+    for (size_t i = 0; i < value->len; i++) {
+        if (value->data[i] < '0' || value->data[i] > '9') {
+            return -1;
+        }
+        zero = zero && value->data[i] == '0';
+    }
+    return zero;
+}
+
+
+// The header is complete -- settle what depends on the headers as a whole.
+// Methods other than GET and HEAD and requests with a body are refused:
+// without reading the body, it would be taken for the next request.
+// Returns 0 on success or -1 if the request is refused
+static int finish_request(http_parser_t *parser, http_request_t *req) {
+    req->length = parser->offset;
+    if (slice_is(&req->method, "GET")) {
+        req->head = 0;
+    } else if (slice_is(&req->method, "HEAD")) {
+        req->head = 1;
+    } else {
+        return fail(parser, 501);
+    }
+
+    // HTTP/1.1 connections are persistent unless the client says otherwise,
+    // HTTP/1.0 connections only if the client asks for it
+    req->keep_alive = req->minor_version >= 1;
+    for (int i = 0; i < req->n_headers; i++) {
+        http_header_t *header = &req->headers[i];
+        if (header->name.len == 17 &&
+                strncasecmp(header->name.data, "Transfer-Encoding", 17) == 0) {
+            return fail(parser, 501);
+        }
+        if (header->name.len == 14 &&
+                strncasecmp(header->name.data, "Content-Length", 14) == 0) {
+            int zero = is_zero_length(&header->value);
+            if (zero != 1) { return fail(parser, zero == 0 ? 413 : 400); }
+            continue;
+        }
+        if (header->name.len != 10 || strncasecmp(header->name.data, "Connection", 10) != 0) {
+            continue;
+        }
+        if (http_header_has_token(&header->value, "close")) {
+            req->keep_alive = 0;
+        } else if (http_header_has_token(&header->value, "keep-alive")) {
+            req->keep_alive = 1;
+        }
+    }
+    return 0;
+}
+
+
+int parse_http_request(http_parser_t *parser, const char *buf, size_t len,
+        http_request_t *req) {
+    size_t i = parser->offset;
+    if (i == 0 && parser->state == S_METHOD) {
+        req->n_headers = 0;
+    }
+
+    while (i < len) {
+        unsigned char c = buf[i];
+        switch (parser->state) {
+        case S_METHOD:
+            // Tolerate empty lines before the request line
+            if (i == parser->token_start && (c == '\r' || c == '\n')) {
+                parser->token_start = ++i;
+                break;
+            }
+            if (c == ' ') {
+                if (i == parser->token_start) { return fail(parser, 400); }
+                req->method = slice(buf, parser->token_start, i);
+                parser->token_start = ++i;
+                parser->state = S_TARGET;
+                break;
+            }
+            if (!token_chars[c]) { return fail(parser, 400); }
+            if (i - parser->token_start >= HTTP_METHOD_MAX) { return fail(parser, 501); }
+            i++;
+            break;
+
+        case S_TARGET: {
+            const char *space = memchr(buf + i, ' ', len - i);
+            size_t end = space != NULL ? (size_t) (space - buf) : len;
+            // A target can't contain control characters, which also keeps a
+            // request line without a version from swallowing the header
+            for (; i < end; i++) {
+                if ((unsigned char) buf[i] < 0x21 || buf[i] == 0x7f) {
+                    return fail(parser, 400);
+                }
+            }
+            if (i - parser->token_start >= HTTP_RESOURCE_MAX) { return fail(parser, 414); }
+            if (space == NULL) { break; }
+            if (i == parser->token_start) { return fail(parser, 400); }
+            req->target = slice(buf, parser->token_start, i);
+            if (decode_target(parser, req) == -1) { return -1; }
+            parser->token_start = ++i;
+            parser->state = S_VERSION;
+            break;
+        }
+
+        case S_VERSION:
+            if (c == '\r' || c == '\n') {
+                if (parse_version(parser, buf + parser->token_start,
+                            i - parser->token_start, req) == -1) {
+                    return -1;
+                }
+                parser->state = c == '\r' ? S_REQUEST_LINE_LF : S_HEADER_START;
+            } else if (i - parser->token_start >= 8) {
+                return fail(parser, 400);
+            }
+            i++;
+            break;
+
+        case S_REQUEST_LINE_LF:
+        case S_HEADER_LF:
+            if (c != '\n') { return fail(parser, 400); }
+            parser->state = S_HEADER_START;
+            i++;
+            break;
+
+        case S_HEADER_START:
+            if (c == '\r') {
+                parser->state = S_END_LF;
+                i++;
+                break;
+            }
+            if (c == '\n') {
+                parser->offset = i + 1;
+                return finish_request(parser, req);
+            }
+            // Obsolete line folding is not supported
+            if (c == ' ' || c == '\t') { return fail(parser, 400); }
+            if (req->n_headers == HTTP_HEADERS_MAX) { return fail(parser, 431); }
+            parser->token_start = i;
+            parser->state = S_HEADER_NAME;
+            break;
+
+        case S_HEADER_NAME:
+            if (c == ':') {
+                if (i == parser->token_start) { return fail(parser, 400); }
+                req->headers[req->n_headers].name = slice(buf, parser->token_start, i);
+                parser->state = S_VALUE_START;
+                i++;
+                break;
+            }
+            if (!token_chars[c]) { return fail(parser, 400); }
+            i++;
+            break;
+
+        case S_VALUE_START:
+            if (c == ' ' || c == '\t') {
+                i++;
+                break;
+            }
+            parser->token_start = i;
+            parser->state = S_VALUE;
+            break;
+
+        case S_VALUE: {
+            const char *lf = memchr(buf + i, '\n', len - i);
+            if (lf == NULL) {
+                i = len;
+                break;
+            }
+            size_t end = lf - buf;
+            i = end + 1;
+            if (end > parser->token_start && buf[end - 1] == '\r') { end--; }
+            while (end > parser->token_start && (buf[end - 1] == ' ' || buf[end - 1] == '\t')) {
+                end--;
+            }
+            req->headers[req->n_headers++].value = slice(buf, parser->token_start, end);
+            parser->state = S_HEADER_START;
+            break;
+        }
+
+        case S_END_LF:
+            if (c != '\n') { return fail(parser, 400); }
+            parser->offset = i + 1;
+            return finish_request(parser, req);
+        }
+    }
+
+    parser->offset = i;
+    if (len >= HTTP_REQUEST_MAX) {
+        // The request does not fit the connection's buffer
+        return fail(parser, 431);
+    }
+    return 1;
+}
+
+
+const http_slice_t *find_http_header(const http_request_t *req, const char *name) {
+    size_t name_len = strlen(name);
+    for (int i = 0; i < req->n_headers; i++) {
+        const http_header_t *header = &req->headers[i];
+        if (header->name.len == name_len &&
+                strncasecmp(header->name.data, name, name_len) == 0) {
+            return &header->value;
+        }
+    }
+    return NULL;
+}
+
+
+int http_header_has_token(const http_slice_t *value, const char *token) {
+    size_t token_len = strlen(token);
+    const char *s = value->data;
+    size_t len = value->len;
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && (s[i] == ' ' || s[i] == '\t' || s[i] == ',')) { i++; }
+        size_t start = i;
+        while (i < len && s[i] != ',') { i++; }
+        size_t end = i;
+        while (end > start && (s[end - 1] == ' ' || s[end - 1] == '\t')) { end--; }
+        if (end - start == token_len && strncasecmp(s + start, token, token_len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
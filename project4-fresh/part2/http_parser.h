@@ -0,0 +1,79 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <stddef.h>
+
+#define HTTP_REQUEST_MAX 4096
+#define HTTP_RESOURCE_MAX 512
+#define HTTP_METHOD_MAX 16
+#define HTTP_HEADERS_MAX 32
+
+// A run of bytes inside the buffer a request was parsed from. Slices are not
+// NUL-terminated and are only valid while that buffer is left untouched.
+typedef struct {
+    const char *data;
+    size_t len;
+} http_slice_t;
+
+typedef struct {
+    http_slice_t name;
+    http_slice_t value;       // Without surrounding whitespace
+} http_header_t;
+
+// Struct representing a parsed HTTP request
+typedef struct {
+    http_slice_t method;
+    http_slice_t target;
+    char resource_name[HTTP_RESOURCE_MAX];  // The target's path, decoded and NUL-terminated
+    int minor_version;        // 0 for HTTP/1.0, 1 for HTTP/1.1
+    http_header_t headers[HTTP_HEADERS_MAX];
+    int n_headers;
+    int keep_alive;           // 1 if the connection may be reused afterwards
+    int head;                 // 1 for HEAD, which is answered without a body
+    size_t length;            // Bytes of the request, including the header
+} http_request_t;
+
+// Struct representing the progress of parsing one request. Parsing resumes
+// where it stopped when more of the request arrives, so every byte is only
+// examined once no matter how the request was split across reads.
+typedef struct {
+    int state;
+    size_t offset;            // Bytes of the buffer parsed so far
+    size_t token_start;       // Offset of the token being parsed
+    int error;                // HTTP status code describing a parse error
+} http_parser_t;
+
+/*
+ * Prepare a parser for a new request, which starts at the beginning of the
+ * buffer passed to parse_http_request.
+ */
+void init_http_parser(http_parser_t *parser);
+
+/*
+ * Parse as much of an HTTP request as has been received into a buffer.
+ * parser: The parser state, initialized with init_http_parser
+ * buf: The bytes received from the client so far. Must be the same buffer,
+ *      holding the same bytes plus any new ones, on every call for a request.
+ * len: Number of valid bytes in buf
+ * req: Filled in as the request is parsed. Its slices point into buf.
+ * Returns 0 once the request is complete, 1 if more bytes are needed, or -1
+ * if the request is malformed or exceeds a limit, in which case
+ * parser->error holds the matching HTTP status code. Only GET and HEAD
+ * requests without a body are accepted, since nothing here reads a body.
+ */
+int parse_http_request(http_parser_t *parser, const char *buf, size_t len,
+        http_request_t *req);
+
+/*
+ * Look up a request header by name, ignoring case.
+ * Returns the first header's value, or NULL if the request has no such header
+ */
+const http_slice_t *find_http_header(const http_request_t *req, const char *name);
+
+/*
+ * Returns 1 if the comma-separated header value contains 'token', ignoring
+ * case, or 0 otherwise
+ */
+int http_header_has_token(const http_slice_t *value, const char *token);
+
+#endif // HTTP_PARSER_H
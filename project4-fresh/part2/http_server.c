@@ -1,216 +1,1083 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "access_log.h"
+#include "blob_store.h"
 #include "connection_queue.h"
+#include "event_loop.h"
+#include "file_cache.h"
+#include "file_map.h"
 #include "http.h"
+#include "io_pool.h"
+#include "keepalive.h"
+#include "mime.h"
+#include "open_cache.h"
+#include "stats.h"
+#include "trace.h"
+#include "uring_loop.h"
+#include "worker_queues.h"
 
 #define BUFSIZE 512
-#define LISTEN_QUEUE_LEN 5
+#define LISTEN_QUEUE_LEN 4096 // capped by the kernel at net.core.somaxconn
 #define N_THREADS 5
+#define IDLE_TIMEOUT_SECS 5
+#define HEADER_TIMEOUT_SECS 10
+#define SEND_TIMEOUT_SECS 30
+#define MAX_REQUESTS 100
+#define CACHE_MB 64
+#define CACHE_MAX_FILE_KB 1024
+#define RETIRE_SECS 30
+#define DEFER_ACCEPT_SECS 1       // How long the kernel holds back a silent connection
+#define SCALE_INTERVAL_MS 100     // How often a pool reconsiders its size
+#define SCALE_UP_WAIT_MS 10       // Queue wait that counts as pressure
+#define SCALE_UP_INTERVALS 3      // Intervals of pressure before workers are added
 
-int keep_going = 1;
+enum { MODE_POOL, MODE_EPOLL, MODE_URING };
+enum { WORKER_UNUSED, WORKER_RUNNING, WORKER_EXITED };
+
+// Cleared by the SIGINT handler and polled by every thread. A lock-free atomic
+// store is async-signal-safe, and the threads load it without a data race.
+volatile _Atomic sig_atomic_t keep_going = 1;
 const char *serve_dir;
-connection_queue_t queue;
+int idle_timeout_ms = IDLE_TIMEOUT_SECS * 1000;
+int header_timeout_ms = HEADER_TIMEOUT_SECS * 1000;
+int send_timeout_ms = SEND_TIMEOUT_SECS * 1000;
+int max_requests = MAX_REQUESTS;
+int admission = ADMIT_REJECT;
+long admit_target_ms = ADMIT_TARGET_MS;
+int retire_secs = RETIRE_SECS;
+file_cache_t file_cache;
+file_map_t file_map;
+open_cache_t open_cache;
+blob_store_t blob_store;
+
+
+// Struct representing a worker thread of the pool
+typedef struct worker_group worker_group_t;
+typedef struct {
+    worker_group_t *group;
+    int id;                   // Index of the worker inside its group
+    atomic_int state;         // One of the WORKER_* values
+    pthread_t thread;
+} worker_t;
+
+// Struct representing a group of the worker pool: a listening socket, the
+// queues its connections are dispatched to, the keepalive set of its idle
+// connections and the workers serving them. Groups share nothing, so with one
+// SO_REUSEPORT listener per group each group accepts and serves on its own.
+// A group may grow from its minimum to its maximum number of workers while
+// its queue backs up, and shrink again once workers have been idle for a while.
+struct worker_group {
+    int index;
+    int listen_fd;
+    worker_queues_t queues;
+    keepalive_t keepalive;
+    pthread_t keepalive_thread;
+    pthread_t acceptor;       // Unused by the first group, the main thread accepts
+    worker_t *workers;        // max_workers slots
+    int min_workers;
+    int max_workers;
+    atomic_int n_live;        // Running workers that were not asked to exit
+    atomic_int peak;          // Most workers live at once
+    atomic_long spawned;      // Workers added while scaling up
+    atomic_long retired;      // Workers asked to exit while scaling down
+    pthread_t scaler;         // Resizes the group if min_workers < max_workers
+    atomic_int scaling;
+    _Alignas(CACHE_LINE) atomic_int n_busy;  // Workers serving a connection
+};
 
 
 void handle_sigint(int signo) {
-    keep_going = 0;
+    atomic_store_explicit(&keep_going, 0, memory_order_relaxed);
 }
 
 
-void *thread_func() {
+// Close a connection that was sent a final response once the client read
+// it, in the keepalive set rather than on the calling thread
+void linger(worker_group_t *group, int client_fd) {
+    if (keepalive_linger(&group->keepalive, client_fd) == -1 &&
+            close(client_fd) == -1) {
+        perror("close");
+    }
+}
+
 
-    int err_val = -1;
-    void *err_res = (void*)(&err_val);
+// Serve requests on a connection until it is closed, or parked in the
+// keepalive set to wait for its next request without holding this worker
+// dequeued: When the worker took the connection out of its queue
+void serve_connection(worker_t *worker, const queued_connection_t *conn, uint64_t dequeued) {
+    worker_group_t *group = worker->group;
+    int client_fd = conn->fd;
+    char buf[HTTP_REQUEST_MAX];
+    size_t buf_len = 0;
+    int requests_served = keepalive_requests_served(&group->keepalive, client_fd);
+
+    // Only the first request served waited in the queue, the ones pipelined
+    // behind it did not
+    request_timing_t timing;
+    memset(&timing, 0, sizeof(request_timing_t));
+    stats_connection_times(client_fd, &timing);
+    timing.dequeued = dequeued;
 
     while (1) {
+        // read data from client. A client trickling its request in cannot
+        // hold the worker for longer than the header timeout.
+        if (keepalive_watch(&group->keepalive, worker->id, client_fd, header_timeout_ms, 0) == -1) { break; }
+        http_request_t req;
+        timing.start = stats_now();
+        int res = read_http_request(client_fd, buf, &buf_len, &req);
+        if (res == 2) {
+            // Answered with an error, which the client should get to read
+            keepalive_unwatch(&group->keepalive, worker->id);
+            linger(group, client_fd);
+            return;
+        }
+        if (res != 0) {
+            if (res == -1) { fprintf(stderr, "Error reading http request\n"); }
+            break;
+        }
+        timing.parsed = stats_now();
+        if (keepalive_watch(&group->keepalive, worker->id, client_fd, send_timeout_ms, 1) == -1) { break; }
+        requests_served++;
+        int keep_alive = req.keep_alive && idle_timeout_ms > 0 &&
+            requests_served < max_requests &&
+            atomic_load_explicit(&keep_going, memory_order_relaxed);
+
+        // get resource path from resource name
+        int dir_len = strlen(serve_dir);
+        char resource_path[dir_len+HTTP_RESOURCE_MAX];
+        strcpy(resource_path, serve_dir);
+        strcat(resource_path, req.resource_name);
 
-        int client_fd = connection_dequeue(&queue);
-        if (client_fd == -1) { 
-            if (!keep_going) { break; }
-            return NULL;
+        http_response_t resp;
+        if (prepare_http_response(&resp, resource_path, &req, keep_alive) == -1)
+            { fprintf(stderr, "Error writing http response\n"); break; }
+        timing.prepared = stats_now();
+        res = send_http_response(client_fd, &resp);
+        timing.first_byte = resp.first_sent;
+        if (res == 0) {
+            stats_request_done(&timing, resp.status, resp.bytes_sent);
+            trace_request(&timing, req.resource_name, resp.status, resp.bytes_sent);
+            access_log_request(&conn->client, &req, &timing, resp.status, resp.bytes_sent);
         }
+        stats_request_reset(&timing);
+        release_http_response(&resp);
+        if (res != 0) { fprintf(stderr, "Error writing http response\n"); break; }
 
-        // read data from client 
-        char resource_name[BUFSIZE]; 
-        memset(resource_name, 0, BUFSIZE);
+        if (!keep_alive) { break; }
 
-        if (read_http_request(client_fd, resource_name) == -1) { 
-            if (!keep_going) { break; }
-            fprintf(stderr, "Error reading http request\n"); 
-            close(client_fd); 
-            return err_res; 
+        // Drop the answered request, keeping anything pipelined behind it.
+        // A pipelined request is served right away, otherwise the connection
+        // waits for its next request in the keepalive set.
+        buf_len -= req.length;
+        memmove(buf, buf + req.length, buf_len);
+        if (buf_len == 0) {
+            keepalive_unwatch(&group->keepalive, worker->id);
+            if (keepalive_park(&group->keepalive, conn, requests_served) == 0) { return; }
+            break;
         }
+    }
 
-        // get resource path from resource name
-        int dir_len = strlen(serve_dir);
-        char resource_path[dir_len+BUFSIZE];
-        memset(resource_path, 0, BUFSIZE);
-        strcpy(resource_path, serve_dir); 
-        strcat(resource_path, resource_name);
+    // cleanup
+    keepalive_unwatch(&group->keepalive, worker->id);
+    if (close(client_fd) == -1) { perror("close"); }
+}
 
-        if (write_http_response(client_fd, resource_path) == -1)
-            { fprintf(stderr, "Error writing http response\n"); close(client_fd); return err_res; }
 
-        // cleanup 
-        int close_result = close(client_fd);
-        if (close_result == -1) { fprintf(stderr, "close failed: %s\n", strerror(close_result)); perror("close"); return err_res; }
+// Answer a connection the workers cannot take on with a 503 and close it
+void turn_away(worker_group_t *group, int client_fd) {
+    stats_shed();
+    if (send_http_overload(client_fd) == 0) {
+        linger(group, client_fd);
+    } else if (close(client_fd) == -1) {
+        perror("close");
     }
+}
+
+
+void *thread_func(void *arg) {
+    worker_t *worker = arg;
+    worker_group_t *group = worker->group;
+    char name[STATS_NAME_MAX];
+    snprintf(name, sizeof(name), "worker %d.%d", group->index, worker->id);
+    stats_set_thread_name(name);
+    // A fixed-size group never needs to know how many workers are busy
+    int count_busy = group->min_workers < group->max_workers;
 
+    while (1) {
+        queued_connection_t conn;
+        if (worker_queues_pop(&group->queues, worker->id, &conn) != 0) {
+            break;
+        }
+        if (worker_queues_expired(&group->queues, conn.fd)) {
+            keepalive_requests_served(&group->keepalive, conn.fd);
+            turn_away(group, conn.fd);
+            continue;
+        }
+        if (count_busy) { atomic_fetch_add(&group->n_busy, 1); }
+        uint64_t start = stats_now();
+        serve_connection(worker, &conn, start);
+        stats_busy(stats_now() - start);
+        if (count_busy) { atomic_fetch_sub(&group->n_busy, 1); }
+    }
+
+    // Leave the per-thread buffers to the next worker started
+    stats_thread_exit();
+    trace_thread_exit();
+    access_log_thread_exit();
+    atomic_store(&worker->state, WORKER_EXITED);
     return NULL;
 }
 
 
-
-int main(int argc, char **argv) {
-    // First command is directory to serve, second command is port
-    if (argc != 3) {
-        printf("Usage: %s <directory> <port>\n", argv[0]);
-        return 1;
+// Start a worker in a free slot of its group
+// Returns 0 on success or -1 on error
+int spawn_worker(worker_group_t *group) {
+    for (int i = 0; i < group->max_workers; i++) {
+        worker_t *worker = &group->workers[i];
+        if (atomic_load(&worker->state) != WORKER_UNUSED) { continue; }
+        atomic_store(&worker->state, WORKER_RUNNING);
+        int create_result = pthread_create(&worker->thread, NULL, thread_func, worker);
+        if (create_result != 0) {
+            fprintf(stderr, "pthread_create failed: %s\n", strerror(create_result));
+            atomic_store(&worker->state, WORKER_UNUSED);
+            return -1;
+        }
+        int live = atomic_fetch_add(&group->n_live, 1) + 1;
+        if (live > atomic_load(&group->peak)) { atomic_store(&group->peak, live); }
+        return 0;
     }
+    return -1;
+}
 
-    serve_dir = argv[1];
-    const char *port = argv[2];
 
-    // Catch SIGINT so we can clean up properly
-    struct sigaction sigact;
-    sigact.sa_handler = handle_sigint;
-    sigfillset(&sigact.sa_mask);
-    sigact.sa_flags = 0; // Note the lack of SA_RESTART
-    if (sigaction(SIGINT, &sigact, NULL) == -1) {
-        perror("sigaction");
-        return 1;
+// Join the workers of a group that exited, freeing their slots
+// Returns 0 on success or -1 on error
+int reap_workers(worker_group_t *group) {
+    int ret_val = 0;
+    for (int i = 0; i < group->max_workers; i++) {
+        worker_t *worker = &group->workers[i];
+        if (atomic_load(&worker->state) != WORKER_EXITED) { continue; }
+        int join_result = pthread_join(worker->thread, NULL);
+        if (join_result != 0) {
+            fprintf(stderr, "pthread_join failed: %s\n", strerror(join_result));
+            ret_val = -1;
+        }
+        atomic_store(&worker->state, WORKER_UNUSED);
     }
+    return ret_val;
+}
 
-    // Set up hints - we'll take either IPv4 or IPv6, TCP socket type
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE; // server
-    struct addrinfo *server;
 
-    // Set up address info for socket() and connect()
-    int ret_val = getaddrinfo(NULL, port, &hints, &server);
-    if (ret_val != 0) {
-        fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(ret_val));
-        return 1;
+// Resize a group's pool until the group is stopped. Every interval, the queue
+// counts as backed up if a connection waited longer than SCALE_UP_WAIT_MS or
+// connections wait while every worker is busy. Once that lasted for
+// SCALE_UP_INTERVALS, the pool grows by the number of connections waiting, up
+// to doubling it. Once some worker stayed idle for retire_secs, one worker is
+// retired per interval for as long as that remains so.
+void *scaler_func(void *arg) {
+    worker_group_t *group = arg;
+    char name[STATS_NAME_MAX];
+    snprintf(name, sizeof(name), "scaler %d", group->index);
+    stats_set_thread_name(name);
+
+    int pressured = 0;        // Consecutive intervals the queue backed up
+    int idle = 0;             // Consecutive intervals with an idle worker
+    int retire_intervals = retire_secs * 1000 / SCALE_INTERVAL_MS;
+    struct timespec interval = { 0, SCALE_INTERVAL_MS * 1000000L };
+    while (atomic_load(&group->scaling)) {
+        nanosleep(&interval, NULL);
+        reap_workers(group);
+
+        size_t depth = worker_queues_depth(&group->queues);
+        uint64_t wait = worker_queues_sample_wait(&group->queues);
+        int live = atomic_load(&group->n_live);
+        int busy = atomic_load(&group->n_busy);
+        if (wait > (uint64_t) SCALE_UP_WAIT_MS * 1000000 || (depth > 0 && busy >= live)) {
+            pressured++;
+            idle = 0;
+        } else if (depth == 0 && busy < live) {
+            idle++;
+            pressured = 0;
+        } else {
+            pressured = 0;
+            idle = 0;
+        }
+
+        if (pressured >= SCALE_UP_INTERVALS && live < group->max_workers) {
+            size_t want = depth == 0 ? 1 : depth;
+            int n = want < (size_t) live ? (int) want : live;
+            for (int i = 0; i < n && live + i < group->max_workers; i++) {
+                if (spawn_worker(group) == -1) { break; }
+                atomic_fetch_add(&group->spawned, 1);
+            }
+            pressured = 0;
+        } else if (idle >= retire_intervals && live > group->min_workers) {
+            if (worker_queues_retire(&group->queues) == 0) {
+                atomic_fetch_sub(&group->n_live, 1);
+                atomic_fetch_add(&group->retired, 1);
+            }
+        }
     }
+    return NULL;
+}
+
+
+void usage(const char *prog) {
+    printf("Usage: %s [-m pool|epoll|uring] [-t threads] [-g groups] [-b backlog]\n"
+           "       [-q queue_capacity] [-s shared|rr|least] [-k idle_secs]\n"
+           "       [-H header_secs] [-W send_secs] [-r max_requests] [-c cache_mb]\n"
+           "       [-C cache_max_file_kb] [-S slow_ms] [-l access_log]\n"
+           "       [-a block|reject|codel] [-w target_ms] [-T max_threads]\n"
+           "       [-I retire_secs] [-o io_threads] [-M mapped_files] [-F open_files]\n"
+           "       [-x mime_types] [-P prerender_kb]\n"
+           "       <directory> <port>\n", prog);
+    printf("  -m  serving model: a pool of blocking worker threads fed by a\n"
+           "      connection queue (default), non-blocking epoll event loops, or\n"
+           "      io_uring event loops that submit all I/O asynchronously\n");
+    printf("  -t  number of worker threads or event loops (default %d); with -T, the\n"
+           "      number of workers the pool starts with and never goes below\n",
+           N_THREADS);
+    printf("  -g  number of SO_REUSEPORT listening sockets; the threads are split\n"
+           "      into this many groups that accept and serve independently\n"
+           "      (default 1, a single listening socket)\n");
+    printf("  -b  backlog of pending connections per listening socket (default %d)\n",
+           LISTEN_QUEUE_LEN);
+    printf("  -q  capacity of the connection queue, rounded up to a power of two\n"
+           "      (default %d)\n", CAPACITY);
+    printf("  -s  how the pool's connections are queued: one queue shared by all\n"
+           "      workers (default), or a queue per worker filled round-robin or\n"
+           "      least-loaded first, with idle workers stealing from busy ones\n");
+    printf("  -k  seconds a persistent connection may stay idle, 0 disables\n"
+           "      persistent connections (default %d)\n", IDLE_TIMEOUT_SECS);
+    printf("  -H  seconds a client may take to send a request, counted from when it\n"
+           "      connects or the request starts arriving (default %d)\n",
+           HEADER_TIMEOUT_SECS);
+    printf("  -W  seconds a response may go without the client taking any of it\n"
+           "      (default %d)\n", SEND_TIMEOUT_SECS);
+    printf("  -r  requests served on a connection before closing it (default %d)\n",
+           MAX_REQUESTS);
+    printf("  -c  megabytes of small files kept in memory, 0 disables the file\n"
+           "      cache (default %d)\n", CACHE_MB);
+    printf("  -C  kilobytes above which files are streamed instead of cached\n"
+           "      (default %d)\n", CACHE_MAX_FILE_KB);
+    printf("  -S  milliseconds from which a request counts as slow; the phases of\n"
+           "      slow requests are listed at " TRACE_PATH " (default %d) and with\n"
+           "      this option a sample of them is also written to stderr, 0 disables\n"
+           "      tracing\n", TRACE_THRESHOLD_MS);
+    printf("  -l  file that a line per request is appended to, - for stdout; lines\n"
+           "      are written by a thread of their own (default no access log)\n");
+    printf("  -a  what the pool does with new connections its workers cannot keep\n"
+           "      up with: block accepting until the queue has room, answer 503\n"
+           "      while the queue is full (default), or also answer 503 to\n"
+           "      connections that waited too long, see -w\n");
+    printf("  -w  with -a codel, milliseconds a connection may wait once the queue\n"
+           "      has not been empty for %d ms; until then it may wait that long\n"
+           "      (default %d)\n", ADMIT_INTERVAL_MS, ADMIT_TARGET_MS);
+    printf("  -T  most worker threads the pool grows to while connections back up\n"
+           "      in its queue; needs -s shared (default -t, a fixed pool)\n");
+    printf("  -I  with -T, seconds workers must have been idle before the pool\n"
+           "      shrinks again (default %d)\n", RETIRE_SECS);
+    printf("  -o  with -m epoll, number of I/O threads that open, load and compress\n"
+           "      files, so the event loops never wait for the disk; 0 does it on\n"
+           "      the loops (default 0)\n");
+    printf("  -M  number of files larger than -C kept mapped in memory and sent from\n"
+           "      their mappings, shared by all responses, instead of with sendfile;\n"
+           "      0 disables mapping (default 0)\n");
+    printf("  -F  number of paths whose open file, status and type are kept for\n"
+           "      later requests, dropped as soon as inotify reports a change; not\n"
+           "      allowed with -m uring, 0 opens every requested file (default 0)\n");
+    printf("  -x  mime.types file mapping extensions to the types files are served\n"
+           "      as, ahead of the built-in types (such as /etc/mime.types)\n");
+    printf("  -P  render the complete response to every file of at most this many\n"
+           "      kilobytes below the directory at startup, sent with one call to\n"
+           "      requests without validators, ranges or compression. Without -F the\n"
+           "      responses never change until restart; with -F a file that changes\n"
+           "      is served from disk from then on, and so is every file once a\n"
+           "      directory changes. 0 disables it (default 0)\n");
+}
+
+
+// Create a listening socket for 'server'. With reuseport several sockets may
+// bind the same port, and the kernel spreads new connections over them.
+// Returns the socket file descriptor or -1 on error
+int open_listener(const struct addrinfo *server, int backlog, int reuseport) {
     // Initialize socket file descriptor
     int sock_fd = socket(server->ai_family, server->ai_socktype, server->ai_protocol);
     if (sock_fd == -1) {
         perror("socket");
-        freeaddrinfo(server);
-        return 1;
+        return -1;
+    }
+    int one = 1;
+    if (reuseport && setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+        perror("setsockopt");
+        close(sock_fd);
+        return -1;
     }
     // Bind socket to receive at a specific port
     if (bind(sock_fd, server->ai_addr, server->ai_addrlen) == -1) {
         perror("bind");
-        freeaddrinfo(server);
         close(sock_fd);
-        return 1;
+        return -1;
     }
-    freeaddrinfo(server);
     // Designate socket as a server socket
-    if (listen(sock_fd, LISTEN_QUEUE_LEN) == -1) {
+    if (listen(sock_fd, backlog) == -1) {
         perror("listen");
         close(sock_fd);
-        return 1;
+        return -1;
     }
+    return sock_fd;
+}
 
-    // Set up connection queue
-    connection_queue_init(&queue);
 
-    // block all signals in worker threads
-    sigset_t main_sigset, worker_sigset;
-    if (sigfillset(&worker_sigset) == -1) { perror("sigfillset"); close(sock_fd); return 1; }
-    if (sigprocmask(SIG_SETMASK, &worker_sigset, &main_sigset) == -1) { perror("sigprocmask"); close(sock_fd); return 1; }
-
-    // Set up worker threads
-    pthread_t threads[N_THREADS];
-    for (int i = 0; i < N_THREADS; i++) {
-        int create_result = pthread_create(&threads[i], NULL, thread_func, NULL);
-        if (create_result == -1) { 
-            fprintf(stderr, "pthread_create failed: %s\n", strerror(create_result)); 
-            if (close(sock_fd) == -1) { perror("close"); }
-            connection_queue_free(&queue);
-            return 1;
+// Stop a group's keepalive thread and workers, then free its resources
+// Returns 0 on success or -1 on error
+int stop_group(worker_group_t *group, int n_groups) {
+    int ret_val = 0;
+
+    // Stop resizing the pool before its workers are joined
+    if (atomic_load(&group->scaling)) {
+        atomic_store(&group->scaling, 0);
+        int join_result = pthread_join(group->scaler, NULL);
+        if (join_result != 0) { fprintf(stderr, "pthread_join failed: %s\n", strerror(join_result)); ret_val = -1; }
+    }
+
+    // Stop handing parked connections back to the workers
+    if (keepalive_stop(&group->keepalive) == -1) {
+        fprintf(stderr, "Failed to stop keepalive thread\n");
+        ret_val = -1;
+    }
+    int join_result = pthread_join(group->keepalive_thread, NULL);
+    if (join_result != 0) { fprintf(stderr, "pthread_join failed: %s\n", strerror(join_result)); ret_val = -1; }
+
+    // Shutdown the queues and join the workers
+    if (worker_queues_shutdown(&group->queues) == -1) {
+        fprintf(stderr, "Failed to shutdown connection queue\n");
+        ret_val = -1;
+    }
+    for (int i = 0; i < group->max_workers; i++) {
+        if (atomic_load(&group->workers[i].state) == WORKER_UNUSED) { continue; }
+        join_result = pthread_join(group->workers[i].thread, NULL);
+        if (join_result != 0) { fprintf(stderr, "pthread_join failed: %s\n", strerror(join_result)); ret_val = -1; }
+    }
+
+    // Show how evenly the connections were spread over the workers
+    if (group->queues.policy != DISPATCH_SHARED) {
+        if (n_groups > 1) { fprintf(stderr, "group %d:\n", group->index); }
+        worker_queues_report(&group->queues, stderr);
+    }
+
+    // Close connections parked after the keepalive thread stopped
+    if (keepalive_free(&group->keepalive) == -1) {
+        fprintf(stderr, "Failed to free keepalive set\n");
+        ret_val = -1;
+    }
+    if (worker_queues_free(&group->queues) == -1) {
+        fprintf(stderr, "Failed to free connection queue\n");
+        ret_val = -1;
+    }
+    free(group->workers);
+
+    return ret_val;
+}
+
+
+// Set up a group's queues and keepalive set, then start its workers, and the
+// thread that resizes the pool if it may grow beyond n_workers
+// Returns 0 on success or -1 on error
+int start_group(worker_group_t *group, int index, int listen_fd, int n_workers,
+        int max_workers, int dispatch, long queue_capacity) {
+    memset(group, 0, sizeof(worker_group_t));
+    group->index = index;
+    group->listen_fd = listen_fd;
+
+    // Set up the connection queues of the worker threads
+    if (worker_queues_init(&group->queues, n_workers, dispatch, queue_capacity,
+                admission, admit_target_ms) == -1) {
+        fprintf(stderr, "Failed to initialize connection queue\n");
+        return -1;
+    }
+
+    // Set up the keepalive set, whose thread hands idle persistent
+    // connections back to the queues once their next request arrives
+    if (keepalive_init(&group->keepalive, &group->queues, idle_timeout_ms,
+                header_timeout_ms, max_workers) == -1) {
+        fprintf(stderr, "Failed to initialize keepalive set\n");
+        worker_queues_free(&group->queues);
+        return -1;
+    }
+    int create_result = pthread_create(&group->keepalive_thread, NULL,
+            keepalive_run, &group->keepalive);
+    if (create_result != 0) {
+        fprintf(stderr, "pthread_create failed: %s\n", strerror(create_result));
+        keepalive_free(&group->keepalive);
+        worker_queues_free(&group->queues);
+        return -1;
+    }
+
+    // Set up worker threads, with a slot for every worker the pool may grow to
+    if ((group->workers = calloc(max_workers, sizeof(worker_t))) == NULL) {
+        perror("calloc");
+        stop_group(group, 1);
+        return -1;
+    }
+    group->min_workers = n_workers;
+    group->max_workers = max_workers;
+    for (int i = 0; i < max_workers; i++) {
+        group->workers[i].group = group;
+        group->workers[i].id = i;
+    }
+    for (int i = 0; i < n_workers; i++) {
+        if (spawn_worker(group) == -1) {
+            stop_group(group, 1);
+            return -1;
+        }
+    }
+
+    if (max_workers > n_workers) {
+        atomic_store(&group->scaling, 1);
+        create_result = pthread_create(&group->scaler, NULL, scaler_func, group);
+        if (create_result != 0) {
+            fprintf(stderr, "pthread_create failed: %s\n", strerror(create_result));
+            atomic_store(&group->scaling, 0);
+            stop_group(group, 1);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+// Returns whether a connection has something for a worker to read, either
+// the start of a request or its end, so that reading it does not block
+static int has_input(int fd) {
+    char byte;
+    return recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) != -1 ||
+        (errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+
+// Accept connections on a group's listening socket and dispatch them to its
+// workers until the server is stopped
+// Returns 0 on a clean stop or -1 on error
+int accept_connections(worker_group_t *group) {
+    char name[STATS_NAME_MAX];
+    snprintf(name, sizeof(name), "acceptor %d", group->index);
+    stats_set_thread_name(name);
+
+    while (atomic_load_explicit(&keep_going, memory_order_relaxed) != 0) {
+        // wait to receive a connection request from client, keeping its
+        // address for the access log
+        struct sockaddr_storage client_addr;
+        socklen_t addr_len = sizeof(client_addr);
+        int client_fd = accept(group->listen_fd, (struct sockaddr *) &client_addr, &addr_len);
+        if (client_fd == -1) {
+            // SIGINT interrupts the main thread, while the other acceptors
+            // block signals and fail once their socket is shut down
+            if (errno == EINTR || errno == EINVAL) { break; }
+            fprintf(stderr, "accept failed: %s\n", strerror(errno));
+            return -1;
+        }
+        stats_accepted(1);
+        stats_connection_accepted(client_fd);
+        queued_connection_t conn;
+        conn.fd = client_fd;
+        access_log_client(&conn.client, (struct sockaddr *) &client_addr);
+
+        // A client that has not sent its request yet waits for it in the
+        // keepalive set, for up to the header timeout, instead of holding a
+        // worker blocked in read
+        if (!has_input(client_fd) && keepalive_park(&group->keepalive, &conn, 0) == 0) {
+            continue;
+        }
+
+        // Unless told to block, the acceptor never waits for the workers,
+        // so a full queue turns clients away instead of stalling the backlog
+        int res = worker_queues_admit(&group->queues, &conn);
+        if (res == 1) {
+            turn_away(group, client_fd);
+        } else if (res == -1) {
+            fprintf(stderr, "Failed to enqueue connection\n");
+            if (close(client_fd) == -1) { perror("close"); }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+// Add the connection queues of a group to the statistics report
+void report_group(FILE *out, void *arg) {
+    worker_group_t *group = arg;
+    fprintf(out, "group %d:\n", group->index);
+    worker_queues_report(&group->queues, out);
+    fprintf(out, "workers: %d live, %d busy, min %d, max %d, peak %d, "
+            "spawned %ld, retired %ld\n", atomic_load(&group->n_live),
+            atomic_load(&group->n_busy), group->min_workers, group->max_workers,
+            atomic_load(&group->peak), atomic_load(&group->spawned),
+            atomic_load(&group->retired));
+}
+
+
+void *acceptor_func(void *arg) {
+    return accept_connections(arg) == 0 ? NULL : (void *) -1;
+}
+
+
+// Serve clients with the worker pool until SIGINT, then stop it
+// Returns 0 on success or -1 on error
+int run_worker_pool(int *listeners, int n_groups, int n_threads, int max_threads,
+        int dispatch, long queue_capacity, sigset_t *main_sigset) {
+    int ret_val = 0;
+
+    // Workers block reading requests, so the kernel only hands a connection
+    // over once its request starts arriving, or once it stayed silent for
+    // DEFER_ACCEPT_SECS
+    int defer_secs = DEFER_ACCEPT_SECS;
+    for (int i = 0; i < n_groups; i++) {
+        if (setsockopt(listeners[i], IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_secs,
+                    sizeof(defer_secs)) == -1) {
+            perror("setsockopt");
+            return -1;
+        }
+    }
+
+    worker_group_t groups[n_groups];
+    int n_started = 0;
+    for (; n_started < n_groups; n_started++) {
+        // Spread the threads evenly over the groups
+        int n_workers = n_threads / n_groups + (n_started < n_threads % n_groups);
+        int max_workers = max_threads / n_groups + (n_started < max_threads % n_groups);
+        if (start_group(&groups[n_started], n_started, listeners[n_started],
+                    n_workers, max_workers, dispatch, queue_capacity) == -1) {
+            ret_val = -1;
+            break;
+        }
+    }
+
+    for (int i = 0; i < n_started; i++) {
+        if (stats_add_reporter(report_group, &groups[i]) == -1) { break; }
+    }
+
+    // The main thread accepts for the first group, every other group gets an
+    // acceptor thread of its own
+    int n_acceptors = 1;
+    for (; ret_val == 0 && n_acceptors < n_groups; n_acceptors++) {
+        int create_result = pthread_create(&groups[n_acceptors].acceptor, NULL,
+                acceptor_func, &groups[n_acceptors]);
+        if (create_result != 0) {
+            fprintf(stderr, "pthread_create failed: %s\n", strerror(create_result));
+            ret_val = -1;
+            break;
         }
     }
 
     // restore old signal mask in main thread
-    if (sigprocmask(SIG_SETMASK, &main_sigset, NULL) == -1) {
+    if (sigprocmask(SIG_SETMASK, main_sigset, NULL) == -1) {
         perror("sigprocmask");
-        if (close(sock_fd) == -1) { perror("close"); }
-        return 1;
+        ret_val = -1;
     }
 
     // Main loop
-    ret_val = 0;
-    while (keep_going != 0) {
-        // wait to receive a connection request from client
-        // don't bother saving client address information
-        int client_fd = accept(sock_fd, NULL, NULL);
-        if (client_fd == -1) {
-            if (errno != EINTR) { 
-                fprintf(stderr, "accept failed: %s\n", strerror(errno)); 
-                if (close(sock_fd) == -1) { perror("close"); }
-                ret_val = 1; 
-            } 
+    if (ret_val == 0 && accept_connections(&groups[0]) == -1) {
+        ret_val = -1;
+    }
+
+    // Shutting down a listening socket makes a blocked accept fail, which
+    // stops the other acceptors
+    for (int i = 1; i < n_acceptors; i++) {
+        if (shutdown(groups[i].listen_fd, SHUT_RD) == -1) { perror("shutdown"); ret_val = -1; }
+        void *acceptor_result;
+        int join_result = pthread_join(groups[i].acceptor, &acceptor_result);
+        if (join_result != 0) {
+            fprintf(stderr, "pthread_join failed: %s\n", strerror(join_result));
+            ret_val = -1;
+        } else if (acceptor_result != NULL) {
+            ret_val = -1;
+        }
+    }
+
+    // The groups' queues are about to be freed
+    stats_clear_reporters();
+    for (int i = 0; i < n_started; i++) {
+        if (stop_group(&groups[i], n_groups) == -1) { ret_val = -1; }
+    }
+
+    return ret_val;
+}
+
+
+// Wait for SIGINT while the epoll or io_uring event loops serve clients, then
+// stop them
+// Returns 0 on success or -1 on error
+int run_event_loops(int mode, int *listeners, int n_groups, int n_threads,
+        int io_threads, sigset_t *main_sigset) {
+    int ret_val = 0;
+
+    // event loops accept on their own, so the listening sockets must not block
+    for (int i = 0; i < n_groups; i++) {
+        int flags = fcntl(listeners[i], F_GETFL);
+        if (flags == -1 || fcntl(listeners[i], F_SETFL, flags | O_NONBLOCK) == -1) {
+            perror("fcntl");
+            return -1;
+        }
+    }
+
+    // The I/O threads are shared by all loops
+    io_pool_t io_pool;
+    if (io_threads > 0) {
+        if (io_pool_init(&io_pool, io_threads) == -1) {
+            fprintf(stderr, "Failed to start I/O threads\n");
+            return -1;
+        }
+        stats_add_reporter(io_pool_report, &io_pool);
+    }
+
+    int uring = mode == MODE_URING;
+    event_loop_t loops[uring ? 1 : n_threads];
+    uring_loop_t rings[uring ? n_threads : 1];
+    pthread_t threads[n_threads];
+    int n_started = 0;
+    for (; n_started < n_threads; n_started++) {
+        // The loops of a group share its listening socket
+        int listen_fd = listeners[n_started % n_groups];
+        int init_result = uring
+            ? uring_loop_init(&rings[n_started], listen_fd, serve_dir,
+                    idle_timeout_ms, header_timeout_ms, send_timeout_ms, max_requests)
+            : event_loop_init(&loops[n_started], listen_fd, serve_dir,
+                    idle_timeout_ms, header_timeout_ms, send_timeout_ms, max_requests,
+                    io_threads > 0 ? &io_pool : NULL);
+        if (init_result == -1) {
+            fprintf(stderr, "Failed to initialize event loop\n");
+            ret_val = -1;
             break;
         }
+        int create_result = uring
+            ? pthread_create(&threads[n_started], NULL, uring_loop_run, &rings[n_started])
+            : pthread_create(&threads[n_started], NULL, event_loop_run, &loops[n_started]);
+        if (create_result != 0) {
+            fprintf(stderr, "pthread_create failed: %s\n", strerror(create_result));
+            if (uring) { uring_loop_free(&rings[n_started]); }
+            else { event_loop_free(&loops[n_started]); }
+            ret_val = -1;
+            break;
+        }
+    }
 
-        if (connection_enqueue(&queue, client_fd) == -1) { 
-            fprintf(stderr, "Failed to enqueue connection\n");
-            if (close(sock_fd) == -1) { perror("close"); }
-            connection_queue_free(&queue); 
-            ret_val = 1; 
+    // signals stay blocked in the event loop threads, so SIGINT is delivered
+    // to this thread once sigsuspend unblocks it
+    while (ret_val == 0 && atomic_load_explicit(&keep_going, memory_order_relaxed) != 0) {
+        sigsuspend(main_sigset);
+    }
+
+    for (int i = 0; i < n_started; i++) {
+        int stop_result = uring ? uring_loop_stop(&rings[i]) : event_loop_stop(&loops[i]);
+        if (stop_result == -1) { ret_val = -1; }
+    }
+    for (int i = 0; i < n_started; i++) {
+        void *loop_result;
+        int join_result = pthread_join(threads[i], &loop_result);
+        if (join_result != 0) {
+            fprintf(stderr, "pthread_join failed: %s\n", strerror(join_result));
+            ret_val = -1;
+        } else if (loop_result != NULL) {
+            ret_val = -1;
         }
+        int free_result = uring ? uring_loop_free(&rings[i]) : event_loop_free(&loops[i]);
+        if (free_result == -1) { ret_val = -1; }
     }
 
-    // (close sock_fd on error)
-    if (ret_val != 0) {
-        if (connection_queue_free(&queue) == -1) {
-            fprintf(stderr, "Failed to free queue\n");
+    // The loops waited for their responses, so the I/O threads are idle
+    if (io_threads > 0) {
+        stats_clear_reporters();
+        if (io_pool_free(&io_pool) == -1) { ret_val = -1; }
+    }
+
+    return ret_val;
+}
+
+
+int main(int argc, char **argv) {
+    int mode = MODE_POOL;
+    int n_threads = N_THREADS;
+    int max_threads = 0;
+    int io_threads = 0;
+    int mapped_files = 0;
+    int open_files = 0;
+    const char *mime_types_path = NULL;
+    long prerender_kb = 0;
+    int n_groups = 1;
+    int backlog = LISTEN_QUEUE_LEN;
+    long queue_capacity = CAPACITY;
+    int dispatch = DISPATCH_SHARED;
+    long cache_mb = CACHE_MB;
+    long cache_max_file_kb = CACHE_MAX_FILE_KB;
+    long slow_ms = TRACE_THRESHOLD_MS;
+    int log_slow = 0;
+    const char *access_log_path = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "m:t:g:b:q:s:k:H:W:r:c:C:S:l:a:w:T:I:o:M:F:x:P:")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (strcmp(optarg, "pool") == 0) { mode = MODE_POOL; }
+            else if (strcmp(optarg, "epoll") == 0) { mode = MODE_EPOLL; }
+            else if (strcmp(optarg, "uring") == 0) { mode = MODE_URING; }
+            else { usage(argv[0]); return 1; }
+            break;
+        case 't':
+            n_threads = atoi(optarg);
+            if (n_threads <= 0) { usage(argv[0]); return 1; }
+            break;
+        case 'g':
+            n_groups = atoi(optarg);
+            if (n_groups <= 0) { usage(argv[0]); return 1; }
+            break;
+        case 'b':
+            backlog = atoi(optarg);
+            if (backlog <= 0) { usage(argv[0]); return 1; }
+            break;
+        case 'q':
+            queue_capacity = atol(optarg);
+            if (queue_capacity <= 0) { usage(argv[0]); return 1; }
+            break;
+        case 's':
+            if (strcmp(optarg, "shared") == 0) { dispatch = DISPATCH_SHARED; }
+            else if (strcmp(optarg, "rr") == 0) { dispatch = DISPATCH_ROUND_ROBIN; }
+            else if (strcmp(optarg, "least") == 0) { dispatch = DISPATCH_LEAST_LOADED; }
+            else { usage(argv[0]); return 1; }
+            break;
+        case 'k':
+            idle_timeout_ms = atoi(optarg) * 1000;
+            if (idle_timeout_ms < 0) { usage(argv[0]); return 1; }
+            break;
+        case 'H':
+            header_timeout_ms = atoi(optarg) * 1000;
+            if (header_timeout_ms <= 0) { usage(argv[0]); return 1; }
+            break;
+        case 'W':
+            send_timeout_ms = atoi(optarg) * 1000;
+            if (send_timeout_ms <= 0) { usage(argv[0]); return 1; }
+            break;
+        case 'r':
+            max_requests = atoi(optarg);
+            if (max_requests <= 0) { usage(argv[0]); return 1; }
+            break;
+        case 'c':
+            cache_mb = atol(optarg);
+            if (cache_mb < 0) { usage(argv[0]); return 1; }
+            break;
+        case 'C':
+            cache_max_file_kb = atol(optarg);
+            if (cache_max_file_kb < 0) { usage(argv[0]); return 1; }
+            break;
+        case 'S':
+            slow_ms = atol(optarg);
+            if (slow_ms < 0) { usage(argv[0]); return 1; }
+            log_slow = 1;
+            break;
+        case 'l':
+            access_log_path = optarg;
+            break;
+        case 'a':
+            if (strcmp(optarg, "block") == 0) { admission = ADMIT_BLOCK; }
+            else if (strcmp(optarg, "reject") == 0) { admission = ADMIT_REJECT; }
+            else if (strcmp(optarg, "codel") == 0) { admission = ADMIT_CODEL; }
+            else { usage(argv[0]); return 1; }
+            break;
+        case 'w':
+            admit_target_ms = atol(optarg);
+            if (admit_target_ms <= 0) { usage(argv[0]); return 1; }
+            break;
+        case 'T':
+            max_threads = atoi(optarg);
+            if (max_threads <= 0) { usage(argv[0]); return 1; }
+            break;
+        case 'I':
+            retire_secs = atoi(optarg);
+            if (retire_secs <= 0) { usage(argv[0]); return 1; }
+            break;
+        case 'o':
+            io_threads = atoi(optarg);
+            if (io_threads < 0) { usage(argv[0]); return 1; }
+            break;
+        case 'M':
+            mapped_files = atoi(optarg);
+            if (mapped_files < 0) { usage(argv[0]); return 1; }
+            break;
+        case 'F':
+            open_files = atoi(optarg);
+            if (open_files < 0) { usage(argv[0]); return 1; }
+            break;
+        case 'x':
+            mime_types_path = optarg;
+            break;
+        case 'P':
+            prerender_kb = atol(optarg);
+            if (prerender_kb < 0) { usage(argv[0]); return 1; }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
         }
-        if (close(sock_fd) == -1) { perror("close"); }
+    }
+
+    // Remaining arguments are the directory to serve and the port
+    if (argc - optind != 2 || n_groups > n_threads ||
+            (io_threads > 0 && mode != MODE_EPOLL) || (open_files > 0 && mode == MODE_URING)) {
+        usage(argv[0]);
+        return 1;
+    }
+    // Only a shared queue lets workers come and go, local queues belong to one
+    if (max_threads == 0) {
+        max_threads = n_threads;
+    } else if (max_threads < n_threads ||
+            (max_threads > n_threads && dispatch != DISPATCH_SHARED)) {
+        usage(argv[0]);
         return 1;
     }
 
-    // Shutdown the queue
-    int shutdown_result = connection_queue_shutdown(&queue);
-    if (shutdown_result == -1) {
-        fprintf(stderr, "Failed to shutdown connection queue\n");
-        if (connection_queue_free(&queue) == -1) {
-            fprintf(stderr, "Failed to free queue\n");
-        }
-        if (close(sock_fd) == -1) { perror("close"); }
+    serve_dir = argv[optind];
+    const char *port = argv[optind + 1];
+    trace_init(slow_ms, log_slow);
+    if (access_log_path != NULL && access_log_init(access_log_path) == -1) {
+        fprintf(stderr, "Failed to open access log\n");
         return 1;
     }
 
-    // join worker threads
-    for (int i = 0; i < N_THREADS; i++) {
-        int join_result = pthread_join(threads[i], NULL);
-        if (join_result != 0) { fprintf(stderr, "pthread_join failed: %s\n", strerror(errno)); ret_val = 1; }
+    if (mime_types_path != NULL && mime_load(mime_types_path) == -1) {
+        fprintf(stderr, "Failed to load MIME types\n");
+        return 1;
     }
 
-    // Free the queue
-    if (connection_queue_free(&queue) == -1) {
-        fprintf(stderr, "Failed to free connection queue\n");
-        if (close(sock_fd) == -1) { perror("close"); }
+    // Set up the cache of small files shared by all threads
+    if (cache_mb > 0) {
+        if (file_cache_init(&file_cache, (size_t) cache_mb << 20,
+                    (size_t) cache_max_file_kb << 10) == -1) {
+            fprintf(stderr, "Failed to initialize file cache\n");
+            return 1;
+        }
+        set_http_file_cache(&file_cache);
+        stats_add_reporter(file_cache_report, &file_cache);
+    }
+    if (mapped_files > 0) {
+        if (file_map_init(&file_map, mapped_files) == -1) {
+            fprintf(stderr, "Failed to initialize file map\n");
+            return 1;
+        }
+        set_http_file_map(&file_map);
+        stats_add_reporter(file_map_report, &file_map);
+    }
+    if (prerender_kb > 0) {
+        if (blob_store_init(&blob_store, serve_dir, (size_t) prerender_kb << 10,
+                    format_http_file_header) == -1) {
+            fprintf(stderr, "Failed to render responses\n");
+            return 1;
+        }
+        set_http_blob_store(&blob_store);
+        stats_add_reporter(blob_store_report, &blob_store);
+    }
+    if (open_files > 0) {
+        // Its watcher also retires the rendered responses to files that change
+        if (open_cache_init(&open_cache, serve_dir, open_files, mime_type_of,
+                    prerender_kb > 0 ? blob_store_invalidate : NULL, &blob_store) == -1) {
+            fprintf(stderr, "Failed to initialize open file cache\n");
+            return 1;
+        }
+        set_http_open_cache(&open_cache);
+        stats_add_reporter(open_cache_report, &open_cache);
+    }
+
+    // Catch SIGINT so we can clean up properly
+    struct sigaction sigact;
+    sigact.sa_handler = handle_sigint;
+    sigfillset(&sigact.sa_mask);
+    sigact.sa_flags = 0; // Note the lack of SA_RESTART
+    if (sigaction(SIGINT, &sigact, NULL) == -1) {
+        perror("sigaction");
         return 1;
     }
 
+    // Set up hints - we'll take either IPv4 or IPv6, TCP socket type
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE; // server
+    struct addrinfo *server;
+
+    // Set up address info for socket() and connect()
+    int ret_val = getaddrinfo(NULL, port, &hints, &server);
+    if (ret_val != 0) {
+        fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(ret_val));
+        return 1;
+    }
+    // One listening socket per group, all bound to the same port
+    int listeners[n_groups];
+    for (int i = 0; i < n_groups; i++) {
+        if ((listeners[i] = open_listener(server, backlog, n_groups > 1)) == -1) {
+            for (int j = 0; j < i; j++) { close(listeners[j]); }
+            freeaddrinfo(server);
+            return 1;
+        }
+    }
+    freeaddrinfo(server);
+
+    // block all signals in worker threads
+    sigset_t main_sigset, worker_sigset;
+    ret_val = 0;
+    if (sigfillset(&worker_sigset) == -1) { perror("sigfillset"); ret_val = -1; }
+    else if (sigprocmask(SIG_SETMASK, &worker_sigset, &main_sigset) == -1) { perror("sigprocmask"); ret_val = -1; }
+
+    if (ret_val == 0 && mode != MODE_POOL) {
+        ret_val = run_event_loops(mode, listeners, n_groups, n_threads, io_threads,
+                &main_sigset);
+        if (sigprocmask(SIG_SETMASK, &main_sigset, NULL) == -1) { perror("sigprocmask"); ret_val = -1; }
+    } else if (ret_val == 0) {
+        ret_val = run_worker_pool(listeners, n_groups, n_threads, max_threads,
+                dispatch, queue_capacity, &main_sigset);
+    }
+
     // remaining cleanup
-    if (close(sock_fd) == -1) { perror("close"); return 1; }
+    if (cache_mb > 0 && file_cache_free(&file_cache) == -1) {
+        fprintf(stderr, "Failed to free file cache\n");
+        ret_val = -1;
+    }
+    if (mapped_files > 0 && file_map_free(&file_map) == -1) {
+        fprintf(stderr, "Failed to free file map\n");
+        ret_val = -1;
+    }
+    if (open_files > 0 && open_cache_free(&open_cache) == -1) {
+        fprintf(stderr, "Failed to free open file cache\n");
+        ret_val = -1;
+    }
+    if (prerender_kb > 0 && blob_store_free(&blob_store) == -1) {
+        fprintf(stderr, "Failed to free rendered responses\n");
+        ret_val = -1;
+    }
+    mime_free();
+    for (int i = 0; i < n_groups; i++) {
+        if (close(listeners[i]) == -1) { perror("close"); ret_val = -1; }
+    }
+    if (access_log_free() == -1) {
+        fprintf(stderr, "Failed to write access log\n");
+        ret_val = -1;
+    }
 
-    return ret_val;
+    return ret_val == 0 ? 0 : 1;
 }
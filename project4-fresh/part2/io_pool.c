@@ -0,0 +1,194 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "io_pool.h"
+#include "stats.h"
+
+
+// Append a task that ran to its owner's list, waking the owner if the list
+// was empty. A non-empty list already has a wakeup on its way.
+static void complete(io_task_t *task) {
+    io_completions_t *done = task->done;
+    task->next = NULL;
+    pthread_mutex_lock(&done->lock);
+    int was_empty = done->head == NULL;
+    if (was_empty) { done->head = task; }
+    else { done->tail->next = task; }
+    done->tail = task;
+    pthread_mutex_unlock(&done->lock);
+
+    uint64_t one = 1;
+    if (was_empty && write(done->event_fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("write");
+    }
+}
+
+
+static void *io_thread(void *arg) {
+    io_pool_t *pool = arg;
+    stats_set_thread_name("io");
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->head == NULL && !pool->stopping) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        io_task_t *task = pool->head;
+        if (task == NULL) {
+            break; // stopping, and nothing is left to run
+        }
+        pool->head = task->next;
+        if (pool->head == NULL) { pool->tail = NULL; }
+        pool->queued--;
+        pthread_mutex_unlock(&pool->lock);
+
+        uint64_t start = stats_now();
+        task->work(task);
+        stats_busy(stats_now() - start);
+        atomic_fetch_add_explicit(&pool->completed, 1, memory_order_relaxed);
+        complete(task);
+
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+
+int io_pool_init(io_pool_t *pool, int n_threads) {
+    int err;
+    memset(pool, 0, sizeof(io_pool_t));
+
+    if ((err = pthread_mutex_init(&pool->lock, NULL)) != 0) {
+        fprintf(stderr, "pthread_mutex_init failed: %s\n", strerror(err));
+        return -1;
+    }
+    if ((err = pthread_cond_init(&pool->cond, NULL)) != 0) {
+        fprintf(stderr, "pthread_cond_init failed: %s\n", strerror(err));
+        pthread_mutex_destroy(&pool->lock);
+        return -1;
+    }
+    if ((pool->threads = malloc(n_threads * sizeof(pthread_t))) == NULL) {
+        perror("malloc");
+        pthread_cond_destroy(&pool->cond);
+        pthread_mutex_destroy(&pool->lock);
+        return -1;
+    }
+
+    for (; pool->n_threads < n_threads; pool->n_threads++) {
+        err = pthread_create(&pool->threads[pool->n_threads], NULL, io_thread, pool);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create failed: %s\n", strerror(err));
+            io_pool_free(pool);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+int io_pool_submit(io_pool_t *pool, io_task_t *task) {
+    task->next = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->stopping) {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    if (pool->tail != NULL) { pool->tail->next = task; }
+    else { pool->head = task; }
+    pool->tail = task;
+    pool->queued++;
+    if (pool->queued > atomic_load_explicit(&pool->max_queued, memory_order_relaxed)) {
+        atomic_store_explicit(&pool->max_queued, pool->queued, memory_order_relaxed);
+    }
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+
+void io_pool_report(FILE *out, void *arg) {
+    io_pool_t *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    long queued = pool->queued;
+    pthread_mutex_unlock(&pool->lock);
+    fprintf(out, "io pool: %d threads, %ld tasks completed, %ld waiting, "
+            "at most %ld waiting\n", pool->n_threads,
+            atomic_load(&pool->completed), queued, atomic_load(&pool->max_queued));
+}
+
+
+int io_pool_free(io_pool_t *pool) {
+    int ret = 0;
+    int err;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->n_threads; i++) {
+        if ((err = pthread_join(pool->threads[i], NULL)) != 0) {
+            fprintf(stderr, "pthread_join failed: %s\n", strerror(err));
+            ret = -1;
+        }
+    }
+
+    free(pool->threads);
+    if ((err = pthread_cond_destroy(&pool->cond)) != 0) {
+        fprintf(stderr, "pthread_cond_destroy failed: %s\n", strerror(err));
+        ret = -1;
+    }
+    if ((err = pthread_mutex_destroy(&pool->lock)) != 0) {
+        fprintf(stderr, "pthread_mutex_destroy failed: %s\n", strerror(err));
+        ret = -1;
+    }
+    return ret;
+}
+
+
+int io_completions_init(io_completions_t *done) {
+    int err;
+    memset(done, 0, sizeof(io_completions_t));
+    if ((done->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        perror("eventfd");
+        return -1;
+    }
+    if ((err = pthread_mutex_init(&done->lock, NULL)) != 0) {
+        fprintf(stderr, "pthread_mutex_init failed: %s\n", strerror(err));
+        close(done->event_fd);
+        return -1;
+    }
+    return 0;
+}
+
+
+io_task_t *io_completions_take(io_completions_t *done) {
+    // Reset the eventfd before taking the list, so a task completing in
+    // between is either taken now or wakes the owner again
+    uint64_t count;
+    if (read(done->event_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("read");
+    }
+    pthread_mutex_lock(&done->lock);
+    io_task_t *tasks = done->head;
+    done->head = NULL;
+    done->tail = NULL;
+    pthread_mutex_unlock(&done->lock);
+    return tasks;
+}
+
+
+int io_completions_free(io_completions_t *done) {
+    int ret = 0;
+    int err;
+    if ((err = pthread_mutex_destroy(&done->lock)) != 0) {
+        fprintf(stderr, "pthread_mutex_destroy failed: %s\n", strerror(err));
+        ret = -1;
+    }
+    if (close(done->event_fd) == -1) { perror("close"); ret = -1; }
+    return ret;
+}
@@ -0,0 +1,89 @@
+#ifndef IO_POOL_H
+#define IO_POOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+// A piece of blocking work, such as opening and reading a file, that is handed
+// to the I/O threads. It is meant to be embedded in whatever it works on,
+// which the owner finds again from the task's address once it completes.
+typedef struct io_task {
+    void (*work)(struct io_task *task);  // Run by an I/O thread
+    struct io_completions *done;  // Where the task goes once it ran
+    struct io_task *next;
+} io_task_t;
+
+// Struct representing the tasks that completed for one owner, typically an
+// event loop, which watches the eventfd to learn about them
+typedef struct io_completions {
+    int event_fd;             // Readable while completed tasks wait to be taken
+    pthread_mutex_t lock;
+    io_task_t *head;
+    io_task_t *tail;
+} io_completions_t;
+
+// Struct representing a pool of threads that run blocking work for threads
+// that must not block, in the order it was submitted
+typedef struct {
+    pthread_t *threads;
+    int n_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;      // Signalled when a task is submitted
+    io_task_t *head;          // Tasks waiting for a thread
+    io_task_t *tail;
+    long queued;              // Length of the list above
+    int stopping;
+    atomic_long completed;
+    atomic_long max_queued;   // Most tasks that waited for a thread at once
+} io_pool_t;
+
+/*
+ * Initialize a new I/O pool and start its threads.
+ * pool: Pointer to io_pool_t to be initialized
+ * n_threads: Number of threads running tasks
+ * Returns 0 on success or -1 on error
+ */
+int io_pool_init(io_pool_t *pool, int n_threads);
+
+/*
+ * Hand a task to the I/O threads. Once it ran, it is appended to task->done.
+ * pool: A pointer to the io_pool_t to run the task
+ * task: The task, with work and done set. It must stay valid until it is taken
+ *       from task->done.
+ * Returns 0 on success or -1 if the pool is stopping
+ */
+int io_pool_submit(io_pool_t *pool, io_task_t *task);
+
+/*
+ * Write the number of threads, tasks completed and tasks waiting to 'out'.
+ */
+void io_pool_report(FILE *out, void *arg);
+
+/*
+ * Run the tasks still waiting, stop the threads and free the pool. Must only
+ * be called once no more tasks are submitted.
+ * Returns 0 on success or -1 on error
+ */
+int io_pool_free(io_pool_t *pool);
+
+/*
+ * Initialize an empty list of completed tasks.
+ * Returns 0 on success or -1 on error
+ */
+int io_completions_init(io_completions_t *done);
+
+/*
+ * Take every completed task, oldest first.
+ * Returns the first task, linked through next, or NULL if there are none
+ */
+io_task_t *io_completions_take(io_completions_t *done);
+
+/*
+ * Deallocates and cleans up any resources associated with a list of completed
+ * tasks. No task may still be in flight towards it.
+ * Returns 0 on success or -1 on error
+ */
+int io_completions_free(io_completions_t *done);
+
+#endif // IO_POOL_H
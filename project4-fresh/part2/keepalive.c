@@ -0,0 +1,561 @@
+#include <errno.h>
+#include <linux/tcp.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "keepalive.h"
+#include "stats.h"
+
+#define MAX_EVENTS 64
+#define MAX_WAIT_MS 1000
+#define RETRY_WAIT_MS 10          // How soon a full worker queue is tried again
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+// Returns the number of bytes the client of a connection has acknowledged,
+// or 0 if it is not known
+static uint64_t bytes_acked(int fd) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1) {
+        return 0;
+    }
+    return info.tcpi_bytes_acked;
+}
+
+
+static int entry_fd(keepalive_t *ka, wheel_timer_t *timer) {
+    keepalive_entry_t *entry =
+        (keepalive_entry_t *) ((char *) timer - offsetof(keepalive_entry_t, timer));
+    return entry - ka->entries;
+}
+
+
+// Cancel the timeout of a parked or lingering connection and stop watching
+// it. Must be called with ka->lock held.
+static void unpark(keepalive_t *ka, int fd) {
+    keepalive_entry_t *entry = &ka->entries[fd];
+    timer_wheel_cancel(&ka->timers, &entry->timer);
+    entry->parked = 0;
+    entry->lingering = 0;
+
+    if (epoll_ctl(ka->epoll_fd, EPOLL_CTL_DEL, fd, NULL) == -1) {
+        perror("epoll_ctl");
+    }
+}
+
+
+// Close a parked or lingering connection. Must be called with ka->lock held.
+static void close_parked(keepalive_t *ka, int fd) {
+    unpark(ka, fd);
+    ka->entries[fd].requests_served = 0;
+    if (close(fd) == -1) { perror("close"); }
+}
+
+
+// Release the slots of a keepalive set, of which n_slots were initialized
+static void free_slots(keepalive_t *ka, int n_slots) {
+    for (int i = 0; i < n_slots; i++) {
+        pthread_mutex_destroy(&ka->slots[i].lock);
+    }
+    free(ka->slots);
+}
+
+
+int keepalive_init(keepalive_t *ka, worker_queues_t *queues, int idle_timeout_ms,
+        int header_timeout_ms, int n_slots) {
+    int err;
+    memset(ka, 0, sizeof(keepalive_t));
+    ka->queues = queues;
+    ka->idle_timeout_ms = idle_timeout_ms;
+    ka->header_timeout_ms = header_timeout_ms;
+    timer_wheel_init(&ka->timers, now_ms());
+
+    // A deadline slot for every worker, each on cache lines of its own
+    ka->slots = aligned_alloc(CACHE_LINE, n_slots * sizeof(keepalive_slot_t));
+    if (ka->slots == NULL) {
+        perror("aligned_alloc");
+        return -1;
+    }
+    memset(ka->slots, 0, n_slots * sizeof(keepalive_slot_t));
+    for (; ka->n_slots < n_slots; ka->n_slots++) {
+        if ((err = pthread_mutex_init(&ka->slots[ka->n_slots].lock, NULL)) != 0) {
+            fprintf(stderr, "pthread_mutex_init failed: %s\n", strerror(err));
+            free_slots(ka, ka->n_slots);
+            return -1;
+        }
+    }
+
+    // One entry for every file descriptor the process may have open
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+        perror("getrlimit");
+        free_slots(ka, ka->n_slots);
+        return -1;
+    }
+    ka->n_entries = limit.rlim_cur;
+    if ((ka->entries = calloc(ka->n_entries, sizeof(keepalive_entry_t))) == NULL) {
+        perror("calloc");
+        free_slots(ka, ka->n_slots);
+        return -1;
+    }
+
+    if ((ka->backlog = malloc(ka->n_entries * sizeof(queued_connection_t))) == NULL) {
+        perror("malloc");
+        free(ka->entries);
+        free_slots(ka, ka->n_slots);
+        return -1;
+    }
+
+    if ((ka->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1");
+        free(ka->backlog);
+        free(ka->entries);
+        free_slots(ka, ka->n_slots);
+        return -1;
+    }
+
+    if ((ka->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        perror("eventfd");
+        close(ka->epoll_fd);
+        free(ka->backlog);
+        free(ka->entries);
+        free_slots(ka, ka->n_slots);
+        return -1;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = ka->wakeup_fd;
+    if (epoll_ctl(ka->epoll_fd, EPOLL_CTL_ADD, ka->wakeup_fd, &event) == -1) {
+        perror("epoll_ctl");
+        close(ka->wakeup_fd);
+        close(ka->epoll_fd);
+        free(ka->backlog);
+        free(ka->entries);
+        free_slots(ka, ka->n_slots);
+        return -1;
+    }
+
+    if ((err = pthread_mutex_init(&ka->lock, NULL)) != 0) {
+        fprintf(stderr, "pthread_mutex_init failed: %s\n", strerror(err));
+        close(ka->wakeup_fd);
+        close(ka->epoll_fd);
+        free(ka->backlog);
+        free(ka->entries);
+        free_slots(ka, ka->n_slots);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int keepalive_park(keepalive_t *ka, const queued_connection_t *conn, int requests_served) {
+    int err;
+    int fd = conn->fd;
+    if (fd >= ka->n_entries) {
+        return -1;
+    }
+
+    if ((err = pthread_mutex_lock(&ka->lock)) != 0) {
+        fprintf(stderr, "pthread_mutex_lock failed: %s\n", strerror(err));
+        return -1;
+    }
+
+    // The timeout replaces whatever deadline the worker had set
+    keepalive_entry_t *entry = &ka->entries[fd];
+    entry->requests_served = requests_served;
+    entry->client = conn->client;
+    entry->parked = 1;
+    int timeout_ms = requests_served == 0 ? ka->header_timeout_ms : ka->idle_timeout_ms;
+    timer_wheel_arm(&ka->timers, &entry->timer, now_ms() + timeout_ms);
+
+    int ret = 0;
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.fd = fd;
+    if (epoll_ctl(ka->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        perror("epoll_ctl");
+        // Undo the timeout so the caller can close the connection
+        unpark(ka, fd);
+        entry->requests_served = 0;
+        ret = -1;
+    }
+
+    if ((err = pthread_mutex_unlock(&ka->lock)) != 0) {
+        fprintf(stderr, "pthread_mutex_unlock failed: %s\n", strerror(err));
+        return -1;
+    }
+
+    return ret;
+}
+
+
+int keepalive_linger(keepalive_t *ka, int fd) {
+    int err;
+    if (fd >= ka->n_entries) {
+        return -1;
+    }
+
+    if ((err = pthread_mutex_lock(&ka->lock)) != 0) {
+        fprintf(stderr, "pthread_mutex_lock failed: %s\n", strerror(err));
+        return -1;
+    }
+
+    keepalive_entry_t *entry = &ka->entries[fd];
+    entry->requests_served = 0;
+    entry->lingering = 1;
+    timer_wheel_arm(&ka->timers, &entry->timer, now_ms() + HTTP_LINGER_MS);
+
+    int ret = 0;
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.fd = fd;
+    if (epoll_ctl(ka->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        perror("epoll_ctl");
+        unpark(ka, fd);
+        ret = -1;
+    }
+
+    if ((err = pthread_mutex_unlock(&ka->lock)) != 0) {
+        fprintf(stderr, "pthread_mutex_unlock failed: %s\n", strerror(err));
+        return -1;
+    }
+
+    return ret;
+}
+
+
+// Wait for the keepalive thread to finish acting on a worker's deadline that
+// it claimed. Returns 0 on success or -1 on error
+static int wait_for_claim(keepalive_slot_t *watch) {
+    int err;
+    if ((err = pthread_mutex_lock(&watch->lock)) != 0) {
+        fprintf(stderr, "pthread_mutex_lock failed: %s\n", strerror(err));
+        return -1;
+    }
+    if ((err = pthread_mutex_unlock(&watch->lock)) != 0) {
+        fprintf(stderr, "pthread_mutex_unlock failed: %s\n", strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+
+int keepalive_watch(keepalive_t *ka, int slot, int fd, int timeout_ms, int stall) {
+    keepalive_slot_t *watch = &ka->slots[slot];
+    atomic_store_explicit(&watch->fd, fd, memory_order_relaxed);
+    atomic_store_explicit(&watch->timeout_ms, timeout_ms, memory_order_relaxed);
+    atomic_store_explicit(&watch->stall, stall, memory_order_relaxed);
+    atomic_store_explicit(&watch->watches,
+            atomic_load_explicit(&watch->watches, memory_order_relaxed) + 1,
+            memory_order_relaxed);
+    // Publishes the fields above to the keepalive thread
+    long old = atomic_exchange_explicit(&watch->deadline, now_ms() + timeout_ms,
+            memory_order_acq_rel);
+    if (old == KEEPALIVE_CLAIMED) {
+        return wait_for_claim(watch);
+    }
+    return 0;
+}
+
+
+int keepalive_unwatch(keepalive_t *ka, int slot) {
+    keepalive_slot_t *watch = &ka->slots[slot];
+    if (atomic_load_explicit(&watch->deadline, memory_order_relaxed) == 0) {
+        return 0; // Only this worker arms it, and nothing else sets it again
+    }
+
+    // Once this returns, the keepalive thread is done with the socket
+    long old = atomic_exchange_explicit(&watch->deadline, 0, memory_order_acq_rel);
+    if (old == KEEPALIVE_CLAIMED) {
+        return wait_for_claim(watch);
+    }
+    return 0;
+}
+
+
+// Close the parked connections that stayed idle for too long, and the
+// lingering ones whose client did not close its end in time.
+// Must be called with ka->lock held.
+static void expire_parked(keepalive_t *ka, long now) {
+    wheel_timer_t *timer;
+    while ((timer = timer_wheel_expire(&ka->timers, now)) != NULL) {
+        int fd = entry_fd(ka, timer);
+        if (ka->entries[fd].parked) { stats_timed_out(); }
+        close_parked(ka, fd);
+    }
+}
+
+
+// Claim a worker's deadline, unless the worker replaced or removed it first.
+// Must be called with watch->lock held, and the claim handed back with
+// release_claim before unlocking.
+// Returns 1 if the deadline was claimed, or 0 otherwise
+static int claim(keepalive_slot_t *watch, long deadline) {
+    return atomic_compare_exchange_strong_explicit(&watch->deadline, &deadline,
+            KEEPALIVE_CLAIMED, memory_order_acq_rel, memory_order_acquire);
+}
+
+
+// Hand a claimed deadline back, set to 'deadline' unless the worker replaced
+// or removed it in the meantime. Returns the deadline the worker has now
+static long release_claim(keepalive_slot_t *watch, long deadline) {
+    long claimed = KEEPALIVE_CLAIMED;
+    if (!atomic_compare_exchange_strong_explicit(&watch->deadline, &claimed, deadline,
+                memory_order_acq_rel, memory_order_acquire)) {
+        return claimed;
+    }
+    return deadline;
+}
+
+
+// Act on a worker's deadline that passed. Its socket is shut down, which
+// makes the read or send fail, unless the client kept acknowledging the
+// response being sent.
+// Returns the worker's deadline afterwards, or 0 if there is none
+static long expire_watch(keepalive_slot_t *watch, long deadline, long now) {
+    pthread_mutex_lock(&watch->lock);
+    if (!claim(watch, deadline)) {
+        pthread_mutex_unlock(&watch->lock);
+        return atomic_load(&watch->deadline);
+    }
+    int fd = atomic_load_explicit(&watch->fd, memory_order_relaxed);
+    deadline = 0;
+    if (atomic_load_explicit(&watch->stall, memory_order_relaxed)) {
+        // Progress is sampled here rather than on every request
+        unsigned watches = atomic_load_explicit(&watch->watches, memory_order_relaxed);
+        uint64_t acked = bytes_acked(fd);
+        if (watch->acked_watch != watches || acked != watch->acked_seen) {
+            watch->acked_watch = watches;
+            watch->acked_seen = acked;
+            deadline = now + atomic_load_explicit(&watch->timeout_ms, memory_order_relaxed);
+        }
+    }
+    if (deadline == 0) {
+        // The worker still owns the socket, it sees the read or send fail and
+        // closes it after unwatching, which waits for the claim
+        stats_timed_out();
+        if (shutdown(fd, SHUT_RDWR) == -1 && errno != ENOTCONN) {
+            perror("shutdown");
+        }
+    }
+    deadline = release_claim(watch, deadline);
+    pthread_mutex_unlock(&watch->lock);
+    return deadline;
+}
+
+
+// Enforce the deadlines of the workers that passed. Only the slots whose
+// deadline passed are locked.
+// Returns the earliest deadline left, or -1 if there is none
+static long expire_watches(keepalive_t *ka, long now) {
+    long next = -1;
+    for (int i = 0; i < ka->n_slots; i++) {
+        keepalive_slot_t *watch = &ka->slots[i];
+        long deadline = atomic_load(&watch->deadline);
+        if (deadline > 0 && deadline <= now) {
+            deadline = expire_watch(watch, deadline, now);
+        }
+        if (deadline > 0 && (next == -1 || deadline < next)) {
+            next = deadline;
+        }
+    }
+    return next;
+}
+
+
+int keepalive_requests_served(keepalive_t *ka, int fd) {
+    if (fd >= ka->n_entries) {
+        return 0;
+    }
+
+    // The entry was written before the connection was enqueued, and the queue
+    // orders that write before this read. Reset it for the next user of fd.
+    int requests_served = ka->entries[fd].requests_served;
+    ka->entries[fd].requests_served = 0;
+    return requests_served;
+}
+
+
+// Drop a connection that could not be handed back to the workers
+static void drop_ready(keepalive_t *ka, int fd) {
+    ka->entries[fd].requests_served = 0;
+    if (close(fd) == -1) { perror("close"); }
+}
+
+
+// Hand the backlog of readable connections to the workers, oldest first, for
+// as long as the queues have room
+static void drain_backlog(keepalive_t *ka) {
+    while (ka->n_backlog > 0) {
+        queued_connection_t *conn = &ka->backlog[ka->backlog_head];
+        int res = worker_queues_try_push(ka->queues, conn);
+        if (res == 1) {
+            return;
+        }
+        if (res == -1) {
+            drop_ready(ka, conn->fd);
+        }
+        ka->backlog_head = (ka->backlog_head + 1) % ka->n_entries;
+        ka->n_backlog--;
+    }
+}
+
+
+void *keepalive_run(void *arg) {
+    keepalive_t *ka = arg;
+    struct epoll_event events[MAX_EVENTS];
+    void *ret = NULL;
+    int running = 1;
+    int err;
+    long next_watch = -1;     // Earliest deadline of the workers seen last time
+    stats_set_thread_name("keepalive");
+
+    while (running) {
+        // Sleep until the next timeout. Deadlines set while sleeping may be
+        // earlier than that, so the sleep is capped to catch them in time,
+        // and to retry the backlog soon if the queues were full.
+        if ((err = pthread_mutex_lock(&ka->lock)) != 0) {
+            fprintf(stderr, "pthread_mutex_lock failed: %s\n", strerror(err));
+            return (void *) -1;
+        }
+        long now = now_ms();
+        long timeout = timer_wheel_timeout(&ka->timers, now);
+        pthread_mutex_unlock(&ka->lock);
+        if (next_watch != -1 && (timeout == -1 || next_watch - now < timeout)) {
+            timeout = next_watch > now ? next_watch - now : 0;
+        }
+        long max_wait = ka->n_backlog > 0 ? RETRY_WAIT_MS : MAX_WAIT_MS;
+        if (timeout == -1 || timeout > max_wait) {
+            timeout = max_wait;
+        }
+
+        int n_events = epoll_wait(ka->epoll_fd, events, MAX_EVENTS, timeout);
+        if (n_events == -1) {
+            if (errno == EINTR) { continue; }
+            perror("epoll_wait");
+            ret = (void *) -1;
+            break;
+        }
+
+        // Collect the connections with a new request and enforce timeouts
+        if ((err = pthread_mutex_lock(&ka->lock)) != 0) {
+            fprintf(stderr, "pthread_mutex_lock failed: %s\n", strerror(err));
+            return (void *) -1;
+        }
+        for (int i = 0; i < n_events; i++) {
+            int fd = events[i].data.fd;
+            if (fd == ka->wakeup_fd) {
+                running = 0;
+            } else if (ka->entries[fd].parked) {
+                // Unparked connections are not in the backlog yet, so it
+                // always has room for them
+                unpark(ka, fd);
+                queued_connection_t *conn =
+                    &ka->backlog[(ka->backlog_head + ka->n_backlog) % ka->n_entries];
+                conn->fd = fd;
+                conn->client = ka->entries[fd].client;
+                ka->n_backlog++;
+            } else if (ka->entries[fd].lingering && drain_http_connection(fd) == 1) {
+                close_parked(ka, fd);
+            }
+        }
+        long now_expired = now_ms();
+        expire_parked(ka, now_expired);
+        pthread_mutex_unlock(&ka->lock);
+        next_watch = expire_watches(ka, now_expired);
+
+        // Hand readable connections back to the workers. Whatever does not
+        // fit stays in the backlog rather than holding up the timeouts.
+        drain_backlog(ka);
+    }
+
+    // Close all connections that are still parked, lingering or waiting for
+    // the queues, and stop workers from waiting for further requests without
+    // cutting off their responses
+    while (ka->n_backlog > 0) {
+        drop_ready(ka, ka->backlog[ka->backlog_head].fd);
+        ka->backlog_head = (ka->backlog_head + 1) % ka->n_entries;
+        ka->n_backlog--;
+    }
+    pthread_mutex_lock(&ka->lock);
+    wheel_timer_t *timer;
+    while ((timer = timer_wheel_pop(&ka->timers)) != NULL) {
+        close_parked(ka, entry_fd(ka, timer));
+    }
+    pthread_mutex_unlock(&ka->lock);
+    for (int i = 0; i < ka->n_slots; i++) {
+        keepalive_slot_t *watch = &ka->slots[i];
+        pthread_mutex_lock(&watch->lock);
+        long deadline = atomic_load(&watch->deadline);
+        while (deadline > 0 && !claim(watch, deadline)) {
+            deadline = atomic_load(&watch->deadline);
+        }
+        if (deadline > 0) {
+            int fd = atomic_load_explicit(&watch->fd, memory_order_relaxed);
+            if (shutdown(fd, SHUT_RD) == -1 && errno != ENOTCONN) {
+                perror("shutdown");
+            }
+            release_claim(watch, deadline);
+        }
+        pthread_mutex_unlock(&watch->lock);
+    }
+
+    return ret;
+}
+
+
+int keepalive_stop(keepalive_t *ka) {
+    uint64_t one = 1;
+    if (write(ka->wakeup_fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("write");
+        return -1;
+    }
+    return 0;
+}
+
+
+int keepalive_free(keepalive_t *ka) {
+    int ret = 0;
+    int err;
+
+    // Workers and acceptors may have parked connections, and acceptors turned
+    // them away, after the keepalive thread stopped
+    wheel_timer_t *timer;
+    while ((timer = timer_wheel_pop(&ka->timers)) != NULL) {
+        int fd = entry_fd(ka, timer);
+        if (ka->entries[fd].parked || ka->entries[fd].lingering) {
+            close_parked(ka, fd);
+        }
+    }
+
+    if ((err = pthread_mutex_destroy(&ka->lock)) != 0) {
+        fprintf(stderr, "pthread_mutex_destroy failed: %s\n", strerror(err));
+        ret = -1;
+    }
+    if (close(ka->wakeup_fd) == -1) { perror("close"); ret = -1; }
+    if (close(ka->epoll_fd) == -1) { perror("close"); ret = -1; }
+    free_slots(ka, ka->n_slots);
+    free(ka->backlog);
+    free(ka->entries);
+    return ret;
+}
@@ -0,0 +1,154 @@
+#ifndef KEEPALIVE_H
+#define KEEPALIVE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "timer_wheel.h"
+#include "worker_queues.h"
+
+// Per file descriptor record of a connection
+typedef struct {
+    int requests_served;
+    int parked;
+    int lingering;            // Closing after a final response
+    access_log_addr_t client; // Handed back to the workers with a parked connection
+    wheel_timer_t timer;      // Idle timeout while parked, or end of lingering
+} keepalive_entry_t;
+
+#define KEEPALIVE_CLAIMED -1L  // Deadline the keepalive thread is acting on
+
+// Struct representing the deadline of one worker's read or send. The worker
+// sets and clears it with atomics alone. The keepalive thread claims a
+// deadline that passed before acting on it, holding the slot's lock until it
+// is done, and a worker that finds its deadline claimed waits for that lock,
+// so that the socket is not closed and reused under a shutdown.
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_long deadline;  // In ms, 0 if there is none
+    atomic_int fd;
+    atomic_int timeout_ms;    // What the deadline was armed with
+    atomic_int stall;         // Whether the deadline only fires without progress
+    atomic_uint watches;      // Deadlines armed so far, only written by the worker
+    unsigned acked_watch;     // Deadline acked_seen was taken for, by its count
+    uint64_t acked_seen;      // Bytes the client had acknowledged back then
+    pthread_mutex_t lock;     // Held while a claimed deadline is acted on
+} keepalive_slot_t;
+
+// Struct representing the set of idle persistent connections of the worker
+// pool. Instead of pinning a worker while waiting for the client's next
+// request, a connection is parked here and put back onto the worker queues
+// once it becomes readable, or closed once it has been idle for too long.
+// New connections whose first request has not arrived yet wait here as well.
+// Connections that were sent a final response linger here until they close.
+// The same thread also enforces the deadlines of workers that block reading a
+// request or sending a response, by shutting the socket down when one passes.
+typedef struct {
+    int epoll_fd;
+    int wakeup_fd;            // eventfd used to ask the keepalive thread to stop
+    int idle_timeout_ms;
+    int header_timeout_ms;    // How long a new connection may stay silent
+    worker_queues_t *queues;
+    keepalive_entry_t *entries;  // Indexed by file descriptor
+    int n_entries;
+    timer_wheel_t timers;     // Idle timeouts of parked connections
+    pthread_mutex_t lock;     // Guards the entries and the timers
+    keepalive_slot_t *slots;  // One per worker
+    int n_slots;
+    // Readable connections waiting for room in the worker queues, oldest
+    // first. Only used by the keepalive thread, which never blocks on the
+    // queues so that deadlines keep being enforced while they are full.
+    queued_connection_t *backlog;
+    int backlog_head;
+    int n_backlog;
+} keepalive_t;
+
+/*
+ * Initialize a new keepalive set.
+ * ka: Pointer to keepalive_t to be initialized
+ * queues: Worker queues that connections are put back onto when they become
+ *         readable
+ * idle_timeout_ms: How long a parked connection may stay idle
+ * header_timeout_ms: How long a parked new connection may wait for its first
+ *                    request
+ * n_slots: Number of workers that set deadlines
+ * Returns 0 on success or -1 on error
+ */
+int keepalive_init(keepalive_t *ka, worker_queues_t *queues, int idle_timeout_ms,
+        int header_timeout_ms, int n_slots);
+
+/*
+ * Park an idle persistent connection until its next request arrives, or a
+ * new connection until its first one does.
+ * ka: A pointer to the keepalive_t to park the connection in
+ * conn: The connection, whose socket has no buffered unread request data
+ * requests_served: Number of requests served on the connection so far, 0 for
+ *                  a new connection, which waits up to the header timeout
+ *                  rather than the idle timeout
+ * Returns 0 on success or -1 on error, in which case the caller still owns
+ * the socket
+ */
+int keepalive_park(keepalive_t *ka, const queued_connection_t *conn, int requests_served);
+
+/*
+ * Close a connection that was sent a final response, such as a 503, once the
+ * client closed its end or HTTP_LINGER_MS passed, discarding whatever the
+ * client still sends meanwhile, so that the response is not reset away.
+ * ka: A pointer to the keepalive_t to close the connection in
+ * fd: The connection's socket, whose sending side was shut down
+ * Returns 0 on success or -1 on error, in which case the caller still owns fd
+ */
+int keepalive_linger(keepalive_t *ka, int fd);
+
+/*
+ * Set a deadline for a worker that is about to block on a connection. Once it
+ * passes, the socket is shut down, which makes the blocked read or send fail.
+ * The worker must call keepalive_unwatch before closing the socket.
+ * ka: A pointer to the keepalive_t whose thread enforces the deadline
+ * slot: Index of the calling worker, from 0 to n_slots - 1
+ * fd: The connection's socket
+ * timeout_ms: Milliseconds from now, the worker's deadline already set is
+ *             replaced
+ * stall: If set, the deadline is pushed back whenever the client acknowledged
+ *        more of the response during the last timeout_ms, so it only catches
+ *        stalls. Progress is first sampled when the deadline passes, so a
+ *        stalled client is cut off after one to two timeouts.
+ * Returns 0 on success or -1 on error
+ */
+int keepalive_watch(keepalive_t *ka, int slot, int fd, int timeout_ms, int stall);
+
+/*
+ * Remove the deadline of a worker. Does nothing if it has none.
+ * Returns 0 on success or -1 on error
+ */
+int keepalive_unwatch(keepalive_t *ka, int slot);
+
+/*
+ * Look up how many requests have already been served on a connection that was
+ * just taken off the connection queue. Returns 0 for a new connection.
+ */
+int keepalive_requests_served(keepalive_t *ka, int fd);
+
+/*
+ * Watch parked connections and enforce deadlines until keepalive_stop is
+ * called. Deadlines may pass up to a second before they are enforced. Meant to
+ * be used as the start routine of a dedicated thread.
+ * arg: A pointer to the keepalive_t to watch
+ * Returns NULL on a clean stop, or a non-NULL value on error
+ */
+void *keepalive_run(void *arg);
+
+/*
+ * Ask the keepalive thread to stop. Connections still parked are closed, and
+ * ones that workers wait for a request on are shut down for reading.
+ * Returns 0 on success or -1 on error
+ */
+int keepalive_stop(keepalive_t *ka);
+
+/*
+ * Deallocates and cleans up any resources associated with a keepalive set.
+ * Returns 0 on success or -1 on error
+ */
+int keepalive_free(keepalive_t *ka);
+
+#endif // KEEPALIVE_H
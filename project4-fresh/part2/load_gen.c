@@ -0,0 +1,911 @@
+// HTTP load generator for comparing the servers on loopback. Every thread
+// drives its share of the connections from an epoll loop and replays a mix of
+// requests over a corpus of files.
+//
+// In a closed loop (the default) each connection sends its next request as
+// soon as the last response arrived. In an open loop (-R) requests are issued
+// at a fixed rate whether or not the server keeps up, and each latency is
+// measured from when its request was due rather than from when a connection
+// became free to send it, so a stalled server cannot hide its queueing delay.
+//
+// Connections are kept alive unless the server closes them or -C is given,
+// so both the HTTP/1.0 part1 server and the part2 server can be driven.
+// Connections that cannot be established are counted apart from failed
+// requests, and in a closed loop a client backs off before trying again.
+//
+// Usage: ./load_gen [options] <host> <port>, see usage() for the options
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define N_THREADS 2
+#define N_CONNECTIONS 10
+#define DURATION_SECS 10
+#define TIMEOUT_MS 5000
+#define BACKOFF_MIN_MS 10         // Wait after a failed connect, doubled while it keeps failing
+#define BACKOFF_MAX_MS 1000
+#define CORPUS_DIR "downloaded_files"
+
+#define PATH_MAX_LEN 512
+#define REQUEST_MAX 1024
+#define RESPONSE_HEADER_MAX 8192
+#define RECV_CHUNK (64 * 1024)
+#define MAX_EVENTS 256
+#define STATUS_MAX 599
+#define HISTOGRAM_SUB_BITS 4      // Buckets per power of two: 2^4, ~6% error
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+// Ways a request can fail once its connection is established
+enum { ERR_SEND, ERR_RECV, ERR_TIMEOUT, ERR_PARSE, ERR_LENGTH, N_ERRORS };
+static const char *error_names[N_ERRORS] =
+    { "send", "recv", "timeout", "parse", "length" };
+
+enum { CONN_CLOSED, CONN_IDLE, CONN_BACKOFF, CONN_CONNECTING, CONN_SENDING, CONN_RECEIVING };
+
+// A resource of the request mix
+typedef struct {
+    char path[PATH_MAX_LEN];  // Absolute path of the request target
+    long size;                // Expected body size of a 200, or -1 if unknown
+    double weight;
+} target_t;
+
+// Struct representing a client connection and the request it is working on
+typedef struct {
+    int fd;                   // Socket, or -1 while closed
+    int state;
+    int reused;               // Whether the request went out on a kept-alive socket
+    const target_t *target;
+    char request[REQUEST_MAX];
+    size_t request_len;
+    size_t request_sent;
+    char header[RESPONSE_HEADER_MAX];
+    size_t header_len;
+    int header_done;
+    int status;
+    int keep_alive;
+    long content_length;      // -1 if the body ends when the server closes
+    size_t body_received;
+    uint64_t start;           // When the request was due, in nanoseconds
+    uint64_t deadline;
+    uint64_t backoff;         // Last wait after a failed connect, 0 once one succeeded
+    uint64_t retry_at;        // When a client backing off may connect again
+} client_t;
+
+// What one thread measured, merged by the main thread at the end
+typedef struct {
+    unsigned long requests;   // Responses received in full
+    unsigned long bytes;      // Header and body bytes received
+    unsigned long errors[N_ERRORS];
+    unsigned long status[STATUS_MAX + 1];
+    unsigned long connects;   // Connections attempted
+    unsigned long connect_failures;
+    unsigned long counts[HISTOGRAM_BUCKETS];  // Latencies in nanoseconds
+    uint64_t max;
+    double sum;
+    unsigned long backlog;    // Open loop requests that were due but never sent
+} results_t;
+
+// Struct representing a load-generating thread
+typedef struct {
+    int id;
+    client_t *clients;
+    int n_clients;
+    int *free_clients;        // Stack of clients with no request in flight
+    int n_free;
+    int n_backoff;            // Clients waiting to connect again
+    int epoll_fd;
+    double interval_ns;       // Time between requests in an open loop, or 0
+    uint64_t begin;
+    uint64_t end;
+    uint64_t issued;          // Open loop requests sent so far
+    uint64_t rng;
+    results_t results;
+    pthread_t thread;
+} worker_t;
+
+// Settings shared by every thread
+static struct addrinfo *server;
+static char host_header[256];
+static target_t *targets;
+static int n_targets;
+static double total_weight;
+static int close_each = 0;
+static uint64_t timeout_ns = (uint64_t) TIMEOUT_MS * 1000000;
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+// Values below 2^SUB_BITS get a bucket each. Above that, the position of the
+// highest set bit picks a group of 2^SUB_BITS buckets and the bits below it
+// pick the bucket within the group.
+static int bucket_of(uint64_t value) {
+    if (value < (1 << HISTOGRAM_SUB_BITS)) {
+        return value;
+    }
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return ((shift + 1) << HISTOGRAM_SUB_BITS) +
+        (int) (value >> shift) - (1 << HISTOGRAM_SUB_BITS);
+}
+
+
+// Returns the highest value that falls into a bucket
+static uint64_t bucket_limit(int bucket) {
+    if (bucket < (1 << HISTOGRAM_SUB_BITS)) {
+        return bucket;
+    }
+    int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+    uint64_t sub = (bucket & ((1 << HISTOGRAM_SUB_BITS) - 1)) + (1 << HISTOGRAM_SUB_BITS);
+    return ((sub + 1) << shift) - 1;
+}
+
+
+// Returns the latency that a share of the requests, in thousandths, stayed under
+static uint64_t percentile(const results_t *r, int thousandths) {
+    if (r->requests == 0) {
+        return 0;
+    }
+    unsigned long rank = (r->requests * thousandths + 999) / 1000;
+    unsigned long seen = 0;
+    int bucket = 0;
+    while (bucket < HISTOGRAM_BUCKETS - 1 && seen + r->counts[bucket] < rank) {
+        seen += r->counts[bucket++];
+    }
+    uint64_t value = bucket_limit(bucket);
+    return value < r->max ? value : r->max;
+}
+
+
+// xorshift64*, good enough to pick requests from the mix
+static double next_random(worker_t *w) {
+    w->rng ^= w->rng >> 12;
+    w->rng ^= w->rng << 25;
+    w->rng ^= w->rng >> 27;
+    return ((w->rng * 0x2545f4914f6cdd1dULL) >> 11) / (double) (1ULL << 53);
+}
+
+
+static const target_t *pick_target(worker_t *w) {
+    double x = next_random(w) * total_weight;
+    for (int i = 0; i < n_targets - 1; i++) {
+        if (x < targets[i].weight) {
+            return &targets[i];
+        }
+        x -= targets[i].weight;
+    }
+    return &targets[n_targets - 1];
+}
+
+
+static void set_events(worker_t *w, client_t *c, uint32_t events) {
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = c;
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, c->fd, &event) == -1) {
+        perror("epoll_ctl");
+    }
+}
+
+
+static void close_client(worker_t *w, client_t *c) {
+    if (c->fd != -1) {
+        if (close(c->fd) == -1) { perror("close"); }
+        c->fd = -1;
+    }
+    c->state = CONN_CLOSED;
+}
+
+
+// Put a client with no request in flight back on the free stack
+static void release_client(worker_t *w, client_t *c) {
+    w->free_clients[w->n_free++] = c - w->clients;
+}
+
+
+static void fail_request(worker_t *w, client_t *c, int error) {
+    w->results.errors[error]++;
+    close_client(w, c);
+    release_client(w, c);
+}
+
+
+// Give up on a connection that could not be established. In a closed loop
+// the client waits before it connects again, twice as long after every
+// failure in a row, so that a server that is down is not flooded with
+// attempts. In an open loop the schedule paces the attempts already, and the
+// client is free for the next request that is due.
+static void fail_connect(worker_t *w, client_t *c) {
+    w->results.connect_failures++;
+    close_client(w, c);
+    if (w->interval_ns > 0) {
+        release_client(w, c);
+        return;
+    }
+    uint64_t max = (uint64_t) BACKOFF_MAX_MS * 1000000;
+    c->backoff = c->backoff == 0 ? (uint64_t) BACKOFF_MIN_MS * 1000000 : c->backoff * 2;
+    if (c->backoff > max) { c->backoff = max; }
+    c->retry_at = now_ns() + c->backoff;
+    c->state = CONN_BACKOFF;
+    w->n_backoff++;
+}
+
+
+// Free the clients whose backoff ended by 'now'
+// Returns when the next backoff ends, or UINT64_MAX if no client backs off
+static uint64_t end_backoffs(worker_t *w, uint64_t now) {
+    uint64_t next = UINT64_MAX;
+    for (int i = 0; i < w->n_clients && w->n_backoff > 0; i++) {
+        client_t *c = &w->clients[i];
+        if (c->state != CONN_BACKOFF) {
+            continue;
+        }
+        if (c->retry_at <= now) {
+            c->state = CONN_CLOSED;
+            w->n_backoff--;
+            release_client(w, c);
+        } else if (c->retry_at < next) {
+            next = c->retry_at;
+        }
+    }
+    return next;
+}
+
+
+// Open a new connection for the client's request
+// Returns 0 on success or -1 on error
+static int connect_client(worker_t *w, client_t *c) {
+    c->fd = socket(server->ai_family, server->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+            server->ai_protocol);
+    if (c->fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    w->results.connects++;
+    c->reused = 0;
+    int res = connect(c->fd, server->ai_addr, server->ai_addrlen);
+    if (res == -1 && errno != EINPROGRESS) {
+        close_client(w, c);
+        return -1;
+    }
+    c->state = res == 0 ? CONN_SENDING : CONN_CONNECTING;
+    if (res == 0) { c->backoff = 0; }
+
+    struct epoll_event event;
+    event.events = EPOLLOUT;
+    event.data.ptr = c;
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, c->fd, &event) == -1) {
+        perror("epoll_ctl");
+        close_client(w, c);
+        return -1;
+    }
+    return 0;
+}
+
+
+// Send the client's request again on a fresh connection. Used when the server
+// closed a kept-alive connection just as the request went out.
+static void retry_request(worker_t *w, client_t *c) {
+    close_client(w, c);
+    c->request_sent = 0;
+    c->header_len = 0;
+    c->header_done = 0;
+    if (connect_client(w, c) == -1) {
+        fail_connect(w, c);
+    }
+}
+
+
+// Start a request on a free client
+// start: When the request was due
+static void start_request(worker_t *w, client_t *c, uint64_t start) {
+    c->target = pick_target(w);
+    c->request_len = snprintf(c->request, REQUEST_MAX,
+            "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n", c->target->path, host_header,
+            close_each ? "Connection: close\r\n" : "");
+    c->request_sent = 0;
+    c->header_len = 0;
+    c->header_done = 0;
+    c->start = start;
+    c->deadline = now_ns() + timeout_ns;
+
+    if (c->state == CONN_IDLE) {
+        c->state = CONN_SENDING;
+        c->reused = 1;
+        set_events(w, c, EPOLLOUT);
+    } else if (connect_client(w, c) == -1) {
+        fail_connect(w, c);
+    }
+}
+
+
+// Returns the value of a header in a complete response header, or NULL
+static const char *find_header(const char *header, const char *name) {
+    size_t len = strlen(name);
+    for (const char *line = strstr(header, "\r\n"); line != NULL;
+            line = strstr(line, "\r\n")) {
+        line += 2;
+        if (strncasecmp(line, name, len) == 0 && line[len] == ':') {
+            const char *value = line + len + 1;
+            while (*value == ' ' || *value == '\t') { value++; }
+            return value;
+        }
+    }
+    return NULL;
+}
+
+
+// Parse the status line and the headers that frame the body
+// Returns 0 on success or -1 if the response is malformed
+static int parse_header(client_t *c) {
+    if (strncmp(c->header, "HTTP/1.", 7) != 0 || c->header_len < 12) {
+        return -1;
+    }
+    int minor_version = c->header[7] - '0';
+    c->status = atoi(c->header + 9);
+    if (c->status < 100 || c->status > STATUS_MAX) {
+        return -1;
+    }
+
+    const char *value = find_header(c->header, "Content-Length");
+    c->content_length = value != NULL ? strtol(value, NULL, 10) : -1;
+    value = find_header(c->header, "Connection");
+    if (value != NULL && strncasecmp(value, "close", 5) == 0) {
+        c->keep_alive = 0;
+    } else if (value != NULL && strncasecmp(value, "keep-alive", 10) == 0) {
+        c->keep_alive = 1;
+    } else {
+        c->keep_alive = minor_version >= 1;
+    }
+    // Without a length the body ends when the connection does
+    if (c->content_length == -1) {
+        c->keep_alive = 0;
+    }
+    c->keep_alive = c->keep_alive && !close_each;
+    return 0;
+}
+
+
+static void finish_request(worker_t *w, client_t *c) {
+    results_t *r = &w->results;
+    uint64_t latency = now_ns() - c->start;
+    r->requests++;
+    r->bytes += c->header_len + c->body_received;
+    r->status[c->status]++;
+    r->counts[bucket_of(latency)]++;
+    r->sum += latency;
+    if (latency > r->max) { r->max = latency; }
+    if (c->status == 200 && c->target->size != -1 &&
+            (long) c->body_received != c->target->size) {
+        r->errors[ERR_LENGTH]++;
+    }
+
+    if (c->keep_alive) {
+        c->state = CONN_IDLE;
+        set_events(w, c, 0);
+    } else {
+        close_client(w, c);
+    }
+    release_client(w, c);
+}
+
+
+// Receive as much of the response as is available
+static void receive_response(worker_t *w, client_t *c) {
+    char chunk[RECV_CHUNK];
+    while (1) {
+        char *buf = chunk;
+        size_t want = RECV_CHUNK;
+        if (!c->header_done) {
+            buf = c->header + c->header_len;
+            want = RESPONSE_HEADER_MAX - 1 - c->header_len;
+        } else if (c->content_length != -1) {
+            size_t left = c->content_length - c->body_received;
+            want = left < want ? left : want;
+        }
+        ssize_t n = want == 0 ? 0 : recv(c->fd, buf, want, 0);
+        if (n == -1) {
+            if (errno == EINTR) { continue; }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { return; }
+            if (c->reused && c->header_len == 0) { retry_request(w, c); }
+            else { fail_request(w, c, ERR_RECV); }
+            return;
+        }
+        if (n == 0 && want > 0) {
+            // The server closed the connection
+            if (c->header_done && c->content_length == -1) {
+                finish_request(w, c);
+            } else if (c->reused && c->header_len == 0) {
+                retry_request(w, c);
+            } else {
+                fail_request(w, c, ERR_RECV);
+            }
+            return;
+        }
+
+        if (!c->header_done) {
+            c->header_len += n;
+            c->header[c->header_len] = '\0';
+            char *end = strstr(c->header, "\r\n\r\n");
+            if (end == NULL) {
+                if (c->header_len == RESPONSE_HEADER_MAX - 1) {
+                    fail_request(w, c, ERR_PARSE);
+                    return;
+                }
+                continue;
+            }
+            // Body bytes that arrived along with the header
+            size_t header_len = end + 4 - c->header;
+            c->body_received = c->header_len - header_len;
+            c->header_len = header_len;
+            end[2] = '\0';
+            c->header_done = 1;
+            if (parse_header(c) == -1) {
+                fail_request(w, c, ERR_PARSE);
+                return;
+            }
+        } else {
+            c->body_received += n;
+        }
+
+        if (c->content_length != -1 && (long) c->body_received >= c->content_length) {
+            if ((long) c->body_received > c->content_length) {
+                fail_request(w, c, ERR_LENGTH);
+            } else {
+                finish_request(w, c);
+            }
+            return;
+        }
+    }
+}
+
+
+static void send_request(worker_t *w, client_t *c) {
+    while (c->request_sent < c->request_len) {
+        ssize_t n = send(c->fd, c->request + c->request_sent,
+                c->request_len - c->request_sent, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) { continue; }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { return; }
+            if (c->reused) { retry_request(w, c); }
+            else { fail_request(w, c, ERR_SEND); }
+            return;
+        }
+        c->request_sent += n;
+    }
+    c->state = CONN_RECEIVING;
+    set_events(w, c, EPOLLIN | EPOLLRDHUP);
+}
+
+
+static void handle_event(worker_t *w, client_t *c, uint32_t events) {
+    if (c->state == CONN_IDLE) {
+        // The server closed a connection that had nothing in flight
+        close_client(w, c);
+        return;
+    }
+    if (c->state == CONN_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+            fail_connect(w, c);
+            return;
+        }
+        c->state = CONN_SENDING;
+        c->backoff = 0;
+    }
+    if (c->state == CONN_SENDING) {
+        send_request(w, c);
+    } else if (c->state == CONN_RECEIVING) {
+        receive_response(w, c);
+    }
+}
+
+
+// Fail every request that has been in flight for too long
+static void expire_requests(worker_t *w, uint64_t now) {
+    for (int i = 0; i < w->n_clients; i++) {
+        client_t *c = &w->clients[i];
+        if (c->state == CONN_CONNECTING && c->deadline <= now) {
+            fail_connect(w, c);
+        } else if (c->state > CONN_CONNECTING && c->deadline <= now) {
+            fail_request(w, c, ERR_TIMEOUT);
+        }
+    }
+}
+
+
+// Issue the requests that are due. In a closed loop every free client sends
+// right away. In an open loop the i-th request is due at begin + i * interval.
+static void issue_requests(worker_t *w, uint64_t now) {
+    // A request that fails right away frees its client again, which must not
+    // be reused until the next round
+    for (int n = w->n_free; n > 0 && w->n_free > 0; n--) {
+        uint64_t due = now;
+        if (w->interval_ns > 0) {
+            due = w->begin + (uint64_t) (w->issued * w->interval_ns);
+            if (due > now) {
+                return;
+            }
+            w->issued++;
+        }
+        client_t *c = &w->clients[w->free_clients[--w->n_free]];
+        start_request(w, c, due);
+    }
+}
+
+
+static void *worker_func(void *arg) {
+    worker_t *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        // Once the run is over, requests in flight are given until their
+        // timeout to finish, so that no server sees a connection cut short
+        // Clients still backing off once the run is over have nothing to wait for
+        uint64_t now = now_ns();
+        uint64_t retry = end_backoffs(w, now < w->end ? now : UINT64_MAX);
+        if (now >= w->end && (w->n_free == w->n_clients || now >= w->end + timeout_ns)) {
+            break;
+        }
+        if (now < w->end) {
+            issue_requests(w, now);
+        }
+
+        // Wake up for the next open loop request, the end of a backoff, the
+        // end of the run or at least often enough to notice timeouts
+        uint64_t wake = w->end > now ? w->end : now + timeout_ns;
+        if (retry < wake) { wake = retry; }
+        if (w->interval_ns > 0 && w->n_free > 0 && now < w->end) {
+            uint64_t due = w->begin + (uint64_t) (w->issued * w->interval_ns);
+            if (due < wake) { wake = due; }
+        }
+        int timeout = wake > now ? (wake - now + 999999) / 1000000 : 0;
+        if (timeout > 100) { timeout = 100; }
+
+        int n_events = epoll_wait(w->epoll_fd, events, MAX_EVENTS, timeout);
+        if (n_events == -1) {
+            if (errno == EINTR) { continue; }
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n_events; i++) {
+            handle_event(w, events[i].data.ptr, events[i].events);
+        }
+        expire_requests(w, now_ns());
+    }
+
+    // Requests that were due but never went out show that the server fell
+    // behind the offered rate
+    if (w->interval_ns > 0) {
+        uint64_t due = (w->end - w->begin) / w->interval_ns;
+        w->results.backlog = due > w->issued ? due - w->issued : 0;
+    }
+    for (int i = 0; i < w->n_clients; i++) {
+        close_client(w, &w->clients[i]);
+    }
+    return NULL;
+}
+
+
+// Build a mix that requests every regular file of a directory equally often
+// Returns 0 on success or -1 on error
+static int load_directory(const char *dir) {
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        perror(dir);
+        return -1;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.' || strlen(entry->d_name) + 2 > PATH_MAX_LEN) {
+            continue;
+        }
+        target_t *grown = realloc(targets, (n_targets + 1) * sizeof(target_t));
+        if (grown == NULL) {
+            perror("realloc");
+            closedir(d);
+            return -1;
+        }
+        targets = grown;
+        snprintf(targets[n_targets].path, PATH_MAX_LEN, "/%s", entry->d_name);
+        targets[n_targets].weight = 1;
+        n_targets++;
+    }
+    closedir(d);
+    return 0;
+}
+
+
+// Read a mix from a file with one "<weight> <path>" line per resource. Blank
+// lines and lines starting with '#' are skipped.
+// Returns 0 on success or -1 on error
+static int load_mix(const char *file) {
+    FILE *f = fopen(file, "r");
+    if (f == NULL) {
+        perror(file);
+        return -1;
+    }
+    char line[PATH_MAX_LEN + 64];
+    int line_no = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line_no++;
+        double weight;
+        char path[PATH_MAX_LEN];
+        if (line[0] == '#' || strspn(line, " \t\r\n") == strlen(line)) {
+            continue;
+        }
+        if (sscanf(line, "%lf %511s", &weight, path) != 2 || weight < 0 ||
+                path[0] != '/') {
+            fprintf(stderr, "%s:%d: expected \"<weight> /<path>\"\n", file, line_no);
+            fclose(f);
+            return -1;
+        }
+        target_t *grown = realloc(targets, (n_targets + 1) * sizeof(target_t));
+        if (grown == NULL) {
+            perror("realloc");
+            fclose(f);
+            return -1;
+        }
+        targets = grown;
+        strcpy(targets[n_targets].path, path);
+        targets[n_targets].weight = weight;
+        n_targets++;
+    }
+    fclose(f);
+    return 0;
+}
+
+
+// Look up the size of each resource in the corpus, so that short bodies are
+// caught. Resources missing from the corpus are not checked.
+static void find_sizes(const char *dir) {
+    for (int i = 0; i < n_targets; i++) {
+        char path[strlen(dir) + PATH_MAX_LEN];
+        snprintf(path, sizeof(path), "%s%s", dir, targets[i].path);
+        struct stat statbuf;
+        targets[i].size = stat(path, &statbuf) == 0 && S_ISREG(statbuf.st_mode)
+            ? statbuf.st_size : -1;
+        total_weight += targets[i].weight;
+    }
+}
+
+
+static void merge_results(results_t *total, const results_t *r) {
+    total->requests += r->requests;
+    total->bytes += r->bytes;
+    for (int i = 0; i < N_ERRORS; i++) { total->errors[i] += r->errors[i]; }
+    for (int i = 0; i <= STATUS_MAX; i++) { total->status[i] += r->status[i]; }
+    total->connects += r->connects;
+    total->connect_failures += r->connect_failures;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) { total->counts[i] += r->counts[i]; }
+    if (r->max > total->max) { total->max = r->max; }
+    total->sum += r->sum;
+    total->backlog += r->backlog;
+}
+
+
+static void print_text(const results_t *r, double secs, double rate,
+        int n_threads, int n_connections) {
+    unsigned long errors = 0;
+    for (int i = 0; i < N_ERRORS; i++) { errors += r->errors[i]; }
+
+    printf("target       %s, %d resources\n", host_header, n_targets);
+    if (rate > 0) {
+        printf("load         open loop at %.1f req/s, %d connections, %d threads, %.1f s\n",
+                rate, n_connections, n_threads, secs);
+    } else {
+        printf("load         closed loop, %d connections, %d threads, %.1f s\n",
+                n_connections, n_threads, secs);
+    }
+    printf("requests     %lu (%.1f req/s)\n", r->requests, r->requests / secs);
+    printf("bytes        %lu (%.2f MB/s)\n", r->bytes, r->bytes / secs / (1 << 20));
+    printf("connections  %lu (%lu failed to connect)\n", r->connects, r->connect_failures);
+    printf("errors       %lu (", errors);
+    for (int i = 0; i < N_ERRORS; i++) {
+        printf("%s%s %lu", i > 0 ? ", " : "", error_names[i], r->errors[i]);
+    }
+    printf(")\n");
+    if (rate > 0) {
+        printf("backlog      %lu requests due but not sent\n", r->backlog);
+    }
+    printf("status      ");
+    for (int i = 0; i <= STATUS_MAX; i++) {
+        if (r->status[i] > 0) { printf(" %d: %lu", i, r->status[i]); }
+    }
+    printf("\nlatency_us   mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p999 %.1f, max %.1f\n",
+            r->requests ? r->sum / r->requests / 1000 : 0,
+            percentile(r, 500) / 1000.0, percentile(r, 900) / 1000.0,
+            percentile(r, 990) / 1000.0, percentile(r, 999) / 1000.0, r->max / 1000.0);
+}
+
+
+static void print_json(const results_t *r, double secs, double rate,
+        int n_threads, int n_connections) {
+    printf("{\"mode\": \"%s\", \"rate\": %.1f, \"threads\": %d, \"connections\": %d, "
+            "\"duration_secs\": %.3f, \"resources\": %d,\n", rate > 0 ? "open" : "closed",
+            rate, n_threads, n_connections, secs, n_targets);
+    printf(" \"requests\": %lu, \"requests_per_sec\": %.1f, \"bytes\": %lu, "
+            "\"bytes_per_sec\": %.1f, \"connects\": %lu, \"connect_failures\": %lu, "
+            "\"backlog\": %lu,\n", r->requests, r->requests / secs, r->bytes,
+            r->bytes / secs, r->connects, r->connect_failures, r->backlog);
+    printf(" \"errors\": {");
+    for (int i = 0; i < N_ERRORS; i++) {
+        printf("%s\"%s\": %lu", i > 0 ? ", " : "", error_names[i], r->errors[i]);
+    }
+    printf("},\n \"status\": {");
+    int first = 1;
+    for (int i = 0; i <= STATUS_MAX; i++) {
+        if (r->status[i] > 0) {
+            printf("%s\"%d\": %lu", first ? "" : ", ", i, r->status[i]);
+            first = 0;
+        }
+    }
+    printf("},\n \"latency_us\": {\"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, "
+            "\"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}}\n",
+            r->requests ? r->sum / r->requests / 1000 : 0,
+            percentile(r, 500) / 1000.0, percentile(r, 900) / 1000.0,
+            percentile(r, 990) / 1000.0, percentile(r, 999) / 1000.0, r->max / 1000.0);
+}
+
+
+static void usage(const char *prog) {
+    printf("Usage: %s [-t threads] [-c connections] [-d secs] [-R rate] [-T timeout_ms]\n"
+           "       [-D dir] [-M mix_file] [-C] [-j] <host> <port>\n", prog);
+    printf("  -t  number of threads (default %d)\n", N_THREADS);
+    printf("  -c  number of connections, spread over the threads (default %d)\n",
+           N_CONNECTIONS);
+    printf("  -d  seconds to run for (default %d)\n", DURATION_SECS);
+    printf("  -R  requests per second to offer in an open loop; without it every\n"
+           "      connection sends its next request once the last one completed\n");
+    printf("  -T  milliseconds after which a request counts as timed out (default %d)\n",
+           TIMEOUT_MS);
+    printf("  -D  directory whose files are requested, each equally often, and\n"
+           "      against which body lengths are checked (default %s)\n", CORPUS_DIR);
+    printf("  -M  file of \"<weight> /<path>\" lines to request instead\n");
+    printf("  -C  open a new connection for every request\n");
+    printf("  -j  print the results as JSON\n");
+}
+
+
+int main(int argc, char **argv) {
+    int n_threads = N_THREADS;
+    int n_connections = N_CONNECTIONS;
+    double duration = DURATION_SECS;
+    double rate = 0;
+    const char *dir = CORPUS_DIR;
+    const char *mix_file = NULL;
+    int json = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:c:d:R:T:D:M:Cj")) != -1) {
+        switch (opt) {
+        case 't': n_threads = atoi(optarg); break;
+        case 'c': n_connections = atoi(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'R': rate = atof(optarg); break;
+        case 'T': timeout_ns = (uint64_t) atol(optarg) * 1000000; break;
+        case 'D': dir = optarg; break;
+        case 'M': mix_file = optarg; break;
+        case 'C': close_each = 1; break;
+        case 'j': json = 1; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (argc - optind != 2 || n_threads <= 0 || n_connections <= 0 ||
+            duration <= 0 || rate < 0 || timeout_ns == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (n_threads > n_connections) {
+        n_threads = n_connections;
+    }
+    const char *host = argv[optind];
+    const char *port = argv[optind + 1];
+    snprintf(host_header, sizeof(host_header), "%s:%s", host, port);
+
+    if ((mix_file != NULL ? load_mix(mix_file) : load_directory(dir)) == -1) {
+        return 1;
+    }
+    find_sizes(dir);
+    if (n_targets == 0 || total_weight <= 0) {
+        fprintf(stderr, "The request mix is empty\n");
+        return 1;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int res = getaddrinfo(host, port, &hints, &server);
+    if (res != 0) {
+        fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(res));
+        return 1;
+    }
+
+    worker_t *workers = calloc(n_threads, sizeof(worker_t));
+    if (workers == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    uint64_t begin = now_ns();
+    uint64_t end = begin + (uint64_t) (duration * 1e9);
+    int n_started = 0;
+    for (; n_started < n_threads; n_started++) {
+        worker_t *w = &workers[n_started];
+        w->id = n_started;
+        w->n_clients = n_connections / n_threads + (n_started < n_connections % n_threads);
+        w->clients = calloc(w->n_clients, sizeof(client_t));
+        w->free_clients = calloc(w->n_clients, sizeof(int));
+        if (w->clients == NULL || w->free_clients == NULL) {
+            perror("calloc");
+            break;
+        }
+        for (int i = 0; i < w->n_clients; i++) {
+            w->clients[i].fd = -1;
+            w->clients[i].state = CONN_CLOSED;
+            w->free_clients[w->n_free++] = w->n_clients - 1 - i;
+        }
+        if ((w->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+            perror("epoll_create1");
+            break;
+        }
+        // Each thread offers its share of the rate, staggered so that the
+        // threads do not all send at the same instant
+        w->interval_ns = rate > 0 ? 1e9 * n_threads / rate : 0;
+        w->begin = begin + (uint64_t) (w->interval_ns * n_started / n_threads);
+        w->end = end;
+        w->rng = 0x9e3779b97f4a7c15ULL * (n_started + 1);
+        int create_result = pthread_create(&w->thread, NULL, worker_func, w);
+        if (create_result != 0) {
+            fprintf(stderr, "pthread_create failed: %s\n", strerror(create_result));
+            close(w->epoll_fd);
+            break;
+        }
+    }
+
+    results_t *total = calloc(1, sizeof(results_t));
+    if (total == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    for (int i = 0; i < n_started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        merge_results(total, &workers[i].results);
+        close(workers[i].epoll_fd);
+    }
+    double secs = (now_ns() - begin) / 1e9;
+
+    if (n_started == n_threads) {
+        if (json) { print_json(total, secs, rate, n_threads, n_connections); }
+        else { print_text(total, secs, rate, n_threads, n_connections); }
+    }
+
+    for (int i = 0; i < n_threads; i++) {
+        free(workers[i].clients);
+        free(workers[i].free_clients);
+    }
+    free(workers);
+    free(total);
+    free(targets);
+    freeaddrinfo(server);
+    return n_started == n_threads ? 0 : 1;
+}
@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mime.h"
+#include "mime_defaults.h"
+
+#define SEPARATORS " \t\r\n"
+
+static const mime_type_t default_type = {
+    "", MIME_DEFAULT_TYPE, "Content-Type: " MIME_DEFAULT_TYPE "\r\n",
+    sizeof("Content-Type: " MIME_DEFAULT_TYPE "\r\n") - 1
+};
+
+// Types in use: the built-in ones, or those loaded from a file
+static const mime_table_t *registry = &mime_default_table;
+static mime_table_t loaded_table;
+static mime_type_t *loaded_types = NULL;  // Each owns one allocation of its strings
+static int n_loaded = 0;
+
+
+// Append the type of an extension, rendering its Content-Type line.
+// Returns 0 on success or -1 on error
+static int add_type(int *capacity, const char *extension, const char *type) {
+    if (n_loaded == *capacity) {
+        int new_capacity = *capacity == 0 ? 256 : *capacity * 2;
+        mime_type_t *types = realloc(loaded_types, new_capacity * sizeof(mime_type_t));
+        if (types == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        loaded_types = types;
+        *capacity = new_capacity;
+    }
+
+    size_t extension_len = strlen(extension);
+    size_t type_len = strlen(type);
+    char *strings = malloc(extension_len + 1 + type_len + 1 +
+            sizeof("Content-Type: \r\n") + type_len);
+    if (strings == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    mime_type_t *added = &loaded_types[n_loaded++];
+    added->extension = strings;
+    memcpy(strings, extension, extension_len + 1);
+    added->type = strings + extension_len + 1;
+    memcpy(strings + extension_len + 1, type, type_len + 1);
+    char *header = strings + extension_len + type_len + 2;
+    added->header = header;
+    added->header_len = sprintf(header, "Content-Type: %s\r\n", type);
+    return 0;
+}
+
+
+int mime_load(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    mime_free();
+
+    int capacity = 0;
+    int ret = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    while (ret == 0 && getline(&line, &line_size, file) != -1) {
+        char *comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+        char *saveptr;
+        const char *type = strtok_r(line, SEPARATORS, &saveptr);
+        if (type == NULL || strlen(type) > MIME_TYPE_MAX || strchr(type, '/') == NULL) {
+            continue;
+        }
+        const char *extension;
+        while (ret == 0 && (extension = strtok_r(NULL, SEPARATORS, &saveptr)) != NULL) {
+            if (strlen(extension) <= MIME_EXTENSION_MAX) {
+                ret = add_type(&capacity, extension, type);
+            }
+        }
+    }
+    if (ret == 0 && ferror(file)) {
+        perror("getline");
+        ret = -1;
+    }
+    free(line);
+    fclose(file);
+
+    // The built-in types fill in what the file leaves out
+    for (uint32_t i = 0; ret == 0 && i < mime_default_table.n_slots; i++) {
+        const mime_type_t *slot = &mime_default_table.slots[i];
+        if (slot->extension != NULL) {
+            ret = add_type(&capacity, slot->extension, slot->type);
+        }
+    }
+
+    if (ret == 0 && mime_table_build(&loaded_table, loaded_types, n_loaded) == 0) {
+        registry = &loaded_table;
+        return 0;
+    }
+    mime_free();
+    return -1;
+}
+
+
+const mime_type_t *mime_type_of(const char *path) {
+    const char *name = strrchr(path, '/');
+    const char *extension = strrchr(name != NULL ? name : path, '.');
+    const mime_type_t *type = NULL;
+    if (extension != NULL) {
+        type = mime_table_lookup(registry, extension + 1);
+    }
+    return type != NULL ? type : &default_type;
+}
+
+
+void mime_free(void) {
+    if (registry == &loaded_table) {
+        mime_table_free(&loaded_table);
+        registry = &mime_default_table;
+    }
+    for (int i = 0; i < n_loaded; i++) {
+        free((char *) loaded_types[i].extension);
+    }
+    free(loaded_types);
+    loaded_types = NULL;
+    n_loaded = 0;
+}
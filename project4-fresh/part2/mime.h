@@ -0,0 +1,74 @@
+#ifndef MIME_H
+#define MIME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MIME_TYPE_MAX 127             // Longer types are not registered
+#define MIME_EXTENSION_MAX 31         // Nor are longer extensions
+#define MIME_DEFAULT_TYPE "application/octet-stream"
+
+// Struct representing the type files with an extension are served as, with
+// the header line announcing it rendered once when it is registered
+typedef struct {
+    const char *extension;    // Without the leading '.', or NULL for a free slot
+    const char *type;
+    const char *header;       // "Content-Type: <type>\r\n"
+    size_t header_len;
+} mime_type_t;
+
+// Struct representing a perfect hash table of types by extension. A hash of
+// the extension picks a bucket, whose displacement moves its extensions to
+// slots no other extension occupies, so a lookup hashes once and compares
+// the one extension in the slot it lands on.
+typedef struct {
+    const mime_type_t *slots;
+    const uint16_t *displacements;    // One per bucket
+    uint32_t n_slots;                 // A power of two
+    uint32_t n_buckets;               // A power of two
+    uint64_t seed;
+} mime_table_t;
+
+/*
+ * Build a perfect hash table of types. Extensions are compared without regard
+ * to case, and the first of several types with the same extension is kept.
+ * table: Pointer to mime_table_t to be initialized, whose slots point to the
+ *        same strings as types
+ * types: The types to register
+ * n_types: Number of types
+ * Returns 0 on success or -1 on error
+ */
+int mime_table_build(mime_table_t *table, const mime_type_t *types, int n_types);
+
+/*
+ * Look up the type of an extension, without the leading '.'.
+ * Returns the type, or NULL if the extension is not in the table
+ */
+const mime_type_t *mime_table_lookup(const mime_table_t *table, const char *extension);
+
+/*
+ * Free a table built by mime_table_build, but not the strings it points to.
+ */
+void mime_table_free(mime_table_t *table);
+
+/*
+ * Register the types of a mime.types file, where each line names a type
+ * followed by its extensions and '#' starts a comment, ahead of the built-in
+ * types. Must be called before any type is looked up.
+ * path: The file to read
+ * Returns 0 on success or -1 on error, leaving the built-in types in place
+ */
+int mime_load(const char *path);
+
+/*
+ * Returns the type of a file by the extension of its path, or the type of
+ * unknown files, MIME_DEFAULT_TYPE, if it has none or an unregistered one
+ */
+const mime_type_t *mime_type_of(const char *path);
+
+/*
+ * Free the types registered by mime_load, going back to the built-in ones.
+ */
+void mime_free(void);
+
+#endif // MIME_H
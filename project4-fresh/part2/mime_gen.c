@@ -0,0 +1,49 @@
+// Generates mime_defaults.h: the perfect hash table of the built-in types
+// listed in mime_types.def, with their Content-Type lines, as static data,
+// so that the server starts with a table that was built at compile time.
+//
+// Usage: ./mime_gen > mime_defaults.h
+
+#include <stdio.h>
+#include <string.h>
+
+#include "mime.h"
+
+#define MIME_TYPE(type, extension) { extension, type, NULL, 0 },
+static const mime_type_t types[] = {
+#include "mime_types.def"
+};
+#undef MIME_TYPE
+
+
+int main(void) {
+    mime_table_t table;
+    if (mime_table_build(&table, types, sizeof(types) / sizeof(types[0])) == -1) {
+        return 1;
+    }
+
+    printf("// Generated by mime_gen from mime_types.def, do not edit\n\n");
+    printf("static const mime_type_t mime_default_slots[%u] = {\n", table.n_slots);
+    for (uint32_t i = 0; i < table.n_slots; i++) {
+        const mime_type_t *slot = &table.slots[i];
+        if (slot->extension != NULL) {
+            printf("    [%u] = { \"%s\", \"%s\", \"Content-Type: %s\\r\\n\", %zu },\n",
+                    i, slot->extension, slot->type, slot->type,
+                    sizeof("Content-Type: \r\n") - 1 + strlen(slot->type));
+        }
+    }
+    printf("};\n\n");
+
+    printf("static const uint16_t mime_default_displacements[%u] = {", table.n_buckets);
+    for (uint32_t b = 0; b < table.n_buckets; b++) {
+        printf("%s%u", b % 16 == 0 ? "\n    " : " ", table.displacements[b]);
+        if (b + 1 < table.n_buckets) { printf(","); }
+    }
+    printf("\n};\n\n");
+
+    printf("static const mime_table_t mime_default_table = {\n"
+           "    mime_default_slots, mime_default_displacements, %u, %u, 0x%016llxULL\n"
+           "};\n", table.n_slots, table.n_buckets, (unsigned long long) table.seed);
+    mime_table_free(&table);
+    return 0;
+}
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "mime.h"
+
+#define MAX_DISPLACEMENT 65535
+#define MAX_SEEDS 64
+#define MAX_BUCKETS 65536
+
+
+// 64-bit FNV-1a hash of an extension, ignoring case, finished with the
+// MurmurHash3 finalizer so that every bit depends on every byte
+static uint64_t hash_extension(const char *extension, uint64_t seed) {
+    uint64_t hash = 0xcbf29ce484222325ULL ^ seed;
+    for (const unsigned char *p = (const unsigned char *) extension; *p != '\0'; p++) {
+        hash ^= *p >= 'A' && *p <= 'Z' ? *p + ('a' - 'A') : *p;
+        hash *= 0x100000001b3ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+
+// The top bits of the hash pick the bucket, the middle ones how far a
+// displacement moves the extension and the bottom ones where it starts
+static uint32_t bucket_of(uint64_t hash, uint32_t n_buckets) {
+    return (hash >> 48) & (n_buckets - 1);
+}
+
+
+static uint32_t slot_of(uint64_t hash, uint32_t displacement, uint32_t n_slots) {
+    uint32_t step = ((hash >> 24) & 0xffffff) | 1;
+    return ((uint32_t) hash + displacement * step) & (n_slots - 1);
+}
+
+
+// Find a displacement that moves every extension of a bucket to a free slot
+// and take those slots. Only the first of repeated extensions is placed.
+// Returns 0 on success or -1 if the bucket cannot be placed with this seed
+static int place_bucket(const mime_type_t *types, const uint64_t *hashes, int *members,
+        int n_members, mime_type_t *slots, uint32_t n_slots, uint32_t *positions,
+        uint16_t *displacement) {
+    for (int j = 0; j < n_members; j++) {
+        for (int i = 0; i < j && members[j] != -1; i++) {
+            if (members[i] == -1 || hashes[members[i]] != hashes[members[j]]) {
+                continue;
+            }
+            if (strcasecmp(types[members[i]].extension, types[members[j]].extension) != 0) {
+                return -1; // Different extensions no displacement can separate
+            }
+            members[j] = -1;
+        }
+    }
+
+    for (uint32_t d = 0; d <= MAX_DISPLACEMENT; d++) {
+        int placed = 1;
+        for (int j = 0; j < n_members && placed; j++) {
+            if (members[j] == -1) {
+                continue;
+            }
+            positions[j] = slot_of(hashes[members[j]], d, n_slots);
+            placed = slots[positions[j]].extension == NULL;
+            for (int i = 0; i < j && placed; i++) {
+                placed = members[i] == -1 || positions[i] != positions[j];
+            }
+        }
+        if (placed) {
+            for (int j = 0; j < n_members; j++) {
+                if (members[j] != -1) {
+                    slots[positions[j]] = types[members[j]];
+                }
+            }
+            *displacement = d;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+// Place every bucket, the largest first while most slots are still free.
+// Returns 0 on success or -1 if some bucket cannot be placed with this seed
+static int place_buckets(const mime_type_t *types, int n_types, uint64_t seed,
+        uint64_t *hashes, int *order, uint32_t *starts, uint32_t *positions,
+        mime_table_t *table, mime_type_t *slots, uint16_t *displacements) {
+    // Sort the types by bucket, keeping their order within each bucket
+    memset(starts, 0, (table->n_buckets + 1) * sizeof(uint32_t));
+    for (int i = 0; i < n_types; i++) {
+        hashes[i] = hash_extension(types[i].extension, seed);
+        starts[bucket_of(hashes[i], table->n_buckets) + 1]++;
+    }
+    uint32_t max_size = 0;
+    for (uint32_t b = 0; b < table->n_buckets; b++) {
+        if (starts[b + 1] > max_size) { max_size = starts[b + 1]; }
+        starts[b + 1] += starts[b];
+    }
+    for (int i = 0; i < n_types; i++) {
+        uint32_t b = bucket_of(hashes[i], table->n_buckets);
+        order[starts[b]++] = i;
+    }
+    for (uint32_t b = table->n_buckets; b > 0; b--) {
+        starts[b] = starts[b - 1];
+    }
+    starts[0] = 0;
+
+    memset(slots, 0, table->n_slots * sizeof(mime_type_t));
+    memset(displacements, 0, table->n_buckets * sizeof(uint16_t));
+    for (uint32_t size = max_size; size > 0; size--) {
+        for (uint32_t b = 0; b < table->n_buckets; b++) {
+            if (starts[b + 1] - starts[b] == size && place_bucket(types, hashes,
+                        order + starts[b], size, slots, table->n_slots, positions,
+                        &displacements[b]) == -1) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+
+int mime_table_build(mime_table_t *table, const mime_type_t *types, int n_types) {
+    // At most half of the slots are used and buckets hold about four types
+    memset(table, 0, sizeof(mime_table_t));
+    table->n_slots = 8;
+    while (table->n_slots < 2 * (uint32_t) n_types) { table->n_slots *= 2; }
+    table->n_buckets = 1;
+    while (table->n_buckets * 4 < (uint32_t) n_types) { table->n_buckets *= 2; }
+    if (table->n_buckets > MAX_BUCKETS) {
+        fprintf(stderr, "Too many MIME types: %d\n", n_types);
+        return -1;
+    }
+
+    uint64_t *hashes = malloc((n_types + 1) * sizeof(uint64_t));
+    int *order = malloc((n_types + 1) * sizeof(int));
+    uint32_t *positions = malloc((n_types + 1) * sizeof(uint32_t));
+    uint32_t *starts = malloc((table->n_buckets + 1) * sizeof(uint32_t));
+    mime_type_t *slots = malloc(table->n_slots * sizeof(mime_type_t));
+    uint16_t *displacements = malloc(table->n_buckets * sizeof(uint16_t));
+    int ret = -1;
+    if (hashes == NULL || order == NULL || positions == NULL || starts == NULL ||
+            slots == NULL || displacements == NULL) {
+        perror("malloc");
+    } else {
+        for (int i = 0; i < MAX_SEEDS && ret == -1; i++) {
+            table->seed = i * 0x9e3779b97f4a7c15ULL;
+            ret = place_buckets(types, n_types, table->seed, hashes, order, starts,
+                    positions, table, slots, displacements);
+        }
+        if (ret == -1) {
+            fprintf(stderr, "Failed to find a perfect hash for %d MIME types\n", n_types);
+        }
+    }
+
+    free(hashes);
+    free(order);
+    free(positions);
+    free(starts);
+    if (ret == -1) {
+        free(slots);
+        free(displacements);
+        return -1;
+    }
+    table->slots = slots;
+    table->displacements = displacements;
+    return 0;
+}
+
+
+const mime_type_t *mime_table_lookup(const mime_table_t *table, const char *extension) {
+    uint64_t hash = hash_extension(extension, table->seed);
+    uint32_t displacement = table->displacements[bucket_of(hash, table->n_buckets)];
+    const mime_type_t *slot = &table->slots[slot_of(hash, displacement, table->n_slots)];
+    if (slot->extension == NULL || strcasecmp(slot->extension, extension) != 0) {
+        return NULL;
+    }
+    return slot;
+}
+
+
+void mime_table_free(mime_table_t *table) {
+    free((mime_type_t *) table->slots);
+    free((uint16_t *) table->displacements);
+    table->slots = NULL;
+    table->displacements = NULL;
+}
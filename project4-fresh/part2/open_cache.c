@@ -0,0 +1,498 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "open_cache.h"
+#include "stats.h"
+
+#define INITIAL_BUCKETS 64
+#define EVENT_BUFFER 4096
+// Anything that may change what opening a path in a directory finds. Events
+// about subdirectories carry IN_ISDIR.
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | \
+        IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | \
+        IN_DONT_FOLLOW | IN_ONLYDIR)
+
+
+static open_cache_shard_t *shard_for(open_cache_t *cache, uint64_t hash) {
+    return &cache->shards[(hash >> 56) % OPEN_CACHE_SHARDS];
+}
+
+
+// Find an entry in a shard. Must be called with shard->lock held.
+static open_entry_t *shard_find(open_cache_shard_t *shard, uint64_t hash,
+        const char *path) {
+    path_node_t *node = path_table_find(&shard->table, hash, path);
+    return node != NULL ? PATH_ENTRY(node, open_entry_t, node) : NULL;
+}
+
+
+// Remove an entry from a shard and drop the shard's reference to it.
+// Must be called with shard->lock held.
+static void shard_remove(open_cache_shard_t *shard, open_entry_t *entry) {
+    path_table_remove(&shard->table, &entry->node);
+    lru_unlink(&shard->lru, &entry->lru);
+    open_cache_release(entry);
+}
+
+
+// Drop the entry of a path and tell the owner. Entries opened before this are
+// kept out by the generation, which changes under the same lock.
+static void invalidate(open_cache_t *cache, const char *path) {
+    uint64_t hash = path_hash(path);
+    open_cache_shard_t *shard = shard_for(cache, hash);
+    pthread_mutex_lock(&shard->lock);
+    atomic_fetch_add(&cache->generation, 1);
+    open_entry_t *entry = shard_find(shard, hash, path);
+    if (entry != NULL) {
+        shard_remove(shard, entry);
+        atomic_fetch_add_explicit(&cache->invalidations, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    if (cache->on_invalidate != NULL) {
+        cache->on_invalidate(cache->on_invalidate_arg, path + cache->root_len);
+    }
+}
+
+
+static void invalidate_all(open_cache_t *cache) {
+    for (int i = 0; i < OPEN_CACHE_SHARDS; i++) {
+        open_cache_shard_t *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        atomic_fetch_add(&cache->generation, 1);
+        while (shard->lru.head != NULL) {
+            shard_remove(shard, PATH_ENTRY(shard->lru.head, open_entry_t, lru));
+            atomic_fetch_add_explicit(&cache->invalidations, 1, memory_order_relaxed);
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    if (cache->on_invalidate != NULL) {
+        cache->on_invalidate(cache->on_invalidate_arg, NULL);
+    }
+}
+
+
+// Only paths named the way inotify events name them can be invalidated, so
+// paths outside the tree or with empty, "." or ".." components are not cached
+static int is_canonical(const open_cache_t *cache, const char *path) {
+    if (strncmp(path, cache->root, cache->root_len) != 0 || path[cache->root_len] != '/') {
+        return 0;
+    }
+    const char *p = path + cache->root_len;
+    while (*p == '/') {
+        const char *name = p + 1;
+        const char *end = strchrnul(name, '/');
+        size_t len = end - name;
+        if (len == 0 || (name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.')))) {
+            return 0;
+        }
+        p = end;
+    }
+    return 1;
+}
+
+
+// Returns 1 if the directory a path is in is watched, so that changes to the
+// path are seen, or 0 otherwise, for instance if it is reached by a symlink
+static int in_watched_dir(open_cache_t *cache, const char *path) {
+    size_t dir_len = strrchr(path, '/') - path;
+    int watched = 0;
+    pthread_mutex_lock(&cache->watch_lock);
+    for (int i = 0; i < cache->n_watches && !watched; i++) {
+        const char *dir = cache->watches[i].path;
+        watched = dir != NULL && strncmp(dir, path, dir_len) == 0 && dir[dir_len] == '\0';
+    }
+    pthread_mutex_unlock(&cache->watch_lock);
+    return watched;
+}
+
+
+// Watch a directory and every directory below it, without following symlinks.
+// Must be called with cache->watch_lock held.
+// Returns 0 on success or -1 if some directory could not be watched
+static int watch_tree(open_cache_t *cache, const char *dir_path) {
+    int wd = inotify_add_watch(cache->inotify_fd, dir_path, WATCH_MASK);
+    if (wd == -1) {
+        fprintf(stderr, "inotify_add_watch %s: %s\n", dir_path, strerror(errno));
+        return -1;
+    }
+    if (wd >= cache->n_watches) {
+        int n_watches = cache->n_watches == 0 ? 64 : cache->n_watches;
+        while (n_watches <= wd) { n_watches *= 2; }
+        open_cache_watch_t *watches = realloc(cache->watches,
+                n_watches * sizeof(open_cache_watch_t));
+        if (watches == NULL) {
+            perror("realloc");
+            inotify_rm_watch(cache->inotify_fd, wd);
+            return -1;
+        }
+        for (int i = cache->n_watches; i < n_watches; i++) {
+            watches[i].wd = -1;
+            watches[i].path = NULL;
+        }
+        cache->watches = watches;
+        cache->n_watches = n_watches;
+    }
+    char *path = strdup(dir_path);
+    if (path == NULL) {
+        perror("strdup");
+        inotify_rm_watch(cache->inotify_fd, wd);
+        return -1;
+    }
+    free(cache->watches[wd].path);
+    cache->watches[wd].wd = wd;
+    cache->watches[wd].path = path;
+
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        fprintf(stderr, "opendir %s: %s\n", dir_path, strerror(errno));
+        return -1;
+    }
+    int ret = 0;
+    struct dirent *dirent;
+    while (ret == 0 && (dirent = readdir(dir)) != NULL) {
+        if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+            continue;
+        }
+        char child[strlen(dir_path) + strlen(dirent->d_name) + 2];
+        sprintf(child, "%s/%s", dir_path, dirent->d_name);
+        struct stat statbuf;
+        int is_dir = dirent->d_type == DT_DIR || (dirent->d_type == DT_UNKNOWN &&
+                lstat(child, &statbuf) == 0 && S_ISDIR(statbuf.st_mode));
+        if (is_dir) {
+            ret = watch_tree(cache, child);
+        }
+    }
+    closedir(dir);
+    return ret;
+}
+
+
+// Forget every watch. Must be called with cache->watch_lock held.
+static void unwatch_all(open_cache_t *cache) {
+    for (int i = 0; i < cache->n_watches; i++) {
+        if (cache->watches[i].wd != -1) {
+            inotify_rm_watch(cache->inotify_fd, cache->watches[i].wd);
+            cache->watches[i].wd = -1;
+        }
+        free(cache->watches[i].path);
+        cache->watches[i].path = NULL;
+    }
+}
+
+
+// A directory of the tree was created, removed or renamed, which moves every
+// path below it. Watch the tree as it is now and start over.
+static void rewatch(open_cache_t *cache) {
+    pthread_mutex_lock(&cache->watch_lock);
+    unwatch_all(cache);
+    if (watch_tree(cache, cache->root) == -1) {
+        fprintf(stderr, "Some directories are no longer watched, their files are not cached\n");
+    }
+    pthread_mutex_unlock(&cache->watch_lock);
+    invalidate_all(cache);
+}
+
+
+// Invalidate the entries of the paths the events name
+static void handle_events(open_cache_t *cache, const char *buf, ssize_t len) {
+    int rescan = 0;
+    const struct inotify_event *event;
+    for (const char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + event->len) {
+        event = (const struct inotify_event *) p;
+        if (event->mask & (IN_Q_OVERFLOW | IN_ISDIR | IN_DELETE_SELF | IN_MOVE_SELF)) {
+            rescan = 1;
+            continue;
+        }
+        if (event->len == 0 || event->wd < 0) {
+            continue; // IN_IGNORED, for a watch that is gone
+        }
+
+        pthread_mutex_lock(&cache->watch_lock);
+        const char *dir = event->wd < cache->n_watches ? cache->watches[event->wd].path : NULL;
+        char path[(dir != NULL ? strlen(dir) : 0) + strlen(event->name) + 2];
+        if (dir != NULL) {
+            sprintf(path, "%s/%s", dir, event->name);
+        }
+        pthread_mutex_unlock(&cache->watch_lock);
+        if (dir != NULL) {
+            invalidate(cache, path);
+        }
+    }
+    if (rescan) {
+        rewatch(cache);
+    }
+}
+
+
+static void *watcher_func(void *arg) {
+    open_cache_t *cache = arg;
+    stats_set_thread_name("open cache");
+    char buf[EVENT_BUFFER] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    struct pollfd fds[2];
+    fds[0].fd = cache->inotify_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = cache->wakeup_fd;
+    fds[1].events = POLLIN;
+    while (1) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) { continue; }
+            perror("poll");
+            break;
+        }
+        if (fds[1].revents != 0) {
+            return NULL;
+        }
+        ssize_t len = read(cache->inotify_fd, buf, sizeof(buf));
+        if (len == -1) {
+            if (errno == EINTR || errno == EAGAIN) { continue; }
+            perror("read");
+            break;
+        }
+        handle_events(cache, buf, len);
+    }
+
+    // Without the events entries could go stale, so stop caching
+    fprintf(stderr, "No longer watching %s, disabling the open file cache\n", cache->root);
+    pthread_mutex_lock(&cache->watch_lock);
+    unwatch_all(cache);
+    pthread_mutex_unlock(&cache->watch_lock);
+    invalidate_all(cache);
+    return NULL;
+}
+
+
+int open_cache_init(open_cache_t *cache, const char *root, int max_entries,
+        const mime_type_t *(*content_type_of)(const char *path),
+        void (*on_invalidate)(void *arg, const char *path), void *on_invalidate_arg) {
+    int err;
+    memset(cache, 0, sizeof(open_cache_t));
+    cache->root = root;
+    cache->root_len = strlen(root);
+    while (cache->root_len > 1 && root[cache->root_len - 1] == '/') {
+        cache->root_len--;
+    }
+    cache->shard_max = max_entries / OPEN_CACHE_SHARDS > 0 ? max_entries / OPEN_CACHE_SHARDS : 1;
+    cache->content_type_of = content_type_of;
+    cache->on_invalidate = on_invalidate;
+    cache->on_invalidate_arg = on_invalidate_arg;
+
+    // The root is watched under the name requests use for it
+    char *root_copy = strndup(root, cache->root_len);
+    if (root_copy == NULL) {
+        perror("strndup");
+        return -1;
+    }
+    cache->root = root_copy;
+
+    int n_shards = 0;
+    for (; n_shards < OPEN_CACHE_SHARDS; n_shards++) {
+        open_cache_shard_t *shard = &cache->shards[n_shards];
+        if (path_table_init(&shard->table, INITIAL_BUCKETS) == -1) {
+            break;
+        }
+        if ((err = pthread_mutex_init(&shard->lock, NULL)) != 0) {
+            fprintf(stderr, "pthread_mutex_init failed: %s\n", strerror(err));
+            path_table_free(&shard->table);
+            break;
+        }
+    }
+    if (n_shards == OPEN_CACHE_SHARDS &&
+            (err = pthread_mutex_init(&cache->watch_lock, NULL)) != 0) {
+        fprintf(stderr, "pthread_mutex_init failed: %s\n", strerror(err));
+    } else if (n_shards == OPEN_CACHE_SHARDS) {
+        if ((cache->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+            perror("inotify_init1");
+        } else if ((cache->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+            perror("eventfd");
+            close(cache->inotify_fd);
+        } else {
+            pthread_mutex_lock(&cache->watch_lock);
+            int watched = watch_tree(cache, cache->root);
+            pthread_mutex_unlock(&cache->watch_lock);
+            if (watched == -1) {
+                fprintf(stderr, "Failed to watch %s\n", cache->root);
+            } else {
+                // Signals are for the threads serving requests
+                sigset_t all_signals, old_signals;
+                sigfillset(&all_signals);
+                pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+                err = pthread_create(&cache->watcher, NULL, watcher_func, cache);
+                pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+                if (err == 0) {
+                    return 0;
+                }
+                fprintf(stderr, "pthread_create failed: %s\n", strerror(err));
+            }
+            unwatch_all(cache);
+            free(cache->watches);
+            close(cache->wakeup_fd);
+            close(cache->inotify_fd);
+        }
+        pthread_mutex_destroy(&cache->watch_lock);
+    }
+
+    for (int i = 0; i < n_shards; i++) {
+        path_table_free(&cache->shards[i].table);
+        pthread_mutex_destroy(&cache->shards[i].lock);
+    }
+    free(root_copy);
+    return -1;
+}
+
+
+open_entry_t *open_cache_get(open_cache_t *cache, const char *path) {
+    if (!is_canonical(cache, path)) {
+        return NULL;
+    }
+    uint64_t hash = path_hash(path);
+    open_cache_shard_t *shard = shard_for(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    open_entry_t *entry = shard_find(shard, hash, path);
+    if (entry != NULL) {
+        atomic_fetch_add(&entry->refs, 1);
+        lru_unlink(&shard->lru, &entry->lru);
+        lru_push_front(&shard->lru, &entry->lru);
+        pthread_mutex_unlock(&shard->lock);
+        atomic_fetch_add_explicit(&cache->hits, 1, memory_order_relaxed);
+        return entry;
+    }
+    unsigned long generation = atomic_load(&cache->generation);
+    pthread_mutex_unlock(&shard->lock);
+
+    if (!in_watched_dir(cache, path)) {
+        return NULL;
+    }
+    atomic_fetch_add_explicit(&cache->misses, 1, memory_order_relaxed);
+
+    // A symlink may point anywhere, so the caller opens those itself
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    struct stat statbuf;
+    if (fd == -1 && errno != ENOENT && errno != ENOTDIR) {
+        return NULL;
+    }
+    if (fd != -1 && fstat(fd, &statbuf) == -1) {
+        perror("fstat");
+        close(fd);
+        return NULL;
+    }
+    // Directories and other special files are served as missing
+    if (fd != -1 && !S_ISREG(statbuf.st_mode)) {
+        close(fd);
+        fd = -1;
+    }
+
+    size_t path_len = strlen(path);
+    if ((entry = malloc(sizeof(open_entry_t) + path_len + 1)) == NULL) {
+        perror("malloc");
+        if (fd != -1) { close(fd); }
+        return NULL;
+    }
+    char *path_copy = (char *) (entry + 1);
+    memcpy(path_copy, path, path_len + 1);
+    entry->node.hash = hash;
+    entry->node.path = path_copy;
+    entry->fd = fd;
+    if (fd != -1) {
+        entry->statbuf = statbuf;
+        entry->content_type = cache->content_type_of(path);
+    } else {
+        memset(&entry->statbuf, 0, sizeof(struct stat));
+        entry->content_type = NULL;
+    }
+    atomic_init(&entry->refs, 1);
+
+    // What was opened after an invalidation may already be outdated, in which
+    // case it only serves this request
+    pthread_mutex_lock(&shard->lock);
+    if (generation == atomic_load(&cache->generation)) {
+        open_entry_t *existing = shard_find(shard, hash, path);
+        if (existing != NULL) {
+            atomic_fetch_add(&existing->refs, 1);
+            pthread_mutex_unlock(&shard->lock);
+            open_cache_release(entry);
+            return existing;
+        }
+        while (shard->table.n_nodes >= (size_t) cache->shard_max) {
+            shard_remove(shard, PATH_ENTRY(shard->lru.tail, open_entry_t, lru));
+        }
+        atomic_fetch_add(&entry->refs, 1); // the shard's reference
+        path_table_insert(&shard->table, &entry->node);
+        lru_push_front(&shard->lru, &entry->lru);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return entry;
+}
+
+
+void open_cache_release(open_entry_t *entry) {
+    if (atomic_fetch_sub(&entry->refs, 1) == 1) {
+        if (entry->fd != -1 && close(entry->fd) == -1) { perror("close"); }
+        free(entry);
+    }
+}
+
+
+void open_cache_report(FILE *out, void *arg) {
+    open_cache_t *cache = arg;
+    size_t n_entries = 0;
+    for (int i = 0; i < OPEN_CACHE_SHARDS; i++) {
+        open_cache_shard_t *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        n_entries += shard->table.n_nodes;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    fprintf(out, "open cache: %zu entries, %ld hits, %ld misses, %ld invalidated\n",
+            n_entries, atomic_load(&cache->hits), atomic_load(&cache->misses),
+            atomic_load(&cache->invalidations));
+}
+
+
+int open_cache_free(open_cache_t *cache) {
+    int ret = 0;
+    int err;
+    uint64_t one = 1;
+    if (write(cache->wakeup_fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("write");
+        ret = -1;
+    } else if ((err = pthread_join(cache->watcher, NULL)) != 0) {
+        fprintf(stderr, "pthread_join failed: %s\n", strerror(err));
+        ret = -1;
+    }
+
+    pthread_mutex_lock(&cache->watch_lock);
+    unwatch_all(cache);
+    pthread_mutex_unlock(&cache->watch_lock);
+    free(cache->watches);
+    if (close(cache->inotify_fd) == -1) { perror("close"); ret = -1; }
+    if (close(cache->wakeup_fd) == -1) { perror("close"); ret = -1; }
+    if ((err = pthread_mutex_destroy(&cache->watch_lock)) != 0) {
+        fprintf(stderr, "pthread_mutex_destroy failed: %s\n", strerror(err));
+        ret = -1;
+    }
+
+    for (int i = 0; i < OPEN_CACHE_SHARDS; i++) {
+        open_cache_shard_t *shard = &cache->shards[i];
+        while (shard->lru.head != NULL) {
+            shard_remove(shard, PATH_ENTRY(shard->lru.head, open_entry_t, lru));
+        }
+        path_table_free(&shard->table);
+        if ((err = pthread_mutex_destroy(&shard->lock)) != 0) {
+            fprintf(stderr, "pthread_mutex_destroy failed: %s\n", strerror(err));
+            ret = -1;
+        }
+    }
+    free((char *) cache->root);
+    return ret;
+}
@@ -0,0 +1,113 @@
+#ifndef OPEN_CACHE_H
+#define OPEN_CACHE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "mime.h"
+#include "path_table.h"
+
+#define OPEN_CACHE_SHARDS 16
+
+// Struct representing what opening a path found: the open file, its status
+// and type, or that there is no regular file there. The descriptor is shared
+// by every response using the entry, which only read it at explicit offsets,
+// and is closed once the entry is invalidated and the last of them released.
+typedef struct open_entry {
+    path_node_t node;         // Keyed by the path that was opened
+    int fd;                   // Open file, or -1 for a path that is not one
+    struct stat statbuf;
+    const mime_type_t *content_type;  // Type of the file, or NULL if there is none
+    atomic_int refs;
+    lru_node_t lru;
+} open_entry_t;
+
+// Struct representing one independently locked part of the cache
+typedef struct {
+    path_table_t table;
+    lru_list_t lru;
+    pthread_mutex_t lock;
+} open_cache_shard_t;
+
+// Struct representing a watched directory of the served tree
+typedef struct {
+    int wd;                   // inotify watch descriptor, or -1 if unused
+    char *path;
+} open_cache_watch_t;
+
+// Struct representing a cache of open files and of paths that are not files,
+// below the served directory. Entries are never stale for long: a thread
+// watching every directory of the tree with inotify drops an entry as soon as
+// its path is written to, replaced or removed, and the whole cache when the
+// tree's directories change. Only paths in watched directories are cached.
+typedef struct {
+    const char *root;         // The served directory, without a trailing '/'
+    size_t root_len;
+    int shard_max;            // Entries kept per shard
+    const mime_type_t *(*content_type_of)(const char *path);
+    void (*on_invalidate)(void *arg, const char *path);
+    void *on_invalidate_arg;
+    atomic_ulong generation;  // Bumped by every invalidation
+    atomic_long hits;
+    atomic_long misses;
+    atomic_long invalidations;
+    open_cache_shard_t shards[OPEN_CACHE_SHARDS];
+
+    int inotify_fd;
+    int wakeup_fd;            // eventfd used to stop the watcher
+    pthread_t watcher;
+    pthread_mutex_t watch_lock;   // Guards the watches below
+    open_cache_watch_t *watches;  // Indexed by watch descriptor
+    int n_watches;            // Slots in watches
+} open_cache_t;
+
+/*
+ * Initialize an empty cache, watch every directory below root and start the
+ * thread that invalidates entries as they change.
+ * cache: Pointer to open_cache_t to be initialized
+ * root: The served directory
+ * max_entries: Number of paths kept in the cache
+ * content_type_of: Returns the type of the file at a path
+ * on_invalidate: Called from the watcher thread with each path that changes,
+ *                relative to root and starting with '/', or with NULL when the
+ *                whole tree may have; may be NULL
+ * on_invalidate_arg: Passed to on_invalidate
+ * Returns 0 on success or -1 on error, including when the tree cannot be
+ * watched in full
+ */
+int open_cache_init(open_cache_t *cache, const char *root, int max_entries,
+        const mime_type_t *(*content_type_of)(const char *path),
+        void (*on_invalidate)(void *arg, const char *path), void *on_invalidate_arg);
+
+/*
+ * Look up a path, opening it if it is not cached.
+ * cache: A pointer to the open_cache_t to search
+ * path: The path of the requested resource below the served directory
+ * Returns a referenced entry that must be passed to open_cache_release, or
+ * NULL if the path cannot be cached and the caller should open it itself
+ */
+open_entry_t *open_cache_get(open_cache_t *cache, const char *path);
+
+/*
+ * Drop a reference obtained from open_cache_get.
+ */
+void open_cache_release(open_entry_t *entry);
+
+/*
+ * Write the number of entries, hits, misses and invalidations to 'out'.
+ * Meant to be registered with stats_add_reporter.
+ * arg: A pointer to the open_cache_t
+ */
+void open_cache_report(FILE *out, void *arg);
+
+/*
+ * Stop watching the tree and free the cache. Files still used by responses
+ * are closed once those are released.
+ * Returns 0 on success or -1 on error
+ */
+int open_cache_free(open_cache_t *cache);
+
+#endif // OPEN_CACHE_H
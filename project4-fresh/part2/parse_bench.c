@@ -0,0 +1,156 @@
+// Microbenchmark for the HTTP request parser. Parses a small corpus of
+// realistic requests over and over on a single thread and reports the
+// throughput, both with every request arriving in one read and with requests
+// trickling in a few bytes at a time.
+//
+// Usage: ./parse_bench [seconds per run]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "http_parser.h"
+
+static const char *corpus[] = {
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: localhost:8000\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+
+    "GET /images/logo.png HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: image\r\n"
+    "Referer: https://www.example.com/\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark\r\n"
+    "\r\n",
+
+    "GET /docs/manual.pdf HTTP/1.0\r\n"
+    "Host: localhost\r\n"
+    "Range: bytes=0-65535\r\n"
+    "If-None-Match: \"5f3a-1b2c3d\"\r\n"
+    "\r\n",
+
+    "GET /static/app%20bundle.js?v=3f2a9c&lang=en HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+};
+
+// The file each request of the corpus names
+static const char *expected_names[] = {
+    "/index.html",
+    "/images/logo.png",
+    "/docs/manual.pdf",
+    "/static/app bundle.js",
+};
+
+#define N_REQUESTS (sizeof(corpus) / sizeof(corpus[0]))
+
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+// Parse every request of the corpus once, feeding each 'chunk' bytes at a time
+// (or all at once if chunk is 0).
+// Returns a checksum of the results so the work can't be optimized away
+static size_t parse_corpus(const size_t *lens, size_t chunk) {
+    size_t sum = 0;
+    http_parser_t parser;
+    http_request_t req;
+    for (size_t i = 0; i < N_REQUESTS; i++) {
+        init_http_parser(&parser);
+        size_t len = chunk == 0 ? lens[i] : 0;
+        int res;
+        while (1) {
+            if (chunk != 0) {
+                len = len + chunk < lens[i] ? len + chunk : lens[i];
+            }
+            res = parse_http_request(&parser, corpus[i], len, &req);
+            if (res != 1 || len == lens[i]) { break; }
+        }
+        if (res != 0) {
+            fprintf(stderr, "Request %zu failed to parse (%d)\n", i, parser.error);
+            exit(1);
+        }
+        sum += req.length + req.n_headers + req.target.len;
+    }
+    return sum;
+}
+
+
+static void run(const char *name, const size_t *lens, size_t chunk, double seconds) {
+    size_t corpus_bytes = 0;
+    for (size_t i = 0; i < N_REQUESTS; i++) {
+        corpus_bytes += lens[i];
+    }
+
+    // Warm up caches and branch predictors
+    size_t checksum = 0;
+    for (int i = 0; i < 10000; i++) {
+        checksum += parse_corpus(lens, chunk);
+    }
+
+    long rounds = 0;
+    double start = now();
+    double elapsed;
+    do {
+        for (int i = 0; i < 1000; i++) {
+            checksum += parse_corpus(lens, chunk);
+        }
+        rounds += 1000;
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+
+    double requests = (double) rounds * N_REQUESTS;
+    printf("%-14s %12.0f req/s per core  %8.1f MB/s  %6.1f ns/req  (checksum %zu)\n",
+            name, requests / elapsed, rounds * corpus_bytes / elapsed / 1e6,
+            elapsed / requests * 1e9, checksum);
+}
+
+
+int main(int argc, char **argv) {
+    double seconds = argc > 1 ? atof(argv[1]) : 2.0;
+    if (seconds <= 0) {
+        fprintf(stderr, "Usage: %s [seconds per run]\n", argv[0]);
+        return 1;
+    }
+
+    size_t lens[N_REQUESTS];
+    for (size_t i = 0; i < N_REQUESTS; i++) {
+        lens[i] = strlen(corpus[i]);
+    }
+
+    // Make sure the parser gets the requests right before timing it
+    for (size_t i = 0; i < N_REQUESTS; i++) {
+        http_parser_t parser;
+        http_request_t req;
+        init_http_parser(&parser);
+        if (parse_http_request(&parser, corpus[i], lens[i], &req) != 0 ||
+                strcmp(req.resource_name, expected_names[i]) != 0) {
+            fprintf(stderr, "Request %zu was parsed wrong\n", i);
+            return 1;
+        }
+    }
+
+    run("whole", lens, 0, seconds);
+    run("64-byte reads", lens, 64, seconds);
+    run("8-byte reads", lens, 8, seconds);
+    return 0;
+}
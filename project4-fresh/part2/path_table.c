@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "path_table.h"
+
+
+uint64_t path_hash(const char *path) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const unsigned char *p = (const unsigned char *) path; *p != '\0'; p++) {
+        hash ^= *p;
+        hash *= 0x100000001b3ULL;
+    }
+    // FNV mixes the last bytes poorly into the high bits
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+
+int path_table_init(path_table_t *table, size_t n_buckets) {
+    table->n_buckets = n_buckets;
+    table->n_nodes = 0;
+    if ((table->buckets = calloc(n_buckets, sizeof(path_node_t *))) == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    return 0;
+}
+
+
+path_node_t *path_table_find(const path_table_t *table, uint64_t hash, const char *path) {
+    path_node_t *node = table->buckets[hash & (table->n_buckets - 1)];
+    while (node != NULL) {
+        if (node->hash == hash && strcmp(node->path, path) == 0) {
+            return node;
+        }
+        node = node->hash_next;
+    }
+    return NULL;
+}
+
+
+static void grow(path_table_t *table) {
+    size_t n_buckets = table->n_buckets * 2;
+    path_node_t **buckets = calloc(n_buckets, sizeof(path_node_t *));
+    if (buckets == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < table->n_buckets; i++) {
+        path_node_t *node = table->buckets[i];
+        while (node != NULL) {
+            path_node_t *next = node->hash_next;
+            size_t idx = node->hash & (n_buckets - 1);
+            node->hash_next = buckets[idx];
+            buckets[idx] = node;
+            node = next;
+        }
+    }
+    free(table->buckets);
+    table->buckets = buckets;
+    table->n_buckets = n_buckets;
+}
+
+
+void path_table_insert(path_table_t *table, path_node_t *node) {
+    size_t idx = node->hash & (table->n_buckets - 1);
+    node->hash_next = table->buckets[idx];
+    table->buckets[idx] = node;
+    if (++table->n_nodes > table->n_buckets) {
+        grow(table);
+    }
+}
+
+
+void path_table_remove(path_table_t *table, path_node_t *node) {
+    path_node_t **link = &table->buckets[node->hash & (table->n_buckets - 1)];
+    while (*link != node) {
+        link = &(*link)->hash_next;
+    }
+    *link = node->hash_next;
+    table->n_nodes--;
+}
+
+
+void path_table_free(path_table_t *table) {
+    free(table->buckets);
+    table->buckets = NULL;
+}
+
+
+void lru_unlink(lru_list_t *list, lru_node_t *node) {
+    if (node->prev != NULL) { node->prev->next = node->next; }
+    else { list->head = node->next; }
+    if (node->next != NULL) { node->next->prev = node->prev; }
+    else { list->tail = node->prev; }
+}
+
+
+void lru_push_front(lru_list_t *list, lru_node_t *node) {
+    node->prev = NULL;
+    node->next = list->head;
+    if (list->head != NULL) { list->head->prev = node; }
+    else { list->tail = node; }
+    list->head = node;
+}
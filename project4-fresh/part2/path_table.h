@@ -0,0 +1,90 @@
+#ifndef PATH_TABLE_H
+#define PATH_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The struct of type 'type' that the node 'node', its member 'member', is
+// embedded in. node must not be NULL.
+#define PATH_ENTRY(node, type, member) \
+    ((type *) ((char *) (node) - offsetof(type, member)))
+
+// Struct representing the link of an entry keyed by path into a
+// path_table_t, embedded in the entry
+typedef struct path_node {
+    uint64_t hash;            // path_hash of path
+    const char *path;
+    struct path_node *hash_next;
+} path_node_t;
+
+// Struct representing a chained hash table of path_node_t. It does no
+// locking and owns none of its entries.
+typedef struct {
+    path_node_t **buckets;
+    size_t n_buckets;         // A power of two
+    size_t n_nodes;
+} path_table_t;
+
+// Struct representing the link of an entry into an lru_list_t, embedded in
+// the entry
+typedef struct lru_node {
+    struct lru_node *prev;    // Towards the most recently used
+    struct lru_node *next;    // Towards the least recently used
+} lru_node_t;
+
+// Struct representing a list of entries from most to least recently used
+typedef struct {
+    lru_node_t *head;
+    lru_node_t *tail;
+} lru_list_t;
+
+/*
+ * Hash a path: 64-bit FNV-1a finished with the MurmurHash3 finalizer, so that
+ * every bit depends on every byte and both the low and the high bits can pick
+ * a bucket or a shard.
+ */
+uint64_t path_hash(const char *path);
+
+/*
+ * Initialize an empty table.
+ * table: Pointer to path_table_t to be initialized
+ * n_buckets: Initial number of buckets, a power of two
+ * Returns 0 on success or -1 on error
+ */
+int path_table_init(path_table_t *table, size_t n_buckets);
+
+/*
+ * Look up a path.
+ * hash: path_hash of path
+ * Returns the node, or NULL if the path is not in the table
+ */
+path_node_t *path_table_find(const path_table_t *table, uint64_t hash, const char *path);
+
+/*
+ * Add a node, whose hash and path are set, doubling the buckets once the
+ * table holds more nodes than buckets. Failure to grow is not an error, the
+ * chains just get longer.
+ */
+void path_table_insert(path_table_t *table, path_node_t *node);
+
+/*
+ * Take a node that is in the table out of it.
+ */
+void path_table_remove(path_table_t *table, path_node_t *node);
+
+/*
+ * Free the buckets. The nodes are left alone.
+ */
+void path_table_free(path_table_t *table);
+
+/*
+ * Take a node out of a list.
+ */
+void lru_unlink(lru_list_t *list, lru_node_t *node);
+
+/*
+ * Add a node to a list as its most recently used.
+ */
+void lru_push_front(lru_list_t *list, lru_node_t *node);
+
+#endif // PATH_TABLE_H
@@ -0,0 +1,411 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+#define CACHE_LINE 64
+#define MAX_REPORTERS 16
+#define MAX_QUEUED_FDS 65536      // Higher descriptors have no timestamps
+
+// Percentiles shown for every phase, in thousandths
+static const int percentiles[] = { 500, 990, 999 };
+static const char *phase_names[N_PHASES] = { "queue", "read", "prepare", "send", "total" };
+
+// Counters of the calling thread, allocated the first time it records anything
+static _Thread_local thread_stats_t *local_stats = NULL;
+
+// Every thread's counters, along with what the last report saw. The lock is
+// only taken when a thread records for the first time and to render a report.
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static thread_stats_t *all_stats = NULL;  // In the order the threads registered
+static thread_stats_t **all_stats_end = &all_stats;
+static int n_threads = 0;
+static uint64_t start_time = 0;
+static uint64_t last_time = 0;
+static unsigned long last_requests = 0;
+static unsigned long last_bytes = 0;
+static unsigned long last_accepts = 0;
+
+static struct {
+    stats_reporter_t reporter;
+    void *arg;
+} reporters[MAX_REPORTERS];
+static int n_reporters = 0;
+
+// When each connection was accepted and put in a connection queue, indexed by
+// descriptor. The queue hands the descriptor over, so it also orders these
+// accesses.
+static atomic_ulong accepted_at[MAX_QUEUED_FDS];
+static atomic_ulong queued_at[MAX_QUEUED_FDS];
+
+
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+// Register the calling thread the first time it records anything, taking
+// over the counters of a thread that exited if there are any
+// Returns its counters, or NULL if they could not be allocated
+static thread_stats_t *get_local_stats(void) {
+    if (local_stats != NULL) {
+        return local_stats;
+    }
+    pthread_mutex_lock(&stats_lock);
+    for (thread_stats_t *stats = all_stats; stats != NULL; stats = stats->next) {
+        if (stats->released) {
+            stats->released = 0;
+            strcpy(stats->name, "thread");
+            pthread_mutex_unlock(&stats_lock);
+            local_stats = stats;
+            return stats;
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    size_t size = (sizeof(thread_stats_t) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    thread_stats_t *stats = aligned_alloc(CACHE_LINE, size);
+    if (stats == NULL) {
+        perror("aligned_alloc");
+        return NULL;
+    }
+    memset(stats, 0, size);
+    strcpy(stats->name, "thread");
+    stats->since = stats_now();
+
+    pthread_mutex_lock(&stats_lock);
+    if (start_time == 0) {
+        start_time = last_time = stats->since;
+    }
+    stats->id = n_threads++;
+    *all_stats_end = stats;
+    all_stats_end = &stats->next;
+    pthread_mutex_unlock(&stats_lock);
+
+    local_stats = stats;
+    return stats;
+}
+
+
+// Add to a counter only the calling thread writes to, which needs no atomic
+// read-modify-write. Readers see either the old or the new value.
+static inline void add(atomic_ulong *counter, unsigned long n) {
+    atomic_store_explicit(counter,
+            atomic_load_explicit(counter, memory_order_relaxed) + n,
+            memory_order_relaxed);
+}
+
+
+static inline unsigned long load(atomic_ulong *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+
+// Values below 2^SUB_BITS get a bucket each. Above that, the position of the
+// highest set bit picks a group of 2^SUB_BITS buckets and the bits below it
+// pick the bucket within the group.
+static int bucket_of(uint64_t value) {
+    if (value < (1 << STATS_HISTOGRAM_SUB_BITS)) {
+        return value;
+    }
+    int shift = 63 - __builtin_clzll(value) - STATS_HISTOGRAM_SUB_BITS;
+    return ((shift + 1) << STATS_HISTOGRAM_SUB_BITS) +
+        (int) (value >> shift) - (1 << STATS_HISTOGRAM_SUB_BITS);
+}
+
+
+// Returns the highest value that falls into a bucket
+static uint64_t bucket_limit(int bucket) {
+    if (bucket < (1 << STATS_HISTOGRAM_SUB_BITS)) {
+        return bucket;
+    }
+    int shift = (bucket >> STATS_HISTOGRAM_SUB_BITS) - 1;
+    uint64_t sub = (bucket & ((1 << STATS_HISTOGRAM_SUB_BITS) - 1)) +
+        (1 << STATS_HISTOGRAM_SUB_BITS);
+    return ((sub + 1) << shift) - 1;
+}
+
+
+static void record(stats_histogram_t *histogram, uint64_t ns) {
+    add(&histogram->counts[bucket_of(ns)], 1);
+    if (ns > load(&histogram->max)) {
+        atomic_store_explicit(&histogram->max, ns, memory_order_relaxed);
+    }
+}
+
+
+void stats_set_thread_name(const char *name) {
+    thread_stats_t *stats = get_local_stats();
+    if (stats != NULL) {
+        pthread_mutex_lock(&stats_lock);
+        snprintf(stats->name, STATS_NAME_MAX, "%s", name);
+        pthread_mutex_unlock(&stats_lock);
+    }
+}
+
+
+void stats_thread_exit(void) {
+    if (local_stats != NULL) {
+        pthread_mutex_lock(&stats_lock);
+        local_stats->released = 1;
+        pthread_mutex_unlock(&stats_lock);
+        local_stats = NULL;
+    }
+}
+
+
+void stats_accepted(int n) {
+    thread_stats_t *stats = get_local_stats();
+    if (stats != NULL) {
+        add(&stats->accepts, n);
+    }
+}
+
+
+void stats_busy(uint64_t ns) {
+    thread_stats_t *stats = get_local_stats();
+    if (stats != NULL) {
+        add(&stats->busy_ns, ns);
+    }
+}
+
+
+void stats_connection_accepted(int fd) {
+    if (fd >= 0 && fd < MAX_QUEUED_FDS) {
+        atomic_store_explicit(&accepted_at[fd], stats_now(), memory_order_relaxed);
+    }
+}
+
+
+void stats_connection_queued(int fd) {
+    if (fd >= 0 && fd < MAX_QUEUED_FDS) {
+        atomic_store_explicit(&queued_at[fd], stats_now(), memory_order_relaxed);
+    }
+}
+
+
+uint64_t stats_connection_dequeued(int fd) {
+    thread_stats_t *stats = get_local_stats();
+    if (stats == NULL || fd < 0 || fd >= MAX_QUEUED_FDS) {
+        return 0;
+    }
+    uint64_t queued = atomic_load_explicit(&queued_at[fd], memory_order_relaxed);
+    uint64_t now = stats_now();
+    if (queued == 0 || now < queued) {
+        return 0;
+    }
+    record(&stats->phases[PHASE_QUEUE], now - queued);
+    return now - queued;
+}
+
+
+void stats_connection_times(int fd, request_timing_t *timing) {
+    if (fd >= 0 && fd < MAX_QUEUED_FDS) {
+        timing->accepted = atomic_load_explicit(&accepted_at[fd], memory_order_relaxed);
+        timing->queued = atomic_load_explicit(&queued_at[fd], memory_order_relaxed);
+    }
+}
+
+
+void stats_request_reset(request_timing_t *timing) {
+    uint64_t accepted = timing->accepted;
+    memset(timing, 0, sizeof(request_timing_t));
+    timing->accepted = accepted;
+}
+
+
+void stats_request_done(const request_timing_t *timing, int status, size_t bytes) {
+    thread_stats_t *stats = get_local_stats();
+    if (stats == NULL) {
+        return;
+    }
+    add(&stats->requests, 1);
+    add(&stats->bytes_out, bytes);
+    if (status >= STATS_STATUS_MIN && status <= STATS_STATUS_MAX) {
+        add(&stats->status[status - STATS_STATUS_MIN], 1);
+    }
+
+    // Phases whose boundaries were not all reached are left out
+    uint64_t now = stats_now();
+    if (timing->start != 0 && timing->parsed >= timing->start) {
+        record(&stats->phases[PHASE_READ], timing->parsed - timing->start);
+    }
+    if (timing->parsed != 0 && timing->prepared >= timing->parsed) {
+        record(&stats->phases[PHASE_PREPARE], timing->prepared - timing->parsed);
+    }
+    if (timing->prepared != 0 && now >= timing->prepared) {
+        record(&stats->phases[PHASE_SEND], now - timing->prepared);
+    }
+    if (timing->start != 0 && now >= timing->start) {
+        record(&stats->phases[PHASE_TOTAL], now - timing->start);
+    }
+}
+
+
+void stats_bad_request(void) {
+    thread_stats_t *stats = get_local_stats();
+    if (stats != NULL) {
+        add(&stats->bad_requests, 1);
+    }
+}
+
+
+void stats_shed(void) {
+    thread_stats_t *stats = get_local_stats();
+    if (stats != NULL) {
+        add(&stats->shed, 1);
+    }
+}
+
+
+void stats_timed_out(void) {
+    thread_stats_t *stats = get_local_stats();
+    if (stats != NULL) {
+        add(&stats->timeouts, 1);
+    }
+}
+
+
+int stats_add_reporter(stats_reporter_t reporter, void *arg) {
+    pthread_mutex_lock(&stats_lock);
+    if (n_reporters == MAX_REPORTERS) {
+        pthread_mutex_unlock(&stats_lock);
+        fprintf(stderr, "Too many statistics reporters\n");
+        return -1;
+    }
+    reporters[n_reporters].reporter = reporter;
+    reporters[n_reporters].arg = arg;
+    n_reporters++;
+    pthread_mutex_unlock(&stats_lock);
+    return 0;
+}
+
+
+void stats_clear_reporters(void) {
+    // A report being rendered holds the lock, so no reporter runs after this
+    pthread_mutex_lock(&stats_lock);
+    n_reporters = 0;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+
+// Write the percentiles of the merged histogram of one phase, in microseconds.
+// Must be called with stats_lock held, which also guards the merged counts.
+static void render_phase(FILE *out, int phase) {
+    static unsigned long counts[STATS_HISTOGRAM_BUCKETS];
+    unsigned long total = 0;
+    uint64_t max = 0;
+    memset(counts, 0, sizeof(counts));
+    for (thread_stats_t *stats = all_stats; stats != NULL; stats = stats->next) {
+        stats_histogram_t *histogram = &stats->phases[phase];
+        for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+            unsigned long count = load(&histogram->counts[i]);
+            counts[i] += count;
+            total += count;
+        }
+        if (load(&histogram->max) > max) { max = load(&histogram->max); }
+    }
+
+    fprintf(out, "%-8s %10lu", phase_names[phase], total);
+    int bucket = 0;
+    unsigned long seen = 0;
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+        // The smallest value that at least this share of the samples is under
+        unsigned long rank = (total * percentiles[i] + 999) / 1000;
+        while (bucket < STATS_HISTOGRAM_BUCKETS - 1 && seen + counts[bucket] < rank) {
+            seen += counts[bucket++];
+        }
+        uint64_t value = total == 0 ? 0 : bucket_limit(bucket);
+        fprintf(out, " %10.1f", (value < max ? value : max) / 1000.0);
+    }
+    fprintf(out, " %10.1f\n", max / 1000.0);
+}
+
+
+int stats_render(FILE *out) {
+    pthread_mutex_lock(&stats_lock);
+    uint64_t now = stats_now();
+    if (start_time == 0) {
+        start_time = last_time = now;
+    }
+
+    unsigned long requests = 0, bytes = 0, accepts = 0, bad_requests = 0, shed = 0;
+    unsigned long timeouts = 0;
+    static unsigned long status[STATS_STATUS_MAX - STATS_STATUS_MIN + 1];
+    memset(status, 0, sizeof(status));
+    for (thread_stats_t *stats = all_stats; stats != NULL; stats = stats->next) {
+        requests += load(&stats->requests);
+        bytes += load(&stats->bytes_out);
+        accepts += load(&stats->accepts);
+        bad_requests += load(&stats->bad_requests);
+        shed += load(&stats->shed);
+        timeouts += load(&stats->timeouts);
+        for (int i = 0; i <= STATS_STATUS_MAX - STATS_STATUS_MIN; i++) {
+            status[i] += load(&stats->status[i]);
+        }
+    }
+
+    // Rates over the whole run and since the previous report
+    double uptime = (now - start_time) / 1e9;
+    double interval = (now - last_time) / 1e9;
+    double total_secs = uptime > 0 ? uptime : 1;
+    double interval_secs = interval > 0 ? interval : 1;
+    fprintf(out, "uptime_secs %.3f\n", uptime);
+    fprintf(out, "interval_secs %.3f\n", interval);
+    fprintf(out, "requests %lu\n", requests);
+    fprintf(out, "requests_per_sec %.1f (%.1f in interval)\n", requests / total_secs,
+            (requests - last_requests) / interval_secs);
+    fprintf(out, "bytes_out %lu\n", bytes);
+    fprintf(out, "bytes_out_per_sec %.1f (%.1f in interval)\n", bytes / total_secs,
+            (bytes - last_bytes) / interval_secs);
+    fprintf(out, "accepts %lu\n", accepts);
+    fprintf(out, "accepts_per_sec %.1f (%.1f in interval)\n", accepts / total_secs,
+            (accepts - last_accepts) / interval_secs);
+    fprintf(out, "bad_requests %lu\n", bad_requests);
+    fprintf(out, "shed %lu\n", shed);
+    fprintf(out, "timeouts %lu\n", timeouts);
+    last_time = now;
+    last_requests = requests;
+    last_bytes = bytes;
+    last_accepts = accepts;
+
+    fprintf(out, "\nstatus count\n");
+    for (int i = 0; i <= STATS_STATUS_MAX - STATS_STATUS_MIN; i++) {
+        if (status[i] > 0) {
+            fprintf(out, "%d %lu\n", i + STATS_STATUS_MIN, status[i]);
+        }
+    }
+
+    fprintf(out, "\n%-8s %10s %10s %10s %10s %10s\n", "phase_us", "count",
+            "p50", "p99", "p999", "max");
+    for (int phase = 0; phase < N_PHASES; phase++) {
+        render_phase(out, phase);
+    }
+
+    fprintf(out, "\n%-4s %-16s %10s %8s %10s %10s\n", "id", "thread", "busy_ms",
+            "busy_pct", "requests", "accepts");
+    for (thread_stats_t *stats = all_stats; stats != NULL; stats = stats->next) {
+        double busy_ms = load(&stats->busy_ns) / 1e6;
+        double alive_ms = (now - stats->since) / 1e6;
+        fprintf(out, "%-4d %-16s %10.1f %8.1f %10lu %10lu\n", stats->id,
+                stats->released ? "(exited)" : stats->name,
+                busy_ms, alive_ms > 0 ? 100 * busy_ms / alive_ms : 0,
+                load(&stats->requests), load(&stats->accepts));
+    }
+
+    for (int i = 0; i < n_reporters; i++) {
+        fprintf(out, "\n");
+        reporters[i].reporter(out, reporters[i].arg);
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    if (ferror(out)) {
+        fprintf(stderr, "Failed to write statistics\n");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,172 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define STATS_PATH "/__stats"         // Reserved resource name of the report
+#define STATS_HISTOGRAM_SUB_BITS 4    // Buckets per power of two: 2^4, ~6% error
+#define STATS_HISTOGRAM_BUCKETS ((64 - STATS_HISTOGRAM_SUB_BITS + 1) << STATS_HISTOGRAM_SUB_BITS)
+#define STATS_STATUS_MIN 100
+#define STATS_STATUS_MAX 599
+#define STATS_NAME_MAX 32
+
+// Phases of serving a request whose latencies are tracked
+enum {
+    PHASE_QUEUE,              // Waiting in a connection queue for a worker
+    PHASE_READ,               // First byte of the request until it is parsed
+    PHASE_PREPARE,            // Opening the file and building the response
+    PHASE_SEND,               // Sending the response
+    PHASE_TOTAL,              // First byte of the request until the last byte sent
+    N_PHASES
+};
+
+// Struct representing a log-linear (HDR-style) histogram of nanosecond
+// latencies. Each power of two is split into 2^STATS_HISTOGRAM_SUB_BITS
+// buckets, so any value is recorded with a bounded relative error.
+typedef struct {
+    atomic_ulong counts[STATS_HISTOGRAM_BUCKETS];
+    atomic_ulong max;
+} stats_histogram_t;
+
+// Struct representing the counters of one thread. Only the owning thread
+// writes to them, without locks or read-modify-write instructions, and
+// readers merge the counters of every thread.
+typedef struct thread_stats {
+    int id;                   // Order in which the threads first recorded anything
+    int released;             // Set once the thread exited, until another takes over
+    char name[STATS_NAME_MAX];
+    uint64_t since;           // When the thread first recorded anything
+    atomic_ulong requests;
+    atomic_ulong bytes_out;
+    atomic_ulong accepts;
+    atomic_ulong bad_requests;
+    atomic_ulong shed;        // Connections turned away with a 503
+    atomic_ulong timeouts;    // Connections closed because a timeout passed
+    atomic_ulong busy_ns;     // Time spent serving rather than waiting
+    atomic_ulong status[STATS_STATUS_MAX - STATS_STATUS_MIN + 1];
+    stats_histogram_t phases[N_PHASES];
+    struct thread_stats *next;
+} thread_stats_t;
+
+// Timestamps of the phase boundaries of one request, in CLOCK_MONOTONIC
+// nanoseconds. A timestamp of 0 means the boundary was not reached, or does
+// not exist in the serving model.
+typedef struct {
+    uint64_t accepted;        // Connection accepted
+    uint64_t queued;          // Connection put in a connection queue for this request
+    uint64_t dequeued;        // Connection taken out of the queue by a worker
+    uint64_t start;           // Request started arriving or being read
+    uint64_t parsed;
+    uint64_t prepared;        // Resource opened and response ready to be sent
+    uint64_t first_byte;      // First byte of the response sent
+} request_timing_t;
+
+// Function that appends a section to the statistics report, such as the
+// state of the connection queues
+typedef void (*stats_reporter_t)(FILE *out, void *arg);
+
+/*
+ * Returns the current CLOCK_MONOTONIC time in nanoseconds
+ */
+uint64_t stats_now(void);
+
+/*
+ * Name the calling thread in the report, e.g. "worker 0.3". Threads that are
+ * not named are called "thread".
+ */
+void stats_set_thread_name(const char *name);
+
+/*
+ * Hand the calling thread's counters over to the next thread that records
+ * anything. Threads that come and go, like the workers of a resizing pool,
+ * call this before exiting, so their counters are kept without piling up.
+ */
+void stats_thread_exit(void);
+
+/*
+ * Record that the calling thread accepted 'n' connections.
+ */
+void stats_accepted(int n);
+
+/*
+ * Record the time the calling thread spent serving rather than waiting.
+ */
+void stats_busy(uint64_t ns);
+
+/*
+ * Remember when a connection was accepted, for connections that are handed
+ * to other threads by their file descriptor.
+ */
+void stats_connection_accepted(int fd);
+
+/*
+ * Record that a connection was put in a connection queue, so that the worker
+ * taking it out can record how long it waited.
+ */
+void stats_connection_queued(int fd);
+
+/*
+ * Record that the calling thread took a connection out of a connection queue.
+ * Returns how many nanoseconds the connection waited, or 0 if it is not known
+ */
+uint64_t stats_connection_dequeued(int fd);
+
+/*
+ * Fill in when a connection was accepted and last queued, as recorded by
+ * stats_connection_accepted and stats_connection_queued.
+ */
+void stats_connection_times(int fd, request_timing_t *timing);
+
+/*
+ * Clear the timestamps of a request once it is answered, keeping when its
+ * connection was accepted for the requests that follow on it.
+ */
+void stats_request_reset(request_timing_t *timing);
+
+/*
+ * Record a request that was answered, measuring its phases up to now.
+ * timing: The phase boundaries of the request
+ * status: The HTTP status code of the response
+ * bytes: Number of bytes sent, including the header
+ */
+void stats_request_done(const request_timing_t *timing, int status, size_t bytes);
+
+/*
+ * Record a request that could not be parsed, so no response was sent.
+ */
+void stats_bad_request(void);
+
+/*
+ * Record a connection that was turned away because the server was overloaded.
+ */
+void stats_shed(void);
+
+/*
+ * Record a connection that was closed because it was idle, sent its request
+ * too slowly or stopped taking its response.
+ */
+void stats_timed_out(void);
+
+/*
+ * Add a section to the report. Reporters are called while the report is
+ * rendered, so they must stay valid until stats_clear_reporters is called.
+ * Returns 0 on success or -1 on error
+ */
+int stats_add_reporter(stats_reporter_t reporter, void *arg);
+
+/*
+ * Remove every reporter added with stats_add_reporter.
+ */
+void stats_clear_reporters(void);
+
+/*
+ * Write a plain-text report merging the counters of every thread: request
+ * and byte rates, status codes, latency percentiles of each phase, per-thread
+ * busy time and the sections of the reporters.
+ * Returns 0 on success or -1 on error
+ */
+int stats_render(FILE *out);
+
+#endif // STATS_H
@@ -0,0 +1,182 @@
+#include <string.h>
+
+#include "timer_wheel.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+// Timers further away than this would wrap around the coarsest level
+#define MAX_TICKS ((uint64_t) SLOT_MASK << (TIMER_WHEEL_BITS * (TIMER_WHEEL_LEVELS - 1)))
+
+
+void timer_wheel_init(timer_wheel_t *wheel, long now_ms) {
+    memset(wheel, 0, sizeof(timer_wheel_t));
+    wheel->origin_ms = now_ms;
+}
+
+
+void wheel_timer_init(wheel_timer_t *timer) {
+    memset(timer, 0, sizeof(wheel_timer_t));
+}
+
+
+static void push(wheel_timer_t **slot, wheel_timer_t *timer) {
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot != NULL) { (*slot)->prev = timer; }
+    *slot = timer;
+}
+
+
+// Put an armed timer on the list it belongs to. A timer goes on the finest
+// level whose current span also holds its tick, so it only moves down once
+// that span comes around.
+static void place(timer_wheel_t *wheel, wheel_timer_t *timer) {
+    if (timer->expires <= wheel->now) {
+        push(&wheel->expired, timer);
+        return;
+    }
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 &&
+            timer->expires >> (TIMER_WHEEL_BITS * (level + 1)) !=
+            wheel->now >> (TIMER_WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    int slot = (timer->expires >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK;
+    push(&wheel->slots[level][slot], timer);
+    wheel->occupied[level] |= 1ULL << slot;
+}
+
+
+// Take a timer off its list, keeping the occupied bits up to date
+static void unlink_timer(timer_wheel_t *wheel, wheel_timer_t *timer) {
+    if (timer->prev != NULL) { timer->prev->next = timer->next; }
+    else { *timer->slot = timer->next; }
+    if (timer->next != NULL) { timer->next->prev = timer->prev; }
+
+    if (*timer->slot == NULL && timer->slot != &wheel->expired) {
+        size_t index = timer->slot - &wheel->slots[0][0];
+        wheel->occupied[index / TIMER_WHEEL_SLOTS] &= ~(1ULL << (index % TIMER_WHEEL_SLOTS));
+    }
+    timer->slot = NULL;
+}
+
+
+void timer_wheel_arm(timer_wheel_t *wheel, wheel_timer_t *timer, long deadline_ms) {
+    if (timer->slot != NULL) {
+        unlink_timer(wheel, timer);
+    } else {
+        wheel->n_timers++;
+    }
+    long ms = deadline_ms - wheel->origin_ms;
+    uint64_t expires = ms <= 0 ? 0 : (ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+    if (expires > wheel->now + MAX_TICKS) {
+        expires = wheel->now + MAX_TICKS;
+    }
+    timer->expires = expires;
+    place(wheel, timer);
+}
+
+
+void timer_wheel_cancel(timer_wheel_t *wheel, wheel_timer_t *timer) {
+    if (timer->slot != NULL) {
+        unlink_timer(wheel, timer);
+        wheel->n_timers--;
+    }
+}
+
+
+// Move the timers of a slot down to the levels their ticks now belong to
+static void cascade(timer_wheel_t *wheel, int level, int slot) {
+    wheel_timer_t *timer = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    wheel->occupied[level] &= ~(1ULL << slot);
+    while (timer != NULL) {
+        wheel_timer_t *next = timer->next;
+        place(wheel, timer);
+        timer = next;
+    }
+}
+
+
+// Process the ticks up to 'now_ms', moving the timers that fire onto the
+// expired list
+static void advance(timer_wheel_t *wheel, long now_ms) {
+    uint64_t target = now_ms <= wheel->origin_ms ? 0 :
+        (uint64_t) (now_ms - wheel->origin_ms) / TIMER_WHEEL_TICK_MS;
+    while (wheel->now < target) {
+        // With no timer left in any slot, time can jump ahead
+        uint64_t occupied = 0;
+        for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+            occupied |= wheel->occupied[level];
+        }
+        if (occupied == 0) {
+            wheel->now = target;
+            return;
+        }
+
+        wheel->now++;
+        // When a level wraps around, the next slot of the coarser level is due
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if ((wheel->now & (((uint64_t) 1 << (TIMER_WHEEL_BITS * level)) - 1)) != 0) {
+                break;
+            }
+            int slot = (wheel->now >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK;
+            if (wheel->occupied[level] & (1ULL << slot)) {
+                cascade(wheel, level, slot);
+            }
+        }
+        int slot = wheel->now & SLOT_MASK;
+        if (wheel->occupied[0] & (1ULL << slot)) {
+            cascade(wheel, 0, slot);
+        }
+    }
+}
+
+
+wheel_timer_t *timer_wheel_expire(timer_wheel_t *wheel, long now_ms) {
+    if (wheel->expired == NULL) {
+        advance(wheel, now_ms);
+    }
+    wheel_timer_t *timer = wheel->expired;
+    if (timer != NULL) {
+        timer_wheel_cancel(wheel, timer);
+    }
+    return timer;
+}
+
+
+wheel_timer_t *timer_wheel_pop(timer_wheel_t *wheel) {
+    wheel_timer_t *timer = wheel->expired;
+    for (int level = 0; timer == NULL && level < TIMER_WHEEL_LEVELS; level++) {
+        if (wheel->occupied[level] != 0) {
+            timer = wheel->slots[level][__builtin_ctzll(wheel->occupied[level])];
+        }
+    }
+    if (timer != NULL) {
+        timer_wheel_cancel(wheel, timer);
+    }
+    return timer;
+}
+
+
+long timer_wheel_timeout(timer_wheel_t *wheel, long now_ms) {
+    if (wheel->n_timers == 0) {
+        return -1;
+    }
+    if (wheel->expired != NULL) {
+        return 0;
+    }
+
+    // The next occupied slot of level 0 in the current span, or else the end
+    // of the span, when coarser timers move down
+    uint64_t next = (wheel->now | SLOT_MASK) + 1;
+    int offset = (wheel->now & SLOT_MASK) + 1;
+    if (offset < TIMER_WHEEL_SLOTS) {
+        uint64_t ahead = wheel->occupied[0] >> offset;
+        if (ahead != 0) {
+            next = wheel->now + 1 + __builtin_ctzll(ahead);
+        }
+    }
+    long remaining = wheel->origin_ms + (long) next * TIMER_WHEEL_TICK_MS - now_ms;
+    return remaining < 0 ? 0 : remaining;
+}
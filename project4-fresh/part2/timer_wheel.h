@@ -0,0 +1,81 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+#define TIMER_WHEEL_TICK_MS 10        // Resolution of the timers
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 6            // Each level has 64 slots
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+
+// A timer that can be armed in a timer wheel. It is meant to be embedded in
+// whatever it times out, which the owner finds again from the timer's address.
+typedef struct wheel_timer {
+    uint64_t expires;         // Tick at which the timer fires
+    struct wheel_timer **slot;  // Head of the list the timer is on, NULL if unarmed
+    struct wheel_timer *prev; // Neighbours in that list
+    struct wheel_timer *next;
+} wheel_timer_t;
+
+// Struct representing a hierarchical timer wheel. Level 0 has a slot for each
+// of the next 64 ticks, and every further level has slots 64 times as coarse,
+// whose timers move down a level when the finer level wraps around. Arming and
+// cancelling a timer are O(1) list operations, and time only advances when the
+// owner asks for expired timers. A wheel is not thread-safe.
+typedef struct {
+    long origin_ms;           // CLOCK_MONOTONIC milliseconds of tick 0
+    uint64_t now;             // Ticks processed so far
+    int n_timers;             // Armed timers, including expired uncollected ones
+    uint64_t occupied[TIMER_WHEEL_LEVELS];  // Bit set for every non-empty slot
+    wheel_timer_t *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    wheel_timer_t *expired;   // Timers that fired but were not collected yet
+} timer_wheel_t;
+
+/*
+ * Initialize an empty timer wheel.
+ * now_ms: The current CLOCK_MONOTONIC time in milliseconds
+ */
+void timer_wheel_init(timer_wheel_t *wheel, long now_ms);
+
+/*
+ * Prepare a timer that is not armed, before it is first used.
+ */
+void wheel_timer_init(wheel_timer_t *timer);
+
+/*
+ * Arm a timer, or move it if it is already armed. Deadlines are rounded up to
+ * the next tick, and ones further away than the wheel spans are clamped.
+ * deadline_ms: CLOCK_MONOTONIC milliseconds at which the timer fires
+ */
+void timer_wheel_arm(timer_wheel_t *wheel, wheel_timer_t *timer, long deadline_ms);
+
+/*
+ * Disarm a timer. Does nothing if it is not armed.
+ */
+void timer_wheel_cancel(timer_wheel_t *wheel, wheel_timer_t *timer);
+
+/*
+ * Advance the wheel to the current time and collect one timer that fired.
+ * The timer is disarmed, so it may be armed again right away. Timers are
+ * placed relative to the time the wheel was last advanced to, so owners
+ * should call this regularly, and before arming timers after a long sleep.
+ * now_ms: The current CLOCK_MONOTONIC time in milliseconds
+ * Returns a timer that fired, or NULL once there are none left
+ */
+wheel_timer_t *timer_wheel_expire(timer_wheel_t *wheel, long now_ms);
+
+/*
+ * Disarm and return any armed timer, for tearing down whatever the wheel
+ * still times out.
+ * Returns the timer, or NULL if none is armed
+ */
+wheel_timer_t *timer_wheel_pop(timer_wheel_t *wheel);
+
+/*
+ * Returns how many milliseconds may pass before timer_wheel_expire has timers
+ * to collect, 0 if it has some already, or -1 if no timer is armed. The time
+ * may be shorter than that when timers have to move down a level first.
+ */
+long timer_wheel_timeout(timer_wheel_t *wheel, long now_ms);
+
+#endif // TIMER_WHEEL_H
@@ -0,0 +1,218 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+#define LOG_INTERVAL_NS 1000000000ULL
+
+// A slot of a ring. Its sequence number is odd while the owning thread is
+// writing the record, so that readers can tell a torn copy (a seqlock).
+typedef struct {
+    atomic_uint sequence;
+    trace_record_t record;
+} trace_slot_t;
+
+// Struct representing the ring of slow requests of one thread
+typedef struct trace_ring {
+    atomic_ulong head;        // Records written so far
+    uint64_t last_logged;     // When a slow request was last written to stderr
+    int released;             // Set once the owner exited, until another takes over
+    struct trace_ring *next;
+    trace_slot_t slots[TRACE_RING_SIZE];
+} trace_ring_t;
+
+static uint64_t threshold_ns = (uint64_t) TRACE_THRESHOLD_MS * 1000000;
+static int log_samples = 0;
+
+// Ring of the calling thread, allocated the first time it has a slow request
+static _Thread_local trace_ring_t *local_ring = NULL;
+
+// Every thread's ring. The lock is only taken when a thread adds its ring and
+// to render a dump.
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t *all_rings = NULL;
+
+
+void trace_init(long threshold_ms, int log) {
+    threshold_ns = (uint64_t) threshold_ms * 1000000;
+    log_samples = log;
+}
+
+
+static trace_ring_t *get_local_ring(void) {
+    if (local_ring != NULL) {
+        return local_ring;
+    }
+    pthread_mutex_lock(&rings_lock);
+    for (trace_ring_t *ring = all_rings; ring != NULL; ring = ring->next) {
+        if (ring->released) {
+            ring->released = 0;
+            pthread_mutex_unlock(&rings_lock);
+            local_ring = ring;
+            return ring;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    trace_ring_t *ring = calloc(1, sizeof(trace_ring_t));
+    if (ring == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    pthread_mutex_lock(&rings_lock);
+    ring->next = all_rings;
+    all_rings = ring;
+    pthread_mutex_unlock(&rings_lock);
+    local_ring = ring;
+    return ring;
+}
+
+
+void trace_thread_exit(void) {
+    if (local_ring != NULL) {
+        pthread_mutex_lock(&rings_lock);
+        local_ring->released = 1;
+        pthread_mutex_unlock(&rings_lock);
+        local_ring = NULL;
+    }
+}
+
+
+// Returns when the request started: when it was queued if it waited in a
+// connection queue, or else when it started arriving
+static uint64_t request_begin(const request_timing_t *timing) {
+    return timing->queued != 0 && timing->queued < timing->start
+        ? timing->queued : timing->start;
+}
+
+
+// Write the time between two phase boundaries, or '-' if either is unknown
+static void print_phase(FILE *out, uint64_t from, uint64_t to) {
+    if (from == 0 || to == 0 || to < from) {
+        fprintf(out, " %10s", "-");
+    } else {
+        fprintf(out, " %10.1f", (to - from) / 1000.0);
+    }
+}
+
+
+static void print_header(FILE *out) {
+    fprintf(out, "%10s %10s %10s %10s %10s %10s %10s %10s %6s %10s  %s\n",
+            "total_us", "conn_age", "queue", "read", "prepare", "first_byte",
+            "send", "done_ago", "status", "bytes", "resource");
+}
+
+
+static void print_record(FILE *out, const trace_record_t *r, uint64_t now) {
+    const request_timing_t *t = &r->timing;
+    fprintf(out, "%10.1f", (r->done - request_begin(t)) / 1000.0);
+    print_phase(out, t->accepted, request_begin(t));
+    print_phase(out, t->queued, t->dequeued);
+    print_phase(out, t->start, t->parsed);
+    print_phase(out, t->parsed, t->prepared);
+    print_phase(out, t->prepared, t->first_byte);
+    print_phase(out, t->first_byte, r->done);
+    print_phase(out, r->done, now);
+    fprintf(out, " %6d %10zu  %s\n", r->status, r->bytes, r->resource);
+}
+
+
+void trace_request(const request_timing_t *timing, const char *resource, int status,
+        size_t bytes) {
+    if (threshold_ns == 0 || timing->start == 0) {
+        return;
+    }
+    uint64_t now = stats_now();
+    if (now - request_begin(timing) < threshold_ns) {
+        return;
+    }
+    trace_ring_t *ring = get_local_ring();
+    if (ring == NULL) {
+        return;
+    }
+
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    trace_slot_t *slot = &ring->slots[head % TRACE_RING_SIZE];
+    unsigned int sequence = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+    atomic_store_explicit(&slot->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    trace_record_t *r = &slot->record;
+    r->timing = *timing;
+    r->done = now;
+    r->status = status;
+    r->bytes = bytes;
+    snprintf(r->resource, TRACE_RESOURCE_MAX, "%s", resource);
+    atomic_store_explicit(&slot->sequence, sequence + 2, memory_order_release);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    // A sample of the slow requests goes to stderr as well
+    if (log_samples && now - ring->last_logged >= LOG_INTERVAL_NS) {
+        ring->last_logged = now;
+        fprintf(stderr, "slow request:\n");
+        print_header(stderr);
+        print_record(stderr, r, now);
+    }
+}
+
+
+// Sort records by when they finished, most recent first
+static int compare_records(const void *a, const void *b) {
+    uint64_t done_a = ((const trace_record_t *) a)->done;
+    uint64_t done_b = ((const trace_record_t *) b)->done;
+    return done_a < done_b ? 1 : done_a > done_b ? -1 : 0;
+}
+
+
+int trace_render(FILE *out) {
+    pthread_mutex_lock(&rings_lock);
+    size_t n_rings = 0;
+    for (trace_ring_t *ring = all_rings; ring != NULL; ring = ring->next) {
+        n_rings++;
+    }
+    trace_record_t *records = malloc((n_rings * TRACE_RING_SIZE + 1) * sizeof(trace_record_t));
+    if (records == NULL) {
+        pthread_mutex_unlock(&rings_lock);
+        perror("malloc");
+        return -1;
+    }
+
+    // Copy every slot that was not being written to while it was copied
+    size_t n_records = 0;
+    for (trace_ring_t *ring = all_rings; ring != NULL; ring = ring->next) {
+        unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        unsigned long n = head < TRACE_RING_SIZE ? head : TRACE_RING_SIZE;
+        for (unsigned long i = 0; i < n; i++) {
+            trace_slot_t *slot = &ring->slots[(head - 1 - i) % TRACE_RING_SIZE];
+            unsigned int before = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+            if (before % 2 == 1) {
+                continue;
+            }
+            memcpy(&records[n_records], &slot->record, sizeof(trace_record_t));
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&slot->sequence, memory_order_relaxed) == before) {
+                n_records++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    qsort(records, n_records, sizeof(trace_record_t), compare_records);
+    uint64_t now = stats_now();
+    fprintf(out, "%zu requests that took at least %.1f ms, most recent first\n"
+            "phase times in microseconds: conn_age is how long the connection had been "
+            "open, queue the wait for a worker, prepare covers opening the file\n\n",
+            n_records, threshold_ns / 1e6);
+    print_header(out);
+    for (size_t i = 0; i < n_records; i++) {
+        print_record(out, &records[i], now);
+    }
+    free(records);
+
+    if (ferror(out)) {
+        fprintf(stderr, "Failed to write traces\n");
+        return -1;
+    }
+    return 0;
+}
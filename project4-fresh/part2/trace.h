@@ -0,0 +1,57 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "stats.h"
+
+#define TRACE_PATH "/__trace"         // Reserved resource name of the dump
+#define TRACE_RING_SIZE 256           // Slow requests kept per thread
+#define TRACE_RESOURCE_MAX 64
+#define TRACE_THRESHOLD_MS 100
+
+// Struct representing a slow request, with the timestamps of its phases
+typedef struct {
+    request_timing_t timing;
+    uint64_t done;            // Last byte of the response sent
+    int status;
+    size_t bytes;
+    char resource[TRACE_RESOURCE_MAX];  // Requested resource name, truncated
+} trace_record_t;
+
+/*
+ * Set which requests are traced. Must be called before any request is.
+ * threshold_ms: Requests that take at least this long are kept, 0 keeps none
+ * log: Whether to also write a sample of the slow requests to stderr, at most
+ *      one per thread and second
+ */
+void trace_init(long threshold_ms, int log);
+
+/*
+ * Keep the phases of a request that has been answered if it was slow. Each
+ * thread keeps its most recent slow requests in a ring of its own, which is
+ * written without locks.
+ * timing: The phase boundaries of the request
+ * resource: The requested resource name
+ * status: The HTTP status code of the response
+ * bytes: Number of bytes sent, including the header
+ */
+void trace_request(const request_timing_t *timing, const char *resource, int status,
+        size_t bytes);
+
+/*
+ * Hand the calling thread's ring over to the next thread that traces a
+ * request, keeping what it holds. Called by threads before they exit.
+ */
+void trace_thread_exit(void);
+
+/*
+ * Write the slow requests kept by every thread, most recent first, with the
+ * time spent in each phase.
+ * Returns 0 on success or -1 on error
+ */
+int trace_render(FILE *out);
+
+#endif // TRACE_H
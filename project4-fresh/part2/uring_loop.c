@@ -0,0 +1,1022 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access_log.h"
+#include "trace.h"
+#include "uring_loop.h"
+
+// user_data of the loop's own operations. A connection's operations carry
+// its pointer instead, with the kind of operation in the low bits.
+#define ACCEPT_DATA 1
+#define WAKEUP_DATA 2
+#define IGNORED_DATA 3
+#define OP_MASK 7
+
+enum { OP_RECV, OP_OPEN, OP_STATX, OP_INSTALL, OP_READ, OP_SEND, OP_CLOSE };
+
+
+// glibc has no wrappers for the io_uring system calls
+static int io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+
+static int io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete,
+        unsigned flags, struct io_uring_getevents_arg *arg) {
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags,
+            arg, arg != NULL ? sizeof(struct io_uring_getevents_arg) : 0);
+}
+
+
+static int io_uring_register(int ring_fd, unsigned opcode, void *arg,
+        unsigned nr_args) {
+    return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+
+static uint64_t op_data(uring_connection_t *conn, int op) {
+    return (uint64_t) (uintptr_t) conn | op;
+}
+
+
+// Hand the SQEs filled in so far to the kernel, and wait for at least
+// 'wait_for' completions, or at most 'timeout_ms' if it is not -1
+// Returns 0 on success or -1 on error
+static int submit(uring_loop_t *loop, unsigned wait_for, long timeout_ms) {
+    struct __kernel_timespec ts = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (timeout_ms % 1000) * 1000000,
+    };
+    struct io_uring_getevents_arg arg = { .ts = (uint64_t) (uintptr_t) &ts };
+    int timed = wait_for > 0 && timeout_ms != -1;
+    while (1) {
+        int res = io_uring_enter(loop->ring_fd, loop->sq_pending, wait_for,
+                (wait_for > 0 ? IORING_ENTER_GETEVENTS : 0) |
+                (timed ? IORING_ENTER_EXT_ARG : 0), timed ? &arg : NULL);
+        if (res == -1) {
+            if (errno == EINTR) { continue; }
+            if (errno == ETIME) { return 0; }
+            perror("io_uring_enter");
+            return -1;
+        }
+        loop->sq_pending -= res;
+        return 0;
+    }
+}
+
+
+// Reserve 'n' consecutive SQEs, submitting queued ones first if the ring is
+// too full. Linked operations must be reserved together, since a link cannot
+// span two submissions.
+// Returns the first SQE, zeroed, or NULL on error
+static struct io_uring_sqe *get_sqes(uring_loop_t *loop, unsigned n) {
+    unsigned tail = *loop->sq_tail;
+    unsigned head = __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head + n > loop->sq_mask + 1) {
+        if (submit(loop, 0, -1) == -1) { return NULL; }
+        head = __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head + n > loop->sq_mask + 1) {
+            fprintf(stderr, "io_uring submission queue is full\n");
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe *first = NULL;
+    for (unsigned i = 0; i < n; i++) {
+        unsigned idx = (tail + i) & loop->sq_mask;
+        struct io_uring_sqe *sqe = &loop->sqes[idx];
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        loop->sq_array[idx] = idx;
+        if (first == NULL) { first = sqe; }
+    }
+    // Publishing the tail before the SQEs are filled in is fine, the kernel
+    // only reads them during io_uring_enter
+    __atomic_store_n(loop->sq_tail, tail + n, __ATOMIC_RELEASE);
+    loop->sq_pending += n;
+    return first;
+}
+
+
+static void arm_accept(uring_loop_t *loop) {
+    struct io_uring_sqe *sqe = get_sqes(loop, 1);
+    if (sqe == NULL) { return; }
+    // Accepted sockets go straight into a free slot of the file table
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->file_index = IORING_FILE_INDEX_ALLOC;
+    sqe->user_data = ACCEPT_DATA;
+    loop->accepting = 1;
+}
+
+
+static void arm_wakeup(uring_loop_t *loop) {
+    struct io_uring_sqe *sqe = get_sqes(loop, 1);
+    if (sqe == NULL) { return; }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = loop->wakeup_fd;
+    sqe->addr = (uint64_t) (uintptr_t) &loop->wakeup_value;
+    sqe->len = sizeof(loop->wakeup_value);
+    sqe->user_data = WAKEUP_DATA;
+}
+
+
+// Close a socket that was accepted into the file table
+static void close_slot(uring_loop_t *loop, int index, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqes(loop, 1);
+    if (sqe == NULL) { return; }
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = index + 1;
+    sqe->user_data = user_data;
+}
+
+
+static void release_buffer(uring_loop_t *loop, uring_connection_t *conn);
+static void cancel_buffer_wait(uring_loop_t *loop, uring_connection_t *conn);
+
+
+// Start closing a connection. Its file and buffer may still be in use by
+// operations in flight, so the last of them to complete finishes the close.
+static void close_connection(uring_loop_t *loop, uring_connection_t *conn) {
+    timer_wheel_cancel(&loop->timers, &conn->timer);
+    conn->closing = 1;
+    if (conn->pending > 0) {
+        return;
+    }
+    release_http_response(&conn->response);
+    release_buffer(loop, conn);
+    cancel_buffer_wait(loop, conn);
+    conn->pending++;
+    close_slot(loop, conn->index, op_data(conn, OP_CLOSE));
+}
+
+
+static void free_connection(uring_loop_t *loop, uring_connection_t *conn) {
+    if (conn->prev != NULL) { conn->prev->next = conn->next; }
+    else { loop->connections = conn->next; }
+    if (conn->next != NULL) { conn->next->prev = conn->prev; }
+    loop->n_connections--;
+    free(conn);
+
+    // A free slot in the file table lets a stalled accept continue
+    if (!loop->accepting && !loop->stopping) {
+        arm_accept(loop);
+    }
+}
+
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+// Restart the timeout of a connection
+static void arm_timeout(uring_loop_t *loop, uring_connection_t *conn, int timeout_ms) {
+    conn->sent_seen = conn->response.bytes_sent;
+    timer_wheel_arm(&loop->timers, &conn->timer, loop->now_ms + timeout_ms);
+}
+
+
+// Close the connections whose timeout passed. Their recv or send may wait
+// indefinitely, so it is cancelled first. A response that made progress since
+// its timeout was armed only gets a new one, which saves touching the wheel on
+// every send.
+static void expire_timeouts(uring_loop_t *loop) {
+    wheel_timer_t *timer;
+    while ((timer = timer_wheel_expire(&loop->timers, now_ms())) != NULL) {
+        uring_connection_t *conn =
+            (uring_connection_t *) ((char *) timer - offsetof(uring_connection_t, timer));
+        if (conn->response.bytes_sent != conn->sent_seen) {
+            arm_timeout(loop, conn, loop->send_timeout_ms);
+            continue;
+        }
+        stats_timed_out();
+        struct io_uring_sqe *sqe = get_sqes(loop, 1);
+        if (sqe != NULL) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = conn->index;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_FD_FIXED |
+                IORING_ASYNC_CANCEL_ALL;
+            sqe->user_data = IGNORED_DATA;
+        }
+        close_connection(loop, conn);
+    }
+}
+
+
+// Receive more of the request
+static void submit_recv(uring_loop_t *loop, uring_connection_t *conn) {
+    struct io_uring_sqe *sqe = get_sqes(loop, 1);
+    if (sqe == NULL) {
+        close_connection(loop, conn);
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->index;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t) (uintptr_t) (conn->request + conn->request_len);
+    sqe->len = HTTP_REQUEST_MAX - conn->request_len;
+    sqe->user_data = op_data(conn, OP_RECV);
+    conn->pending++;
+}
+
+
+// Send what remains of conn->msg
+static void submit_send(uring_loop_t *loop, uring_connection_t *conn) {
+    struct io_uring_sqe *sqe = get_sqes(loop, 1);
+    if (sqe == NULL) {
+        close_connection(loop, conn);
+        return;
+    }
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->index;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t) (uintptr_t) &conn->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = op_data(conn, OP_SEND);
+    conn->pending++;
+}
+
+
+static void set_message(uring_connection_t *conn, int n_iov) {
+    memset(&conn->msg, 0, sizeof(struct msghdr));
+    conn->msg.msg_iov = conn->iov;
+    conn->msg.msg_iovlen = n_iov;
+}
+
+
+// Set the file slot of a registered buffer to 'fd', or empty it if fd is -1
+static void update_body_slot(uring_loop_t *loop, struct io_uring_sqe *sqe, int buffer,
+        int fd) {
+    // The kernel reads the descriptor when the update runs, not when it is
+    // submitted
+    loop->body_files[buffer] = fd;
+    sqe->opcode = IORING_OP_FILES_UPDATE;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t) (uintptr_t) &loop->body_files[buffer];
+    sqe->len = 1;
+    sqe->off = URING_MAX_CONNECTIONS + buffer;
+}
+
+
+// Read the next chunk of the file body into the connection's registered
+// buffer and send it once the read completes. The first chunk follows the
+// header in the same buffer, so both leave in a single send. The body file is
+// put into the buffer's slot of the file table ahead of its first read.
+static void submit_chunk(uring_loop_t *loop, uring_connection_t *conn) {
+    http_response_t *resp = &conn->response;
+    char *buf = loop->buffers + (size_t) conn->buffer * URING_BUFFER_SIZE;
+
+    size_t header_len = resp->header_len - resp->header_sent;
+    memcpy(buf, resp->header + resp->header_sent, header_len);
+    resp->header_sent = resp->header_len;
+    size_t len = URING_BUFFER_SIZE - header_len;
+    if (len > resp->body_remaining) { len = resp->body_remaining; }
+
+    int install = !conn->body_installed;
+    struct io_uring_sqe *sqe = get_sqes(loop, install ? 3 : 2);
+    if (sqe == NULL) {
+        close_connection(loop, conn);
+        return;
+    }
+    if (install) {
+        update_body_slot(loop, sqe, conn->buffer, resp->file_fd);
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = op_data(conn, OP_INSTALL);
+        conn->body_installed = 1;
+        conn->pending++;
+        sqe = &loop->sqes[(sqe - loop->sqes + 1) & loop->sq_mask];
+    }
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = URING_MAX_CONNECTIONS + conn->buffer;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    sqe->addr = (uint64_t) (uintptr_t) (buf + header_len);
+    sqe->len = len;
+    sqe->off = resp->body_offset;
+    sqe->buf_index = 0;
+    sqe->user_data = op_data(conn, OP_READ);
+    conn->read_len = len;
+    conn->pending++;
+
+    // A short read breaks the link just like a failed one, and the send then
+    // completes with -ECANCELED. The read's completion tells the two apart.
+    resp->body_offset += len;
+    resp->body_remaining -= len;
+    conn->iov[0].iov_base = buf;
+    conn->iov[0].iov_len = header_len + len;
+    set_message(conn, 1);
+
+    sqe = &loop->sqes[(sqe - loop->sqes + 1) & loop->sq_mask];
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->index;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t) (uintptr_t) &conn->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = op_data(conn, OP_SEND);
+    conn->pending++;
+}
+
+
+// Give a registered buffer to a connection, or queue it until one is free.
+// Returns 1 if the connection got a buffer
+static int acquire_buffer(uring_loop_t *loop, uring_connection_t *conn) {
+    if (loop->n_free_buffers == 0) {
+        conn->buffer_next = NULL;
+        if (loop->buffer_tail != NULL) { loop->buffer_tail->buffer_next = conn; }
+        else { loop->buffer_head = conn; }
+        loop->buffer_tail = conn;
+        return 0;
+    }
+    conn->buffer = loop->free_buffers[--loop->n_free_buffers];
+    return 1;
+}
+
+
+// Return a connection's buffer, handing it to the longest waiting connection
+static void release_buffer(uring_loop_t *loop, uring_connection_t *conn) {
+    if (conn->buffer == -1) { return; }
+    int buffer = conn->buffer;
+    int installed = conn->body_installed;
+    conn->buffer = -1;
+    conn->body_installed = 0;
+
+    uring_connection_t *waiter = loop->buffer_head;
+    if (waiter == NULL) {
+        // Let go of the body file, which the next user of the buffer would
+        // otherwise only replace
+        struct io_uring_sqe *sqe = installed ? get_sqes(loop, 1) : NULL;
+        if (sqe != NULL) {
+            update_body_slot(loop, sqe, buffer, -1);
+            sqe->user_data = IGNORED_DATA;
+        }
+        loop->free_buffers[loop->n_free_buffers++] = buffer;
+        return;
+    }
+    loop->buffer_head = waiter->buffer_next;
+    if (loop->buffer_head == NULL) { loop->buffer_tail = NULL; }
+    waiter->buffer = buffer;
+    submit_chunk(loop, waiter);
+}
+
+
+// Take a connection that is being closed off the list of those waiting for a
+// buffer, if it is on it
+static void cancel_buffer_wait(uring_loop_t *loop, uring_connection_t *conn) {
+    uring_connection_t *prev = NULL;
+    for (uring_connection_t *waiter = loop->buffer_head; waiter != NULL;
+            waiter = waiter->buffer_next) {
+        if (waiter == conn) {
+            if (prev != NULL) { prev->buffer_next = conn->buffer_next; }
+            else { loop->buffer_head = conn->buffer_next; }
+            if (loop->buffer_tail == conn) { loop->buffer_tail = prev; }
+            return;
+        }
+        prev = waiter;
+    }
+}
+
+
+// Start sending a prepared response
+static void start_response(uring_loop_t *loop, uring_connection_t *conn) {
+    http_response_t *resp = &conn->response;
+    if (conn->timing.prepared == 0) {
+        conn->timing.prepared = stats_now();
+    }
+    if (resp->file_fd != -1 && resp->body_remaining > 0) {
+        // Later parts of a multipart body reuse the buffer of the first
+        if (conn->buffer != -1 || acquire_buffer(loop, conn)) {
+            submit_chunk(loop, conn);
+        }
+        return;
+    }
+
+    // The header and a body held in memory, if any, go out in one message
+    conn->iov[0].iov_base = resp->header;
+    conn->iov[0].iov_len = resp->header_len;
+    set_message(conn, 1);
+    if (resp->body_remaining > 0) {
+        conn->iov[1].iov_base = (char *) resp->body_data + resp->body_offset;
+        conn->iov[1].iov_len = resp->body_remaining;
+        conn->msg.msg_iovlen = 2;
+    }
+    submit_send(loop, conn);
+}
+
+
+// Open the requested resource
+static void submit_open(uring_loop_t *loop, uring_connection_t *conn) {
+    struct io_uring_sqe *sqe = get_sqes(loop, 1);
+    if (sqe == NULL) {
+        close_connection(loop, conn);
+        return;
+    }
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t) (uintptr_t) conn->resource_path;
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    sqe->user_data = op_data(conn, OP_OPEN);
+    conn->pending++;
+    conn->opening++;
+}
+
+
+// Look up the type, size and validators of the requested resource
+static void submit_statx(uring_loop_t *loop, uring_connection_t *conn) {
+    struct io_uring_sqe *sqe = get_sqes(loop, 1);
+    if (sqe == NULL) {
+        close_connection(loop, conn);
+        return;
+    }
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t) (uintptr_t) conn->resource_path;
+    sqe->len = STATX_TYPE | STATX_SIZE | STATX_INO | STATX_MTIME;
+    sqe->off = (uint64_t) (uintptr_t) &conn->statx;
+    sqe->user_data = op_data(conn, OP_STATX);
+    conn->pending++;
+    conn->opening++;
+}
+
+
+static void start_reading(uring_loop_t *loop, uring_connection_t *conn);
+
+
+// Parse the buffered request and start answering it, or receive more of it
+static void process_request(uring_loop_t *loop, uring_connection_t *conn) {
+    http_request_t *req = &conn->req;
+    // The request is timed from its first byte, which may have been pipelined
+    // behind the previous one. From then on, a kept-alive connection gets the
+    // time for a request instead of for idling.
+    if (conn->timing.start == 0 && conn->request_len > 0) {
+        conn->timing.start = stats_now();
+        if (conn->requests_served > 0) {
+            arm_timeout(loop, conn, loop->header_timeout_ms);
+        }
+    }
+    int res = parse_http_request(&conn->parser, conn->request, conn->request_len, req);
+    if (res == -1) {
+        stats_bad_request();
+        // Answer with the error, then close the connection
+        prepare_http_error_response(&conn->response, conn->parser.error);
+        conn->keep_alive = 0;
+        conn->rejecting = 1;
+        arm_timeout(loop, conn, loop->send_timeout_ms);
+        start_response(loop, conn);
+        return;
+    }
+    if (res == 1) {
+        submit_recv(loop, conn);
+        return;
+    }
+    conn->timing.parsed = stats_now();
+    arm_timeout(loop, conn, loop->send_timeout_ms);
+
+    conn->request_consumed = req->length;
+    conn->requests_served++;
+    conn->keep_alive = req->keep_alive && loop->idle_timeout_ms > 0 &&
+        conn->requests_served < loop->max_requests;
+
+    // get resource path from resource name
+    strcpy(conn->resource_path, loop->serve_dir);
+    strcat(conn->resource_path, req->resource_name);
+
+    if (prepare_cached_http_response(&conn->response, conn->resource_path, req,
+                conn->keep_alive) == 1) {
+        start_response(loop, conn);
+        return;
+    }
+
+    // A client revalidating its copy may only need the file's status, so the
+    // file is opened once that is known. Otherwise both happen at once.
+    conn->open_result = -1;
+    conn->revalidating = is_conditional_http_request(req);
+    if (!conn->revalidating) {
+        submit_open(loop, conn);
+    }
+    if (!conn->closing) {
+        submit_statx(loop, conn);
+    }
+}
+
+
+// Both the open and the statx of the resource have completed, or only the
+// statx if the client is revalidating its copy
+static void finish_open(uring_loop_t *loop, uring_connection_t *conn) {
+    int file_fd = conn->open_result >= 0 ? conn->open_result : -1;
+    if (conn->closing) {
+        if (file_fd != -1 && close(file_fd) == -1) { perror("close"); }
+        return;
+    }
+
+    struct stat statbuf;
+    memset(&statbuf, 0, sizeof(statbuf));
+    statbuf.st_mode = conn->statx.stx_mode;
+    statbuf.st_size = conn->statx.stx_size;
+    statbuf.st_ino = conn->statx.stx_ino;
+    statbuf.st_mtim.tv_sec = conn->statx.stx_mtime.tv_sec;
+    statbuf.st_mtim.tv_nsec = conn->statx.stx_mtime.tv_nsec;
+
+    if (conn->revalidating) {
+        conn->revalidating = 0;
+        if (conn->statx_result == 0 && S_ISREG(statbuf.st_mode) &&
+                prepare_not_modified_http_response(&conn->response,
+                    conn->resource_path, &statbuf,
+                    &conn->req, conn->keep_alive) == 1) {
+            start_response(loop, conn);
+        } else {
+            submit_open(loop, conn);
+        }
+        return;
+    }
+    if (prepare_http_file_response(&conn->response, conn->resource_path, file_fd,
+                conn->statx_result == 0 ? &statbuf : NULL, &conn->req,
+                conn->keep_alive) == -1) {
+        fprintf(stderr, "Error writing http response\n");
+        close_connection(loop, conn);
+        return;
+    }
+    start_response(loop, conn);
+}
+
+
+// The whole response has been sent
+static void finish_response(uring_loop_t *loop, uring_connection_t *conn) {
+    if (conn->rejecting) {
+        // There is no request to account for
+        stats_request_reset(&conn->timing);
+        close_connection(loop, conn);
+        return;
+    }
+    conn->timing.first_byte = conn->response.first_sent;
+    stats_request_done(&conn->timing, conn->response.status,
+            conn->response.bytes_sent);
+    trace_request(&conn->timing, conn->req.resource_name, conn->response.status,
+            conn->response.bytes_sent);
+    // Sockets only exist in the file table, so their addresses are not known
+    access_log_request(NULL, &conn->req, &conn->timing, conn->response.status,
+            conn->response.bytes_sent);
+    stats_request_reset(&conn->timing);
+    release_http_response(&conn->response);
+    release_buffer(loop, conn);
+    if (!conn->keep_alive) {
+        close_connection(loop, conn);
+        return;
+    }
+
+    // Drop the answered request, keeping anything pipelined behind it
+    conn->request_len -= conn->request_consumed;
+    memmove(conn->request, conn->request + conn->request_consumed,
+            conn->request_len);
+    init_http_parser(&conn->parser);
+    start_reading(loop, conn);
+}
+
+
+// Wait for the next request. A new connection has to send its first request
+// in time, while a kept-alive one may idle for a while before it starts.
+static void start_reading(uring_loop_t *loop, uring_connection_t *conn) {
+    init_http_response(&conn->response);
+    arm_timeout(loop, conn, conn->requests_served > 0 ? loop->idle_timeout_ms
+            : loop->header_timeout_ms);
+    process_request(loop, conn);
+}
+
+
+static void handle_accept(uring_loop_t *loop, struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        // The multishot accept ended. A full file table is not an error, the
+        // accept is rearmed once a connection closes.
+        loop->accepting = 0;
+        if (cqe->res < 0 && cqe->res != -ENFILE && cqe->res != -ECANCELED) {
+            fprintf(stderr, "accept failed: %s\n", strerror(-cqe->res));
+        }
+        // The kernel rejects multishot accepts into the file table with
+        // EINVAL if it does not support them, which retrying will not fix
+        if (cqe->res == -EINVAL) {
+            fprintf(stderr, "io_uring loop stopped accepting connections\n");
+        } else if (loop->n_connections < URING_MAX_CONNECTIONS && !loop->stopping) {
+            arm_accept(loop);
+        }
+    }
+    if (cqe->res < 0) {
+        return;
+    }
+    if (loop->stopping) {
+        close_slot(loop, cqe->res, IGNORED_DATA);
+        return;
+    }
+
+    uring_connection_t *conn = malloc(sizeof(uring_connection_t));
+    if (conn == NULL) {
+        perror("malloc");
+        close_slot(loop, cqe->res, IGNORED_DATA);
+        return;
+    }
+    memset(conn, 0, offsetof(uring_connection_t, request));
+    stats_accepted(1);
+    conn->timing.accepted = stats_now();
+    conn->index = cqe->res;
+    conn->request_len = 0;
+    init_http_parser(&conn->parser);
+    conn->requests_served = 0;
+    conn->buffer = -1;
+    wheel_timer_init(&conn->timer);
+    conn->prev = NULL;
+    conn->next = loop->connections;
+    if (loop->connections != NULL) { loop->connections->prev = conn; }
+    loop->connections = conn;
+    loop->n_connections++;
+
+    start_reading(loop, conn);
+}
+
+
+static void handle_completion(uring_loop_t *loop, struct io_uring_cqe *cqe) {
+    uring_connection_t *conn =
+        (uring_connection_t *) (uintptr_t) (cqe->user_data & ~(uint64_t) OP_MASK);
+    int op = cqe->user_data & OP_MASK;
+    int res = cqe->res;
+    conn->pending--;
+
+    switch (op) {
+    case OP_CLOSE:
+        free_connection(loop, conn);
+        return;
+
+    case OP_RECV:
+        if (conn->closing) { break; }
+        if (res <= 0) {
+            // The client closed the connection, it failed, or its timeout
+            // passed
+            if (res < 0 && res != -ECANCELED && res != -ECONNRESET) {
+                fprintf(stderr, "recv failed: %s\n", strerror(-res));
+            }
+            close_connection(loop, conn);
+            break;
+        }
+        conn->request_len += res;
+        process_request(loop, conn);
+        break;
+
+    case OP_OPEN:
+    case OP_STATX:
+        if (op == OP_OPEN) { conn->open_result = res; }
+        else { conn->statx_result = res; }
+        if (--conn->opening == 0) {
+            finish_open(loop, conn);
+        }
+        break;
+
+    case OP_INSTALL:
+        // A failed update cancels the read and send linked to it
+        if (res < 0) {
+            if (res != -ECANCELED) {
+                fprintf(stderr, "registering file failed: %s\n", strerror(-res));
+            }
+            conn->failed = 1;
+        }
+        break;
+
+    case OP_READ:
+        // Anything but a full read cancels the linked send
+        if (res != (int) conn->read_len) {
+            if (res >= 0) {
+                fprintf(stderr, "File was truncated while being sent\n");
+            } else if (res != -ECANCELED) {
+                fprintf(stderr, "read failed: %s\n", strerror(-res));
+            }
+            conn->failed = 1;
+        }
+        break;
+
+    case OP_SEND:
+        if (res == -ECANCELED) {
+            // The read it was linked to came up short or failed, or the
+            // connection's timeout passed
+            close_connection(loop, conn);
+            break;
+        }
+        if (conn->closing || conn->failed) {
+            close_connection(loop, conn);
+            break;
+        }
+        if (res < 0) {
+            if (res != -EPIPE && res != -ECONNRESET) {
+                fprintf(stderr, "send failed: %s\n", strerror(-res));
+            }
+            close_connection(loop, conn);
+            break;
+        }
+        // Skip what was sent and send the rest, if any
+        if (conn->response.bytes_sent == 0) {
+            conn->response.first_sent = stats_now();
+        }
+        conn->response.bytes_sent += res;
+        size_t sent = res;
+        while (conn->msg.msg_iovlen > 0 && sent >= conn->msg.msg_iov->iov_len) {
+            sent -= conn->msg.msg_iov->iov_len;
+            conn->msg.msg_iov++;
+            conn->msg.msg_iovlen--;
+        }
+        if (conn->msg.msg_iovlen > 0) {
+            conn->msg.msg_iov->iov_base = (char *) conn->msg.msg_iov->iov_base + sent;
+            conn->msg.msg_iov->iov_len -= sent;
+            submit_send(loop, conn);
+        } else if (conn->buffer != -1 && conn->response.body_remaining > 0) {
+            submit_chunk(loop, conn);
+        } else if (next_http_response_part(&conn->response)) {
+            start_response(loop, conn);
+        } else {
+            finish_response(loop, conn);
+        }
+        break;
+    }
+
+    if (conn->closing && conn->pending == 0) {
+        close_connection(loop, conn);
+    }
+}
+
+
+// Map the rings shared with the kernel
+// Returns 0 on success or -1 on error
+static int map_rings(uring_loop_t *loop, struct io_uring_params *params) {
+    loop->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+    loop->cq_ring_size = params->cq_off.cqes +
+        params->cq_entries * sizeof(struct io_uring_cqe);
+    // Both rings may share one mapping
+    if (params->features & IORING_FEAT_SINGLE_MMAP) {
+        if (loop->cq_ring_size > loop->sq_ring_size) {
+            loop->sq_ring_size = loop->cq_ring_size;
+        }
+        loop->cq_ring_size = loop->sq_ring_size;
+    }
+
+    loop->sq_ring = mmap(NULL, loop->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, loop->ring_fd, IORING_OFF_SQ_RING);
+    if (loop->sq_ring == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    if (params->features & IORING_FEAT_SINGLE_MMAP) {
+        loop->cq_ring = loop->sq_ring;
+    } else {
+        loop->cq_ring = mmap(NULL, loop->cq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, loop->ring_fd, IORING_OFF_CQ_RING);
+        if (loop->cq_ring == MAP_FAILED) {
+            perror("mmap");
+            munmap(loop->sq_ring, loop->sq_ring_size);
+            return -1;
+        }
+    }
+
+    loop->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+    loop->sqes = mmap(NULL, loop->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, loop->ring_fd, IORING_OFF_SQES);
+    if (loop->sqes == MAP_FAILED) {
+        perror("mmap");
+        if (loop->cq_ring != loop->sq_ring) { munmap(loop->cq_ring, loop->cq_ring_size); }
+        munmap(loop->sq_ring, loop->sq_ring_size);
+        return -1;
+    }
+
+    char *sq = loop->sq_ring;
+    loop->sq_head = (unsigned *) (sq + params->sq_off.head);
+    loop->sq_tail = (unsigned *) (sq + params->sq_off.tail);
+    loop->sq_mask = *(unsigned *) (sq + params->sq_off.ring_mask);
+    loop->sq_array = (unsigned *) (sq + params->sq_off.array);
+    char *cq = loop->cq_ring;
+    loop->cq_head = (unsigned *) (cq + params->cq_off.head);
+    loop->cq_tail = (unsigned *) (cq + params->cq_off.tail);
+    loop->cq_mask = *(unsigned *) (cq + params->cq_off.ring_mask);
+    loop->cqes = (struct io_uring_cqe *) (cq + params->cq_off.cqes);
+    return 0;
+}
+
+
+static void unmap_rings(uring_loop_t *loop) {
+    munmap(loop->sqes, loop->sqes_size);
+    if (loop->cq_ring != loop->sq_ring) { munmap(loop->cq_ring, loop->cq_ring_size); }
+    munmap(loop->sq_ring, loop->sq_ring_size);
+}
+
+
+// Register an empty file table for accepted sockets and body files, and the
+// buffers that file bodies are read into, so none of them is looked up or
+// pinned per request
+// Returns 0 on success or -1 on error
+static int register_resources(uring_loop_t *loop) {
+    int files[URING_FILE_SLOTS];
+    for (int i = 0; i < URING_FILE_SLOTS; i++) {
+        files[i] = -1;
+    }
+    if (io_uring_register(loop->ring_fd, IORING_REGISTER_FILES, files,
+                URING_FILE_SLOTS) == -1) {
+        perror("io_uring_register");
+        return -1;
+    }
+    // Accepted sockets only take the slots before the body files'
+    struct io_uring_file_index_range range = { 0, URING_MAX_CONNECTIONS, 0 };
+    if (io_uring_register(loop->ring_fd, IORING_REGISTER_FILE_ALLOC_RANGE, &range, 0) == -1) {
+        perror("io_uring_register");
+        return -1;
+    }
+
+    size_t size = (size_t) URING_BUFFERS * URING_BUFFER_SIZE;
+    loop->buffers = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (loop->buffers == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    struct iovec region = { loop->buffers, size };
+    if (io_uring_register(loop->ring_fd, IORING_REGISTER_BUFFERS, &region, 1) == -1) {
+        perror("io_uring_register");
+        munmap(loop->buffers, size);
+        return -1;
+    }
+    for (int i = 0; i < URING_BUFFERS; i++) {
+        loop->free_buffers[i] = URING_BUFFERS - 1 - i;
+    }
+    loop->n_free_buffers = URING_BUFFERS;
+    return 0;
+}
+
+
+// Cancel everything in flight and close all connections
+static void stop_all(uring_loop_t *loop) {
+    loop->stopping = 1;
+    struct io_uring_sqe *sqe = get_sqes(loop, 1);
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+        sqe->user_data = IGNORED_DATA;
+    }
+    for (uring_connection_t *conn = loop->connections; conn != NULL; ) {
+        uring_connection_t *next = conn->next;
+        close_connection(loop, conn);
+        conn = next;
+    }
+}
+
+
+int uring_loop_init(uring_loop_t *loop, int listen_fd, const char *serve_dir,
+        int idle_timeout_ms, int header_timeout_ms, int send_timeout_ms,
+        int max_requests) {
+    memset(loop, 0, sizeof(uring_loop_t));
+    loop->listen_fd = listen_fd;
+    loop->serve_dir = serve_dir;
+    loop->idle_timeout_ms = idle_timeout_ms;
+    loop->header_timeout_ms = header_timeout_ms;
+    loop->send_timeout_ms = send_timeout_ms;
+    loop->max_requests = max_requests;
+    loop->now_ms = now_ms();
+    timer_wheel_init(&loop->timers, loop->now_ms);
+
+    if (strlen(serve_dir) + HTTP_RESOURCE_MAX > PATH_MAX) {
+        fprintf(stderr, "Served directory path is too long\n");
+        return -1;
+    }
+
+    // Only the loop's thread submits, so the kernel may defer completion work
+    // until that thread asks for events. The ring is enabled by that thread.
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+        IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN |
+        IORING_SETUP_R_DISABLED;
+    params.cq_entries = URING_ENTRIES * 4;
+    if ((loop->ring_fd = io_uring_setup(URING_ENTRIES, &params)) == -1 &&
+            errno == EINVAL) {
+        // Older kernels lack some of these flags
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = URING_ENTRIES * 4;
+        loop->ring_fd = io_uring_setup(URING_ENTRIES, &params);
+    }
+    if (loop->ring_fd == -1) {
+        perror("io_uring_setup");
+        return -1;
+    }
+    loop->enabled = !(params.flags & IORING_SETUP_R_DISABLED);
+    // Timeouts are waited for with io_uring_enter itself
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        fprintf(stderr, "io_uring does not support waiting with a timeout\n");
+        close(loop->ring_fd);
+        return -1;
+    }
+
+    if (map_rings(loop, &params) == -1) {
+        close(loop->ring_fd);
+        return -1;
+    }
+
+    if (register_resources(loop) == -1) {
+        unmap_rings(loop);
+        close(loop->ring_fd);
+        return -1;
+    }
+
+    if ((loop->wakeup_fd = eventfd(0, EFD_CLOEXEC)) == -1) {
+        perror("eventfd");
+        munmap(loop->buffers, (size_t) URING_BUFFERS * URING_BUFFER_SIZE);
+        unmap_rings(loop);
+        close(loop->ring_fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void *uring_loop_run(void *arg) {
+    uring_loop_t *loop = arg;
+    void *ret = NULL;
+    int running = 1;
+
+    if (!loop->enabled && io_uring_register(loop->ring_fd,
+                IORING_REGISTER_ENABLE_RINGS, NULL, 0) == -1) {
+        perror("io_uring_register");
+        return (void *) -1;
+    }
+
+    stats_set_thread_name("uring loop");
+    arm_wakeup(loop);
+    arm_accept(loop);
+
+    // After a stop request, keep reaping completions until every connection
+    // and the accept have wound down
+    while (running || loop->connections != NULL || loop->accepting) {
+        // One system call submits everything queued by the last batch of
+        // completions and waits for the next one, or for the next timeout
+        if (submit(loop, 1, timer_wheel_timeout(&loop->timers, now_ms())) == -1) {
+            ret = (void *) -1;
+            break;
+        }
+
+        uint64_t busy_start = stats_now();
+        loop->now_ms = now_ms();
+        unsigned head = *loop->cq_head;
+        unsigned tail = __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &loop->cqes[head & loop->cq_mask];
+            if (cqe->user_data == WAKEUP_DATA) {
+                running = 0;
+                stop_all(loop);
+            } else if (cqe->user_data == ACCEPT_DATA) {
+                handle_accept(loop, cqe);
+            } else if (cqe->user_data != IGNORED_DATA) {
+                handle_completion(loop, cqe);
+            }
+        }
+        __atomic_store_n(loop->cq_head, head, __ATOMIC_RELEASE);
+        expire_timeouts(loop);
+        stats_busy(stats_now() - busy_start);
+    }
+
+    return ret;
+}
+
+
+int uring_loop_stop(uring_loop_t *loop) {
+    uint64_t one = 1;
+    if (write(loop->wakeup_fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("write");
+        return -1;
+    }
+    return 0;
+}
+
+
+int uring_loop_free(uring_loop_t *loop) {
+    int ret = 0;
+
+    // Connections left by a loop that failed are only closed along with the
+    // ring's file table
+    unmap_rings(loop);
+    if (close(loop->ring_fd) == -1) { perror("close"); ret = -1; }
+    while (loop->connections != NULL) {
+        uring_connection_t *conn = loop->connections;
+        loop->connections = conn->next;
+        release_http_response(&conn->response);
+        free(conn);
+    }
+    munmap(loop->buffers, (size_t) URING_BUFFERS * URING_BUFFER_SIZE);
+    if (close(loop->wakeup_fd) == -1) { perror("close"); ret = -1; }
+    return ret;
+}
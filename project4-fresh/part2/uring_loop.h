@@ -0,0 +1,152 @@
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "http.h"
+#include "stats.h"
+#include "timer_wheel.h"
+
+#define URING_ENTRIES 256
+#define URING_MAX_CONNECTIONS 1024  // Slots of the file table for sockets
+#define URING_BUFFERS 64            // Registered buffers shared by the bodies
+#define URING_BUFFER_SIZE (32 * 1024)
+// The registered file table: a slot for every socket, then one for the body
+// file that each registered buffer is being filled from
+#define URING_FILE_SLOTS (URING_MAX_CONNECTIONS + URING_BUFFERS)
+
+// Struct representing a client connection served by an io_uring loop. The
+// socket only exists as a slot in the ring's registered file table, and every
+// operation on it completes asynchronously, so the connection counts the
+// operations still in flight before it may be freed.
+typedef struct uring_connection {
+    int index;                // Slot of the socket in the registered file table
+    int pending;              // Submitted operations that have not completed
+    int opening;              // Outstanding open and statx of the resource
+    int revalidating;         // Set while only the resource's status is looked up
+    int closing;              // Set once the connection is being closed
+    int failed;               // Set when a linked operation failed
+    int body_installed;       // Whether the body file is in its buffer's slot
+    int rejecting;            // Set while answering a request that was malformed
+    request_timing_t timing;  // Phases of the request being answered
+    char request[HTTP_REQUEST_MAX];
+    size_t request_len;
+    size_t request_consumed;  // Bytes of the request currently being answered
+    http_parser_t parser;     // Progress parsing the request at the buffer start
+    http_request_t req;
+    int keep_alive;
+    int requests_served;
+    char resource_path[PATH_MAX];
+    int open_result;          // File descriptor or negative errno of the open
+    int statx_result;
+    struct statx statx;
+    wheel_timer_t timer;      // Timeout of the current state
+    size_t sent_seen;         // Bytes of the response sent when it was armed
+    http_response_t response;
+    int buffer;               // Registered buffer holding the body, or -1
+    size_t read_len;          // Length of the chunk being read into it
+    struct msghdr msg;        // What remains of the current send
+    struct iovec iov[2];
+    struct uring_connection *buffer_next;  // Next connection waiting for a buffer
+    struct uring_connection *prev;  // Neighbours in the list of all connections
+    struct uring_connection *next;
+} uring_connection_t;
+
+// Struct representing an io_uring-based event loop. Like an epoll event loop it
+// is driven by one thread and serves every connection it accepts, but accept,
+// recv, open, file reads and sends are all submitted to the kernel in batches
+// through a ring of its own. Accepting is multishot, sockets and the files
+// bodies are read from are registered files, and bodies are read into
+// registered buffers.
+typedef struct {
+    int ring_fd;
+    int listen_fd;
+    int wakeup_fd;            // eventfd used to ask the loop to stop
+    uint64_t wakeup_value;
+    int enabled;              // Whether the ring was created disabled
+    int stopping;             // Set once the loop was asked to stop
+    const char *serve_dir;
+    int idle_timeout_ms;      // 0 disables persistent connections
+    int header_timeout_ms;    // Longest a request may take to arrive
+    int send_timeout_ms;      // Longest a response may go without progress
+    int max_requests;         // Requests served before a connection is closed
+    timer_wheel_t timers;     // Timeouts of all connections
+    long now_ms;              // CLOCK_MONOTONIC milliseconds after the last wait
+
+    // Submission queue
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_pending;      // SQEs filled in but not submitted yet
+
+    // Completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    char *buffers;            // URING_BUFFERS registered buffers
+    int body_files[URING_BUFFERS];  // What the buffers' file slots are set to
+    int free_buffers[URING_BUFFERS];
+    int n_free_buffers;
+    uring_connection_t *buffer_head;  // Connections waiting for a buffer
+    uring_connection_t *buffer_tail;
+
+    int accepting;            // Whether a multishot accept is armed
+    uring_connection_t *connections;
+    int n_connections;
+} uring_loop_t;
+
+/*
+ * Initialize a new io_uring loop.
+ * loop: Pointer to uring_loop_t to be initialized
+ * listen_fd: Listening socket. Several loops may share it.
+ * serve_dir: Directory that requested resources are served from
+ * idle_timeout_ms: How long a connection may wait for its next request, or 0
+ *                  to close every connection after one response
+ * header_timeout_ms: How long a client may take to send a whole request, from
+ *                    when it connects or the request starts arriving
+ * send_timeout_ms: How long a response may go without any of it being sent
+ * max_requests: Number of requests served on a connection before closing it
+ * Returns 0 on success or -1 on error, e.g. if the kernel lacks io_uring
+ */
+int uring_loop_init(uring_loop_t *loop, int listen_fd, const char *serve_dir,
+        int idle_timeout_ms, int header_timeout_ms, int send_timeout_ms,
+        int max_requests);
+
+/*
+ * Run an io_uring loop until uring_loop_stop is called. Meant to be used as
+ * the start routine of the thread that drives the loop.
+ * arg: A pointer to the uring_loop_t to run
+ * Returns NULL on a clean stop, or a non-NULL value on error
+ */
+void *uring_loop_run(void *arg);
+
+/*
+ * Ask an io_uring loop to stop. Safe to call from any thread.
+ * Returns 0 on success or -1 on error
+ */
+int uring_loop_stop(uring_loop_t *loop);
+
+/*
+ * Deallocates and cleans up any resources associated with an io_uring loop,
+ * closing the connections that were still open when it stopped. Must only be
+ * called once the loop is no longer running.
+ * Returns 0 on success or -1 on error
+ */
+int uring_loop_free(uring_loop_t *loop);
+
+#endif // URING_LOOP_H
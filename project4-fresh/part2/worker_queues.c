@@ -0,0 +1,326 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "futex.h"
+#include "stats.h"
+#include "worker_queues.h"
+
+
+// Pick the queue a new connection goes to
+static int choose_queue(worker_queues_t *wq) {
+    if (wq->policy != DISPATCH_LEAST_LOADED) {
+        return atomic_fetch_add(&wq->next, 1) % wq->n_queues;
+    }
+
+    // Start the scan at a rotating position so ties are spread evenly
+    int start = atomic_fetch_add(&wq->next, 1) % wq->n_queues;
+    int best = start;
+    size_t best_len = SIZE_MAX;
+    for (int i = 0; i < wq->n_queues; i++) {
+        int idx = (start + i) % wq->n_queues;
+        size_t len = connection_queue_length(&wq->queues[idx].queue);
+        if (len < best_len) {
+            best = idx;
+            best_len = len;
+            if (len == 0) { break; }
+        }
+    }
+    return best;
+}
+
+
+static void record_depth(worker_queue_t *q) {
+    size_t depth = connection_queue_length(&q->queue);
+    size_t max_depth = atomic_load_explicit(&q->max_depth, memory_order_relaxed);
+    while (depth > max_depth &&
+            !atomic_compare_exchange_weak(&q->max_depth, &max_depth, depth)) {
+    }
+}
+
+
+// Take a connection from the worker's own queue, or else steal one from the
+// first peer that has any, starting with the worker's neighbour
+// Returns 0 on success or -1 if every queue is empty
+static int take(worker_queues_t *wq, int worker_id, queued_connection_t *conn) {
+    if (connection_try_dequeue(&wq->queues[worker_id].queue, conn) == 0) {
+        return 0;
+    }
+    for (int i = 1; i < wq->n_queues; i++) {
+        int victim = (worker_id + i) % wq->n_queues;
+        if (connection_try_dequeue(&wq->queues[victim].queue, conn) == 0) {
+            atomic_fetch_add_explicit(&wq->queues[worker_id].stolen, 1,
+                    memory_order_relaxed);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+int worker_queues_init(worker_queues_t *wq, int n_workers, int policy,
+        size_t capacity, int admission, long target_ms) {
+    memset(wq, 0, sizeof(worker_queues_t));
+    wq->policy = policy;
+    wq->admission = admission;
+    wq->target_ns = (uint64_t) target_ms * 1000000;
+    atomic_store(&wq->last_empty, stats_now());
+    wq->n_queues = policy == DISPATCH_SHARED ? 1 : n_workers;
+
+    // Keep each worker's queue and counters on cache lines of their own
+    size_t size = wq->n_queues * sizeof(worker_queue_t);
+    size = (size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    wq->queues = aligned_alloc(CACHE_LINE, size);
+    if (wq->queues == NULL) {
+        perror("aligned_alloc");
+        return -1;
+    }
+    memset(wq->queues, 0, size);
+
+    for (int i = 0; i < wq->n_queues; i++) {
+        if (connection_queue_init(&wq->queues[i].queue, capacity) == -1) {
+            for (int j = 0; j < i; j++) {
+                connection_queue_free(&wq->queues[j].queue);
+            }
+            free(wq->queues);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+int worker_queues_push(worker_queues_t *wq, const queued_connection_t *conn) {
+    // Stamped first, since a worker may take the connection right away
+    stats_connection_queued(conn->fd);
+    int target = wq->n_queues == 1 ? 0 : choose_queue(wq);
+    worker_queue_t *q = &wq->queues[target];
+
+    if (wq->n_queues == 1) {
+        // Workers sleep inside connection_dequeue, which this wakes up
+        if (connection_enqueue(&q->queue, conn) == -1) {
+            return -1;
+        }
+    } else {
+        // Fall back to any queue with room before blocking on the target
+        int placed = connection_try_enqueue(&q->queue, conn) == 0;
+        for (int i = 1; !placed && i < wq->n_queues; i++) {
+            q = &wq->queues[(target + i) % wq->n_queues];
+            placed = connection_try_enqueue(&q->queue, conn) == 0;
+        }
+        if (!placed) {
+            q = &wq->queues[target];
+            if (connection_enqueue(&q->queue, conn) == -1) {
+                return -1;
+            }
+        }
+        // Any idle worker will do, it steals the connection if it is not its own
+        futex_notify(&wq->added, &wq->n_idle);
+    }
+
+    atomic_fetch_add_explicit(&q->dispatched, 1, memory_order_relaxed);
+    record_depth(q);
+    return 0;
+}
+
+
+int worker_queues_try_push(worker_queues_t *wq, const queued_connection_t *conn) {
+    if (atomic_load(&wq->shutdown)) {
+        return -1;
+    }
+
+    stats_connection_queued(conn->fd);
+    int target = wq->n_queues == 1 ? 0 : choose_queue(wq);
+    for (int i = 0; i < wq->n_queues; i++) {
+        worker_queue_t *q = &wq->queues[(target + i) % wq->n_queues];
+        if (connection_try_enqueue(&q->queue, conn) == 0) {
+            if (wq->n_queues > 1) {
+                futex_notify(&wq->added, &wq->n_idle);
+            }
+            atomic_fetch_add_explicit(&q->dispatched, 1, memory_order_relaxed);
+            record_depth(q);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+int worker_queues_admit(worker_queues_t *wq, const queued_connection_t *conn) {
+    if (wq->admission == ADMIT_BLOCK) {
+        return worker_queues_push(wq, conn);
+    }
+    int ret = worker_queues_try_push(wq, conn);
+    if (ret == 1) {
+        atomic_fetch_add_explicit(&wq->rejected, 1, memory_order_relaxed);
+    }
+    return ret;
+}
+
+
+// Wait until a connection can be taken from any of the queues
+// Returns 0 on success, or -1 once the queues are shut down
+static int wait_for_connection(worker_queues_t *wq, int worker_id, queued_connection_t *conn) {
+    if (wq->n_queues == 1) {
+        return connection_dequeue(&wq->queues[0].queue, conn);
+    }
+
+    int spins = 0;
+    while (1) {
+        if (take(wq, worker_id, conn) == 0) {
+            return 0;
+        }
+        if (atomic_load(&wq->shutdown)) {
+            return -1;
+        }
+
+        // Every queue is empty -- spin for a while, then sleep until a
+        // connection is pushed
+        if (spins < SPIN_COUNT) {
+            spins++;
+            cpu_relax();
+            continue;
+        }
+        unsigned int added = atomic_load(&wq->added);
+        atomic_fetch_add(&wq->n_idle, 1);
+        // Re-check after announcing ourselves, or a connection pushed in
+        // between might not wake anyone
+        if (take(wq, worker_id, conn) == 0) {
+            atomic_fetch_sub(&wq->n_idle, 1);
+            return 0;
+        }
+        if (!atomic_load(&wq->shutdown) && futex_wait(&wq->added, added) == -1 &&
+                errno != EAGAIN && errno != EINTR) {
+            perror("futex");
+            atomic_fetch_sub(&wq->n_idle, 1);
+            return -1;
+        }
+        atomic_fetch_sub(&wq->n_idle, 1);
+    }
+}
+
+
+int worker_queues_pop(worker_queues_t *wq, int worker_id, queued_connection_t *conn) {
+    if (wait_for_connection(wq, worker_id, conn) == -1) {
+        return -1;
+    }
+    if (conn->fd == WORKER_QUEUES_RETIRE) {
+        return WORKER_QUEUES_RETIRE;
+    }
+    // The shared maximum is only written when it grows, which is rare
+    uint64_t wait = stats_connection_dequeued(conn->fd);
+    uint64_t max_wait = atomic_load_explicit(&wq->max_wait, memory_order_relaxed);
+    while (wait > max_wait &&
+            !atomic_compare_exchange_weak(&wq->max_wait, &max_wait, wait)) {
+    }
+    return 0;
+}
+
+
+int worker_queues_retire(worker_queues_t *wq) {
+    if (wq->n_queues != 1) {
+        return -1;
+    }
+    queued_connection_t retire = { .fd = WORKER_QUEUES_RETIRE };
+    return connection_try_enqueue(&wq->queues[0].queue, &retire);
+}
+
+
+size_t worker_queues_depth(worker_queues_t *wq) {
+    size_t depth = 0;
+    for (int i = 0; i < wq->n_queues; i++) {
+        depth += connection_queue_length(&wq->queues[i].queue);
+    }
+    return depth;
+}
+
+
+uint64_t worker_queues_sample_wait(worker_queues_t *wq) {
+    return atomic_exchange(&wq->max_wait, 0);
+}
+
+
+int worker_queues_expired(worker_queues_t *wq, int connection_fd) {
+    if (wq->admission != ADMIT_CODEL) {
+        return 0;
+    }
+
+    // Taking the last connection shows the workers are keeping up. The shared
+    // timestamp is only refreshed once it is a little stale, so that idle
+    // workers do not keep bouncing its cache line.
+    uint64_t now = stats_now();
+    uint64_t last_empty = atomic_load_explicit(&wq->last_empty, memory_order_relaxed);
+    size_t depth = 0;
+    for (int i = 0; i < wq->n_queues && depth == 0; i++) {
+        depth += connection_queue_length(&wq->queues[i].queue);
+    }
+    if (depth == 0 && now > last_empty + 1000000) {
+        atomic_store_explicit(&wq->last_empty, now, memory_order_relaxed);
+        last_empty = now;
+    }
+
+    request_timing_t timing;
+    memset(&timing, 0, sizeof(request_timing_t));
+    stats_connection_times(connection_fd, &timing);
+    if (timing.queued == 0 || now < timing.queued) {
+        return 0;
+    }
+    uint64_t limit = now > last_empty + (uint64_t) ADMIT_INTERVAL_MS * 1000000
+        ? wq->target_ns : (uint64_t) ADMIT_INTERVAL_MS * 1000000;
+    if (now - timing.queued <= limit) {
+        return 0;
+    }
+    atomic_fetch_add_explicit(&wq->expired, 1, memory_order_relaxed);
+    return 1;
+}
+
+
+void worker_queues_report(worker_queues_t *wq, FILE *out) {
+    for (int i = 0; i < wq->n_queues; i++) {
+        worker_queue_t *q = &wq->queues[i];
+        fprintf(out, "queue %d: dispatched %ld, stolen by this worker %ld, "
+                "depth %zu, max depth %zu\n", i,
+                atomic_load(&q->dispatched), atomic_load(&q->stolen),
+                connection_queue_length(&q->queue), atomic_load(&q->max_depth));
+    }
+    fprintf(out, "turned away: queues full %ld, waited too long %ld\n",
+            atomic_load(&wq->rejected), atomic_load(&wq->expired));
+}
+
+
+int worker_queues_shutdown(worker_queues_t *wq) {
+    int ret = 0;
+    atomic_store(&wq->shutdown, 1);
+
+    for (int i = 0; i < wq->n_queues; i++) {
+        if (connection_queue_shutdown(&wq->queues[i].queue) == -1) {
+            ret = -1;
+        }
+    }
+
+    atomic_fetch_add(&wq->added, 1);
+    if (futex_wake(&wq->added, INT_MAX) == -1) {
+        perror("futex");
+        ret = -1;
+    }
+
+    return ret;
+}
+
+
+int worker_queues_free(worker_queues_t *wq) {
+    int ret = 0;
+    if (wq->queues == NULL) {
+        return 0;
+    }
+    for (int i = 0; i < wq->n_queues; i++) {
+        if (connection_queue_free(&wq->queues[i].queue) == -1) {
+            ret = -1;
+        }
+    }
+    free(wq->queues);
+    wq->queues = NULL;
+    return ret;
+}
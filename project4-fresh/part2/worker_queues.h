@@ -0,0 +1,158 @@
+#ifndef WORKER_QUEUES_H
+#define WORKER_QUEUES_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "connection_queue.h"
+
+// How new connections are spread over the workers
+enum {
+    DISPATCH_SHARED,          // A single queue shared by every worker
+    DISPATCH_ROUND_ROBIN,     // Local queues, filled in turn
+    DISPATCH_LEAST_LOADED     // Local queues, shortest queue first
+};
+
+// What happens to new connections once the workers fall behind
+enum {
+    ADMIT_BLOCK,              // Wait for room in the queues, stalling accept
+    ADMIT_REJECT,             // Turn connections away while every queue is full
+    ADMIT_CODEL               // Also turn away connections that waited too long
+};
+
+#define ADMIT_INTERVAL_MS 100     // Longest wait allowed while the queues drain
+#define ADMIT_TARGET_MS 5         // Longest wait allowed once they stop draining
+
+#define WORKER_QUEUES_RETIRE -2   // Popped by a worker that should exit
+
+// Struct representing the local queue of one worker, along with counters that
+// show how well the load is balanced
+typedef struct {
+    connection_queue_t queue;
+    atomic_long dispatched;   // Connections put on this queue
+    atomic_long stolen;       // Connections this worker took from its peers
+    atomic_size_t max_depth;  // Longest this queue has been
+} worker_queue_t;
+
+// Struct representing the queues that feed connections to the worker pool.
+// With local queues every worker drains its own queue first and steals from
+// its peers when it runs dry, so the workers rarely touch the same cache lines.
+typedef struct {
+    worker_queue_t *queues;
+    int n_queues;             // 1 with a shared queue, one per worker otherwise
+    int policy;
+    atomic_uint next;         // Round-robin cursor
+    // Futex word bumped whenever a connection is added to a local queue,
+    // together with the number of workers sleeping on it
+    atomic_uint added;
+    atomic_int n_idle;
+    atomic_int shutdown;
+    int admission;            // One of the ADMIT_* values
+    uint64_t target_ns;       // With ADMIT_CODEL, see worker_queues_expired
+    _Alignas(CACHE_LINE) atomic_ulong last_empty;  // When a worker last emptied the queues
+    atomic_long rejected;     // Connections turned away because the queues were full
+    atomic_long expired;      // Connections turned away after waiting too long
+    _Alignas(CACHE_LINE) atomic_ulong max_wait;  // Longest wait since the last sample
+} worker_queues_t;
+
+/*
+ * Initialize the queues of a worker pool.
+ * wq: Pointer to worker_queues_t to be initialized
+ * n_workers: Number of workers that take connections from the queues
+ * policy: One of the DISPATCH_* values
+ * capacity: Capacity of each queue
+ * admission: One of the ADMIT_* values
+ * target_ms: With ADMIT_CODEL, how long connections may wait once the queues
+ *            have not been empty for ADMIT_INTERVAL_MS
+ * Returns 0 on success or -1 on error
+ */
+int worker_queues_init(worker_queues_t *wq, int n_workers, int policy,
+        size_t capacity, int admission, long target_ms);
+
+/*
+ * Hand a connection to the workers. Blocks while the chosen queue and all of
+ * the others are full.
+ * wq: A pointer to the worker_queues_t to add to
+ * conn: The connection to add, which is copied
+ * Returns 0 on success or -1 on error or after shutdown
+ */
+int worker_queues_push(worker_queues_t *wq, const queued_connection_t *conn);
+
+/*
+ * Hand a connection to the workers if any queue has room, without waiting.
+ * wq: A pointer to the worker_queues_t to add to
+ * conn: The connection to add, which is copied
+ * Returns 0 if the connection was queued, 1 if every queue is full, or -1
+ * after shutdown
+ */
+int worker_queues_try_push(worker_queues_t *wq, const queued_connection_t *conn);
+
+/*
+ * Hand a newly accepted connection to the workers according to the admission
+ * policy. Unless the policy is ADMIT_BLOCK, this never waits for room.
+ * wq: A pointer to the worker_queues_t to add to
+ * conn: The connection to add, which is copied
+ * Returns 0 if the connection was queued, 1 if it must be turned away because
+ * every queue is full, or -1 on error or after shutdown
+ */
+int worker_queues_admit(worker_queues_t *wq, const queued_connection_t *conn);
+
+/*
+ * Take the next connection for a worker, from its own queue if possible and
+ * from a peer's queue otherwise. Blocks while all queues are empty.
+ * wq: A pointer to the worker_queues_t to remove from
+ * worker_id: Index of the calling worker, from 0 to n_workers - 1
+ * conn: Set to the connection taken
+ * Returns 0 on success, WORKER_QUEUES_RETIRE if the worker should exit, or -1
+ * once the queues are shut down and empty
+ */
+int worker_queues_pop(worker_queues_t *wq, int worker_id, queued_connection_t *conn);
+
+/*
+ * Ask one worker to exit once it runs out of earlier connections. Only
+ * supported with a shared queue, which any worker may take the request from.
+ * Returns 0 on success or -1 if the queue is full or shut down
+ */
+int worker_queues_retire(worker_queues_t *wq);
+
+/*
+ * Returns the number of connections waiting in all of the queues
+ */
+size_t worker_queues_depth(worker_queues_t *wq);
+
+/*
+ * Returns the longest time in nanoseconds a connection waited in the queues
+ * since the previous call, and starts over
+ */
+uint64_t worker_queues_sample_wait(worker_queues_t *wq);
+
+/*
+ * Decide whether a connection just taken with worker_queues_pop waited too
+ * long to be worth serving. With ADMIT_CODEL a connection may wait up to
+ * ADMIT_INTERVAL_MS while the queues keep draining, but only up to the target
+ * once they have not been empty for that long, so a standing queue is shed
+ * from its oldest end instead of making every client wait.
+ * Returns 1 if the connection must be turned away or 0 otherwise
+ */
+int worker_queues_expired(worker_queues_t *wq, int connection_fd);
+
+/*
+ * Write the per-worker dispatch, steal and queue depth counters to 'out',
+ * along with the connections turned away.
+ */
+void worker_queues_report(worker_queues_t *wq, FILE *out);
+
+/*
+ * Shut down the queues. Blocked workers and producers return an error.
+ * Returns 0 on success or -1 on error
+ */
+int worker_queues_shutdown(worker_queues_t *wq);
+
+/*
+ * Deallocates and cleans up any resources associated with the queues.
+ * Returns 0 on success or -1 on error
+ */
+int worker_queues_free(worker_queues_t *wq);
+
+#endif // WORKER_QUEUES_H